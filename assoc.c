@@ -12,6 +12,7 @@
  */
 
 #include "memcached.h"
+#include "restart.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
@@ -24,6 +25,11 @@
 #include <string.h>
 #include <assert.h>
 #include <pthread.h>
+#include <sys/mman.h>
+#include <sched.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 static pthread_cond_t maintenance_cond = PTHREAD_COND_INITIALIZER;
 static pthread_mutex_t maintenance_lock = PTHREAD_MUTEX_INITIALIZER;
@@ -34,51 +40,440 @@ unsigned int hashpower = HASHPOWER_DEFAULT;
 #define hashsize(n) ((uint64_t)1<<(n))
 #define hashmask(n) (hashsize(n)-1)
 
-/* Main hash table. This is where we look except during expansion. */
-static item** primary_hashtable = 0;
+/*
+ * The set of tables in use is described by an immutable descriptor which is
+ * swapped out with a single atomic store. Every caller of the assoc_*
+ * functions holds the item lock for the hash value it's working on, and loads
+ * the descriptor once it has that lock. This lets us start and finish a
+ * resize without pausing the worker threads.
+ *
+ * While resizing, `old` points at the previous primary table. Buckets in the
+ * old table are moved over one at a time under their item lock, after which
+ * the old bucket is marked as moved and lookups go to the primary.
+ * When growing, an old bucket maps to exactly two new buckets. When
+ * shrinking, two old buckets map to one new bucket. Either way all of the
+ * buckets involved share one item lock, so moves never race with each other.
+ */
+struct assoc_table {
+    void *primary; /* where we look, except for unmoved buckets. */
+    void *old; /* previous table during a resize, NULL otherwise. */
+    unsigned int hashpower; /* hashpower this table is sized for. */
+    unsigned int power; /* number of buckets in the primary table. */
+    unsigned int old_power; /* number of buckets in the old table. */
+};
+
+static struct assoc_table *assoc_table = NULL;
+
+#define assoc_table_load() __atomic_load_n(&assoc_table, __ATOMIC_ACQUIRE)
+
+static enum assoc_index_type assoc_index = ASSOC_INDEX_CHAINED;
+
+/* Resize progress. Buckets may be moved by helper threads or by workers
+ * touching them, so these are updated atomically. */
+static uint64_t resize_cursor = 0;
+static uint64_t resize_moved = 0;
+static struct timeval resize_started;
+
+/* What the maintenance thread was woken up to do. */
+static enum {
+    RESIZE_NONE = 0, RESIZE_GROW, RESIZE_SHRINK
+} resize_request = RESIZE_NONE;
+static unsigned int resize_power = 0; /* grow straight to this, if set */
+
+/* We never shrink below the size we started with. */
+static unsigned int hashpower_min = HASHPOWER_DEFAULT;
 
 /*
- * Previous hash table. During expansion, we look here for keys that haven't
- * been moved over to the primary yet.
+ * Chained index: one item pointer per bucket, with collisions linked through
+ * it->h_next. A moved bucket in the old table is replaced with ASSOC_MOVED.
  */
-static item** old_hashtable = 0;
+#define ASSOC_MOVED ((item *)1)
 
-/* Flag: Are we in the middle of expanding now? */
-static bool expanding = false;
+/*
+ * Bucketed index: each bucket is a cache line holding a handful of item
+ * pointers along with a one byte tag per slot taken from the hash value.
+ * Lookups compare the tags all at once and only dereference items whose tag
+ * matches, rather than walking h_next through slab memory. Items which don't
+ * fit spill into an h_next chain hanging off the bucket.
+ *
+ * Buckets hold several items, so this index uses half as many buckets as the
+ * chained one for the same hashpower. Each bucket is 64 bytes, so it uses
+ * four times the memory of the chained index.
+ */
+#define ASSOC_BUCKET_SLOTS 6
+#define ASSOC_BUCKET_MASK ((1 << ASSOC_BUCKET_SLOTS) - 1)
+
+typedef struct {
+    uint8_t tags[ASSOC_BUCKET_SLOTS]; /* 0 means the slot is empty. */
+    uint8_t moved; /* set in the old table once the bucket is moved. */
+    uint8_t unused;
+    item *slots[ASSOC_BUCKET_SLOTS];
+    item *overflow;
+} assoc_bucket;
+
+static_assert(sizeof(assoc_bucket) == 64, "assoc_bucket must be a cache line");
+
+/* Bucket indexes are taken from the low bits of the hash value, so the tag is
+ * mixed from all of them to stay useful with large tables. */
+static inline uint8_t _bucket_tag(const uint32_t hv) {
+    uint8_t tag = (hv * 0x9E3779B1U) >> 24;
+    return tag ? tag : 1;
+}
+
+/* Returns a bitmask of the slots holding this tag. */
+static inline unsigned int _bucket_match(const assoc_bucket *b, const uint8_t tag) {
+#ifdef __SSE2__
+    __m128i tags = _mm_loadl_epi64((const __m128i *)b->tags);
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(tags, _mm_set1_epi8(tag)))
+        & ASSOC_BUCKET_MASK;
+#else
+    unsigned int mask = 0;
+    int x;
+    for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+        if (b->tags[x] == tag)
+            mask |= 1 << x;
+    }
+    return mask;
+#endif
+}
+
+static size_t _index_bytes(const unsigned int power) {
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        return hashsize(power) * sizeof(assoc_bucket);
+    }
+    return hashsize(power) * sizeof(item *);
+}
+
+static unsigned int _index_power(const unsigned int hp) {
+    return assoc_index == ASSOC_INDEX_BUCKETED ? hp - 1 : hp;
+}
 
 /*
- * During expansion we migrate values with bucket granularity; this is how
- * far we've gotten so far. Ranges from 0 .. hashsize(hashpower - 1) - 1.
+ * With a restart memory file, the table is kept in a file next to it so a
+ * clean restart can map it straight back in rather than rehashing every item.
+ * A resize builds its new table in a second file and renames it into place
+ * once every bucket has moved.
  */
-static uint64_t expand_bucket = 0;
+static char *index_file = NULL;
+static char *index_file_new = NULL;
 
-void assoc_init(const int hashtable_init) {
+/* What the restart metadata says was saved in index_file. */
+static char *restart_index = NULL;
+static char *restart_algorithm = NULL;
+static unsigned int restart_hashpower = 0;
+static bool index_reused = false;
+
+static void *_index_map(const char *file, const unsigned int power, const bool reuse) {
+    struct stat st;
+    void *ptr;
+    int fd = open(file, O_RDWR|O_CREAT|(reuse ? 0 : O_TRUNC), S_IRUSR|S_IWUSR);
+    if (fd == -1) {
+        return NULL;
+    }
+    if (reuse) {
+        if (fstat(fd, &st) != 0 || (size_t)st.st_size != _index_bytes(power)) {
+            close(fd);
+            return NULL;
+        }
+    } else if (ftruncate(fd, _index_bytes(power)) != 0) {
+        close(fd);
+        return NULL;
+    }
+    ptr = mmap(NULL, _index_bytes(power), PROT_READ|PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    return ptr;
+}
+
+/* Tables are mapped directly so that freeing one after a shrink hands the
+ * memory back to the OS, rather than leaving a hole in the malloc heap. This
+ * also gets us zeroed, cache line aligned memory for free. */
+static void *_index_alloc(const unsigned int power) {
+    if (index_file != NULL) {
+        return _index_map(index_file_new, power, false);
+    }
+    void *ptr = mmap(NULL, _index_bytes(power), PROT_READ|PROT_WRITE,
+            MAP_PRIVATE|MAP_ANON, -1, 0);
+    if (ptr == MAP_FAILED) {
+        return NULL;
+    }
+    return ptr;
+}
+
+static void _index_free(void *ptr, const unsigned int power) {
+    munmap(ptr, _index_bytes(power));
+}
+
+static struct assoc_table *assoc_table_new(void *primary, void *old,
+        unsigned int hp, unsigned int old_hp) {
+    struct assoc_table *t = malloc(sizeof(struct assoc_table));
+    if (t == NULL) {
+        return NULL;
+    }
+    t->primary = primary;
+    t->old = old;
+    t->hashpower = hp;
+    t->power = _index_power(hp);
+    t->old_power = _index_power(old_hp);
+    return t;
+}
+
+static void assoc_table_publish(struct assoc_table *t) {
+    __atomic_store_n(&assoc_table, t, __ATOMIC_RELEASE);
+    hashpower = t->hashpower;
+}
+
+void assoc_init(const int hashtable_init, enum assoc_index_type index) {
+    void *primary_hashtable;
     if (hashtable_init) {
         hashpower = hashtable_init;
     }
-    primary_hashtable = calloc(hashsize(hashpower), sizeof(void *));
+    hashpower_min = hashpower;
+    assoc_index = index;
+    switch (index) {
+        case ASSOC_INDEX_CHAINED:
+            settings.hash_index = "chained";
+            break;
+        case ASSOC_INDEX_BUCKETED:
+            settings.hash_index = "bucketed";
+            break;
+    }
+    if (settings.memory_file != NULL) {
+        size_t len = strlen(settings.memory_file) + sizeof(".hash.new");
+        index_file = malloc(len);
+        index_file_new = malloc(len);
+        if (index_file == NULL || index_file_new == NULL) {
+            fprintf(stderr, "Failed to init hashtable.\n");
+            exit(EXIT_FAILURE);
+        }
+        snprintf(index_file, len, "%s.hash", settings.memory_file);
+        snprintf(index_file_new, len, "%s.hash.new", settings.memory_file);
+    }
+    primary_hashtable = NULL;
+    // only reuse a saved table laid out exactly the way we'd build one.
+    if (restart_hashpower == hashpower
+            && restart_index && strcmp(restart_index, settings.hash_index) == 0
+            && restart_algorithm && strcmp(restart_algorithm, settings.hash_algorithm) == 0) {
+        primary_hashtable = _index_map(index_file, _index_power(hashpower), true);
+        if (primary_hashtable) {
+            index_reused = true;
+            restart_index_restored(RESTART_INDEX_HASH);
+        }
+    }
+    if (! primary_hashtable) {
+        primary_hashtable = _index_alloc(_index_power(hashpower));
+        if (primary_hashtable && index_file) {
+            rename(index_file_new, index_file);
+        }
+    }
     if (! primary_hashtable) {
         fprintf(stderr, "Failed to init hashtable.\n");
         exit(EXIT_FAILURE);
     }
+    assoc_table = assoc_table_new(primary_hashtable, NULL, hashpower, hashpower);
+    if (! assoc_table) {
+        fprintf(stderr, "Failed to init hashtable.\n");
+        exit(EXIT_FAILURE);
+    }
     STATS_LOCK();
     stats_state.hash_power_level = hashpower;
-    stats_state.hash_bytes = hashsize(hashpower) * sizeof(void *);
+    stats_state.hash_bytes = _index_bytes(assoc_table->power);
     STATS_UNLOCK();
 }
 
+static void _bucket_insert(assoc_bucket *b, item *it, const uint32_t hv) {
+    unsigned int empty = _bucket_match(b, 0);
+    if (empty) {
+        int slot = __builtin_ctz(empty);
+        it->h_next = NULL;
+        __atomic_store_n(&b->slots[slot], it, __ATOMIC_RELEASE);
+        __atomic_store_n(&b->tags[slot], _bucket_tag(hv), __ATOMIC_RELEASE);
+    } else {
+        it->h_next = b->overflow;
+        __atomic_store_n(&b->overflow, it, __ATOMIC_RELEASE);
+    }
+}
+
+/* Moves one bucket from the old table into the primary.
+ * CALLED WITH the item lock for the old bucket held. */
+static void assoc_move_bucket(struct assoc_table *t, const uint64_t oldbucket) {
+    item *it, *next;
+    uint32_t hv;
+
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        assoc_bucket *old = (assoc_bucket *)t->old + oldbucket;
+        assoc_bucket *primary = t->primary;
+        int x;
+        for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+            if (old->tags[x] == 0)
+                continue;
+            it = old->slots[x];
+            hv = hash(ITEM_key(it), it->nkey);
+            _bucket_insert(&primary[hv & hashmask(t->power)], it, hv);
+        }
+        for (it = old->overflow; NULL != it; it = next) {
+            next = it->h_next;
+            hv = hash(ITEM_key(it), it->nkey);
+            _bucket_insert(&primary[hv & hashmask(t->power)], it, hv);
+        }
+        __atomic_store_n(&old->moved, 1, __ATOMIC_RELEASE);
+    } else {
+        item **old = t->old;
+        item **primary = t->primary;
+        uint64_t bucket;
+        for (it = old[oldbucket]; NULL != it; it = next) {
+            next = it->h_next;
+            bucket = hash(ITEM_key(it), it->nkey) & hashmask(t->power);
+            it->h_next = primary[bucket];
+            __atomic_store_n(&primary[bucket], it, __ATOMIC_RELEASE);
+        }
+        __atomic_store_n(&old[oldbucket], ASSOC_MOVED, __ATOMIC_RELEASE);
+    }
+
+    __atomic_fetch_add(&resize_moved, 1, __ATOMIC_RELAXED);
+}
+
+static inline bool _bucket_is_moved(struct assoc_table *t, const uint64_t oldbucket) {
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        return __atomic_load_n(&((assoc_bucket *)t->old)[oldbucket].moved, __ATOMIC_ACQUIRE);
+    }
+    return __atomic_load_n(&((item **)t->old)[oldbucket], __ATOMIC_ACQUIRE) == ASSOC_MOVED;
+}
+
+/* Returns the primary table bucket for a hash value. If we're resizing and
+ * the old buckets feeding this one haven't been moved yet, we move them now;
+ * the caller already holds the lock we need and the buckets are typically
+ * small. */
+static void *_hashbucket(const uint32_t hv) {
+    struct assoc_table *t = assoc_table_load();
+    uint64_t bucket = hv & hashmask(t->power);
+
+    if (t->old != NULL) {
+        uint64_t oldbucket = hv & hashmask(t->old_power);
+        if (!_bucket_is_moved(t, oldbucket)) {
+            assoc_move_bucket(t, oldbucket);
+        }
+        if (t->old_power > t->power) {
+            // shrinking: the sibling old bucket also lands here.
+            oldbucket ^= hashsize(t->power);
+            if (!_bucket_is_moved(t, oldbucket)) {
+                assoc_move_bucket(t, oldbucket);
+            }
+        }
+    }
+
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        return (assoc_bucket *)t->primary + bucket;
+    }
+    return (item **)t->primary + bucket;
+}
+
+/*
+ * Multi-key lookups can prefetch their buckets and items up front, so the
+ * cache misses for every key overlap rather than being taken one at a time.
+ * This reads the tables without holding any item locks; what it finds is only
+ * ever used as a prefetch hint. A resize waits for prefetching threads to
+ * leave before freeing a table or descriptor. Readers register against one of
+ * two counters, so a steady stream of them can't hold a resize off forever.
+ */
+static unsigned int prefetch_epoch = 0;
+static uint64_t prefetch_readers[2] = {0, 0};
+
+void assoc_prefetch(const uint32_t *hv, const int count) {
+    unsigned int epoch = __atomic_load_n(&prefetch_epoch, __ATOMIC_SEQ_CST) & 1;
+    struct assoc_table *t;
+    int x;
+
+    __atomic_fetch_add(&prefetch_readers[epoch], 1, __ATOMIC_SEQ_CST);
+    t = assoc_table_load();
+
+    // first pass pulls in the buckets.
+    for (x = 0; x < count; x++) {
+        uint64_t bucket = hv[x] & hashmask(t->power);
+        if (assoc_index == ASSOC_INDEX_BUCKETED) {
+            __builtin_prefetch((assoc_bucket *)t->primary + bucket);
+        } else {
+            __builtin_prefetch((item **)t->primary + bucket);
+        }
+    }
+
+    // second pass pulls in the items we're going to compare keys against.
+    // Buckets not yet moved by a resize come up empty here, which is fine.
+    for (x = 0; x < count; x++) {
+        uint64_t bucket = hv[x] & hashmask(t->power);
+        if (assoc_index == ASSOC_INDEX_BUCKETED) {
+            assoc_bucket *b = (assoc_bucket *)t->primary + bucket;
+            unsigned int mask = _bucket_match(b, _bucket_tag(hv[x]));
+            while (mask) {
+                int slot = __builtin_ctz(mask);
+                __builtin_prefetch(__atomic_load_n(&b->slots[slot], __ATOMIC_RELAXED));
+                mask &= mask - 1;
+            }
+        } else {
+            item *it = __atomic_load_n((item **)t->primary + bucket, __ATOMIC_RELAXED);
+            if (it != NULL) {
+                __builtin_prefetch(it);
+            }
+        }
+    }
+
+    __atomic_fetch_sub(&prefetch_readers[epoch], 1, __ATOMIC_RELEASE);
+}
+
+/* Waits until no thread can still be prefetching from an old descriptor.
+ * Anyone registering after the epoch flips sees the current descriptor, so
+ * we only need to drain the counter that was in use. Flipping twice covers a
+ * reader which read the epoch before an earlier flip but registered after. */
+static void assoc_prefetch_sync(void) {
+    int x;
+    for (x = 0; x < 2; x++) {
+        unsigned int epoch = __atomic_fetch_add(&prefetch_epoch, 1, __ATOMIC_SEQ_CST) & 1;
+        while (__atomic_load_n(&prefetch_readers[epoch], __ATOMIC_SEQ_CST) != 0) {
+            sched_yield();
+        }
+    }
+}
+
+/* Finds the slot holding the key in a bucketed index, or returns -1 and sets
+ * *before to the h_next pointer leading to the item in the overflow chain. */
+static int _bucket_find(assoc_bucket *b, const char *key, const size_t nkey,
+        const uint32_t hv, item ***before) {
+    unsigned int mask = _bucket_match(b, _bucket_tag(hv));
+    item **pos;
+
+    while (mask) {
+        int slot = __builtin_ctz(mask);
+        item *it = b->slots[slot];
+        if ((nkey == it->nkey) && (memcmp(key, ITEM_key(it), nkey) == 0)) {
+            return slot;
+        }
+        mask &= mask - 1;
+    }
+
+    pos = &b->overflow;
+    while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
+        pos = &(*pos)->h_next;
+    }
+    *before = pos;
+    return -1;
+}
+
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
     item *it;
-    uint64_t oldbucket;
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it = old_hashtable[oldbucket];
-    } else {
-        it = primary_hashtable[hv & hashmask(hashpower)];
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        assoc_bucket *b = _hashbucket(hv);
+        item **before = NULL;
+        int slot = _bucket_find(b, key, nkey, hv, &before);
+        it = slot >= 0 ? b->slots[slot] : *before;
+        MEMCACHED_ASSOC_FIND(key, nkey, 0);
+        return it;
     }
 
+    it = *(item **)_hashbucket(hv);
+
     item *ret = NULL;
 #ifdef ENABLE_DTRACE
     int depth = 0;
@@ -101,16 +496,7 @@ item *assoc_find(const char *key, const size_t nkey, const uint32_t hv) {
    the item wasn't found */
 
 static item** _hashitem_before (const char *key, const size_t nkey, const uint32_t hv) {
-    item **pos;
-    uint64_t oldbucket;
-
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        pos = &old_hashtable[oldbucket];
-    } else {
-        pos = &primary_hashtable[hv & hashmask(hashpower)];
-    }
+    item **pos = _hashbucket(hv);
 
     while (*pos && ((nkey != (*pos)->nkey) || memcmp(key, ITEM_key(*pos), nkey))) {
         pos = &(*pos)->h_next;
@@ -118,51 +504,91 @@ static item** _hashitem_before (const char *key, const size_t nkey, const uint32
     return pos;
 }
 
-/* grows the hashtable to the next power of 2. */
-static void assoc_expand(void) {
-    old_hashtable = primary_hashtable;
-
-    primary_hashtable = calloc(hashsize(hashpower + 1), sizeof(void *));
-    if (primary_hashtable) {
-        if (settings.verbose > 1)
-            fprintf(stderr, "Hash table expansion starting\n");
-        hashpower++;
-        expanding = true;
-        expand_bucket = 0;
-        STATS_LOCK();
-        stats_state.hash_power_level = hashpower;
-        stats_state.hash_bytes += hashsize(hashpower) * sizeof(void *);
-        stats_state.hash_is_expanding = true;
-        STATS_UNLOCK();
+/* Lookup for lock-free readers, see item_read_begin(). Nothing is locked, so
+ * this never moves buckets for a resize and gives up on unmoved ones. It can
+ * also miss an item being moved or replaced while we look, and callers retry
+ * misses under the item lock. What it returns may be unlinked already, but
+ * its memory isn't reused until the caller leaves its epoch. */
+item *assoc_find_unlocked(const char *key, const size_t nkey, const uint32_t hv) {
+    struct assoc_table *t = assoc_table_load();
+    uint64_t bucket = hv & hashmask(t->power);
+    item *it;
+
+    if (t->old != NULL) {
+        uint64_t oldbucket = hv & hashmask(t->old_power);
+        if (!_bucket_is_moved(t, oldbucket)) {
+            return NULL;
+        }
+        if (t->old_power > t->power
+                && !_bucket_is_moved(t, oldbucket ^ hashsize(t->power))) {
+            return NULL;
+        }
+    }
+
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        assoc_bucket *b = (assoc_bucket *)t->primary + bucket;
+        unsigned int mask = _bucket_match(b, _bucket_tag(hv));
+        while (mask) {
+            int slot = __builtin_ctz(mask);
+            it = __atomic_load_n(&b->slots[slot], __ATOMIC_ACQUIRE);
+            if (it != NULL && nkey == it->nkey && memcmp(key, ITEM_key(it), nkey) == 0) {
+                return it;
+            }
+            mask &= mask - 1;
+        }
+        it = __atomic_load_n(&b->overflow, __ATOMIC_ACQUIRE);
     } else {
-        primary_hashtable = old_hashtable;
-        /* Bad news, but we can keep running. */
+        it = __atomic_load_n((item **)t->primary + bucket, __ATOMIC_ACQUIRE);
+    }
+
+    while (it) {
+        if (nkey == it->nkey && memcmp(key, ITEM_key(it), nkey) == 0) {
+            return it;
+        }
+        it = __atomic_load_n(&it->h_next, __ATOMIC_ACQUIRE);
     }
+    return NULL;
 }
 
-void assoc_start_expand(uint64_t curr_items) {
-    if (pthread_mutex_trylock(&maintenance_lock) == 0) {
-        if (curr_items > (hashsize(hashpower) * 3) / 2 && hashpower < HASHPOWER_MAX) {
-            pthread_cond_signal(&maintenance_cond);
+/* Says whether this very item is linked under the hash value, without looking
+ * at the item itself; it may have been freed or reused already. Needs the
+ * item lock for hv. */
+bool assoc_linked(const item *it, const uint32_t hv) {
+    item *search;
+
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        assoc_bucket *b = _hashbucket(hv);
+        int x;
+        for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+            if (b->slots[x] == it) {
+                return true;
+            }
         }
-        pthread_mutex_unlock(&maintenance_lock);
+        search = b->overflow;
+    } else {
+        search = *(item **)_hashbucket(hv);
     }
+
+    for (; search != NULL; search = search->h_next) {
+        if (search == it) {
+            return true;
+        }
+    }
+    return false;
 }
 
 /* Note: this isn't an assoc_update.  The key must not already exist to call this */
 int assoc_insert(item *it, const uint32_t hv) {
-    uint64_t oldbucket;
+    item **bucket;
 
 //    assert(assoc_find(ITEM_key(it), it->nkey) == 0);  /* shouldn't have duplicately named things defined */
 
-    if (expanding &&
-        (oldbucket = (hv & hashmask(hashpower - 1))) >= expand_bucket)
-    {
-        it->h_next = old_hashtable[oldbucket];
-        old_hashtable[oldbucket] = it;
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        _bucket_insert(_hashbucket(hv), it, hv);
     } else {
-        it->h_next = primary_hashtable[hv & hashmask(hashpower)];
-        primary_hashtable[hv & hashmask(hashpower)] = it;
+        bucket = _hashbucket(hv);
+        it->h_next = *bucket;
+        __atomic_store_n(bucket, it, __ATOMIC_RELEASE);
     }
 
     MEMCACHED_ASSOC_INSERT(ITEM_key(it), it->nkey);
@@ -170,7 +596,20 @@ int assoc_insert(item *it, const uint32_t hv) {
 }
 
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
-    item **before = _hashitem_before(key, nkey, hv);
+    item **before;
+
+    if (assoc_index == ASSOC_INDEX_BUCKETED) {
+        assoc_bucket *b = _hashbucket(hv);
+        int slot = _bucket_find(b, key, nkey, hv, &before);
+        if (slot >= 0) {
+            MEMCACHED_ASSOC_DELETE(key, nkey);
+            b->tags[slot] = 0;
+            b->slots[slot] = NULL;
+            return;
+        }
+    } else {
+        before = _hashitem_before(key, nkey, hv);
+    }
 
     if (*before) {
         item *nxt;
@@ -189,74 +628,297 @@ void assoc_delete(const char *key, const size_t nkey, const uint32_t hv) {
 }
 
 
+/* Saves what a restart needs to know to reuse index_file. A table caught
+ * halfway through a resize isn't saved, and gets rebuilt on restart. */
+int assoc_restart_save(const char *tag, void *ctx, void *data) {
+    struct assoc_table *t = assoc_table_load();
+    if (index_file == NULL || t->old != NULL) {
+        return 0;
+    }
+    msync(t->primary, _index_bytes(t->power), MS_SYNC);
+    restart_set_kv(ctx, "index", "%s", settings.hash_index);
+    restart_set_kv(ctx, "algorithm", "%s", settings.hash_algorithm);
+    restart_set_kv(ctx, "hashpower", "%u", t->hashpower);
+    return 0;
+}
+
+// The options we'll be running with aren't known yet, so the saved values
+// are compared in assoc_init().
+int assoc_restart_check(const char *tag, void *ctx, void *data) {
+    char *key;
+    char *val;
+    while (restart_get_kv(ctx, &key, &val) == RESTART_OK) {
+        uint32_t hp;
+        if (strcmp(key, "index") == 0) {
+            free(restart_index);
+            restart_index = strdup(val);
+        } else if (strcmp(key, "algorithm") == 0) {
+            free(restart_algorithm);
+            restart_algorithm = strdup(val);
+        } else if (strcmp(key, "hashpower") == 0 && safe_strtoul(val, &hp)) {
+            restart_hashpower = hp;
+        } else {
+            fprintf(stderr, "[restart] bad assoc line: %s %s\n", key, val);
+        }
+    }
+    return 0;
+}
+
+/* Moves the items in a reused table over to the new memory base. If items are
+ * being relinked instead, the table is emptied out for them. */
+void assoc_restart_fixup(void *old_base, void *new_base, const bool relink) {
+    struct assoc_table *t = assoc_table_load();
+    uint64_t bucket;
+    int x;
+
+    if (relink) {
+        if (index_reused) {
+            memset(t->primary, 0, _index_bytes(t->power));
+        }
+        return;
+    }
+    if (old_base == new_base) {
+        return;
+    }
+    for (bucket = 0; bucket < hashsize(t->power); bucket++) {
+        if (assoc_index == ASSOC_INDEX_BUCKETED) {
+            assoc_bucket *b = (assoc_bucket *)t->primary + bucket;
+            for (x = 0; x < ASSOC_BUCKET_SLOTS; x++) {
+                if (b->tags[x] != 0) {
+                    b->slots[x] = restart_rebase(b->slots[x], old_base, new_base);
+                }
+            }
+            if (b->overflow) {
+                b->overflow = restart_rebase(b->overflow, old_base, new_base);
+            }
+        } else {
+            item **pos = (item **)t->primary + bucket;
+            if (*pos) {
+                *pos = restart_rebase(*pos, old_base, new_base);
+            }
+        }
+    }
+}
+
 static volatile int do_run_maintenance_thread = 1;
+static bool maintenance_running = false;
 
-#define DEFAULT_HASH_BULK_MOVE 1
+#define DEFAULT_HASH_BULK_MOVE 256
 int hash_bulk_move = DEFAULT_HASH_BULK_MOVE;
 
-static void *assoc_maintenance_thread(void *arg) {
+static void assoc_resize_stats(void) {
+    struct timeval now;
+    gettimeofday(&now, NULL);
+    uint64_t elapsed_us =
+        (now.tv_sec - resize_started.tv_sec) * 1000000
+        + (now.tv_usec - resize_started.tv_usec);
+
+    STATS_LOCK();
+    stats_state.hash_resize_buckets_moved =
+        __atomic_load_n(&resize_moved, __ATOMIC_RELAXED);
+    stats_state.hash_resize_time_us = elapsed_us;
+    STATS_UNLOCK();
+}
+
+/* Claims ranges of hash_bulk_move buckets from the old table and moves them
+ * into the primary. Any number of these can run against the same table. */
+static void *assoc_resize_worker(void *arg) {
+    struct assoc_table *t = arg;
+    uint64_t oldsize = hashsize(t->old_power);
 
-    mutex_lock(&maintenance_lock);
     while (do_run_maintenance_thread) {
-        int ii = 0;
-
-        /* There is only one expansion thread, so no need to global lock. */
-        for (ii = 0; ii < hash_bulk_move && expanding; ++ii) {
-            item *it, *next;
-            uint64_t bucket;
-            void *item_lock = NULL;
-
-            /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
-             * is the lowest N bits of the hv, and the bucket of item_locks is
-             *  also the lowest M bits of hv, and N is greater than M.
-             *  So we can process expanding with only one item_lock. cool! */
-            if ((item_lock = item_trylock(expand_bucket))) {
-                    for (it = old_hashtable[expand_bucket]; NULL != it; it = next) {
-                        next = it->h_next;
-                        bucket = hash(ITEM_key(it), it->nkey) & hashmask(hashpower);
-                        it->h_next = primary_hashtable[bucket];
-                        primary_hashtable[bucket] = it;
-                    }
-
-                    old_hashtable[expand_bucket] = NULL;
-
-                    expand_bucket++;
-                    if (expand_bucket == hashsize(hashpower - 1)) {
-                        expanding = false;
-                        free(old_hashtable);
-                        STATS_LOCK();
-                        stats_state.hash_bytes -= hashsize(hashpower - 1) * sizeof(void *);
-                        stats_state.hash_is_expanding = false;
-                        STATS_UNLOCK();
-                        if (settings.verbose > 1)
-                            fprintf(stderr, "Hash table expansion done\n");
-                    }
-
-            } else {
-                usleep(10*1000);
+        uint64_t start = __atomic_fetch_add(&resize_cursor, hash_bulk_move,
+                __ATOMIC_RELAXED);
+        uint64_t end = start + hash_bulk_move;
+        uint64_t bucket;
+
+        if (start >= oldsize) {
+            break;
+        }
+        if (end > oldsize) {
+            end = oldsize;
+        }
+
+        /* bucket = hv & hashmask(hashpower) =>the bucket of hash table
+         * is the lowest N bits of the hv, and the bucket of item_locks is
+         *  also the lowest M bits of hv, and N is greater than M.
+         *  So we can process resizing with only one item_lock. cool! */
+        for (bucket = start; bucket < end; bucket++) {
+            item_lock(bucket);
+            if (!_bucket_is_moved(t, bucket)) {
+                assoc_move_bucket(t, bucket);
             }
+            item_unlock(bucket);
+        }
+
+        assoc_resize_stats();
+    }
+
+    return NULL;
+}
+
+/* grows or shrinks the hashtable by a power of 2. */
+static void assoc_resize(const unsigned int new_hashpower) {
+    struct assoc_table *cur = assoc_table_load();
+    struct assoc_table *resizing, *done;
+    pthread_t *helpers = NULL;
+    int nhelpers = settings.hash_expand_threads - 1;
+    bool grow = new_hashpower > cur->hashpower;
+    int x;
+
+    void *primary_hashtable = _index_alloc(_index_power(new_hashpower));
+    if (primary_hashtable == NULL) {
+        /* Bad news, but we can keep running. */
+        return;
+    }
+    resizing = assoc_table_new(primary_hashtable, cur->primary, new_hashpower, cur->hashpower);
+    done = assoc_table_new(primary_hashtable, NULL, new_hashpower, new_hashpower);
+    if (resizing == NULL || done == NULL) {
+        _index_free(primary_hashtable, _index_power(new_hashpower));
+        free(resizing);
+        free(done);
+        return;
+    }
+
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table %s starting\n", grow ? "expansion" : "shrink");
+
+    resize_cursor = 0;
+    resize_moved = 0;
+    gettimeofday(&resize_started, NULL);
+    assoc_table_publish(resizing);
 
-            if (item_lock) {
-                item_trylock_unlock(item_lock);
-                item_lock = NULL;
+    STATS_LOCK();
+    stats_state.hash_power_level = hashpower;
+    stats_state.hash_bytes += _index_bytes(resizing->power);
+    stats_state.hash_is_expanding = true;
+    if (grow) {
+        stats_state.hash_expansions++;
+    } else {
+        stats_state.hash_shrinks++;
+    }
+    stats_state.hash_resize_buckets_moved = 0;
+    stats_state.hash_resize_time_us = 0;
+    STATS_UNLOCK();
+
+    if (nhelpers > 0) {
+        helpers = calloc(nhelpers, sizeof(pthread_t));
+        for (x = 0; helpers != NULL && x < nhelpers; x++) {
+            if (pthread_create(&helpers[x], NULL, assoc_resize_worker, resizing) != 0) {
+                break;
             }
+            thread_setname(helpers[x], "mc-assocexp");
         }
+        nhelpers = x;
+    }
+
+    // this thread helps out, then waits for the rest to finish.
+    assoc_resize_worker(resizing);
+    for (x = 0; x < nhelpers; x++) {
+        pthread_join(helpers[x], NULL);
+    }
+    free(helpers);
+
+    if (!do_run_maintenance_thread) {
+        // shutting down mid-resize; leave the tables as they are.
+        return;
+    }
+
+    assoc_table_publish(done);
+    if (index_file != NULL) {
+        rename(index_file_new, index_file);
+    }
+    /* A thread which loaded an older descriptor must be holding an item lock.
+     * Once we've cycled through every lock nothing can still be referencing
+     * the old table. Prefetching threads and lock-free readers don't hold
+     * locks, so they're waited on separately. */
+    item_locks_sync();
+    assoc_prefetch_sync();
+    epoch_sync();
+    if (cur->old != NULL) {
+        _index_free(cur->old, cur->old_power);
+    }
+    _index_free(cur->primary, cur->power);
+    free(resizing);
+
+    assoc_resize_stats();
+    STATS_LOCK();
+    stats_state.hash_bytes -= _index_bytes(cur->power);
+    stats_state.hash_is_expanding = false;
+    STATS_UNLOCK();
+    free(cur);
+    if (settings.verbose > 1)
+        fprintf(stderr, "Hash table %s done\n", grow ? "expansion" : "shrink");
+}
+
+void assoc_start_expand(uint64_t curr_items) {
+    if (pthread_mutex_trylock(&maintenance_lock) == 0) {
+        if (curr_items > (hashsize(hashpower) * 3) / 2 && hashpower < HASHPOWER_MAX) {
+            resize_request = RESIZE_GROW;
+            pthread_cond_signal(&maintenance_cond);
+        } else if (settings.hash_shrink && hashpower > hashpower_min
+                && curr_items < hashsize(hashpower) / 8) {
+            resize_request = RESIZE_SHRINK;
+            pthread_cond_signal(&maintenance_cond);
+        }
+        pthread_mutex_unlock(&maintenance_lock);
+    }
+}
+
+/* Grows the table in one step to fit items, rather than doubling it each
+ * time the inserts cross the threshold. For bulk loads of a known size. */
+void assoc_start_expand_to(uint64_t items) {
+    unsigned int hp;
+    mutex_lock(&maintenance_lock);
+    hp = hashpower;
+    while (items > (hashsize(hp) * 3) / 2 && hp < HASHPOWER_MAX) {
+        hp++;
+    }
+    if (hp > hashpower) {
+        resize_power = hp;
+        resize_request = RESIZE_GROW;
+        pthread_cond_signal(&maintenance_cond);
+    }
+    mutex_unlock(&maintenance_lock);
+}
 
-        if (!expanding) {
-            /* We are done expanding.. just wait for next invocation */
+enum assoc_shrink_result assoc_start_shrink(void) {
+    enum assoc_shrink_result ret = SHRINK_OK;
+    if (!maintenance_running) {
+        return SHRINK_DISABLED;
+    }
+    if (pthread_mutex_trylock(&maintenance_lock) != 0) {
+        return SHRINK_RUNNING;
+    }
+    if (hashpower <= hashpower_min) {
+        ret = SHRINK_MINIMUM;
+    } else {
+        resize_request = RESIZE_SHRINK;
+        pthread_cond_signal(&maintenance_cond);
+    }
+    pthread_mutex_unlock(&maintenance_lock);
+    return ret;
+}
+
+static void *assoc_maintenance_thread(void *arg) {
+
+    mutex_lock(&maintenance_lock);
+    while (do_run_maintenance_thread) {
+        /* We are done resizing.. just wait for next invocation */
+        while (resize_request == RESIZE_NONE && do_run_maintenance_thread) {
             pthread_cond_wait(&maintenance_cond, &maintenance_lock);
-            /* assoc_expand() swaps out the hash table entirely, so we need
-             * all threads to not hold any references related to the hash
-             * table while this happens.
-             * This is instead of a more complex, possibly slower algorithm to
-             * allow dynamic hash table expansion without causing significant
-             * wait times.
-             */
-            if (do_run_maintenance_thread) {
-                pause_threads(PAUSE_ALL_THREADS);
-                assoc_expand();
-                pause_threads(RESUME_ALL_THREADS);
+        }
+        /* Resizing runs to completion while we hold the maintenance lock,
+         * which also holds off any hash table iterators. Worker threads
+         * keep running throughout. */
+        if (do_run_maintenance_thread) {
+            if (resize_request == RESIZE_GROW) {
+                assoc_resize(resize_power > hashpower ? resize_power : hashpower + 1);
+                resize_power = 0;
+            } else if (hashpower > hashpower_min) {
+                assoc_resize(hashpower - 1);
             }
+            resize_request = RESIZE_NONE;
         }
     }
     mutex_unlock(&maintenance_lock);
@@ -281,12 +943,13 @@ int start_assoc_maintenance_thread(void) {
         return -1;
     }
     thread_setname(maintenance_tid, "mc-assocmaint");
+    maintenance_running = true;
     return 0;
 }
 
 void stop_assoc_maintenance_thread(void) {
-    mutex_lock(&maintenance_lock);
     do_run_maintenance_thread = 0;
+    mutex_lock(&maintenance_lock);
     pthread_cond_signal(&maintenance_cond);
     mutex_unlock(&maintenance_lock);
 
@@ -296,9 +959,12 @@ void stop_assoc_maintenance_thread(void) {
 
 struct assoc_iterator {
     uint64_t bucket;
+    uint64_t end;
     item *it;
     item *next;
+    int slot;
     bool bucket_locked;
+    bool holds_lock; /* the maintenance lock */
 };
 
 void *assoc_get_iterator(void) {
@@ -308,41 +974,74 @@ void *assoc_get_iterator(void) {
     }
     // this will hang the caller while a hash table expansion is running.
     mutex_lock(&maintenance_lock);
+    iter->end = hashsize(assoc_table_load()->power);
+    iter->holds_lock = true;
+    return iter;
+}
+
+void *assoc_get_iterator_part(const unsigned int part, const unsigned int parts) {
+    struct assoc_iterator *iter = calloc(1, sizeof(struct assoc_iterator));
+    uint64_t size;
+    if (iter == NULL) {
+        return NULL;
+    }
+    size = hashsize(assoc_table_load()->power);
+    iter->bucket = size * part / parts;
+    iter->end = size * (part + 1) / parts;
     return iter;
 }
 
+/* Returns the next item in the locked bucket. The caller may unlink the item
+ * we return before asking for the next one. */
+static item *_iterate_bucket(struct assoc_iterator *iter) {
+    // - slots first, then the overflow chain once slot goes past the end.
+    if (assoc_index == ASSOC_INDEX_BUCKETED && iter->slot <= ASSOC_BUCKET_SLOTS) {
+        assoc_bucket *b = (assoc_bucket *)assoc_table_load()->primary + iter->bucket;
+        while (iter->slot < ASSOC_BUCKET_SLOTS) {
+            int slot = iter->slot++;
+            if (b->tags[slot] != 0) {
+                return b->slots[slot];
+            }
+        }
+        iter->slot++;
+        iter->next = b->overflow;
+    }
+
+    iter->it = iter->next;
+    if (iter->it != NULL) {
+        iter->next = iter->it->h_next;
+    }
+    return iter->it;
+}
+
 bool assoc_iterate(void *iterp, item **it) {
     struct assoc_iterator *iter = (struct assoc_iterator *) iterp;
     *it = NULL;
     // - if locked bucket and next, update next and return
     if (iter->bucket_locked) {
-        if (iter->next != NULL) {
-            iter->it = iter->next;
-            iter->next = iter->it->h_next;
-            *it = iter->it;
-        } else {
+        if ((*it = _iterate_bucket(iter)) == NULL) {
             // unlock previous bucket, if any
             item_unlock(iter->bucket);
             // iterate the bucket post since it starts at 0.
             iter->bucket++;
             iter->bucket_locked = false;
-            *it = NULL;
         }
         return true;
     }
 
+    // - only check the primary hash table since expand is blocked.
+    struct assoc_table *t = assoc_table_load();
+
     // - loop until we hit the end or find something.
-    if (iter->bucket != hashsize(hashpower)) {
+    if (iter->bucket < iter->end) {
         // - lock next bucket
         item_lock(iter->bucket);
         iter->bucket_locked = true;
-        // - only check the primary hash table since expand is blocked.
-        iter->it = primary_hashtable[iter->bucket];
-        if (iter->it != NULL) {
-            // - set it, next and return
-            iter->next = iter->it->h_next;
-            *it = iter->it;
-        } else {
+        iter->slot = 0;
+        if (assoc_index == ASSOC_INDEX_CHAINED) {
+            iter->next = ((item **)t->primary)[iter->bucket];
+        }
+        if ((*it = _iterate_bucket(iter)) == NULL) {
             // - nothing found in this bucket, try next.
             item_unlock(iter->bucket);
             iter->bucket_locked = false;
@@ -360,6 +1059,8 @@ void assoc_iterate_final(void *iterp) {
     if (iter->bucket_locked) {
         item_unlock(iter->bucket);
     }
-    mutex_unlock(&maintenance_lock);
+    if (iter->holds_lock) {
+        mutex_unlock(&maintenance_lock);
+    }
     free(iter);
 }
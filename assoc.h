@@ -1,16 +1,37 @@
 /* associative array */
-void assoc_init(const int hashpower_init);
+enum assoc_index_type {
+    ASSOC_INDEX_CHAINED = 0, ASSOC_INDEX_BUCKETED
+};
+
+void assoc_init(const int hashpower_init, enum assoc_index_type index);
 
 item *assoc_find(const char *key, const size_t nkey, const uint32_t hv);
+item *assoc_find_unlocked(const char *key, const size_t nkey, const uint32_t hv);
+bool assoc_linked(const item *it, const uint32_t hv);
 int assoc_insert(item *item, const uint32_t hv);
 void assoc_delete(const char *key, const size_t nkey, const uint32_t hv);
+void assoc_prefetch(const uint32_t *hv, const int count);
 
 int start_assoc_maintenance_thread(void);
 void stop_assoc_maintenance_thread(void);
 void assoc_start_expand(uint64_t curr_items);
+void assoc_start_expand_to(uint64_t items);
+
+enum assoc_shrink_result {
+    SHRINK_OK = 0, SHRINK_RUNNING, SHRINK_MINIMUM, SHRINK_DISABLED
+};
+enum assoc_shrink_result assoc_start_shrink(void);
+
+/* restart support, see restart.c */
+int assoc_restart_check(const char *tag, void *ctx, void *data);
+int assoc_restart_save(const char *tag, void *ctx, void *data);
+void assoc_restart_fixup(void *old_base, void *new_base, const bool relink);
 
 /* walk functions */
 void *assoc_get_iterator(void);
+/* Walks one of parts even slices of the table. Only valid while an iterator
+ * from assoc_get_iterator() is held, which keeps the table from changing. */
+void *assoc_get_iterator_part(const unsigned int part, const unsigned int parts);
 bool assoc_iterate(void *iterp, item **it);
 void assoc_iterate_final(void *iterp);
 
@@ -0,0 +1,199 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for the hash table index layouts in assoc.c.
+ *
+ * Items are spread through a large buffer in random order so lookups behave
+ * like they would against a big slab heap, rather than a hot, compact one.
+ *
+ * usage: bench_assoc [items] [lookups]
+ */
+#include "memcached.h"
+#include "restart.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* The bits of the server assoc.c needs. The benchmark is single threaded. */
+struct settings settings;
+struct stats_state stats_state;
+
+void STATS_LOCK(void) {}
+void STATS_UNLOCK(void) {}
+void item_lock(uint32_t hv) {}
+void item_unlock(uint32_t hv) {}
+void item_locks_sync(void) {}
+void thread_setname(pthread_t thread, const char *name) {}
+void restart_set_kv(void *ctx, const char *key, const char *fmt, ...) {}
+enum restart_get_kv_ret restart_get_kv(void *ctx, char **key, char **val) {
+    return RESTART_DONE;
+}
+void restart_index_restored(enum restart_index_part part) {}
+
+#define ITEM_STRIDE 128
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static uint64_t rng_state = 88172645463325252ULL;
+
+static uint64_t rng(void) {
+    rng_state ^= rng_state << 13;
+    rng_state ^= rng_state >> 7;
+    rng_state ^= rng_state << 17;
+    return rng_state;
+}
+
+static void shuffle(uint32_t *list, uint32_t count) {
+    uint32_t x;
+    for (x = count - 1; x > 0; x--) {
+        uint32_t y = rng() % (x + 1);
+        uint32_t tmp = list[x];
+        list[x] = list[y];
+        list[y] = tmp;
+    }
+}
+
+static item *item_at(char *heap, uint32_t slot) {
+    return (item *)(heap + (size_t)slot * ITEM_STRIDE);
+}
+
+/* Looks keys up in batches the way a multiget would, first one key at a
+ * time and then with the whole batch hashed and prefetched up front. */
+#define MULTIGET_MAX 100
+
+static void multiget(const char *name, char *heap, uint32_t count,
+        uint32_t *order, uint32_t lookups) {
+    static const uint32_t sizes[] = {1, 10, MULTIGET_MAX};
+    uint32_t hv[MULTIGET_MAX];
+    uint32_t s, x, y;
+
+    for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+        uint32_t batch = sizes[s];
+        uint32_t keys = lookups - lookups % batch;
+        uint64_t start, serial, prefetched, found = 0;
+
+        start = now_ns();
+        for (x = 0; x < keys; x += batch) {
+            for (y = 0; y < batch; y++) {
+                item *it = item_at(heap, order[(x + y) % count]);
+                hv[y] = hash(ITEM_key(it), it->nkey);
+                found += assoc_find(ITEM_key(it), it->nkey, hv[y]) == it;
+            }
+        }
+        serial = now_ns() - start;
+
+        start = now_ns();
+        for (x = 0; x < keys; x += batch) {
+            for (y = 0; y < batch; y++) {
+                item *it = item_at(heap, order[(x + y) % count]);
+                hv[y] = hash(ITEM_key(it), it->nkey);
+            }
+            if (batch > 1) {
+                assoc_prefetch(hv, batch);
+            }
+            for (y = 0; y < batch; y++) {
+                item *it = item_at(heap, order[(x + y) % count]);
+                found += assoc_find(ITEM_key(it), it->nkey, hv[y]) == it;
+            }
+        }
+        prefetched = now_ns() - start;
+
+        printf("%-9s get%-4u %6.1f ns/key serial, %6.1f ns/key prefetched (%llu found)\n",
+                name, batch, (double)serial / keys, (double)prefetched / keys,
+                (unsigned long long)found);
+    }
+}
+
+static void run(const char *name, enum assoc_index_type index,
+        char *heap, uint32_t count, uint32_t *order, uint32_t lookups) {
+    unsigned int hp = 12;
+    uint32_t x;
+    uint64_t start, found = 0;
+    char key[KEY_MAX_LENGTH];
+
+    /* size the table as it would be right before it grows. */
+    while (((uint64_t)3 << hp) / 2 < count)
+        hp++;
+    hp--;
+    assoc_init(hp, index);
+
+    start = now_ns();
+    for (x = 0; x < count; x++) {
+        item *it = item_at(heap, order[x]);
+        assoc_insert(it, hash(ITEM_key(it), it->nkey));
+    }
+    printf("%-9s insert: %6.1f ns/op\n", name,
+            (double)(now_ns() - start) / count);
+
+    shuffle(order, count);
+    start = now_ns();
+    for (x = 0; x < lookups; x++) {
+        item *it = item_at(heap, order[x % count]);
+        uint32_t hv = hash(ITEM_key(it), it->nkey);
+        found += assoc_find(ITEM_key(it), it->nkey, hv) == it;
+    }
+    printf("%-9s hit:    %6.1f ns/op (%llu found)\n", name,
+            (double)(now_ns() - start) / lookups, (unsigned long long)found);
+
+    multiget(name, heap, count, order, lookups);
+
+    start = now_ns();
+    found = 0;
+    for (x = 0; x < lookups; x++) {
+        int nkey = snprintf(key, sizeof(key), "miss:%u", x);
+        found += assoc_find(key, nkey, hash(key, nkey)) != NULL;
+    }
+    printf("%-9s miss:   %6.1f ns/op (%llu found)\n", name,
+            (double)(now_ns() - start) / lookups, (unsigned long long)found);
+
+    start = now_ns();
+    for (x = 0; x < count; x++) {
+        item *it = item_at(heap, order[x]);
+        assoc_delete(ITEM_key(it), it->nkey, hash(ITEM_key(it), it->nkey));
+    }
+    printf("%-9s delete: %6.1f ns/op\n", name,
+            (double)(now_ns() - start) / count);
+    printf("%-9s hash_bytes: %llu\n\n", name,
+            (unsigned long long)stats_state.hash_bytes);
+}
+
+int main(int argc, char **argv) {
+    uint32_t count = argc > 1 ? atoi(argv[1]) : 4000000;
+    uint32_t lookups = argc > 2 ? atoi(argv[2]) : 10000000;
+    uint32_t x;
+    char *heap;
+    uint32_t *order;
+
+    if (count == 0 || lookups == 0) {
+        fprintf(stderr, "usage: %s [items] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    hash_init(MURMUR3_HASH);
+    heap = calloc(count, ITEM_STRIDE);
+    order = malloc(sizeof(uint32_t) * count);
+    if (heap == NULL || order == NULL) {
+        fprintf(stderr, "Failed to allocate %u items\n", count);
+        return 1;
+    }
+
+    for (x = 0; x < count; x++) {
+        order[x] = x;
+    }
+    shuffle(order, count);
+    for (x = 0; x < count; x++) {
+        item *it = item_at(heap, order[x]);
+        it->nkey = snprintf(ITEM_key(it), ITEM_STRIDE - sizeof(item),
+                "key:%u", x);
+    }
+
+    printf("%u items, %u lookups\n\n", count, lookups);
+    run("chained", ASSOC_INDEX_CHAINED, heap, count, order, lookups);
+    run("bucketed", ASSOC_INDEX_BUCKETED, heap, count, order, lookups);
+
+    return 0;
+}
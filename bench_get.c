@@ -0,0 +1,132 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for reads of a single hot key from many threads.
+ *
+ * Compares what a get hit costs in synchronization on the normal path, which
+ * takes the item lock to grab a reference and again to drop it, against the
+ * epoch protected path used with -o lockfree_get. Both copy the value out the
+ * same way. Every thread reads the same item, so the locked path bounces the
+ * lock and refcount cache lines between cores.
+ *
+ * usage: bench_get [max threads] [seconds per run]
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+struct settings settings;
+
+#define VALUE_SIZE 100
+
+static item *hot;
+static pthread_mutex_t hot_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int running;
+
+typedef struct {
+    pthread_t tid;
+    epoch_slot *epoch;
+    bool lockfree;
+    uint64_t reads;
+    char buf[WRITE_BUFFER_SIZE];
+} bench_thread;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void *reader(void *arg) {
+    bench_thread *t = arg;
+    uint64_t reads = 0;
+
+    while (running) {
+        if (t->lockfree) {
+            epoch_enter(t->epoch);
+            if (__atomic_load_n(&hot->it_flags, __ATOMIC_ACQUIRE) & ITEM_LINKED) {
+                memcpy(t->buf, ITEM_data(hot), hot->nbytes);
+            }
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            reads += (__atomic_load_n(&hot->it_flags, __ATOMIC_RELAXED) & ITEM_LINKED) != 0;
+            epoch_exit(t->epoch);
+        } else {
+            pthread_mutex_lock(&hot_lock);
+            refcount_incr(hot);
+            pthread_mutex_unlock(&hot_lock);
+            memcpy(t->buf, ITEM_data(hot), hot->nbytes);
+            pthread_mutex_lock(&hot_lock);
+            refcount_decr(hot);
+            pthread_mutex_unlock(&hot_lock);
+            reads++;
+        }
+    }
+    t->reads = reads;
+    return NULL;
+}
+
+static double run(bench_thread *threads, int nthreads, bool lockfree, int seconds) {
+    uint64_t start, total = 0;
+    int x;
+
+    running = 1;
+    for (x = 0; x < nthreads; x++) {
+        threads[x].lockfree = lockfree;
+        threads[x].reads = 0;
+        if (pthread_create(&threads[x].tid, NULL, reader, &threads[x]) != 0) {
+            fprintf(stderr, "Failed to start thread\n");
+            exit(1);
+        }
+    }
+    start = now_ns();
+    sleep(seconds);
+    running = 0;
+    for (x = 0; x < nthreads; x++) {
+        pthread_join(threads[x].tid, NULL);
+        total += threads[x].reads;
+    }
+    return (double)total * 1000 / (now_ns() - start);
+}
+
+int main(int argc, char **argv) {
+    int max = argc > 1 ? atoi(argv[1]) : 32;
+    int seconds = argc > 2 ? atoi(argv[2]) : 1;
+    bench_thread *threads;
+    int n, x;
+
+    if (max < 1 || seconds < 1) {
+        fprintf(stderr, "usage: %s [max threads] [seconds per run]\n", argv[0]);
+        return 1;
+    }
+
+    threads = calloc(max, sizeof(bench_thread));
+    hot = calloc(1, sizeof(item) + KEY_MAX_LENGTH + VALUE_SIZE + 64);
+    if (threads == NULL || hot == NULL) {
+        fprintf(stderr, "Failed to allocate\n");
+        return 1;
+    }
+    hot->nkey = snprintf(ITEM_key(hot), KEY_MAX_LENGTH, "hotkey");
+    hot->nbytes = VALUE_SIZE;
+    hot->refcount = 1;
+    hot->it_flags = ITEM_LINKED;
+    memset(ITEM_data(hot), 'x', VALUE_SIZE);
+
+    epoch_init(max);
+    for (x = 0; x < max; x++) {
+        threads[x].epoch = epoch_slot_get(x);
+    }
+
+    printf("one %d byte item, %d second runs\n\n", VALUE_SIZE, seconds);
+    // powers of two, then max.
+    for (n = 1; n <= max; n = (n < max && n * 2 > max) ? max : n * 2) {
+        double locked = run(threads, n, false, seconds);
+        double lockfree = run(threads, n, true, seconds);
+        printf("%3d threads: %8.2f Mreads/s locked, %8.2f Mreads/s lock-free\n",
+                n, locked, lockfree);
+    }
+
+    free(hot);
+    free(threads);
+    return 0;
+}
@@ -0,0 +1,78 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for the key hash functions in hash.c.
+ *
+ * Reports per key throughput for each algorithm at several key sizes.
+ *
+ * usage: bench_hash [keys per size]
+ */
+#include "memcached.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* hash_init() records the algorithm name here. */
+struct settings settings;
+
+#define POOL_KEYS 4096
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void run(enum hashfunc_type type, char *pool, size_t nkey,
+        uint32_t hashes) {
+    uint32_t sum = 0;
+    uint64_t start, elapsed;
+    uint32_t x;
+
+    hash_init(type);
+
+    start = now_ns();
+    for (x = 0; x < hashes; x++) {
+        sum += hash(pool + (size_t)(x % POOL_KEYS) * KEY_MAX_LENGTH, nkey);
+    }
+    elapsed = now_ns() - start;
+
+    printf("%-8s %4zu bytes: %6.2f ns/key %7.0f MB/s (%08x)\n",
+            settings.hash_algorithm, nkey,
+            (double)elapsed / hashes, (double)nkey * hashes * 1000 / elapsed,
+            sum);
+}
+
+int main(int argc, char **argv) {
+    static const size_t sizes[] = {8, 16, 32, 64, 128, KEY_MAX_LENGTH};
+    static const enum hashfunc_type types[] = {JENKINS_HASH, MURMUR3_HASH, XXH3_HASH};
+    uint32_t hashes = argc > 1 ? atoi(argv[1]) : 10000000;
+    char *pool;
+    size_t s, t, x;
+
+    if (hashes == 0) {
+        fprintf(stderr, "usage: %s [keys per size]\n", argv[0]);
+        return 1;
+    }
+
+    pool = malloc((size_t)POOL_KEYS * KEY_MAX_LENGTH);
+    if (pool == NULL) {
+        fprintf(stderr, "Failed to allocate key pool\n");
+        return 1;
+    }
+    srand(1);
+    for (x = 0; x < (size_t)POOL_KEYS * KEY_MAX_LENGTH; x++) {
+        pool[x] = 'a' + rand() % 26;
+    }
+
+    printf("%u keys per size\n\n", hashes);
+    for (t = 0; t < sizeof(types) / sizeof(types[0]); t++) {
+        for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++) {
+            run(types[t], pool, sizes[s], hashes);
+        }
+        printf("\n");
+    }
+
+    free(pool);
+    return 0;
+}
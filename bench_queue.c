@@ -0,0 +1,223 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Microbenchmark for handing work to a worker thread.
+ *
+ * Compares the old connection queue, a mutex protected list of items from a
+ * freelist cache with a write to the worker's eventfd (or pipe) for every
+ * item, against the MPSC ring the workers use now, which only writes to the
+ * eventfd when the worker has gone idle. Producer threads each push a fixed
+ * number of items stamped with the time they were pushed, and a single
+ * consumer pops them the way thread_libevent_process does. Producers push as
+ * fast as they can, so once they outrun the consumer the latency is mostly
+ * time spent waiting in the queue.
+ *
+ * usage: bench_queue [max producers] [items per producer]
+ */
+#include "config.h"
+#include "cache.h"
+#include "mpsc.h"
+#include "queue.h"
+#include <poll.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#ifdef HAVE_EVENTFD
+#include <sys/eventfd.h>
+#endif
+
+// about the size of a CQ_ITEM.
+typedef struct bench_item {
+    uint64_t stamp;
+    char pad[48];
+    STAILQ_ENTRY(bench_item) i_next;
+} bench_item;
+
+typedef struct {
+    STAILQ_HEAD(bench_head, bench_item) head;
+    pthread_mutex_t lock;
+    cache_t *cache;
+} list_queue;
+
+static int notify_fds[2];
+static bool use_ring;
+static list_queue lq;
+static mpsc_ring ring;
+static uint64_t items_per;
+static uint64_t wakeups;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void notify(void) {
+#ifdef HAVE_EVENTFD
+    uint64_t u = 1;
+    if (write(notify_fds[1], &u, sizeof(u)) != sizeof(u)) {
+        perror("write");
+    }
+#else
+    if (write(notify_fds[1], "c", 1) != 1) {
+        perror("write");
+    }
+#endif
+}
+
+// returns the number of events read, same as the worker.
+static uint64_t wait_notify(void) {
+    struct pollfd pfd = { .fd = notify_fds[0], .events = POLLIN };
+    poll(&pfd, 1, -1);
+#ifdef HAVE_EVENTFD
+    uint64_t u = 0;
+    if (read(notify_fds[0], &u, sizeof(u)) != sizeof(u)) {
+        return 0;
+    }
+    return u;
+#else
+    char buf[32];
+    ssize_t r = read(notify_fds[0], buf, sizeof(buf));
+    return r > 0 ? r : 0;
+#endif
+}
+
+static void *producer(void *arg) {
+    for (uint64_t x = 0; x < items_per; x++) {
+        if (use_ring) {
+            bench_item it;
+            bool wake;
+            it.stamp = now_ns();
+            while (!mpsc_push(&ring, &it, &wake)) {
+            }
+            if (wake) {
+                notify();
+            }
+        } else {
+            bench_item *it;
+            while ((it = cache_alloc(lq.cache)) == NULL) {
+            }
+            it->stamp = now_ns();
+            pthread_mutex_lock(&lq.lock);
+            STAILQ_INSERT_TAIL(&lq.head, it, i_next);
+            pthread_mutex_unlock(&lq.lock);
+            notify();
+        }
+    }
+    return NULL;
+}
+
+// returns the summed latency of all items.
+static uint64_t consume(uint64_t total) {
+    uint64_t done = 0, lat = 0;
+
+    while (done < total) {
+        uint64_t count = wait_notify();
+        wakeups++;
+        if (use_ring) {
+            bench_item it;
+            for (;;) {
+                if (!mpsc_pop(&ring, &it)) {
+                    if (mpsc_sleep(&ring)) {
+                        break;
+                    }
+                    continue;
+                }
+                lat += now_ns() - it.stamp;
+                done++;
+            }
+        } else {
+            for (uint64_t x = 0; x < count; x++) {
+                pthread_mutex_lock(&lq.lock);
+                bench_item *it = STAILQ_FIRST(&lq.head);
+                if (it != NULL) {
+                    STAILQ_REMOVE_HEAD(&lq.head, i_next);
+                }
+                pthread_mutex_unlock(&lq.lock);
+                if (it == NULL) {
+                    break;
+                }
+                lat += now_ns() - it->stamp;
+                cache_free(lq.cache, it);
+                done++;
+            }
+        }
+    }
+    return lat;
+}
+
+static void run(int nprod, bool ring_mode, double *mitems, double *avg_us, double *per_wake) {
+    pthread_t *tids = calloc(nprod, sizeof(pthread_t));
+    uint64_t total = items_per * nprod;
+    uint64_t start, lat;
+
+    use_ring = ring_mode;
+    wakeups = 0;
+    start = now_ns();
+    for (int x = 0; x < nprod; x++) {
+        if (pthread_create(&tids[x], NULL, producer, NULL) != 0) {
+            fprintf(stderr, "Failed to start thread\n");
+            exit(1);
+        }
+    }
+    lat = consume(total);
+    for (int x = 0; x < nprod; x++) {
+        pthread_join(tids[x], NULL);
+    }
+    // the list queue can leave counts in the eventfd for items we already
+    // took; clear them out for the next run.
+    while (1) {
+        struct pollfd pfd = { .fd = notify_fds[0], .events = POLLIN };
+        if (poll(&pfd, 1, 0) <= 0)
+            break;
+        wait_notify();
+    }
+    *mitems = (double)total * 1000 / (now_ns() - start);
+    *avg_us = (double)lat / total / 1000;
+    *per_wake = (double)total / wakeups;
+    free(tids);
+}
+
+int main(int argc, char **argv) {
+    int max = argc > 1 ? atoi(argv[1]) : 8;
+    long per = argc > 2 ? atol(argv[2]) : 200000;
+
+    if (max < 1 || per < 1) {
+        fprintf(stderr, "usage: %s [max producers] [items per producer]\n", argv[0]);
+        return 1;
+    }
+    items_per = per;
+
+#ifdef HAVE_EVENTFD
+    notify_fds[0] = notify_fds[1] = eventfd(0, EFD_NONBLOCK);
+    if (notify_fds[0] == -1) {
+#else
+    if (pipe(notify_fds) == -1) {
+#endif
+        perror("notify fd");
+        return 1;
+    }
+
+    STAILQ_INIT(&lq.head);
+    pthread_mutex_init(&lq.lock, NULL);
+    lq.cache = cache_create("bench", sizeof(bench_item), sizeof(char *));
+    if (lq.cache == NULL || !mpsc_init(&ring, 1024, sizeof(bench_item))) {
+        fprintf(stderr, "Failed to allocate\n");
+        return 1;
+    }
+
+    printf("%lu items per producer, one consumer\n\n", per);
+    printf("               %-31s   %-31s\n", "list + notify per item", "ring + coalesced notify");
+    // powers of two, then max.
+    for (int n = 1; n <= max; n = (n < max && n * 2 > max) ? max : n * 2) {
+        double lt, ll, lw, rt, rl, rw;
+        run(n, false, &lt, &ll, &lw);
+        run(n, true, &rt, &rl, &rw);
+        printf("%3d producers: %6.2f Mitems/s %8.1fus %8.1f/wake   %6.2f Mitems/s %8.1fus %8.1f/wake\n",
+                n, lt, ll, lw, rt, rl, rw);
+    }
+
+    return 0;
+}
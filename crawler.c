@@ -7,6 +7,7 @@
 /* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
 #include "memcached.h"
 #include "storage.h"
+#include "snapshot.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/resource.h>
@@ -21,6 +22,7 @@
 #include <assert.h>
 #include <unistd.h>
 #include <poll.h>
+#include <fnmatch.h>
 
 #include "base64.h"
 
@@ -41,12 +43,14 @@ typedef int (*crawler_init_func)(crawler_module_t *cm, void *data); // TODO: ini
 typedef void (*crawler_deinit_func)(crawler_module_t *cm); // TODO: extra args?
 typedef void (*crawler_doneclass_func)(crawler_module_t *cm, int slab_cls);
 typedef void (*crawler_finalize_func)(crawler_module_t *cm);
+typedef int (*crawler_flush_func)(crawler_module_t *cm);
 
 typedef struct {
     crawler_init_func init; /* run before crawl starts */
     crawler_eval_func eval; /* runs on an item. */
     crawler_doneclass_func doneclass; /* runs once per sub-crawler completion. */
     crawler_finalize_func finalize; /* runs once when all sub-crawlers are done. */
+    crawler_flush_func flush; /* writes out a thread's buffer, instead of to the client. */
     bool needs_lock; /* whether or not we need the LRU lock held when eval is called */
     bool needs_client; /* whether or not to grab onto the remote client */
 } crawler_module_reg_t;
@@ -95,13 +99,58 @@ crawler_module_reg_t crawler_mgdump_mod = {
     .needs_client = true
 };
 
-crawler_module_reg_t *crawler_mod_regs[4] = {
+static int crawler_invalidate_init(crawler_module_t *cm, void *data);
+static void crawler_invalidate_eval(crawler_module_t *cm, item *search, uint32_t hv, int i);
+static void crawler_invalidate_finalize(crawler_module_t *cm);
+
+crawler_module_reg_t crawler_invalidate_mod = {
+    .init = crawler_invalidate_init,
+    .eval = crawler_invalidate_eval,
+    .doneclass = NULL,
+    .finalize = crawler_invalidate_finalize,
+    .needs_lock = false,
+    .needs_client = false
+};
+
+static int crawler_export_init(crawler_module_t *cm, void *data);
+static void crawler_export_eval(crawler_module_t *cm, item *search, uint32_t hv, int i);
+static void crawler_export_finalize(crawler_module_t *cm);
+static int crawler_export_flush(crawler_module_t *cm);
+
+crawler_module_reg_t crawler_export_mod = {
+    .init = crawler_export_init,
+    .eval = crawler_export_eval,
+    .doneclass = NULL,
+    .finalize = crawler_export_finalize,
+    .flush = crawler_export_flush,
+    .needs_lock = false,
+    .needs_client = true
+};
+
+crawler_module_reg_t *crawler_mod_regs[6] = {
     &crawler_expired_mod,
     &crawler_expired_mod,
     &crawler_metadump_mod,
     &crawler_mgdump_mod,
+    &crawler_invalidate_mod,
+    &crawler_export_mod,
 };
 
+/* A crawl can be split over several threads. The main crawler thread takes
+ * the first share itself and hands the rest to helper threads, each of which
+ * owns a subset of slab classes, or a slice of the hash table. Each thread
+ * evaluates items into its own copy of the module, buffering its own output,
+ * and the buffers are written to the client one at a time.
+ */
+typedef struct {
+    pthread_t tid;
+    pthread_mutex_t *lock; /* held while crawling, so lru_crawler_pause() can stop it */
+    pthread_mutex_t helper_lock;
+    crawler_module_t cm;
+    int id;
+    bool run; /* set by the main thread when there's a share to crawl */
+} crawler_thread_t;
+
 static int lru_crawler_write(crawler_client_t *c);
 crawler_module_t active_crawler_mod;
 enum crawler_run_type active_crawler_type;
@@ -113,6 +162,17 @@ static volatile int do_run_lru_crawler_thread = 0;
 static int lru_crawler_initialized = 0;
 static pthread_mutex_t lru_crawler_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_cond_t  lru_crawler_cond = PTHREAD_COND_INITIALIZER;
+/* serializes writes to the client, which any crawler thread may do. */
+static pthread_mutex_t lru_crawler_client_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static crawler_thread_t *crawler_threads = NULL;
+static int crawler_thread_count = 0;
+/* helpers wait here for a share of a crawl, and the main thread for them to
+ * finish one. Never held while taking any other crawler lock. */
+static pthread_mutex_t crawler_pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t crawler_pool_cond = PTHREAD_COND_INITIALIZER;
+static int crawler_pool_busy = 0;
+static bool crawler_pool_stop = false;
 #ifdef EXTSTORE
 /* TODO: pass this around */
 static void *storage;
@@ -142,12 +202,12 @@ static void lru_crawler_release_client(crawler_client_t *c) {
 }
 
 static int lru_crawler_expand_buf(crawler_client_t *c) {
-    c->buflen *= 2;
-    char *nb = realloc(c->buf, c->buflen);
+    char *nb = realloc(c->buf, c->buflen * 2);
     if (nb == NULL) {
         return -1;
     }
     c->buf = nb;
+    c->buflen *= 2;
     return 0;
 }
 
@@ -259,6 +319,202 @@ static void crawler_expired_eval(crawler_module_t *cm, item *search, uint32_t hv
     pthread_mutex_unlock(&d->lock);
 }
 
+struct crawler_invalidate_data {
+    char pattern[KEY_MAX_LENGTH + 1];
+    size_t len;
+    bool glob; /* else the pattern is a key prefix */
+};
+
+/* progress of invalidations, for "stats". */
+static uint64_t invalidate_checked = 0;
+static uint64_t invalidate_items = 0;
+static uint64_t invalidate_bytes = 0;
+
+static int crawler_invalidate_init(crawler_module_t *cm, void *data) {
+    struct crawler_invalidate_data *d = calloc(1, sizeof(struct crawler_invalidate_data));
+    if (d == NULL) {
+        return -1;
+    }
+    // data is the caller's pattern, already checked for length.
+    d->len = strlen(data);
+    memcpy(d->pattern, data, d->len);
+    d->glob = strpbrk(d->pattern, "*?[") != NULL;
+    cm->data = d;
+    return 0;
+}
+
+static void crawler_invalidate_eval(crawler_module_t *cm, item *search, uint32_t hv, int i) {
+    struct crawler_invalidate_data *d = (struct crawler_invalidate_data *) cm->data;
+    bool match;
+
+    if (d->glob) {
+        char key[KEY_MAX_LENGTH + 1];
+        memcpy(key, ITEM_key(search), search->nkey);
+        key[search->nkey] = '\0';
+        match = fnmatch(d->pattern, key, 0) == 0;
+    } else {
+        match = search->nkey >= d->len
+            && memcmp(ITEM_key(search), d->pattern, d->len) == 0;
+    }
+    __atomic_fetch_add(&invalidate_checked, 1, __ATOMIC_RELAXED);
+
+    if (match) {
+        __atomic_fetch_add(&invalidate_items, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&invalidate_bytes, ITEM_ntotal(search), __ATOMIC_RELAXED);
+#ifdef EXTSTORE
+        STORAGE_delete(storage, search);
+#endif
+        do_item_unlink(search, hv);
+        do_item_remove(search);
+    } else {
+        refcount_decr(search);
+    }
+}
+
+static void crawler_invalidate_finalize(crawler_module_t *cm) {
+    free(cm->data);
+    cm->data = NULL;
+}
+
+struct crawler_export_data {
+    pthread_mutex_t lock;
+    int fd;
+    bool failed;
+    uint64_t items;
+    char path[PATH_MAX];
+    char tmp_path[PATH_MAX];
+};
+
+static uint64_t export_items = 0;
+static uint64_t export_bytes = 0;
+
+/* Writes to a temporary file, which only replaces the export file once
+ * everything is written. */
+static int crawler_export_init(crawler_module_t *cm, void *data) {
+    struct crawler_export_data *d = calloc(1, sizeof(struct crawler_export_data));
+    if (d == NULL) {
+        return -1;
+    }
+    if (snprintf(d->path, sizeof(d->path), "%s", (char *)data) >= (int)sizeof(d->path)
+            || snprintf(d->tmp_path, sizeof(d->tmp_path), "%s.tmp", d->path)
+                >= (int)sizeof(d->tmp_path)) {
+        free(d);
+        return -1;
+    }
+    d->fd = open(d->tmp_path, O_WRONLY|O_CREAT|O_TRUNC, 0644);
+    if (d->fd < 0) {
+        free(d);
+        return -1;
+    }
+    snapshot_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN);
+    if (write(d->fd, &h, sizeof(h)) != sizeof(h)) {
+        close(d->fd);
+        unlink(d->tmp_path);
+        free(d);
+        return -1;
+    }
+    pthread_mutex_init(&d->lock, NULL);
+    cm->data = d;
+    return 0;
+}
+
+static void crawler_export_eval(crawler_module_t *cm, item *it, uint32_t hv, int i) {
+    crawler_client_t *c = &cm->c;
+    int is_flushed = item_is_flushed(it);
+    size_t size;
+    /* Ignore expired content, and values which live in extstore. */
+    if ((it->exptime != 0 && it->exptime < current_time)
+        || is_flushed || (it->it_flags & ITEM_HDR)) {
+        refcount_decr(it);
+        return;
+    }
+
+    // values can be bigger than the buffer.
+    size = snapshot_record_size(it);
+    while ((size_t)(c->buflen - c->bufused) < size) {
+        if (lru_crawler_expand_buf(c) != 0) {
+            struct crawler_export_data *d = cm->data;
+            d->failed = true;
+            refcount_decr(it);
+            return;
+        }
+    }
+    snapshot_record_write(c->buf + c->bufused, it);
+    refcount_decr(it);
+    c->bufused += size;
+    __atomic_fetch_add(&((struct crawler_export_data *)cm->data)->items, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&export_items, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&export_bytes, size, __ATOMIC_RELAXED);
+}
+
+static int crawler_export_flush(crawler_module_t *cm) {
+    struct crawler_export_data *d = cm->data;
+    crawler_client_t *c = &cm->c;
+    int sent = 0;
+
+    pthread_mutex_lock(&d->lock);
+    while (!d->failed && sent < c->bufused) {
+        ssize_t n = write(d->fd, c->buf + sent, c->bufused - sent);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        } else if (n <= 0) {
+            d->failed = true;
+            break;
+        }
+        sent += n;
+    }
+    c->bufused = 0;
+    pthread_mutex_unlock(&d->lock);
+    return d->failed ? -1 : 0;
+}
+
+static void crawler_export_finalize(crawler_module_t *cm) {
+    struct crawler_export_data *d = cm->data;
+    const char *res = "OK\r\n";
+
+    // lets the loader size the hash table up front.
+    if (pwrite(d->fd, &d->items, sizeof(d->items), offsetof(snapshot_header, items))
+            != sizeof(d->items)) {
+        d->failed = true;
+    }
+    if (fsync(d->fd) != 0) {
+        d->failed = true;
+    }
+    if (close(d->fd) != 0) {
+        d->failed = true;
+    }
+    if (!d->failed && rename(d->tmp_path, d->path) != 0) {
+        d->failed = true;
+    }
+    if (d->failed) {
+        unlink(d->tmp_path);
+        res = "SERVER_ERROR failed to write export file\r\n";
+    }
+    if (cm->c.c != NULL) {
+        lru_crawler_write(&cm->c); // empty the write buffer
+        memcpy(cm->c.buf, res, strlen(res));
+        cm->c.bufused += strlen(res);
+    }
+    pthread_mutex_destroy(&d->lock);
+    free(d);
+    cm->data = NULL;
+}
+
+void lru_crawler_stats(ADD_STAT add_stats, void *c) {
+    APPEND_STAT("lru_crawler_exported", "%llu",
+            (unsigned long long)__atomic_load_n(&export_items, __ATOMIC_RELAXED));
+    APPEND_STAT("lru_crawler_exported_bytes", "%llu",
+            (unsigned long long)__atomic_load_n(&export_bytes, __ATOMIC_RELAXED));
+    APPEND_STAT("lru_crawler_invalidate_checked", "%llu",
+            (unsigned long long)__atomic_load_n(&invalidate_checked, __ATOMIC_RELAXED));
+    APPEND_STAT("lru_crawler_invalidated", "%llu",
+            (unsigned long long)__atomic_load_n(&invalidate_items, __ATOMIC_RELAXED));
+    APPEND_STAT("lru_crawler_invalidated_bytes", "%llu",
+            (unsigned long long)__atomic_load_n(&invalidate_bytes, __ATOMIC_RELAXED));
+}
+
 static void crawler_metadump_eval(crawler_module_t *cm, item *it, uint32_t hv, int i) {
     char keybuf[KEY_MAX_URI_ENCODED_LENGTH];
     int is_flushed = item_is_flushed(it);
@@ -393,7 +649,7 @@ static int lru_crawler_write(crawler_client_t *c) {
 
 static void lru_crawler_class_done(int i) {
     crawlers[i].it_flags = 0;
-    crawler_count--;
+    __atomic_sub_fetch(&crawler_count, 1, __ATOMIC_RELAXED);
     do_item_unlinktail_q((item *)&crawlers[i]);
     do_item_stats_add_crawl(i, crawlers[i].reclaimed,
             crawlers[i].unfetched, crawlers[i].checked);
@@ -402,16 +658,63 @@ static void lru_crawler_class_done(int i) {
         active_crawler_mod.mod->doneclass(&active_crawler_mod, i);
 }
 
+/* Hands a thread's buffered output to the client, or to the module if it
+ * writes output elsewhere. If the client has gone away, the thread's copy of
+ * it is dropped as well. */
+static int lru_crawler_flush(crawler_thread_t *t) {
+    crawler_client_t *c = &t->cm.c;
+    int ret = -1;
+
+    if (t->cm.mod->flush != NULL) {
+        return t->cm.mod->flush(&t->cm);
+    }
+
+    pthread_mutex_lock(&lru_crawler_client_lock);
+    if (active_crawler_mod.c.c != NULL) {
+        ret = lru_crawler_write(c);
+        if (ret != 0) {
+            // the write closed the client and freed our buffer.
+            active_crawler_mod.c.c = NULL;
+            free(active_crawler_mod.c.buf);
+            active_crawler_mod.c.buf = NULL;
+        }
+    } else if (c->c != NULL) {
+        c->c = NULL;
+        free(c->buf);
+        c->buf = NULL;
+    }
+    pthread_mutex_unlock(&lru_crawler_client_lock);
+    return ret;
+}
+
+/* Cycles the thread's crawl lock, sleeping if it's time to. */
+static void lru_crawler_yield(crawler_thread_t *t, int *crawls_persleep) {
+    if (*crawls_persleep <= 0 && settings.lru_crawler_sleep) {
+        pthread_mutex_unlock(t->lock);
+        usleep(settings.lru_crawler_sleep);
+        pthread_mutex_lock(t->lock);
+        *crawls_persleep = settings.crawls_persleep;
+    } else if (!settings.lru_crawler_sleep) {
+        // TODO: only cycle lock every N?
+        pthread_mutex_unlock(t->lock);
+        pthread_mutex_lock(t->lock);
+    }
+}
+
 // ensure we build the buffer a little bit to cut down on poll/write syscalls.
 #define MIN_ITEMS_PER_WRITE 16
-static void item_crawl_hash(void) {
-    // get iterator from assoc. can hang for a long time.
-    // - blocks hash expansion
-    void *iter = assoc_get_iterator();
+static void item_crawl_hash(crawler_thread_t *t) {
+    // the main thread holds a full iterator, blocking hash expansion while
+    // the slices are walked.
+    void *iter = assoc_get_iterator_part(t->id, crawler_thread_count);
     int crawls_persleep = settings.crawls_persleep;
     item *it = NULL;
     int items = 0;
 
+    if (iter == NULL) {
+        return;
+    }
+
     // loop while iterator returns something
     // - iterator func handles bucket-walking
     // - iterator returns with bucket locked.
@@ -419,31 +722,22 @@ static void item_crawl_hash(void) {
         // if iterator returns true but no item, we're inbetween buckets and
         // can do cleanup work without holding an item lock.
         if (it == NULL) {
-            if (active_crawler_mod.c.c != NULL) {
+            if (t->cm.c.c != NULL) {
                 if (items > MIN_ITEMS_PER_WRITE) {
-                    int ret = lru_crawler_write(&active_crawler_mod.c);
+                    int ret = lru_crawler_flush(t);
                     items = 0;
                     if (ret != 0) {
                         // fail out and finalize.
                         break;
                     }
                 }
-            } else if (active_crawler_mod.mod->needs_client) {
+            } else if (t->cm.mod->needs_client) {
                 // fail out and finalize.
                 break;
             }
 
             // - sleep bits from orig loop
-            if (crawls_persleep <= 0 && settings.lru_crawler_sleep) {
-                pthread_mutex_unlock(&lru_crawler_lock);
-                usleep(settings.lru_crawler_sleep);
-                pthread_mutex_lock(&lru_crawler_lock);
-                crawls_persleep = settings.crawls_persleep;
-            } else if (!settings.lru_crawler_sleep) {
-                // TODO: only cycle lock every N?
-                pthread_mutex_unlock(&lru_crawler_lock);
-                pthread_mutex_lock(&lru_crawler_lock);
-            }
+            lru_crawler_yield(t, &crawls_persleep);
             continue;
         }
 
@@ -456,8 +750,8 @@ static void item_crawl_hash(void) {
         // We're presently holding an item lock, so we cannot flush the
         // buffer to the network socket as the syscall is both slow and could
         // hang waiting for POLLOUT. Instead we must expand the buffer.
-        if (active_crawler_mod.c.c != NULL) {
-            crawler_client_t *c = &active_crawler_mod.c;
+        if (t->cm.c.c != NULL) {
+            crawler_client_t *c = &t->cm.c;
             if (c->buflen - c->bufused < LRU_CRAWLER_MINBUFSPACE) {
                 if (lru_crawler_expand_buf(c) != 0) {
                     // failed to expand buffer, stop.
@@ -465,73 +759,77 @@ static void item_crawl_hash(void) {
                 }
             }
         }
-        // FIXME: missing hv and i are fine for metadump eval, but not fine
-        // for expire eval.
-        active_crawler_mod.mod->eval(&active_crawler_mod, it, 0, 0);
+        // FIXME: missing i is fine for metadump and invalidate eval, but not
+        // fine for expire eval.
+        t->cm.mod->eval(&t->cm, it, hash(ITEM_key(it), it->nkey), 0);
         crawls_persleep--;
         items++;
     }
 
-    // must finalize or we leave the hash table expansion blocked.
     assoc_iterate_final(iter);
     return;
 }
 
-static void *item_crawler_thread(void *arg) {
+/* Slab classes are split between the crawler threads. */
+static int lru_crawler_owner(const int id) {
+    return CLEAR_LRU(id) % crawler_thread_count;
+}
+
+static void item_crawl_lru(crawler_thread_t *t) {
     int i;
+    int active;
     int crawls_persleep = settings.crawls_persleep;
 
-    pthread_mutex_lock(&lru_crawler_lock);
-    pthread_cond_signal(&lru_crawler_cond);
-    settings.lru_crawler = true;
-    if (settings.verbose > 2)
-        fprintf(stderr, "Starting LRU crawler background thread\n");
-    while (do_run_lru_crawler_thread) {
-    pthread_cond_wait(&lru_crawler_cond, &lru_crawler_lock);
-
-    if (crawler_count == -1) {
-        item_crawl_hash();
-        crawler_count = 0;
-    } else {
-    while (crawler_count) {
+    do {
         item *search = NULL;
         void *hold_lock = NULL;
+        active = 0;
 
         for (i = POWER_SMALLEST; i < LARGEST_ID; i++) {
-            if (crawlers[i].it_flags != 1) {
+            if (crawlers[i].it_flags != 1 || lru_crawler_owner(i) != t->id) {
                 continue;
             }
+            active++;
 
-            if (active_crawler_mod.c.c != NULL) {
-                crawler_client_t *c = &active_crawler_mod.c;
+            if (t->cm.c.c != NULL) {
+                crawler_client_t *c = &t->cm.c;
                 if (c->buflen - c->bufused < LRU_CRAWLER_MINBUFSPACE) {
-                    int ret = lru_crawler_write(c);
+                    int ret = lru_crawler_flush(t);
                     if (ret != 0) {
                         lru_crawler_class_done(i);
                         continue;
                     }
                 }
-            } else if (active_crawler_mod.mod->needs_client) {
+            } else if (t->cm.mod->needs_client) {
                 lru_crawler_class_done(i);
                 continue;
             }
             pthread_mutex_lock(&lru_locks[i]);
+            uint32_t hv = 0;
+            hold_lock = NULL;
+            search = crawlers[i].prev;
+            if (search != NULL) {
+                hv = hash(ITEM_key(search), search->nkey);
+                /* Attempt to hash item lock the "search" item. If locked, no
+                 * other callers can incr the refcount. Item locks are shared
+                 * with other crawler threads, so if it's taken the crawler
+                 * stays put and tries the item again next time around.
+                 */
+                if ((hold_lock = item_trylock(hv)) == NULL) {
+                    pthread_mutex_unlock(&lru_locks[i]);
+                    continue;
+                }
+            }
             search = do_item_crawl_q((item *)&crawlers[i]);
             if (search == NULL ||
                 (crawlers[i].remaining && --crawlers[i].remaining < 1)) {
                 if (settings.verbose > 2)
                     fprintf(stderr, "Nothing left to crawl for %d\n", i);
+                if (hold_lock)
+                    item_trylock_unlock(hold_lock);
                 lru_crawler_class_done(i);
                 continue;
             }
-            uint32_t hv = hash(ITEM_key(search), search->nkey);
-            /* Attempt to hash item lock the "search" item. If locked, no
-             * other callers can incr the refcount
-             */
-            if ((hold_lock = item_trylock(hv)) == NULL) {
-                pthread_mutex_unlock(&lru_locks[i]);
-                continue;
-            }
             /* Now see if the item is refcount locked */
             if (refcount_incr(search) != 2) {
                 refcount_decr(search);
@@ -545,31 +843,177 @@ static void *item_crawler_thread(void *arg) {
             /* Frees the item or decrements the refcount. */
             /* Interface for this could improve: do the free/decr here
              * instead? */
-            if (!active_crawler_mod.mod->needs_lock) {
+            if (!t->cm.mod->needs_lock) {
                 pthread_mutex_unlock(&lru_locks[i]);
             }
 
-            active_crawler_mod.mod->eval(&active_crawler_mod, search, hv, i);
+            t->cm.mod->eval(&t->cm, search, hv, i);
 
             if (hold_lock)
                 item_trylock_unlock(hold_lock);
-            if (active_crawler_mod.mod->needs_lock) {
+            if (t->cm.mod->needs_lock) {
                 pthread_mutex_unlock(&lru_locks[i]);
             }
 
-            if (crawls_persleep-- <= 0 && settings.lru_crawler_sleep) {
-                pthread_mutex_unlock(&lru_crawler_lock);
-                usleep(settings.lru_crawler_sleep);
-                pthread_mutex_lock(&lru_crawler_lock);
-                crawls_persleep = settings.crawls_persleep;
-            } else if (!settings.lru_crawler_sleep) {
-                // TODO: only cycle lock every N?
-                pthread_mutex_unlock(&lru_crawler_lock);
-                pthread_mutex_lock(&lru_crawler_lock);
-            }
+            crawls_persleep--;
+            lru_crawler_yield(t, &crawls_persleep);
         }
-    } // while
-    } // if crawler_count
+    } while (active);
+}
+
+/* Crawls a thread's share of the current crawl, then sends whatever output
+ * it has left. Called with the thread's lock held. */
+static void lru_crawler_crawl_share(crawler_thread_t *t) {
+    if (crawler_count == -1) {
+        item_crawl_hash(t);
+    } else {
+        item_crawl_lru(t);
+    }
+
+    while (t->cm.c.c != NULL && t->cm.c.bufused != 0) {
+        if (lru_crawler_flush(t) != 0) {
+            break;
+        }
+    }
+    if (t->cm.c.c != NULL) {
+        t->cm.c.c = NULL;
+        free(t->cm.c.buf);
+        t->cm.c.buf = NULL;
+    }
+}
+
+/* Sets a thread up with its own copy of the active module. */
+static int lru_crawler_share_prepare(crawler_thread_t *t) {
+    t->cm.mod = active_crawler_mod.mod;
+    t->cm.data = active_crawler_mod.data;
+    memset(&t->cm.c, 0, sizeof(crawler_client_t));
+    if (active_crawler_mod.c.c != NULL) {
+        size_t size = LRU_CRAWLER_MINBUFSPACE * 16;
+        t->cm.c.buf = malloc(size);
+        if (t->cm.c.buf == NULL) {
+            return -1;
+        }
+        t->cm.c.buflen = size;
+        t->cm.c.c = active_crawler_mod.c.c;
+        t->cm.c.sfd = active_crawler_mod.c.sfd;
+    }
+    return 0;
+}
+
+/* Runs one round of a crawl over all crawler threads. Called by the main
+ * crawler thread with lru_crawler_lock held, which it drops while waiting for
+ * the helpers to finish.
+ */
+static void lru_crawler_run(void) {
+    int x;
+
+    pthread_mutex_lock(&crawler_pool_lock);
+    for (x = 1; x < crawler_thread_count; x++) {
+        crawler_thread_t *t = &crawler_threads[x];
+        if (lru_crawler_share_prepare(t) != 0) {
+            continue;
+        }
+        t->run = true;
+        crawler_pool_busy++;
+    }
+    pthread_cond_broadcast(&crawler_pool_cond);
+    pthread_mutex_unlock(&crawler_pool_lock);
+
+    if (lru_crawler_share_prepare(&crawler_threads[0]) == 0) {
+        lru_crawler_crawl_share(&crawler_threads[0]);
+    }
+
+    pthread_mutex_unlock(&lru_crawler_lock);
+    pthread_mutex_lock(&crawler_pool_lock);
+    while (crawler_pool_busy != 0) {
+        pthread_cond_wait(&crawler_pool_cond, &crawler_pool_lock);
+    }
+    pthread_mutex_unlock(&crawler_pool_lock);
+    pthread_mutex_lock(&lru_crawler_lock);
+}
+
+static void *item_crawler_helper_thread(void *arg) {
+    crawler_thread_t *t = arg;
+
+    pthread_mutex_lock(&crawler_pool_lock);
+    while (1) {
+        while (!t->run && !crawler_pool_stop) {
+            pthread_cond_wait(&crawler_pool_cond, &crawler_pool_lock);
+        }
+        if (!t->run) {
+            break;
+        }
+        pthread_mutex_unlock(&crawler_pool_lock);
+
+        pthread_mutex_lock(t->lock);
+        lru_crawler_crawl_share(t);
+        pthread_mutex_unlock(t->lock);
+
+        pthread_mutex_lock(&crawler_pool_lock);
+        t->run = false;
+        crawler_pool_busy--;
+        pthread_cond_broadcast(&crawler_pool_cond);
+    }
+    pthread_mutex_unlock(&crawler_pool_lock);
+    return NULL;
+}
+
+static void lru_crawler_start_helpers(void) {
+    int x, ret;
+
+    crawler_thread_count = settings.lru_crawler_threads;
+    crawler_pool_stop = false;
+    for (x = 1; x < crawler_thread_count; x++) {
+        crawler_thread_t *t = &crawler_threads[x];
+        if ((ret = pthread_create(&t->tid, NULL,
+            item_crawler_helper_thread, t)) != 0) {
+            fprintf(stderr, "Can't create LRU crawler helper thread: %s\n",
+                strerror(ret));
+            // the main thread takes over the rest.
+            crawler_thread_count = x;
+            break;
+        }
+        thread_setname(t->tid, "mc-itemcrawl");
+    }
+}
+
+static void lru_crawler_stop_helpers(void) {
+    int x;
+
+    pthread_mutex_lock(&crawler_pool_lock);
+    crawler_pool_stop = true;
+    pthread_cond_broadcast(&crawler_pool_cond);
+    pthread_mutex_unlock(&crawler_pool_lock);
+    for (x = 1; x < crawler_thread_count; x++) {
+        pthread_join(crawler_threads[x].tid, NULL);
+    }
+}
+
+static void *item_crawler_thread(void *arg) {
+    lru_crawler_start_helpers();
+
+    pthread_mutex_lock(&lru_crawler_lock);
+    pthread_cond_signal(&lru_crawler_cond);
+    settings.lru_crawler = true;
+    if (settings.verbose > 2)
+        fprintf(stderr, "Starting LRU crawler background thread\n");
+    while (do_run_lru_crawler_thread) {
+    pthread_cond_wait(&lru_crawler_cond, &lru_crawler_lock);
+
+    if (crawler_count == -1) {
+        // held over all the slices, so the table can't expand under them.
+        void *iter = assoc_get_iterator();
+        if (iter != NULL) {
+            lru_crawler_run();
+            assoc_iterate_final(iter);
+        }
+        crawler_count = 0;
+    } else {
+        // crawls may be restarted for classes whose thread already finished.
+        while (__atomic_load_n(&crawler_count, __ATOMIC_RELAXED) > 0) {
+            lru_crawler_run();
+        }
+    }
 
     if (active_crawler_mod.mod != NULL) {
         if (active_crawler_mod.mod->finalize != NULL)
@@ -592,6 +1036,7 @@ static void *item_crawler_thread(void *arg) {
     STATS_UNLOCK();
     }
     pthread_mutex_unlock(&lru_crawler_lock);
+    lru_crawler_stop_helpers();
     if (settings.verbose > 2)
         fprintf(stderr, "LRU crawler thread stopping\n");
     settings.lru_crawler = false;
@@ -685,7 +1130,7 @@ static int do_lru_crawler_start(uint32_t id, uint32_t remaining) {
         crawlers[sid].unfetched = 0;
         crawlers[sid].checked = 0;
         do_item_linktail_q((item *)&crawlers[sid]);
-        crawler_count++;
+        __atomic_add_fetch(&crawler_count, 1, __ATOMIC_RELAXED);
         starts++;
     }
     pthread_mutex_unlock(&lru_locks[sid]);
@@ -738,8 +1183,9 @@ int lru_crawler_start(uint8_t *ids, uint32_t remaining,
         return -1;
     }
 
-    /* hash table walk only supported with metadump for now. */
-    if (ids == NULL && type != CRAWLER_METADUMP && type != CRAWLER_MGDUMP) {
+    /* hash table walk only supported with metadump and invalidate for now. */
+    if (ids == NULL && type != CRAWLER_METADUMP && type != CRAWLER_MGDUMP
+            && type != CRAWLER_INVALIDATE) {
         pthread_mutex_unlock(&lru_crawler_lock);
         return -2;
     }
@@ -749,8 +1195,11 @@ int lru_crawler_start(uint8_t *ids, uint32_t remaining,
         assert(crawler_mod_regs[type] != NULL);
         active_crawler_mod.mod = crawler_mod_regs[type];
         active_crawler_type = type;
-        if (active_crawler_mod.mod->init != NULL) {
-            active_crawler_mod.mod->init(&active_crawler_mod, data);
+        if (active_crawler_mod.mod->init != NULL
+                && active_crawler_mod.mod->init(&active_crawler_mod, data) != 0) {
+            active_crawler_mod.mod = NULL;
+            pthread_mutex_unlock(&lru_crawler_lock);
+            return -2;
         }
         if (active_crawler_mod.mod->needs_client) {
             if (c == NULL || sfd == 0) {
@@ -836,12 +1285,56 @@ enum crawler_result_type lru_crawler_crawl(char *slabs, const enum crawler_run_t
     }
 }
 
-/* If we hold this lock, crawler can't wake up or move */
+static enum crawler_result_type lru_crawler_result(const int starts) {
+    if (starts == -1) {
+        return CRAWLER_RUNNING;
+    } else if (starts == -2) {
+        return CRAWLER_ERROR;
+    } else if (starts) {
+        return CRAWLER_OK;
+    } else {
+        return CRAWLER_NOTSTARTED;
+    }
+}
+
+/* Unlinks every item whose key starts with pattern, or matches it as a glob
+ * if it has any of "*?[" in it.
+ * Walks the hash table rather than the LRUs: items bumped by concurrent
+ * fetches would otherwise move behind the crawler and be missed.
+ */
+enum crawler_result_type lru_crawler_invalidate(const char *pattern) {
+    int starts;
+
+    starts = lru_crawler_start(NULL, 0,
+            CRAWLER_INVALIDATE, (void *)pattern, NULL, 0);
+    return lru_crawler_result(starts);
+}
+
+/* Writes a snapshot of every live item to path, for snapshot_load(). */
+enum crawler_result_type lru_crawler_export(const char *path, void *c, const int sfd) {
+    uint8_t tocrawl[POWER_LARGEST];
+    int starts;
+
+    memset(tocrawl, 1, sizeof(tocrawl));
+    starts = lru_crawler_start(tocrawl, LRU_CRAWLER_CAP_REMAINING,
+            CRAWLER_EXPORT, (void *)path, c, sfd);
+    return lru_crawler_result(starts);
+}
+
+/* If we hold these locks, crawlers can't wake up or move */
 void lru_crawler_pause(void) {
+    int x;
     pthread_mutex_lock(&lru_crawler_lock);
+    for (x = 1; x < settings.lru_crawler_threads; x++) {
+        pthread_mutex_lock(&crawler_threads[x].helper_lock);
+    }
 }
 
 void lru_crawler_resume(void) {
+    int x;
+    for (x = settings.lru_crawler_threads - 1; x > 0; x--) {
+        pthread_mutex_unlock(&crawler_threads[x].helper_lock);
+    }
     pthread_mutex_unlock(&lru_crawler_lock);
 }
 
@@ -853,6 +1346,22 @@ int init_lru_crawler(void *arg) {
         active_crawler_mod.c.c = NULL;
         active_crawler_mod.mod = NULL;
         active_crawler_mod.data = NULL;
+        crawler_threads = calloc(settings.lru_crawler_threads,
+                sizeof(crawler_thread_t));
+        if (crawler_threads == NULL) {
+            fprintf(stderr, "Failed to allocate LRU crawler threads\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int x = 0; x < settings.lru_crawler_threads; x++) {
+            crawler_thread_t *t = &crawler_threads[x];
+            t->id = x;
+            if (x == 0) {
+                t->lock = &lru_crawler_lock;
+            } else {
+                pthread_mutex_init(&t->helper_lock, NULL);
+                t->lock = &t->helper_lock;
+            }
+        }
         lru_crawler_initialized = 1;
     }
     return 0;
@@ -37,6 +37,9 @@ enum crawler_result_type lru_crawler_crawl(char *slabs, enum crawler_run_type,
 int lru_crawler_start(uint8_t *ids, uint32_t remaining,
                              const enum crawler_run_type type, void *data,
                              void *c, const int sfd);
+enum crawler_result_type lru_crawler_invalidate(const char *pattern);
+enum crawler_result_type lru_crawler_export(const char *path, void *c, const int sfd);
+void lru_crawler_stats(ADD_STAT add_stats, void *c);
 void lru_crawler_pause(void);
 void lru_crawler_resume(void);
 
@@ -0,0 +1,72 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Epochs for lock-free readers. See epoch.h.
+ *
+ * The global epoch only moves forward when something is retired. A reader
+ * copies it into its slot and then fences, so either a retiring thread sees
+ * the reader's slot when it scans, or the reader sees the memory already
+ * unlinked. A slot holding an epoch newer than a ticket belongs to a reader
+ * which started after that memory was unlinked.
+ */
+#include "epoch.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+
+static uint64_t epoch_global = 1;
+static epoch_slot *slots = NULL;
+static int slot_count = 0;
+
+void epoch_init(const int nslots) {
+    void *ptr = NULL;
+    if (posix_memalign(&ptr, sizeof(epoch_slot), sizeof(epoch_slot) * nslots) != 0) {
+        fprintf(stderr, "Failed to allocate epoch slots\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(ptr, 0, sizeof(epoch_slot) * nslots);
+    slots = ptr;
+    slot_count = nslots;
+}
+
+epoch_slot *epoch_slot_get(const int id) {
+    return &slots[id];
+}
+
+void epoch_enter(epoch_slot *s) {
+    __atomic_store_n(&s->epoch, __atomic_load_n(&epoch_global, __ATOMIC_ACQUIRE),
+            __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void epoch_exit(epoch_slot *s) {
+    __atomic_store_n(&s->epoch, 0, __ATOMIC_RELEASE);
+}
+
+/* Call after unlinking: anything unlinked before this returns is covered by
+ * the ticket. */
+uint64_t epoch_retire(void) {
+    return __atomic_fetch_add(&epoch_global, 1, __ATOMIC_SEQ_CST);
+}
+
+bool epoch_safe(const uint64_t ticket) {
+    int x;
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (x = 0; x < slot_count; x++) {
+        uint64_t e = __atomic_load_n(&slots[x].epoch, __ATOMIC_ACQUIRE);
+        if (e != 0 && e <= ticket) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void epoch_wait(const uint64_t ticket) {
+    while (!epoch_safe(ticket)) {
+        sched_yield();
+    }
+}
+
+void epoch_sync(void) {
+    epoch_wait(epoch_retire());
+}
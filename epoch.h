@@ -0,0 +1,33 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EPOCH_H
+#define EPOCH_H
+#include <stdbool.h>
+#include <stdint.h>
+
+/*
+ * Epoch based reclamation, for readers which look at shared memory without
+ * taking locks or references.
+ *
+ * Each reading thread owns a slot. It enters an epoch before reading and
+ * leaves it when done, which should be a matter of nanoseconds. Memory a
+ * reader could have found is unlinked first, then stamped with a ticket from
+ * epoch_retire(). Once epoch_safe() returns true for that ticket no reader
+ * can still be looking at it, and it may be reused.
+ */
+typedef struct {
+    uint64_t epoch; /* epoch this thread entered in, 0 if not reading. */
+} __attribute__((aligned(64))) epoch_slot;
+
+void epoch_init(const int nslots);
+epoch_slot *epoch_slot_get(const int id);
+
+void epoch_enter(epoch_slot *s);
+void epoch_exit(epoch_slot *s);
+
+uint64_t epoch_retire(void);
+bool epoch_safe(const uint64_t ticket);
+void epoch_wait(const uint64_t ticket);
+/* waits for every reader in an epoch right now to leave. */
+void epoch_sync(void);
+
+#endif
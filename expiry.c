@@ -0,0 +1,238 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Hierarchical timer wheel of item expiry times. See expiry.h.
+ *
+ * Each level has 64 slots. Level 0 slots are a second wide, level 1 slots a
+ * minute or so, and so on, for about 194 days over four levels. An entry goes
+ * in the lowest level which reaches its exptime. Every second the maintainer
+ * fires the level 0 slot for that second. Whenever a level wraps, the next
+ * slot of the level above is cascaded down first, its entries spread over
+ * the finer slots below.
+ *
+ * Entries point at items without holding a reference, so by the time one
+ * fires the item may have been replaced, freed or reused. item_reap() only
+ * trusts the pointer once it finds it linked under the hash value. An item
+ * whose exptime was pushed out since goes back on the wheel. Touches which
+ * pull an exptime in add another entry; other ways of changing it don't, and
+ * those items get reclaimed late, by the wheel or the crawler.
+ *
+ * Inserts come from worker threads linking items, so the wheel is split in
+ * stripes by hash value, each with its own lock. Entries take 16 bytes, and
+ * there are at most one per 256 bytes of memory limit. Items past that, or
+ * too far out, aren't indexed and are left to the crawler.
+ */
+#include "memcached.h"
+#include "expiry.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define EXPIRY_STRIPES 16
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+#define WHEEL_SPAN ((uint64_t)1 << (WHEEL_BITS * WHEEL_LEVELS))
+/* bytes of memory limit per entry allowed. */
+#define EXPIRY_BYTES_PER_ENTRY 256
+/* seconds reclaims are averaged over. */
+#define EXPIRY_RATE_WINDOW 60
+
+typedef struct {
+    item *it;
+    uint32_t hv;
+    rel_time_t exptime;
+} expiry_entry;
+
+typedef struct {
+    expiry_entry *e;
+    uint32_t count;
+    uint32_t size;
+} expiry_slot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    rel_time_t now; /* last second fired */
+    expiry_slot slots[WHEEL_LEVELS][WHEEL_SLOTS];
+} expiry_wheel;
+
+static expiry_wheel wheels[EXPIRY_STRIPES];
+/* only touched by the LRU maintainer. */
+static rel_time_t expiry_now = 0;
+static uint64_t expiry_rate[EXPIRY_RATE_WINDOW];
+static unsigned int expiry_ticks = 0;
+
+static uint64_t entries = 0;
+static uint64_t entries_max = 0;
+static uint64_t dropped = 0;
+static uint64_t reclaimed = 0;
+/* expired items found in use, and not unlinked since. */
+static uint64_t expired_bytes = 0;
+
+void expiry_init(void) {
+    int x;
+    for (x = 0; x < EXPIRY_STRIPES; x++) {
+        pthread_mutex_init(&wheels[x].lock, NULL);
+        wheels[x].now = current_time;
+    }
+    expiry_now = current_time;
+    entries_max = settings.maxbytes / EXPIRY_BYTES_PER_ENTRY;
+}
+
+/* Entries due before floor go in floor's slot. */
+static bool wheel_insert(expiry_wheel *w, const expiry_entry *e, const rel_time_t floor) {
+    rel_time_t t = e->exptime > floor ? e->exptime : floor;
+    uint64_t delta = t - w->now;
+    expiry_slot *s;
+    int level = 0;
+
+    if (delta >= WHEEL_SPAN) {
+        return false;
+    }
+    while (delta >= ((uint64_t)1 << (WHEEL_BITS * (level + 1)))) {
+        level++;
+    }
+    s = &w->slots[level][(t >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1)];
+    if (s->count == s->size) {
+        uint32_t size = s->size ? s->size * 2 : 16;
+        expiry_entry *n = realloc(s->e, size * sizeof(expiry_entry));
+        if (n == NULL) {
+            return false;
+        }
+        s->e = n;
+        s->size = size;
+    }
+    s->e[s->count++] = *e;
+    return true;
+}
+
+void expiry_add(item *it, const uint32_t hv) {
+    expiry_wheel *w = &wheels[hv % EXPIRY_STRIPES];
+    expiry_entry e = { it, hv, it->exptime };
+    bool added;
+
+    if (__atomic_add_fetch(&entries, 1, __ATOMIC_RELAXED) > entries_max) {
+        __atomic_sub_fetch(&entries, 1, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&dropped, 1, __ATOMIC_RELAXED);
+        return;
+    }
+    pthread_mutex_lock(&w->lock);
+    added = wheel_insert(w, &e, w->now + 1);
+    pthread_mutex_unlock(&w->lock);
+    if (!added) {
+        __atomic_sub_fetch(&entries, 1, __ATOMIC_RELAXED);
+    }
+}
+
+/* Takes the entries out of a slot, leaving it empty. */
+static expiry_slot wheel_detach(expiry_wheel *w, const int level, const unsigned int slot) {
+    expiry_slot s = w->slots[level][slot];
+    memset(&w->slots[level][slot], 0, sizeof(expiry_slot));
+    return s;
+}
+
+/* Spreads the next slot of a level over the levels below. */
+static void wheel_cascade(expiry_wheel *w, const int level) {
+    expiry_slot s = wheel_detach(w, level,
+            (w->now >> (WHEEL_BITS * level)) & (WHEEL_SLOTS - 1));
+    uint32_t x;
+    for (x = 0; x < s.count; x++) {
+        if (!wheel_insert(w, &s.e[x], w->now)) {
+            __atomic_sub_fetch(&entries, 1, __ATOMIC_RELAXED);
+        }
+    }
+    free(s.e);
+}
+
+/* Fires one second of one stripe. Returns the number of items reclaimed. */
+static uint64_t wheel_tick(expiry_wheel *w, const rel_time_t now) {
+    expiry_slot s;
+    uint64_t done = 0;
+    uint32_t x, kept = 0;
+    int level;
+
+    pthread_mutex_lock(&w->lock);
+    w->now = now;
+    // cascade from the top, so entries can drop more than one level.
+    for (level = WHEEL_LEVELS - 1; level > 0; level--) {
+        if ((now & (((rel_time_t)1 << (WHEEL_BITS * level)) - 1)) == 0) {
+            wheel_cascade(w, level);
+        }
+    }
+    s = wheel_detach(w, 0, now & (WHEEL_SLOTS - 1));
+    pthread_mutex_unlock(&w->lock);
+
+    for (x = 0; x < s.count; x++) {
+        expiry_entry *e = &s.e[x];
+        switch (item_reap(e->it, e->hv, &e->exptime)) {
+            case REAP_RECLAIMED:
+                done++;
+                break;
+            case REAP_BUSY:
+                // try again next second.
+                s.e[kept++] = *e;
+                break;
+            case REAP_NOT_EXPIRED:
+                if (e->exptime != 0) {
+                    s.e[kept++] = *e;
+                    break;
+                }
+                /* fall through */
+            case REAP_GONE:
+                break;
+        }
+    }
+
+    __atomic_sub_fetch(&entries, s.count - kept, __ATOMIC_RELAXED);
+    if (kept != 0) {
+        pthread_mutex_lock(&w->lock);
+        for (x = 0; x < kept; x++) {
+            if (!wheel_insert(w, &s.e[x], now + 1)) {
+                __atomic_sub_fetch(&entries, 1, __ATOMIC_RELAXED);
+            }
+        }
+        pthread_mutex_unlock(&w->lock);
+    }
+    free(s.e);
+    return done;
+}
+
+void expiry_run(void) {
+    while (expiry_now < current_time) {
+        uint64_t done = 0;
+        int x;
+
+        expiry_now++;
+        for (x = 0; x < EXPIRY_STRIPES; x++) {
+            done += wheel_tick(&wheels[x], expiry_now);
+        }
+        __atomic_fetch_add(&reclaimed, done, __ATOMIC_RELAXED);
+        __atomic_store_n(&expiry_rate[expiry_now % EXPIRY_RATE_WINDOW], done,
+                __ATOMIC_RELAXED);
+        if (expiry_ticks < EXPIRY_RATE_WINDOW) {
+            __atomic_add_fetch(&expiry_ticks, 1, __ATOMIC_RELAXED);
+        }
+    }
+}
+
+void expiry_expired_bytes(const int64_t bytes) {
+    __atomic_add_fetch(&expired_bytes, bytes, __ATOMIC_RELAXED);
+}
+
+void expiry_stats(ADD_STAT add_stats, void *c) {
+    unsigned int ticks = __atomic_load_n(&expiry_ticks, __ATOMIC_RELAXED);
+    uint64_t window = 0;
+    int x;
+
+    for (x = 0; x < EXPIRY_RATE_WINDOW; x++) {
+        window += __atomic_load_n(&expiry_rate[x], __ATOMIC_RELAXED);
+    }
+    APPEND_STAT("expiry_wheel_entries", "%llu",
+            (unsigned long long)__atomic_load_n(&entries, __ATOMIC_RELAXED));
+    APPEND_STAT("expiry_wheel_dropped", "%llu",
+            (unsigned long long)__atomic_load_n(&dropped, __ATOMIC_RELAXED));
+    APPEND_STAT("expiry_wheel_reclaimed", "%llu",
+            (unsigned long long)__atomic_load_n(&reclaimed, __ATOMIC_RELAXED));
+    APPEND_STAT("expiry_wheel_reclaimed_per_sec", "%.2f",
+            ticks ? (double)window / ticks : 0.0);
+    APPEND_STAT("expiry_wheel_expired_bytes", "%llu",
+            (unsigned long long)__atomic_load_n(&expired_bytes, __ATOMIC_RELAXED));
+}
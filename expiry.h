@@ -0,0 +1,23 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef EXPIRY_H
+#define EXPIRY_H
+
+/*
+ * Expiry wheel: items with a TTL are indexed by when they expire, so the LRU
+ * maintainer can reclaim them as they come due instead of waiting for the
+ * LRU crawler to find them. The crawler still picks up whatever the wheel
+ * doesn't hold.
+ */
+
+void expiry_init(void);
+/* Called with the item lock held, when an item is linked or touched to an
+ * earlier exptime. */
+void expiry_add(item *it, const uint32_t hv);
+/* Reclaims everything due up to current_time. */
+void expiry_run(void);
+/* Called with the item lock held as ITEM_EXPIRED is set on (or cleared off,
+ * with a negative size) an item. */
+void expiry_expired_bytes(const int64_t bytes);
+void expiry_stats(ADD_STAT add_stats, void *c);
+
+#endif
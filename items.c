@@ -3,6 +3,10 @@
 #include "bipbuffer.h"
 #include "slab_automove.h"
 #include "storage.h"
+#include "restart.h"
+#include "sketch.h"
+#include "mrc.h"
+#include "expiry.h"
 #ifdef EXTSTORE
 #include "slab_automove_extstore.h"
 #endif
@@ -44,6 +48,7 @@ typedef struct {
     uint64_t moves_to_warm;
     uint64_t moves_within_lru;
     uint64_t direct_reclaims;
+    uint64_t admission_rejects; /* items evicted on leaving HOT by tinylfu */
     uint64_t hits_to_hot;
     uint64_t hits_to_warm;
     uint64_t hits_to_cold;
@@ -102,10 +107,130 @@ static lru_bump_buf *bump_buf_tail = NULL;
 static pthread_mutex_t bump_buf_lock = PTHREAD_MUTEX_INITIALIZER;
 /* TODO: tunable? Need bench results */
 #define LRU_BUMP_BUF_SIZE 8192
+/* ACTIVE items one eviction can give second chances to, with lru_clock. */
+#define LRU_CLOCK_SWEEPS 50
 
 static bool lru_bump_async(lru_bump_buf *b, item *it, uint32_t hv);
 static uint64_t lru_total_bumps_dropped(void);
 
+/*
+ * Eviction policies.
+ *
+ * With lru_policy=tinylfu the segmented LRU works like W-TinyLFU: HOT is the
+ * admission window and WARM/COLD are the main cache. Every fetch or store of
+ * a key bumps its count in a frequency sketch. Once memory is full, an item
+ * falling out of HOT without being hit only moves on to COLD if its key has
+ * been asked for more often than the key at the tail of COLD, which would be
+ * evicted next. Otherwise it's evicted right away, so a scan through keys
+ * nobody asks for again can't push out the working set.
+ *
+ * Evicted keys are also remembered in a small ghost table, and a miss on one
+ * counts against the class it was evicted from. That gives each class a hit
+ * ratio to judge the policy by. The default policy has no use for either, so
+ * it doesn't pay for them.
+ */
+static sketch_t *lru_sketch = NULL;
+static uint32_t *ghost = NULL;
+static uint32_t ghost_mask = 0;
+
+#define GHOST_MAX (1 << 22)
+#define SKETCH_WIDTH_MAX (1 << 26)
+/* ghost entries are the hash, with the low bits swapped for the class id. */
+#define GHOST_CLSID 0x3f
+
+void item_policy_init(const enum lru_policy_type policy) {
+    uint32_t size = 1024;
+
+    switch (policy) {
+        case LRU_POLICY_SEGMENTED:
+            settings.lru_policy = "segmented";
+            break;
+        case LRU_POLICY_TINYLFU:
+            lru_sketch = sketch_create(settings.maxbytes / 256 < SKETCH_WIDTH_MAX
+                    ? settings.maxbytes / 256 : SKETCH_WIDTH_MAX);
+            if (lru_sketch == NULL) {
+                fprintf(stderr, "Failed to allocate frequency sketch.\n");
+                exit(EXIT_FAILURE);
+            }
+            while (size < settings.maxbytes / 1024 && size < GHOST_MAX) {
+                size <<= 1;
+            }
+            ghost = calloc(size, sizeof(uint32_t));
+            if (ghost == NULL) {
+                fprintf(stderr, "Failed to allocate ghost table.\n");
+                exit(EXIT_FAILURE);
+            }
+            ghost_mask = size - 1;
+            settings.lru_policy = "tinylfu";
+            break;
+    }
+}
+
+/* Memory an item takes up, as far as miss ratio curves go. */
+static void item_mrc_reference(const uint32_t hv, item *it, const bool get) {
+    if (it == NULL) {
+        mrc_reference(hv, 0, 0, get);
+    } else if (it->it_flags & ITEM_CHUNKED) {
+        mrc_reference(hv, ITEM_clsid(it), ITEM_ntotal(it), get);
+    } else {
+        mrc_reference(hv, ITEM_clsid(it), slabs_size(ITEM_clsid(it)), get);
+    }
+}
+
+static void item_ghost_add(const uint32_t hv, const unsigned int clsid) {
+    if (ghost == NULL) {
+        return;
+    }
+    __atomic_store_n(&ghost[hv & ghost_mask], (hv & ~GHOST_CLSID) | clsid,
+            __ATOMIC_RELAXED);
+}
+
+static void item_ghost_forget(const uint32_t hv) {
+    uint32_t *g;
+    if (ghost == NULL) {
+        return;
+    }
+    g = &ghost[hv & ghost_mask];
+    if ((__atomic_load_n(g, __ATOMIC_RELAXED) & ~GHOST_CLSID) == (hv & ~GHOST_CLSID)) {
+        __atomic_store_n(g, 0, __ATOMIC_RELAXED);
+    }
+}
+
+static void item_ghost_miss(LIBEVENT_THREAD *t, const uint32_t hv) {
+    uint32_t g;
+    if (ghost == NULL) {
+        return;
+    }
+    g = __atomic_load_n(&ghost[hv & ghost_mask], __ATOMIC_RELAXED);
+    if (g != 0 && (g & ~GHOST_CLSID) == (hv & ~GHOST_CLSID)) {
+        pthread_mutex_lock(&t->stats.mutex);
+        t->stats.slab_stats[g & GHOST_CLSID].evicted_misses++;
+        pthread_mutex_unlock(&t->stats.mutex);
+    }
+}
+
+/* Called with the HOT lock held. A busy COLD lock, or a COLD without a
+ * tail, lets the item in. */
+static bool lru_admit(const int clsid, const uint32_t hv) {
+    pthread_mutex_t *cold_lock = &lru_locks[clsid|COLD_LRU];
+    item *victim;
+    uint32_t victim_hv;
+
+    if (pthread_mutex_trylock(cold_lock) != 0) {
+        return true;
+    }
+    victim = tails[clsid|COLD_LRU];
+    if (victim == NULL || (victim->nbytes == 0 && victim->nkey == 0)) {
+        pthread_mutex_unlock(cold_lock);
+        return true;
+    }
+    // the key can't change while it's on the LRU.
+    victim_hv = hash(ITEM_key(victim), victim->nkey);
+    pthread_mutex_unlock(cold_lock);
+
+    return sketch_estimate(lru_sketch, hv) > sketch_estimate(lru_sketch, victim_hv);
+}
+
 /* Get the next CAS id for a new item. */
 /* TODO: refactor some atomics for this. */
 uint64_t get_cas_id(void) {
@@ -121,6 +246,15 @@ void set_cas_id(uint64_t new_cas) {
     pthread_mutex_unlock(&cas_id_lock);
 }
 
+/* Makes sure CAS ids handed out from now on are above new_cas. */
+void set_cas_id_floor(uint64_t new_cas) {
+    pthread_mutex_lock(&cas_id_lock);
+    if (cas_id < new_cas) {
+        cas_id = new_cas;
+    }
+    pthread_mutex_unlock(&cas_id_lock);
+}
+
 int item_is_flushed(item *it) {
     rel_time_t oldest_live = settings.oldest_live;
     uint64_t cas = ITEM_get_cas(it);
@@ -203,6 +337,11 @@ item *do_item_alloc_pull(const size_t ntotal, const unsigned int id) {
         }
     }
 
+    if (it == NULL && slabs_magazines_flush(id) != 0) {
+        // other worker threads were holding on to the free chunks.
+        it = slabs_alloc(ntotal, id, 0);
+    }
+
     if (i > 0) {
         pthread_mutex_lock(&lru_locks[id]);
         itemstats[id].direct_reclaims += i;
@@ -370,7 +509,7 @@ void item_free(item *it) {
     /* so slab size changer can tell later if item is already free or not */
     clsid = ITEM_clsid(it);
     DEBUG_REFCNT(it, 'F');
-    slabs_free(it, ntotal, clsid);
+    slabs_retire(it, ntotal, clsid);
 }
 
 /**
@@ -393,28 +532,131 @@ bool item_size_ok(const size_t nkey, const int flags, const int nbytes) {
 }
 
 /* fixing stats/references during warm start */
-void do_item_link_fixup(item *it) {
-    item **head, **tail;
+/* Relinks an item found in restart memory. Its LRU links are intact, so we
+ * only need to find the ends of each LRU. Several threads can run this at
+ * once, as long as they hold a lock covering hv for the hash table insert.
+ * Counts are gathered in the caller's item_fixup_counts and added in with
+ * item_fixup_merge(). */
+void do_item_link_fixup(item *it, const uint32_t hv, item_fixup_counts *counts) {
+    item *none = NULL;
     int ntotal = ITEM_ntotal(it);
-    uint32_t hv = hash(ITEM_key(it), it->nkey);
+    // the expiry wheel's count of these didn't survive the restart.
+    it->it_flags &= ~ITEM_EXPIRED;
     assoc_insert(it, hv);
 
-    head = &heads[it->slabs_clsid];
-    tail = &tails[it->slabs_clsid];
-    if (it->prev == 0 && *head == 0) *head = it;
-    if (it->next == 0 && *tail == 0) *tail = it;
-    sizes[it->slabs_clsid]++;
-    sizes_bytes[it->slabs_clsid] += ntotal;
+    if (it->prev == 0) {
+        __atomic_compare_exchange_n(&heads[it->slabs_clsid], &none, it,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        none = NULL;
+    }
+    if (it->next == 0) {
+        __atomic_compare_exchange_n(&tails[it->slabs_clsid], &none, it,
+                false, __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+    }
+    counts->sizes[it->slabs_clsid]++;
+    counts->sizes_bytes[it->slabs_clsid] += ntotal;
+    counts->curr_items++;
+    counts->curr_bytes += ntotal;
+
+    item_stats_sizes_add(it);
+
+    return;
+}
 
+void item_fixup_merge(item_fixup_counts *counts) {
+    int id;
+    for (id = 0; id < LARGEST_ID; id++) {
+        __atomic_fetch_add(&sizes[id], counts->sizes[id], __ATOMIC_RELAXED);
+        __atomic_fetch_add(&sizes_bytes[id], counts->sizes_bytes[id], __ATOMIC_RELAXED);
+    }
     STATS_LOCK();
-    stats_state.curr_bytes += ntotal;
-    stats_state.curr_items += 1;
-    stats.total_items += 1;
+    stats_state.curr_bytes += counts->curr_bytes;
+    stats_state.curr_items += counts->curr_items;
+    stats.total_items += counts->curr_items;
     STATS_UNLOCK();
+}
 
-    item_stats_sizes_add(it);
+/* Counters read back from the restart metadata. */
+static uint64_t restart_curr_items = 0;
+static uint64_t restart_curr_bytes = 0;
+static uint64_t restart_total_items = 0;
+
+/* The LRUs themselves live in the memory file; we just need their ends. */
+int item_restart_save(const char *tag, void *ctx, void *data) {
+    int id;
+    for (id = 0; id < LARGEST_ID; id++) {
+        if (heads[id] != NULL) {
+            restart_set_kv(ctx, "lru", "%d,%llx,%llx,%u,%llu", id,
+                    (unsigned long long)(mc_ptr_t)heads[id],
+                    (unsigned long long)(mc_ptr_t)tails[id],
+                    sizes[id], (unsigned long long)sizes_bytes[id]);
+        }
+    }
+    restart_set_kv(ctx, "curr_items", "%llu", (unsigned long long)stats_state.curr_items);
+    restart_set_kv(ctx, "curr_bytes", "%llu", (unsigned long long)stats_state.curr_bytes);
+    restart_set_kv(ctx, "total_items", "%llu", (unsigned long long)stats.total_items);
+    return 0;
+}
 
-    return;
+// A bad or missing line means items get relinked by walking memory instead,
+// so this never holds up a restart.
+int item_restart_check(const char *tag, void *ctx, void *data) {
+    char *key;
+    char *val;
+    int seen = 0;
+    bool failed = false;
+
+    while (restart_get_kv(ctx, &key, &val) == RESTART_OK) {
+        int id;
+        unsigned long long head, tail, bytes;
+        unsigned int size;
+        if (strcmp(key, "lru") == 0
+                && sscanf(val, "%d,%llx,%llx,%u,%llu", &id, &head, &tail, &size, &bytes) == 5
+                && id >= 0 && id < LARGEST_ID) {
+            heads[id] = (item *)(mc_ptr_t)head;
+            tails[id] = (item *)(mc_ptr_t)tail;
+            sizes[id] = size;
+            sizes_bytes[id] = bytes;
+        } else if (strcmp(key, "curr_items") == 0 && safe_strtoull(val, &restart_curr_items)) {
+            seen++;
+        } else if (strcmp(key, "curr_bytes") == 0 && safe_strtoull(val, &restart_curr_bytes)) {
+            seen++;
+        } else if (strcmp(key, "total_items") == 0 && safe_strtoull(val, &restart_total_items)) {
+            seen++;
+        } else {
+            fprintf(stderr, "[restart] bad items line: %s %s\n", key, val);
+            failed = true;
+        }
+    }
+
+    if (seen == 3 && !failed) {
+        restart_index_restored(RESTART_INDEX_LRU);
+    }
+    return 0;
+}
+
+/* Moves the saved LRU ends over to the new memory base, or throws them away
+ * if restart_fixup() is going to relink every item. */
+void item_restart_fixup(void *old_base, void *new_base, const bool relink) {
+    int id;
+    if (relink) {
+        memset(heads, 0, sizeof(heads));
+        memset(tails, 0, sizeof(tails));
+        memset(sizes, 0, sizeof(sizes));
+        memset(sizes_bytes, 0, sizeof(sizes_bytes));
+        return;
+    }
+    for (id = 0; id < LARGEST_ID; id++) {
+        if (heads[id] != NULL) {
+            heads[id] = restart_rebase(heads[id], old_base, new_base);
+            tails[id] = restart_rebase(tails[id], old_base, new_base);
+        }
+    }
+    STATS_LOCK();
+    stats_state.curr_items = restart_curr_items;
+    stats_state.curr_bytes = restart_curr_bytes;
+    stats.total_items = restart_total_items;
+    STATS_UNLOCK();
 }
 
 static void do_item_link_q(item *it) { /* item is the new head */
@@ -498,6 +740,8 @@ static void item_unlink_q(item *it) {
 int do_item_link(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_LINK(ITEM_key(it), it->nkey, it->nbytes);
     assert((it->it_flags & (ITEM_LINKED|ITEM_SLABBED)) == 0);
+    // a copy of an expired item, made by the slab mover.
+    it->it_flags &= ~ITEM_EXPIRED;
     it->it_flags |= ITEM_LINKED;
     it->time = current_time;
 
@@ -511,6 +755,16 @@ int do_item_link(item *it, const uint32_t hv) {
     ITEM_set_cas(it, (settings.use_cas) ? get_cas_id() : 0);
     assoc_insert(it, hv);
     item_link_q(it);
+    if (lru_sketch != NULL) {
+        sketch_increment(lru_sketch, hv);
+    }
+    item_ghost_forget(hv);
+    if (mrc_sampled(hv)) {
+        item_mrc_reference(hv, it, false);
+    }
+    if (settings.expiry_wheel && it->exptime != 0) {
+        expiry_add(it, hv);
+    }
     refcount_incr(it);
     item_stats_sizes_add(it);
 
@@ -521,6 +775,10 @@ void do_item_unlink(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_UNLINK(ITEM_key(it), it->nkey, it->nbytes);
     if ((it->it_flags & ITEM_LINKED) != 0) {
         it->it_flags &= ~ITEM_LINKED;
+        if (it->it_flags & ITEM_EXPIRED) {
+            it->it_flags &= ~ITEM_EXPIRED;
+            expiry_expired_bytes(-(int64_t)ITEM_ntotal(it));
+        }
         STATS_LOCK();
         stats_state.curr_bytes -= ITEM_ntotal(it);
         stats_state.curr_items -= 1;
@@ -537,6 +795,10 @@ void do_item_unlink_nolock(item *it, const uint32_t hv) {
     MEMCACHED_ITEM_UNLINK(ITEM_key(it), it->nkey, it->nbytes);
     if ((it->it_flags & ITEM_LINKED) != 0) {
         it->it_flags &= ~ITEM_LINKED;
+        if (it->it_flags & ITEM_EXPIRED) {
+            it->it_flags &= ~ITEM_EXPIRED;
+            expiry_expired_bytes(-(int64_t)ITEM_ntotal(it));
+        }
         STATS_LOCK();
         stats_state.curr_bytes -= ITEM_ntotal(it);
         stats_state.curr_items -= 1;
@@ -783,6 +1045,7 @@ void item_stats(ADD_STAT add_stats, void *c) {
             totals.moves_to_warm += itemstats[i].moves_to_warm;
             totals.moves_within_lru += itemstats[i].moves_within_lru;
             totals.direct_reclaims += itemstats[i].direct_reclaims;
+            totals.admission_rejects += itemstats[i].admission_rejects;
             totals.mem_requested += sizes_bytes[i];
             size += sizes[i];
             lru_size_map[x] = sizes[i];
@@ -874,6 +1137,17 @@ void item_stats(ADD_STAT add_stats, void *c) {
                                 "%llu", (unsigned long long)totals.hits_to_temp);
 
         }
+        if (lru_sketch != NULL) {
+            uint64_t hits = totals.hits_to_hot + totals.hits_to_warm
+                + totals.hits_to_cold + totals.hits_to_temp;
+            uint64_t misses = thread_stats.slab_stats[n].evicted_misses;
+            APPEND_NUM_FMT_STAT(fmt, n, "admission_rejects",
+                                "%llu", (unsigned long long)totals.admission_rejects);
+            APPEND_NUM_FMT_STAT(fmt, n, "evicted_misses",
+                                "%llu", (unsigned long long)misses);
+            APPEND_NUM_FMT_STAT(fmt, n, "hit_ratio", "%.4f",
+                                hits + misses ? (double)hits / (hits + misses) : 0.0);
+        }
     }
 
     /* getting here means both ascii and binary terminators fit */
@@ -932,7 +1206,9 @@ void item_stats_sizes_add(item *it) {
     int ntotal = ITEM_ntotal(it);
     int bucket = ntotal / 32;
     if ((ntotal % 32) != 0) bucket++;
-    if (bucket < stats_sizes_buckets) stats_sizes_hist[bucket]++;
+    // atomic since restart recovery adds items from several threads.
+    if (bucket < stats_sizes_buckets)
+        __atomic_fetch_add(&stats_sizes_hist[bucket], 1, __ATOMIC_RELAXED);
 }
 
 /* I think there's no way for this to be accurate without using the CAS value.
@@ -976,6 +1252,10 @@ void item_stats_sizes(ADD_STAT add_stats, void *c) {
 /** wrapper around assoc_find which does the lazy expiration logic */
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update) {
     item *it = assoc_find(key, nkey, hv);
+    // misses count too, so a key is popular by the time it's stored.
+    if (lru_sketch != NULL && do_update) {
+        sketch_increment(lru_sketch, hv);
+    }
     if (it != NULL) {
         refcount_incr(it);
         /* Optimization for slab reassignment. prevents popular items from
@@ -1045,6 +1325,11 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, LIBEVEN
             }
             DEBUG_REFCNT(it, '+');
         }
+    } else if (do_update) {
+        item_ghost_miss(t, hv);
+    }
+    if (do_update && mrc_sampled(hv)) {
+        item_mrc_reference(hv, it, true);
     }
 
     if (settings.verbose > 2)
@@ -1056,6 +1341,73 @@ item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, LIBEVEN
     return it;
 }
 
+/*
+ * Lock-free reads, for -o lockfree_get.
+ *
+ * item_read_begin() looks an item up without its item lock or a reference,
+ * from inside the thread's epoch. Freed items aren't reused until readers
+ * leave their epochs (see slabs_retire()), and linked items aren't changed
+ * in place in this mode, so the caller can copy out what it needs. Then
+ * item_read_end() says whether the item was still linked.
+ *
+ * Anything which needs more than a read returns NULL, and the caller uses
+ * item_get() instead: misses, expired or flushed items, chunked or extstore
+ * items, and items which haven't had their hit flags set yet. Items hot
+ * enough to be worth this have.
+ */
+item *item_read_begin(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t) {
+    item *it;
+    uint16_t flags;
+
+    epoch_enter(t->epoch);
+    it = assoc_find_unlocked(key, nkey, hv);
+    if (it == NULL) {
+        goto fallback;
+    }
+
+    flags = __atomic_load_n(&it->it_flags, __ATOMIC_ACQUIRE);
+    if ((flags & ITEM_LINKED) == 0 || (flags & (ITEM_CHUNKED|ITEM_HDR)) != 0) {
+        goto fallback;
+    }
+    if (item_is_flushed(it) || (it->exptime != 0 && it->exptime <= current_time)) {
+        goto fallback;
+    }
+    // do_item_bump() would have nothing to do.
+    if (settings.lru_segmented) {
+        if ((flags & ITEM_ACTIVE) == 0) {
+            goto fallback;
+        }
+    } else if ((flags & ITEM_FETCHED) == 0
+            || it->time < current_time - ITEM_UPDATE_INTERVAL) {
+        goto fallback;
+    }
+
+    if (lru_sketch != NULL) {
+        sketch_increment(lru_sketch, hv);
+    }
+    if (mrc_sampled(hv)) {
+        item_mrc_reference(hv, it, true);
+    }
+    return it;
+fallback:
+    epoch_exit(t->epoch);
+    return NULL;
+}
+
+bool item_read_end(LIBEVENT_THREAD *t, item *it) {
+    bool linked;
+
+    // anything we copied was read before this.
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    linked = (__atomic_load_n(&it->it_flags, __ATOMIC_RELAXED) & ITEM_LINKED) != 0;
+    if (linked) {
+        LOGGER_LOG(t->l, LOG_FETCHERS, LOGGER_ITEM_GET, NULL, 1, ITEM_key(it),
+                   it->nkey, it->nbytes, ITEM_clsid(it), t->cur_sfd);
+    }
+    epoch_exit(t->epoch);
+    return linked;
+}
+
 // Requires lock held for item.
 // Split out of do_item_get() to allow mget functions to look through header
 // data before losing state modified via the bump function.
@@ -1065,6 +1417,8 @@ void do_item_bump(LIBEVENT_THREAD *t, item *it, const uint32_t hv) {
      * ACTIVE, but only needs a single hit to maintain activity
      * afterward.
      * FETCHED tells if an item has ever been active.
+     * With lru_clock, ACTIVE items in COLD stay put until they reach the
+     * tail, where they get a second chance instead of being bumped now.
      */
     if (settings.lru_segmented) {
         if ((it->it_flags & ITEM_ACTIVE) == 0) {
@@ -1074,6 +1428,8 @@ void do_item_bump(LIBEVENT_THREAD *t, item *it, const uint32_t hv) {
                 it->it_flags |= ITEM_ACTIVE;
                 if (ITEM_lruid(it) != COLD_LRU) {
                     it->time = current_time; // only need to bump time.
+                } else if (settings.lru_clock) {
+                    // swept by lru_pull_tail().
                 } else if (!lru_bump_async(t->lru_bump_buf, it, hv)) {
                     // add flag before async bump to avoid race.
                     it->it_flags &= ~ITEM_ACTIVE;
@@ -1090,11 +1446,49 @@ item *do_item_touch(const char *key, size_t nkey, uint32_t exptime,
                     const uint32_t hv, LIBEVENT_THREAD *t) {
     item *it = do_item_get(key, nkey, hv, t, DO_UPDATE);
     if (it != NULL) {
+        rel_time_t old_exptime = it->exptime;
         it->exptime = exptime;
+        // a later exptime is picked up when the wheel fires the earlier one.
+        if (settings.expiry_wheel && exptime != 0
+                && (old_exptime == 0 || exptime < old_exptime)) {
+            expiry_add(it, hv);
+        }
     }
     return it;
 }
 
+/* Reclaims an item the expiry wheel thinks is due. The item may be long gone,
+ * so it's left alone unless it's still linked under the same hash value.
+ * Sets *exptime if it isn't due after all. An expired item that's in use is
+ * marked ITEM_EXPIRED and counted until it's unlinked. */
+enum item_reap_result item_reap(item *it, const uint32_t hv, rel_time_t *exptime) {
+    enum item_reap_result res;
+
+    item_lock(hv);
+    if (!assoc_linked(it, hv) || hash(ITEM_key(it), it->nkey) != hv) {
+        res = REAP_GONE;
+    } else if ((it->exptime == 0 || it->exptime > current_time)
+            && !item_is_flushed(it)) {
+        *exptime = it->exptime;
+        res = REAP_NOT_EXPIRED;
+    } else if (refcount_incr(it) != 2) {
+        // in use; the next fetch will reclaim it if we don't.
+        refcount_decr(it);
+        if ((it->it_flags & ITEM_EXPIRED) == 0) {
+            it->it_flags |= ITEM_EXPIRED;
+            expiry_expired_bytes(ITEM_ntotal(it));
+        }
+        res = REAP_BUSY;
+    } else {
+        STORAGE_delete(ext_storage, it);
+        do_item_unlink(it, hv);
+        do_item_remove(it);
+        res = REAP_RECLAIMED;
+    }
+    item_unlock(hv);
+    return res;
+}
+
 /*** LRU MAINTENANCE THREAD ***/
 
 /* Returns number of items remove, expired, or evicted.
@@ -1114,6 +1508,7 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
     void *hold_lock = NULL;
     unsigned int move_to_lru = 0;
     uint64_t limit = 0;
+    int sweeps = LRU_CLOCK_SWEEPS;
 
     id |= cur_lru;
     pthread_mutex_lock(&lru_locks[id]);
@@ -1200,6 +1595,17 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
                         do_item_unlink_q(search);
                         it = search;
                     }
+                } else if ((sizes_bytes[id] > limit ||
+                            current_time - search->time > max_age)
+                        && cur_lru == HOT_LRU && (flags & LRU_PULL_ADMIT)
+                        && !lru_admit(orig_id, hv)) {
+                    itemstats[id].admission_rejects++;
+                    LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EVICTION, search);
+                    STORAGE_delete(ext_storage, search);
+                    do_item_unlink_nolock(search, hv);
+                    item_ghost_add(hv, orig_id);
+                    it = search;
+                    removed++;
                 } else if (sizes_bytes[id] > limit ||
                            current_time - search->time > max_age) {
                     itemstats[id].moves_to_cold++;
@@ -1214,6 +1620,21 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
                 }
                 break;
             case COLD_LRU:
+                if ((flags & LRU_PULL_EVICT) && settings.lru_clock
+                        && (search->it_flags & ITEM_ACTIVE) != 0
+                        && sweeps-- > 0) {
+                    /* Second chance: back to the head of COLD, so the
+                     * sweep can go on under this lock. */
+                    itemstats[id].moves_within_lru++;
+                    search->it_flags &= ~ITEM_ACTIVE;
+                    search->time = current_time;
+                    do_item_unlink_q(search);
+                    do_item_link_q(search);
+                    do_item_remove(search);
+                    item_trylock_unlock(hold_lock);
+                    tries++;
+                    continue;
+                }
                 it = search; /* No matter what, we're stopping */
                 if (flags & LRU_PULL_EVICT) {
                     if (settings.evict_to_free == 0) {
@@ -1233,6 +1654,7 @@ int lru_pull_tail(const int orig_id, const int cur_lru,
                     LOGGER_LOG(NULL, LOG_EVICTIONS, LOGGER_EVICTION, search);
                     STORAGE_delete(ext_storage, search);
                     do_item_unlink_nolock(search, hv);
+                    item_ghost_add(hv, orig_id);
                     removed++;
                     if (settings.slab_automove == 2) {
                         slabs_reassign(-1, orig_id);
@@ -1398,10 +1820,16 @@ static int lru_maintainer_juggle(const int slabs_clsid) {
     int did_moves = 0;
     uint64_t total_bytes = 0;
     unsigned int chunks_perslab = 0;
-    //unsigned int chunks_free = 0;
+    unsigned int chunks_free = 0;
+    bool mem_limit_reached = false;
+    uint8_t hot_flags = LRU_PULL_CRAWL_BLOCKS;
     /* TODO: if free_chunks below high watermark, increase aggressiveness */
-    slabs_available_chunks(slabs_clsid, NULL,
+    chunks_free = slabs_available_chunks(slabs_clsid, &mem_limit_reached,
             &chunks_perslab);
+    // only worth turning items away once the class is out of room.
+    if (lru_sketch != NULL && mem_limit_reached && chunks_free < chunks_perslab) {
+        hot_flags |= LRU_PULL_ADMIT;
+    }
     if (settings.temp_lru) {
         /* Only looking for reclaims. Run before we size the LRU. */
         for (i = 0; i < 500; i++) {
@@ -1442,7 +1870,7 @@ static int lru_maintainer_juggle(const int slabs_clsid) {
     /* Juggle HOT/WARM up to N times */
     for (i = 0; i < 500; i++) {
         int do_more = 0;
-        if (lru_pull_tail(slabs_clsid, HOT_LRU, total_bytes, LRU_PULL_CRAWL_BLOCKS, hot_age, NULL) ||
+        if (lru_pull_tail(slabs_clsid, HOT_LRU, total_bytes, hot_flags, hot_age, NULL) ||
             lru_pull_tail(slabs_clsid, WARM_LRU, total_bytes, LRU_PULL_CRAWL_BLOCKS, warm_age, NULL)) {
             do_more++;
         }
@@ -1664,6 +2092,10 @@ static void *lru_maintainer_thread(void *arg) {
             to_sleep = 1000;
         }
 
+        if (settings.expiry_wheel) {
+            expiry_run();
+        }
+
         /* Once per second at most */
         if (settings.lru_crawler && last_crawler_check != current_time) {
             lru_maintainer_crawler_check(cdata, l);
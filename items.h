@@ -9,6 +9,7 @@
 /* See items.c */
 uint64_t get_cas_id(void);
 void set_cas_id(uint64_t new_cas);
+void set_cas_id_floor(uint64_t new_cas);
 
 /*@null@*/
 item *do_item_alloc(const char *key, const size_t nkey, const unsigned int flags, const rel_time_t exptime, const int nbytes);
@@ -24,7 +25,18 @@ void do_item_remove(item *it);
 void do_item_update(item *it);   /** update LRU time to current and reposition */
 void do_item_update_nolock(item *it);
 int  do_item_replace(item *it, item *new_it, const uint32_t hv);
-void do_item_link_fixup(item *it);
+/* Counts gathered by one thread relinking items after a restart. */
+typedef struct {
+    unsigned int sizes[POWER_LARGEST];
+    uint64_t sizes_bytes[POWER_LARGEST];
+    uint64_t curr_items;
+    uint64_t curr_bytes;
+} item_fixup_counts;
+void do_item_link_fixup(item *it, const uint32_t hv, item_fixup_counts *counts);
+void item_fixup_merge(item_fixup_counts *counts);
+int item_restart_check(const char *tag, void *ctx, void *data);
+int item_restart_save(const char *tag, void *ctx, void *data);
+void item_restart_fixup(void *old_base, void *new_base, const bool relink);
 
 int item_is_flushed(item *it);
 unsigned int do_get_lru_size(uint32_t id);
@@ -38,6 +50,14 @@ void *item_lru_bump_buf_create(void);
 #define LRU_PULL_EVICT 1
 #define LRU_PULL_CRAWL_BLOCKS 2
 #define LRU_PULL_RETURN_ITEM 4 /* fill info struct if available */
+#define LRU_PULL_ADMIT 8 /* items leaving HOT must win a place in COLD */
+
+enum lru_policy_type {
+    LRU_POLICY_SEGMENTED = 0,
+    LRU_POLICY_TINYLFU
+};
+
+void item_policy_init(const enum lru_policy_type policy);
 
 struct lru_pull_tail_return {
     item *it;
@@ -73,7 +93,14 @@ void fill_item_stats_automove(item_stats_automove *am);
 
 item *do_item_get(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update);
 item *do_item_touch(const char *key, const size_t nkey, uint32_t exptime, const uint32_t hv, LIBEVENT_THREAD *t);
+
+enum item_reap_result {
+    REAP_GONE = 0, REAP_RECLAIMED, REAP_NOT_EXPIRED, REAP_BUSY
+};
+enum item_reap_result item_reap(item *it, const uint32_t hv, rel_time_t *exptime);
 void do_item_bump(LIBEVENT_THREAD *t, item *it, const uint32_t hv);
+item *item_read_begin(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t);
+bool item_read_end(LIBEVENT_THREAD *t, item *it);
 void item_stats_reset(void);
 extern pthread_mutex_t lru_locks[POWER_LARGEST];
 
@@ -17,6 +17,9 @@
 #include "storage.h"
 #include "authfile.h"
 #include "restart.h"
+#include "mrc.h"
+#include "expiry.h"
+#include "snapshot.h"
 #include <sys/stat.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -58,10 +61,25 @@
 #include "proto_bin.h"
 #include "proto_proxy.h"
 
+#ifdef WORKER_URING
+#include "uring.h"
+#endif
+#ifdef SHM_TRANSPORT
+#include "shm.h"
+#endif
+
 #if defined(__FreeBSD__)
 #include <sys/sysctl.h>
 #endif
 
+#ifdef ZEROCOPY
+#include <linux/errqueue.h>
+#endif
+
+#ifdef UDP_BATCH
+#include <netinet/udp.h>
+#endif
+
 /*
  * forward declarations
  */
@@ -84,7 +102,14 @@ static int try_read_command_udp(conn *c);
 static enum try_read_result try_read_network(conn *c);
 static enum try_read_result try_read_udp(conn *c);
 
-static int start_conn_timeout_thread(void);
+#ifdef ZEROCOPY
+static void conn_zc_release(conn *c, bool all);
+static void conn_zc_reap(conn *c);
+#endif
+#ifdef LISTEN_REUSEPORT
+static void worker_accept_new_conns(LIBEVENT_THREAD *me, const bool do_accept);
+#endif
+
 
 /* stats */
 static void stats_init(void);
@@ -94,7 +119,6 @@ static void conn_to_str(const conn *c, char *addr, char *svr_addr);
 static void settings_init(void);
 
 /* event handling, network IO */
-static void event_handler(const evutil_socket_t fd, const short which, void *arg);
 static void conn_close(conn *c);
 static void conn_init(void);
 static bool update_event(conn *c, const int new_flags);
@@ -263,8 +287,12 @@ static void settings_init(void) {
     settings.lru_crawler = false;
     settings.lru_crawler_sleep = 100;
     settings.lru_crawler_tocrawl = 0;
+    settings.lru_crawler_threads = 1;
     settings.lru_maintainer_thread = false;
     settings.lru_segmented = true;
+    settings.lru_clock = false;
+    settings.expiry_wheel = false;
+    settings.snapshot_load = NULL;
     settings.hot_lru_pct = 20;
     settings.warm_lru_pct = 40;
     settings.hot_max_factor = 0.2;
@@ -272,7 +300,12 @@ static void settings_init(void) {
     settings.temp_lru = false;
     settings.temporary_ttl = 61;
     settings.idle_timeout = 0; /* disabled */
+    settings.mrc_sample_rate = 0; /* disabled */
     settings.hashpower_init = 0;
+    settings.hash_expand_threads = 1;
+    settings.restart_threads = 1;
+    settings.lockfree_get = false;
+    settings.slab_magazines = true;
     settings.slab_reassign = true;
     settings.slab_automove = 1;
     settings.slab_automove_ratio = 0.8;
@@ -295,112 +328,120 @@ static void settings_init(void) {
 #ifdef SOCK_COOKIE_ID
     settings.sock_cookie_id = 0;
 #endif
+#ifdef WORKER_URING
+    settings.worker_uring = false;
+#endif
+#ifdef ZEROCOPY
+    settings.zerocopy_min = 0; /* disabled */
+#endif
+#ifdef LISTEN_REUSEPORT
+    settings.reuseport = false;
+#endif
+    settings.sched_quantum = 0; /* disabled */
+    settings.sched_stats = false;
+    settings.worker_spin = 0; /* disabled */
+#ifdef BUSY_POLL
+    settings.busy_poll = 0;
+#endif
+#ifdef UDP_BATCH
+    settings.udp_batch = 16;
+#endif
+#ifdef SHM_TRANSPORT
+    settings.shm_ring_size = 0; /* disabled */
+#endif
 }
 
 extern pthread_mutex_t conn_lock;
 
-/* Connection timeout thread bits */
-static pthread_t conn_timeout_tid;
-static int do_run_conn_timeout_thread;
-static pthread_cond_t conn_timeout_cond = PTHREAD_COND_INITIALIZER;
-static pthread_mutex_t conn_timeout_lock = PTHREAD_MUTEX_INITIALIZER;
-
-#define CONNS_PER_SLICE 100
-static void *conn_timeout_thread(void *arg) {
-    int i;
-    conn *c;
-    rel_time_t oldest_last_cmd;
-    int sleep_time;
-    int sleep_slice = max_fds / CONNS_PER_SLICE;
-    if (sleep_slice == 0)
-        sleep_slice = CONNS_PER_SLICE;
-
-    useconds_t timeslice = 1000000 / sleep_slice;
-
-    mutex_lock(&conn_timeout_lock);
-    while(do_run_conn_timeout_thread) {
-        if (settings.verbose > 2)
-            fprintf(stderr, "idle timeout thread at top of connection list\n");
-
-        oldest_last_cmd = current_time;
-
-        for (i = 0; i < max_fds; i++) {
-            if ((i % CONNS_PER_SLICE) == 0) {
-                if (settings.verbose > 2)
-                    fprintf(stderr, "idle timeout thread sleeping for %ulus\n",
-                        (unsigned int)timeslice);
-                usleep(timeslice);
-            }
-
-            if (!conns[i])
-                continue;
-
-            c = conns[i];
+/*
+ * Idle connection timeouts.
+ *
+ * Each worker keeps its TCP connections in a timer wheel with a slot per
+ * second, and a timer on its event base checks the slots that came due since
+ * it last ran. Commands only update last_cmd_time; a connection that was
+ * active since it went into the wheel is moved to the slot for its new
+ * deadline when it comes up. Only connections that might be due are looked
+ * at, and only by the thread that owns them.
+ */
+static void conn_idle_link(conn *c, rel_time_t deadline) {
+    conn **slot = &c->thread->idle_wheel[deadline & (IDLE_WHEEL_SLOTS - 1)];
+    c->idle_next = *slot;
+    if (c->idle_next)
+        c->idle_next->idle_pprev = &c->idle_next;
+    c->idle_pprev = slot;
+    *slot = c;
+}
 
-            if (!IS_TCP(c->transport))
-                continue;
+void conn_idle_add(conn *c) {
+    if (c->thread->idle_wheel == NULL || c->idle_pprev != NULL)
+        return;
+    conn_idle_link(c, c->last_cmd_time + settings.idle_timeout + 1);
+    c->thread->idle_conns++;
+}
 
-            if (c->state != conn_new_cmd && c->state != conn_read)
-                continue;
+static void conn_idle_del(conn *c) {
+    if (c->idle_pprev == NULL)
+        return;
+    *c->idle_pprev = c->idle_next;
+    if (c->idle_next)
+        c->idle_next->idle_pprev = c->idle_pprev;
+    c->idle_next = NULL;
+    c->idle_pprev = NULL;
+    c->thread->idle_conns--;
+}
 
-            if ((current_time - c->last_cmd_time) > settings.idle_timeout) {
-                timeout_conn(c);
-            } else {
-                if (c->last_cmd_time < oldest_last_cmd)
-                    oldest_last_cmd = c->last_cmd_time;
+static void conn_idle_tick(evutil_socket_t fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    rel_time_t now = current_time;
+    rel_time_t t = me->idle_clock;
+
+    // after a long stall, one lap around the wheel sees everything.
+    if (now - t > IDLE_WHEEL_SLOTS)
+        t = now - IDLE_WHEEL_SLOTS;
+
+    while (t != now) {
+        t++;
+        conn **slot = &me->idle_wheel[t & (IDLE_WHEEL_SLOTS - 1)];
+        conn *c = *slot;
+        *slot = NULL;
+        while (c) {
+            conn *next = c->idle_next;
+            c->idle_next = NULL;
+            c->idle_pprev = NULL;
+            me->idle_conns--;
+
+            rel_time_t deadline = c->last_cmd_time + settings.idle_timeout + 1;
+            if (deadline <= now) {
+                if (c->state == conn_new_cmd || c->state == conn_read) {
+                    conn_close_idle(c);
+                    c = next;
+                    continue;
+                }
+                // busy, possibly off on a side thread. look again later.
+                deadline = now + 1;
             }
+            conn_idle_link(c, deadline);
+            me->idle_conns++;
+            c = next;
         }
-
-        /* This is the soonest we could have another connection time out */
-        sleep_time = settings.idle_timeout - (current_time - oldest_last_cmd) + 1;
-        if (sleep_time <= 0)
-            sleep_time = 1;
-
-        if (settings.verbose > 2)
-            fprintf(stderr,
-                    "idle timeout thread finished pass, sleeping for %ds\n",
-                    sleep_time);
-
-        struct timeval now;
-        struct timespec to_sleep;
-        gettimeofday(&now, NULL);
-        to_sleep.tv_sec = now.tv_sec + sleep_time;
-        to_sleep.tv_nsec = 0;
-
-        pthread_cond_timedwait(&conn_timeout_cond, &conn_timeout_lock, &to_sleep);
     }
-
-    mutex_unlock(&conn_timeout_lock);
-    return NULL;
+    me->idle_clock = now;
 }
 
-static int start_conn_timeout_thread(void) {
-    int ret;
+void conn_idle_init(LIBEVENT_THREAD *me) {
+    struct timeval t = {.tv_sec = 1, .tv_usec = 0};
 
     if (settings.idle_timeout == 0)
-        return -1;
-
-    do_run_conn_timeout_thread = 1;
-    if ((ret = pthread_create(&conn_timeout_tid, NULL,
-        conn_timeout_thread, NULL)) != 0) {
-        fprintf(stderr, "Can't create idle connection timeout thread: %s\n",
-            strerror(ret));
-        return -1;
+        return;
+    me->idle_wheel = calloc(IDLE_WHEEL_SLOTS, sizeof(conn *));
+    if (me->idle_wheel == NULL) {
+        fprintf(stderr, "Failed to allocate idle timeout wheel\n");
+        exit(EXIT_FAILURE);
     }
-    thread_setname(conn_timeout_tid, "mc-idletimeout");
-
-    return 0;
-}
-
-int stop_conn_timeout_thread(void) {
-    if (!do_run_conn_timeout_thread)
-        return -1;
-    mutex_lock(&conn_timeout_lock);
-    do_run_conn_timeout_thread = 0;
-    pthread_cond_signal(&conn_timeout_cond);
-    mutex_unlock(&conn_timeout_lock);
-    pthread_join(conn_timeout_tid, NULL);
-    return 0;
+    me->idle_clock = current_time;
+    event_set(&me->idle_event, -1, EV_PERSIST, conn_idle_tick, me);
+    event_base_set(me->base, &me->idle_event);
+    evtimer_add(&me->idle_event, &t);
 }
 
 /*
@@ -549,12 +590,17 @@ void conn_worker_readd(conn *c) {
         }
     }
     c->ev_flags = EV_READ | EV_PERSIST;
-    event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
-    event_base_set(c->thread->base, &c->event);
+#ifdef WORKER_URING
+    if (!uring_conn_attach(c))
+#endif
+    {
+        event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
+        event_base_set(c->thread->base, &c->event);
 
-    // TODO: call conn_cleanup/fail/etc
-    if (event_add(&c->event, 0) == -1) {
-        perror("event_add");
+        // TODO: call conn_cleanup/fail/etc
+        if (event_add(&c->event, 0) == -1) {
+            perror("event_add");
+        }
     }
 
     // side thread wanted us to close immediately.
@@ -628,6 +674,53 @@ void conn_io_queue_return(io_pending_t *io) {
     io->return_cb(io);
 }
 
+#ifdef UDP_BATCH
+/*
+ * Datagrams read from a UDP socket with one recvmmsg(), handed out to the
+ * state machine one at a time. Each gets a buffer as large as the conn's own
+ * read buffer so nothing is truncated; pages past the end of short datagrams
+ * are never touched.
+ */
+struct udp_batch {
+    int count; /* datagrams read */
+    int next; /* next one to handle */
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    struct iovec iovs[UDP_BATCH_MAX];
+    struct sockaddr_in6 addrs[UDP_BATCH_MAX];
+    char *bufs;
+};
+
+static struct udp_batch *udp_batch_new(void) {
+    struct udp_batch *b = calloc(1, sizeof(struct udp_batch));
+    if (b == NULL) {
+        return NULL;
+    }
+    b->bufs = malloc((size_t)settings.udp_batch * UDP_READ_BUFFER_SIZE);
+    if (b->bufs == NULL) {
+        free(b);
+        return NULL;
+    }
+    for (int x = 0; x < settings.udp_batch; x++) {
+        b->iovs[x].iov_base = b->bufs + (size_t)x * UDP_READ_BUFFER_SIZE;
+        b->iovs[x].iov_len = UDP_READ_BUFFER_SIZE;
+        b->msgs[x].msg_hdr.msg_iov = &b->iovs[x];
+        b->msgs[x].msg_hdr.msg_iovlen = 1;
+        b->msgs[x].msg_hdr.msg_name = &b->addrs[x];
+    }
+    return b;
+}
+#endif
+
+// true if a UDP conn has read datagrams it hasn't handled yet, which no read
+// event will come in for.
+static inline bool udp_read_pending(conn *c) {
+#ifdef UDP_BATCH
+    return c->udp_batch != NULL && c->udp_batch->next < c->udp_batch->count;
+#else
+    return false;
+#endif
+}
+
 conn *conn_new(const int sfd, enum conn_states init_state,
                 const int event_flags,
                 const int read_buffer_size, enum network_transport transport,
@@ -677,6 +770,20 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         conns[sfd] = c;
     }
 
+#ifdef UDP_BATCH
+    if (IS_UDP(transport) && settings.udp_batch > 1 && c->udp_batch == NULL) {
+        c->udp_batch = udp_batch_new();
+        if (c->udp_batch == NULL) {
+            conn_free(c);
+            STATS_LOCK();
+            stats.malloc_fails++;
+            STATS_UNLOCK();
+            fprintf(stderr, "Failed to allocate buffers for connection\n");
+            return NULL;
+        }
+    }
+#endif
+
     c->transport = transport;
     c->protocol = bproto;
     c->tag = conntag;
@@ -737,6 +844,7 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->cmd = -1;
     c->rbytes = 0;
     c->rcurr = c->rbuf;
+    c->rprefetched = 0;
     c->ritem = 0;
     c->rbuf_malloced = false;
     c->item_malloced = false;
@@ -745,6 +853,8 @@ conn *conn_new(const int sfd, enum conn_states init_state,
     c->mset_res = false;
     c->close_after_write = false;
     c->last_cmd_time = current_time; /* initialize for idle kicker */
+    c->sched_deficit = 0;
+    c->sched_class = SCHED_CLASS_DEFAULT;
     // wipe all queues.
     memset(c->io_queues, 0, sizeof(c->io_queues));
     c->io_queues_submitted = 0;
@@ -772,6 +882,32 @@ conn *conn_new(const int sfd, enum conn_states init_state,
         c->write = tcp_write;
     }
 
+#ifdef ZEROCOPY
+    c->zerocopy = false;
+    c->zc_sent = c->zc_done = c->zc_pending = 0;
+    c->zc_head = c->zc_tail = NULL;
+    if (settings.zerocopy_min && transport == tcp_transport
+            && init_state == conn_new_cmd && ssl == NULL) {
+        int on = 1;
+        // fails on kernels older than 4.14; large sends are then copied.
+        if (setsockopt(sfd, SOL_SOCKET, SO_ZEROCOPY, &on, sizeof(on)) == 0) {
+            c->zerocopy = true;
+        }
+    }
+#endif
+
+#ifdef BUSY_POLL
+    if (settings.busy_poll && (IS_UDP(transport)
+            || (transport == tcp_transport && init_state == conn_new_cmd))) {
+        // raising it past net.core.busy_read needs CAP_NET_ADMIN; without
+        // that reads just don't busy poll.
+        if (setsockopt(sfd, SOL_SOCKET, SO_BUSY_POLL, &settings.busy_poll,
+                    sizeof(settings.busy_poll)) != 0 && settings.verbose > 1) {
+            perror("setsockopt(SO_BUSY_POLL)");
+        }
+    }
+#endif
+
     if (IS_UDP(transport)) {
         c->try_read_command = try_read_command_udp;
     } else {
@@ -888,6 +1024,12 @@ void conn_free(conn *c) {
         conns[c->sfd] = NULL;
         if (c->rbuf)
             free(c->rbuf);
+#ifdef UDP_BATCH
+        if (c->udp_batch) {
+            free(c->udp_batch->bufs);
+            free(c->udp_batch);
+        }
+#endif
 #ifdef TLS
         if (c->ssl_wbuf)
             c->ssl_wbuf = NULL;
@@ -908,10 +1050,28 @@ static void conn_close(conn *c) {
 
     /* delete the event, the socket and the conn */
     event_del(&c->event);
+    if (c->thread) {
+        conn_idle_del(c);
+    }
+#ifdef WORKER_URING
+    uring_conn_detach(c);
+#endif
 
     if (settings.verbose > 1)
         fprintf(stderr, "<%d connection closed.\n", c->sfd);
 
+#ifdef ZEROCOPY
+    if (c->zc_pending) {
+        conn_zc_reap(c);
+    }
+    if (c->zc_pending) {
+        // the kernel's still sending from these responses' items and
+        // buffers, and would carry on after close() from memory we're about
+        // to reuse. Reset the connection so it drops what's still queued.
+        struct linger ling = {1, 0};
+        setsockopt(c->sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+    }
+#endif
     conn_cleanup(c);
 
     // force release of read buffer.
@@ -929,6 +1089,14 @@ static void conn_close(conn *c) {
     }
 #endif
     close(c->sfd);
+#ifdef ZEROCOPY
+    conn_zc_release(c, true);
+#endif
+#ifdef SHM_TRANSPORT
+    if (c->shm) {
+        shm_conn_close(c);
+    }
+#endif
     c->close_reason = 0;
     pthread_mutex_lock(&conn_lock);
     allow_new_conns = true;
@@ -1233,6 +1401,99 @@ mc_resp* resp_finish(conn *c, mc_resp *resp) {
     return next;
 }
 
+#ifdef ZEROCOPY
+/*
+ * A response sent with MSG_ZEROCOPY can't be freed when the send returns:
+ * the kernel reads the item, and the response's own wbuf, until it reports
+ * the send complete on the socket's error queue. Finished responses are
+ * moved to a list on the connection instead, and freed from there by
+ * conn_zc_reap() as the completions come in.
+ */
+static void conn_zc_release(conn *c, bool all) {
+    mc_resp *resp = c->zc_head;
+    // the list is in send order, so stop at the first one still in flight.
+    while (resp && (all || (int32_t)(resp->zc_seq - c->zc_done) < 0)) {
+        resp = resp_finish(c, resp);
+    }
+    c->zc_head = resp;
+    if (resp == NULL) {
+        c->zc_tail = NULL;
+    }
+}
+
+static void conn_zc_reap(conn *c) {
+    char control[128];
+    struct msghdr msg;
+    struct cmsghdr *cm;
+    uint64_t copied = 0;
+
+    for (;;) {
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        if (recvmsg(c->sfd, &msg, MSG_ERRQUEUE) == -1) {
+            break;
+        }
+
+        for (cm = CMSG_FIRSTHDR(&msg); cm != NULL; cm = CMSG_NXTHDR(&msg, cm)) {
+            if (!(cm->cmsg_level == IPPROTO_IP && cm->cmsg_type == IP_RECVERR) &&
+                !(cm->cmsg_level == IPPROTO_IPV6 && cm->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            struct sock_extended_err *serr = (struct sock_extended_err *)CMSG_DATA(cm);
+            if (serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY || serr->ee_errno != 0) {
+                continue;
+            }
+            // completions come as a range of send ids: [ee_info, ee_data]
+            uint32_t count = serr->ee_data - serr->ee_info + 1;
+            c->zc_pending -= count;
+            if (serr->ee_info == c->zc_done) {
+                c->zc_done = serr->ee_data + 1;
+            }
+            if (serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) {
+                copied += count;
+            }
+        }
+    }
+
+    // ranges can arrive out of order; we only move past a gap once
+    // everything's come back.
+    if (c->zc_pending == 0) {
+        c->zc_done = c->zc_sent;
+    }
+    if (copied) {
+        THR_STATS_LOCK(c->thread);
+        c->thread->stats.zerocopy_copied += copied;
+        THR_STATS_UNLOCK(c->thread);
+    }
+    conn_zc_release(c, false);
+}
+#endif
+
+// Finishes a response which has been sent in full.
+static mc_resp *resp_finish_sent(conn *c, mc_resp *resp) {
+#ifdef ZEROCOPY
+    if (resp->zc) {
+        mc_resp *next = resp->next;
+        if (c->resp_head == resp) {
+            c->resp_head = next;
+        }
+        if (c->resp == resp) {
+            c->resp = NULL;
+        }
+        resp->next = NULL;
+        if (c->zc_tail) {
+            c->zc_tail->next = resp;
+        } else {
+            c->zc_head = resp;
+        }
+        c->zc_tail = resp;
+        return next;
+    }
+#endif
+    return resp_finish(c, resp);
+}
+
 // tells if connection has a depth of response objects to process.
 bool resp_has_stack(conn *c) {
     return c->resp_head->next != NULL ? true : false;
@@ -1431,6 +1692,10 @@ static void reset_cmd_handler(conn *c) {
     }
     if (c->rbytes > 0) {
         conn_set_state(c, conn_parse_cmd);
+    } else if (udp_read_pending(c)) {
+        // handle the rest of the batch first so the responses go out
+        // together.
+        conn_set_state(c, conn_read);
     } else if (c->resp_head) {
         conn_set_state(c, conn_mwrite);
     } else {
@@ -1762,6 +2027,25 @@ void append_stat(const char *name, ADD_STAT add_stats, conn *c,
     add_stats(name, strlen(name), val_str, vlen, c);
 }
 
+/* Upper bound of the histogram bucket holding the given percentile. */
+static unsigned long long sched_turn_pct(const uint64_t *hist, double pct) {
+    uint64_t total = 0, seen = 0;
+    int b;
+    for (b = 0; b < SCHED_TURN_BUCKETS; b++) {
+        total += hist[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+    for (b = 0; b < SCHED_TURN_BUCKETS - 1; b++) {
+        seen += hist[b];
+        if (seen >= total * pct) {
+            break;
+        }
+    }
+    return 1ULL << b;
+}
+
 /* return server specific stats only */
 void server_stats(ADD_STAT add_stats, conn *c) {
     pid_t pid = getpid();
@@ -1855,6 +2139,13 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     if (settings.idle_timeout) {
         APPEND_STAT("idle_kicks", "%llu", (unsigned long long)thread_stats.idle_kicks);
     }
+#ifdef ZEROCOPY
+    if (settings.zerocopy_min) {
+        APPEND_STAT("zerocopy_sends", "%llu", (unsigned long long)thread_stats.zerocopy_sends);
+        APPEND_STAT("zerocopy_copied", "%llu", (unsigned long long)thread_stats.zerocopy_copied);
+        APPEND_STAT("zerocopy_fallbacks", "%llu", (unsigned long long)thread_stats.zerocopy_fallbacks);
+    }
+#endif
     APPEND_STAT("bytes_read", "%llu", (unsigned long long)thread_stats.bytes_read);
     APPEND_STAT("bytes_written", "%llu", (unsigned long long)thread_stats.bytes_written);
     APPEND_STAT("limit_maxbytes", "%llu", (unsigned long long)settings.maxbytes);
@@ -1863,9 +2154,41 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     APPEND_STAT("time_in_listen_disabled_us", "%llu", stats.time_in_listen_disabled_us);
     APPEND_STAT("threads", "%d", settings.num_threads);
     APPEND_STAT("conn_yields", "%llu", (unsigned long long)thread_stats.conn_yields);
+    if (settings.sched_quantum) {
+        APPEND_STAT("sched_yields", "%llu", (unsigned long long)thread_stats.sched_yields);
+        APPEND_STAT("sched_skips", "%llu", (unsigned long long)thread_stats.sched_skips);
+    }
+    if (settings.sched_stats) {
+        APPEND_STAT("sched_turn_p50_us", "%llu", sched_turn_pct(thread_stats.sched_turn_us, 0.5));
+        APPEND_STAT("sched_turn_p99_us", "%llu", sched_turn_pct(thread_stats.sched_turn_us, 0.99));
+        APPEND_STAT("sched_turn_p999_us", "%llu", sched_turn_pct(thread_stats.sched_turn_us, 0.999));
+        APPEND_STAT("sched_turn_max_us", "%llu", sched_turn_pct(thread_stats.sched_turn_us, 1));
+    }
+    if (settings.udpport) {
+        APPEND_STAT("udp_read_calls", "%llu", (unsigned long long)thread_stats.udp_read_calls);
+        APPEND_STAT("udp_read_datagrams", "%llu", (unsigned long long)thread_stats.udp_read_datagrams);
+        APPEND_STAT("udp_write_calls", "%llu", (unsigned long long)thread_stats.udp_write_calls);
+        APPEND_STAT("udp_write_datagrams", "%llu", (unsigned long long)thread_stats.udp_write_datagrams);
+    }
+#ifdef SHM_TRANSPORT
+    if (settings.shm_ring_size) {
+        APPEND_STAT("curr_shm_connections", "%u", stats_state.shm_conns);
+        APPEND_STAT("shm_wakeups", "%llu", (unsigned long long)thread_stats.shm_wakeups);
+    }
+#endif
+    if (settings.worker_spin) {
+        APPEND_STAT("worker_spin_us", "%llu", (unsigned long long)thread_stats.spin_us);
+        APPEND_STAT("worker_spin_hits", "%llu", (unsigned long long)thread_stats.spin_hits);
+        APPEND_STAT("worker_spin_sleeps", "%llu", (unsigned long long)thread_stats.spin_sleeps);
+        APPEND_STAT("worker_sleep_us", "%llu", (unsigned long long)thread_stats.sleep_us);
+    }
     APPEND_STAT("hash_power_level", "%u", stats_state.hash_power_level);
     APPEND_STAT("hash_bytes", "%llu", (unsigned long long)stats_state.hash_bytes);
     APPEND_STAT("hash_is_expanding", "%u", stats_state.hash_is_expanding);
+    APPEND_STAT("hash_expansions", "%llu", (unsigned long long)stats_state.hash_expansions);
+    APPEND_STAT("hash_shrinks", "%llu", (unsigned long long)stats_state.hash_shrinks);
+    APPEND_STAT("hash_resize_buckets_moved", "%llu", (unsigned long long)stats_state.hash_resize_buckets_moved);
+    APPEND_STAT("hash_resize_time_us", "%llu", (unsigned long long)stats_state.hash_resize_time_us);
     if (settings.slab_reassign) {
         APPEND_STAT("slab_reassign_rescues", "%llu", stats.slab_reassign_rescues);
         APPEND_STAT("slab_reassign_chunk_rescues", "%llu", stats.slab_reassign_chunk_rescues);
@@ -1879,6 +2202,7 @@ void server_stats(ADD_STAT add_stats, conn *c) {
     if (settings.lru_crawler) {
         APPEND_STAT("lru_crawler_running", "%u", stats_state.lru_crawler_running);
         APPEND_STAT("lru_crawler_starts", "%u", stats.lru_crawler_starts);
+        lru_crawler_stats(add_stats, c);
     }
     if (settings.lru_maintainer_thread) {
         APPEND_STAT("lru_maintainer_juggles", "%llu", (unsigned long long)stats.lru_maintainer_juggles);
@@ -1942,6 +2266,11 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("item_size_max", "%d", settings.item_size_max);
     APPEND_STAT("maxconns_fast", "%s", settings.maxconns_fast ? "yes" : "no");
     APPEND_STAT("hashpower_init", "%d", settings.hashpower_init);
+    APPEND_STAT("hash_expand_threads", "%d", settings.hash_expand_threads);
+    APPEND_STAT("hash_shrink", "%s", settings.hash_shrink ? "yes" : "no");
+    APPEND_STAT("restart_threads", "%d", settings.restart_threads);
+    APPEND_STAT("lockfree_get", "%s", settings.lockfree_get ? "yes" : "no");
+    APPEND_STAT("slab_magazines", "%s", settings.slab_magazines ? "yes" : "no");
     APPEND_STAT("slab_reassign", "%s", settings.slab_reassign ? "yes" : "no");
     APPEND_STAT("slab_automove", "%d", settings.slab_automove);
     APPEND_STAT("slab_automove_ratio", "%.2f", settings.slab_automove_ratio);
@@ -1950,12 +2279,19 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("lru_crawler", "%s", settings.lru_crawler ? "yes" : "no");
     APPEND_STAT("lru_crawler_sleep", "%d", settings.lru_crawler_sleep);
     APPEND_STAT("lru_crawler_tocrawl", "%lu", (unsigned long)settings.lru_crawler_tocrawl);
+    APPEND_STAT("lru_crawler_threads", "%d", settings.lru_crawler_threads);
     APPEND_STAT("tail_repair_time", "%d", settings.tail_repair_time);
     APPEND_STAT("flush_enabled", "%s", settings.flush_enabled ? "yes" : "no");
     APPEND_STAT("dump_enabled", "%s", settings.dump_enabled ? "yes" : "no");
     APPEND_STAT("hash_algorithm", "%s", settings.hash_algorithm);
+    APPEND_STAT("hash_index", "%s", settings.hash_index);
     APPEND_STAT("lru_maintainer_thread", "%s", settings.lru_maintainer_thread ? "yes" : "no");
     APPEND_STAT("lru_segmented", "%s", settings.lru_segmented ? "yes" : "no");
+    APPEND_STAT("lru_policy", "%s", settings.lru_policy);
+    APPEND_STAT("lru_clock", "%s", settings.lru_clock ? "yes" : "no");
+    APPEND_STAT("expiry_wheel", "%s", settings.expiry_wheel ? "yes" : "no");
+    APPEND_STAT("snapshot_load", "%s",
+                settings.snapshot_load ? settings.snapshot_load : "NULL");
     APPEND_STAT("hot_lru_pct", "%d", settings.hot_lru_pct);
     APPEND_STAT("warm_lru_pct", "%d", settings.warm_lru_pct);
     APPEND_STAT("hot_max_factor", "%.2f", settings.hot_max_factor);
@@ -1967,6 +2303,7 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
     APPEND_STAT("worker_logbuf_size", "%u", settings.logger_buf_size);
     APPEND_STAT("read_buf_mem_limit", "%u", settings.read_buf_mem_limit);
     APPEND_STAT("track_sizes", "%s", item_stats_sizes_status() ? "yes" : "no");
+    APPEND_STAT("mrc_sample_rate", "%u", settings.mrc_sample_rate);
     APPEND_STAT("inline_ascii_response", "%s", "no"); // setting is dead, cannot be yes.
 #ifdef HAVE_DROP_PRIVILEGES
     APPEND_STAT("drop_privileges", "%s", settings.drop_privileges ? "yes" : "no");
@@ -2000,6 +2337,27 @@ void process_stat_settings(ADD_STAT add_stats, void *c) {
 #ifdef PROXY
     APPEND_STAT("proxy_enabled", "%s", settings.proxy_enabled ? "yes" : "no");
     APPEND_STAT("proxy_uring_enabled", "%s", settings.proxy_uring ? "yes" : "no");
+#endif
+#ifdef WORKER_URING
+    APPEND_STAT("worker_uring", "%s", settings.worker_uring ? "yes" : "no");
+#endif
+#ifdef ZEROCOPY
+    APPEND_STAT("zerocopy_min", "%d", settings.zerocopy_min);
+#endif
+#ifdef LISTEN_REUSEPORT
+    APPEND_STAT("reuseport", "%s", settings.reuseport ? "yes" : "no");
+#endif
+    APPEND_STAT("sched_quantum", "%d", settings.sched_quantum);
+    APPEND_STAT("sched_stats", "%s", settings.sched_stats ? "yes" : "no");
+    APPEND_STAT("worker_spin", "%d", settings.worker_spin);
+#ifdef BUSY_POLL
+    APPEND_STAT("busy_poll", "%d", settings.busy_poll);
+#endif
+#ifdef UDP_BATCH
+    APPEND_STAT("udp_batch", "%d", settings.udp_batch);
+#endif
+#ifdef SHM_TRANSPORT
+    APPEND_STAT("shm_ring_size", "%d", settings.shm_ring_size);
 #endif
     APPEND_STAT("num_napi_ids", "%s", settings.num_napi_ids);
     APPEND_STAT("memory_file", "%s", settings.memory_file);
@@ -2023,6 +2381,10 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
             STATS_UNLOCK();
             APPEND_STAT("slab_global_page_pool", "%u", global_page_pool_size(NULL));
             item_stats_totals(add_stats, c);
+            if (settings.expiry_wheel) {
+                expiry_stats(add_stats, c);
+            }
+            snapshot_stats(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "items") == 0) {
             item_stats(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "slabs") == 0) {
@@ -2033,6 +2395,8 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c) {
             item_stats_sizes_enable(add_stats, c);
         } else if (nz_strcmp(nkey, stat_type, "sizes_disable") == 0) {
             item_stats_sizes_disable(add_stats, c);
+        } else if (nz_strcmp(nkey, stat_type, "mrc") == 0) {
+            mrc_stats(add_stats, c);
         } else {
             ret = false;
         }
@@ -2196,11 +2560,15 @@ void process_stats_conns(ADD_STAT add_stats, void *c) {
 
 #define IT_REFCOUNT_LIMIT 60000
 item* limited_get(const char *key, size_t nkey, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow) {
+    return limited_get_hv(key, nkey, hash(key, nkey), t, exptime, should_touch, do_update, overflow);
+}
+
+item* limited_get_hv(const char *key, size_t nkey, uint32_t hv, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow) {
     item *it;
     if (should_touch) {
-        it = item_touch(key, nkey, exptime, t);
+        it = item_touch_hv(key, nkey, hv, exptime, t);
     } else {
-        it = item_get(key, nkey, t, do_update);
+        it = item_get_hv(key, nkey, hv, t, do_update);
     }
     if (it && it->refcount > IT_REFCOUNT_LIMIT) {
         item_remove(it);
@@ -2303,8 +2671,9 @@ enum delta_result_type do_add_delta(LIBEVENT_THREAD *t, const char *key, const s
     res = strlen(buf);
     /* refcount == 2 means we are the only ones holding the item, and it is
      * linked. We hold the item's lock in this function, so refcount cannot
-     * increase. */
-    if (res + 2 <= it->nbytes && it->refcount == 2) { /* replace in-place */
+     * increase. Lock-free readers don't take a reference, so never change
+     * the value under them. */
+    if (res + 2 <= it->nbytes && it->refcount == 2 && !settings.lockfree_get) { /* replace in-place */
         /* When changing the value without replacing the item, we
            need to update the CAS on the existing item. */
         /* We also need to fiddle it in the sizes tracker in case the tracking
@@ -2391,6 +2760,76 @@ static int try_read_command_udp(conn *c) {
     }
 }
 
+/*
+ * Takes the request out of a datagram into the read buffer. Returns false if
+ * it has to be dropped.
+ */
+static bool udp_take_request(conn *c, char *buf, int res) {
+    unsigned char *hdr = (unsigned char *)buf;
+
+    if (res <= 8) {
+        return false;
+    }
+
+    /* Beginning of UDP packet is the request ID; save it. */
+    c->request_id = hdr[0] * 256 + hdr[1];
+
+    /* If this is a multi-packet request, drop it. */
+    if (hdr[4] != 0 || hdr[5] != 1) {
+        return false;
+    }
+
+    /* Don't care about any of the rest of the header. */
+    res -= 8;
+    memmove(c->rbuf, buf + 8, res);
+
+    c->rbytes = res;
+    c->rcurr = c->rbuf;
+    return true;
+}
+
+#ifdef UDP_BATCH
+/*
+ * Hands out the next datagram from the last recvmmsg(), reading another
+ * batch once they've all been handled.
+ */
+static enum try_read_result try_read_udp_batch(conn *c) {
+    struct udp_batch *b = c->udp_batch;
+
+    for (;;) {
+        if (b->next == b->count) {
+            for (int x = 0; x < settings.udp_batch; x++) {
+                b->msgs[x].msg_hdr.msg_namelen = sizeof(b->addrs[x]);
+            }
+            int n = recvmmsg(c->sfd, b->msgs, settings.udp_batch, 0, NULL);
+            b->next = b->count = 0;
+            if (n <= 0) {
+                return READ_NO_DATA_RECEIVED;
+            }
+            b->count = n;
+
+            uint64_t bytes = 0;
+            for (int x = 0; x < n; x++) {
+                bytes += b->msgs[x].msg_len;
+            }
+            pthread_mutex_lock(&c->thread->stats.mutex);
+            c->thread->stats.bytes_read += bytes;
+            c->thread->stats.udp_read_calls++;
+            c->thread->stats.udp_read_datagrams += n;
+            pthread_mutex_unlock(&c->thread->stats.mutex);
+        }
+
+        struct mmsghdr *m = &b->msgs[b->next];
+        memcpy(&c->request_addr, &b->addrs[b->next], m->msg_hdr.msg_namelen);
+        c->request_addr_size = m->msg_hdr.msg_namelen;
+        b->next++;
+        if (udp_take_request(c, m->msg_hdr.msg_iov->iov_base, m->msg_len)) {
+            return READ_DATA_RECEIVED;
+        }
+    }
+}
+#endif
+
 /*
  * read a UDP request.
  */
@@ -2399,30 +2838,24 @@ static enum try_read_result try_read_udp(conn *c) {
 
     assert(c != NULL);
 
+#ifdef UDP_BATCH
+    if (c->udp_batch != NULL) {
+        return try_read_udp_batch(c);
+    }
+#endif
+
     c->request_addr_size = sizeof(c->request_addr);
     res = recvfrom(c->sfd, c->rbuf, c->rsize,
                    0, (struct sockaddr *)&c->request_addr,
                    &c->request_addr_size);
-    if (res > 8) {
-        unsigned char *buf = (unsigned char *)c->rbuf;
+    if (res > 0) {
         pthread_mutex_lock(&c->thread->stats.mutex);
         c->thread->stats.bytes_read += res;
+        c->thread->stats.udp_read_calls++;
+        c->thread->stats.udp_read_datagrams++;
         pthread_mutex_unlock(&c->thread->stats.mutex);
-
-        /* Beginning of UDP packet is the request ID; save it. */
-        c->request_id = buf[0] * 256 + buf[1];
-
-        /* If this is a multi-packet request, drop it. */
-        if (buf[4] != 0 || buf[5] != 1) {
-            return READ_NO_DATA_RECEIVED;
-        }
-
-        /* Don't care about any of the rest of the header. */
-        res -= 8;
-        memmove(c->rbuf, c->rbuf + 8, res);
-
-        c->rbytes = res;
-        c->rcurr = c->rbuf;
+    }
+    if (udp_take_request(c, c->rbuf, res)) {
         return READ_DATA_RECEIVED;
     }
     return READ_NO_DATA_RECEIVED;
@@ -2508,6 +2941,10 @@ static enum try_read_result try_read_network(conn *c) {
 static bool update_event(conn *c, const int new_flags) {
     assert(c != NULL);
 
+#ifdef WORKER_URING
+    if (c->uring != NULL)
+        return uring_conn_update(c, new_flags);
+#endif
     struct event_base *base = c->event.ev_base;
     if (c->ev_flags == new_flags)
         return true;
@@ -2519,6 +2956,27 @@ static bool update_event(conn *c, const int new_flags) {
     return true;
 }
 
+static void accept_new_conns_stats(const bool do_accept) {
+    if (do_accept) {
+        struct timeval maxconns_exited;
+        uint64_t elapsed_us;
+        gettimeofday(&maxconns_exited,NULL);
+        STATS_LOCK();
+        elapsed_us =
+            (maxconns_exited.tv_sec - stats.maxconns_entered.tv_sec) * 1000000
+            + (maxconns_exited.tv_usec - stats.maxconns_entered.tv_usec);
+        stats.time_in_listen_disabled_us += elapsed_us;
+        stats_state.accepting_conns = true;
+        STATS_UNLOCK();
+    } else {
+        STATS_LOCK();
+        stats_state.accepting_conns = false;
+        gettimeofday(&stats.maxconns_entered,NULL);
+        stats.listen_disabled_num++;
+        STATS_UNLOCK();
+    }
+}
+
 /*
  * Sets whether we are listening for new connections or not.
  */
@@ -2540,30 +2998,110 @@ void do_accept_new_conns(const bool do_accept) {
         }
     }
 
-    if (do_accept) {
-        struct timeval maxconns_exited;
-        uint64_t elapsed_us;
-        gettimeofday(&maxconns_exited,NULL);
-        STATS_LOCK();
-        elapsed_us =
-            (maxconns_exited.tv_sec - stats.maxconns_entered.tv_sec) * 1000000
-            + (maxconns_exited.tv_usec - stats.maxconns_entered.tv_usec);
-        stats.time_in_listen_disabled_us += elapsed_us;
-        stats_state.accepting_conns = true;
-        STATS_UNLOCK();
-    } else {
-        STATS_LOCK();
-        stats_state.accepting_conns = false;
-        gettimeofday(&stats.maxconns_entered,NULL);
-        stats.listen_disabled_num++;
-        STATS_UNLOCK();
+    accept_new_conns_stats(do_accept);
+    if (!do_accept) {
         allow_new_conns = false;
         maxconns_handler(-42, 0, 0);
     }
 }
 
+#ifdef LISTEN_REUSEPORT
+static void worker_maxconns_handler(const evutil_socket_t fd, const short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct timeval t = {.tv_sec = 0, .tv_usec = 10000};
+
+    if (fd == -42 || allow_new_conns == false) {
+        /* reschedule in 10ms if we need to keep polling */
+        evtimer_set(&me->maxconns_event, worker_maxconns_handler, me);
+        event_base_set(me->base, &me->maxconns_event);
+        evtimer_add(&me->maxconns_event, &t);
+    } else {
+        evtimer_del(&me->maxconns_event);
+        worker_accept_new_conns(me, true);
+    }
+}
+
+/*
+ * do_accept_new_conns() for a worker's own listeners. Called by the worker
+ * which owns them, which then polls to turn them back on the same way the
+ * main thread does.
+ */
+static void worker_accept_new_conns(LIBEVENT_THREAD *me, const bool do_accept) {
+    conn *next;
+
+    for (next = me->listen_conn; next; next = next->next) {
+        update_event(next, do_accept ? EV_READ | EV_PERSIST : 0);
+        if (listen(next->sfd, do_accept ? settings.backlog : 0) != 0) {
+            perror("listen");
+        }
+    }
+
+    pthread_mutex_lock(&conn_lock);
+    accept_new_conns_stats(do_accept);
+    if (!do_accept) {
+        allow_new_conns = false;
+    }
+    pthread_mutex_unlock(&conn_lock);
+
+    if (!do_accept) {
+        worker_maxconns_handler(-42, 0, me);
+    }
+}
+#endif
+
 #define TRANSMIT_ONE_RESP true
 #define TRANSMIT_ALL_RESP false
+// Adds the unsent part of a response to iovs, stopping short of IOV_MAX.
+static int _transmit_resp_iovs(mc_resp *resp, struct iovec *iovs, int iovused) {
+    if (resp->chunked_data_iov) {
+        // Handle chunked items specially.
+        // They spend much more time in send so we can be a bit wasteful
+        // in rebuilding iovecs for them.
+        item_chunk *ch = (item_chunk *)ITEM_schunk((item *)resp->iov[resp->chunked_data_iov].iov_base);
+        int x;
+        for (x = 0; x < resp->iovcnt; x++) {
+            // This iov is tracking how far we've copied so far.
+            if (x == resp->chunked_data_iov) {
+                int done = resp->chunked_total - resp->iov[x].iov_len;
+                // Start from the len to allow binprot to cut the \r\n
+                int todo = resp->iov[x].iov_len;
+                while (ch && todo > 0 && iovused < IOV_MAX-1) {
+                    int skip = 0;
+                    if (!ch->used) {
+                        ch = ch->next;
+                        continue;
+                    }
+                    // Skip parts we've already sent.
+                    if (done >= ch->used) {
+                        done -= ch->used;
+                        ch = ch->next;
+                        continue;
+                    } else if (done) {
+                        skip = done;
+                        done = 0;
+                    }
+                    iovs[iovused].iov_base = ch->data + skip;
+                    // Stupid binary protocol makes this go negative.
+                    iovs[iovused].iov_len = ch->used - skip > todo ? todo : ch->used - skip;
+                    iovused++;
+                    todo -= ch->used - skip;
+                    ch = ch->next;
+                }
+            } else {
+                iovs[iovused].iov_base = resp->iov[x].iov_base;
+                iovs[iovused].iov_len = resp->iov[x].iov_len;
+                iovused++;
+            }
+            if (iovused >= IOV_MAX-1)
+                break;
+        }
+    } else {
+        memcpy(&iovs[iovused], resp->iov, sizeof(struct iovec)*resp->iovcnt);
+        iovused += resp->iovcnt;
+    }
+    return iovused;
+}
+
 static int _transmit_pre(conn *c, struct iovec *iovs, int iovused, bool one_resp) {
     mc_resp *resp = c->resp_head;
     while (resp && iovused + resp->iovcnt < IOV_MAX-1) {
@@ -2573,52 +3111,7 @@ static int _transmit_pre(conn *c, struct iovec *iovs, int iovused, bool one_resp
             resp = resp->next;
             continue;
         }
-        if (resp->chunked_data_iov) {
-            // Handle chunked items specially.
-            // They spend much more time in send so we can be a bit wasteful
-            // in rebuilding iovecs for them.
-            item_chunk *ch = (item_chunk *)ITEM_schunk((item *)resp->iov[resp->chunked_data_iov].iov_base);
-            int x;
-            for (x = 0; x < resp->iovcnt; x++) {
-                // This iov is tracking how far we've copied so far.
-                if (x == resp->chunked_data_iov) {
-                    int done = resp->chunked_total - resp->iov[x].iov_len;
-                    // Start from the len to allow binprot to cut the \r\n
-                    int todo = resp->iov[x].iov_len;
-                    while (ch && todo > 0 && iovused < IOV_MAX-1) {
-                        int skip = 0;
-                        if (!ch->used) {
-                            ch = ch->next;
-                            continue;
-                        }
-                        // Skip parts we've already sent.
-                        if (done >= ch->used) {
-                            done -= ch->used;
-                            ch = ch->next;
-                            continue;
-                        } else if (done) {
-                            skip = done;
-                            done = 0;
-                        }
-                        iovs[iovused].iov_base = ch->data + skip;
-                        // Stupid binary protocol makes this go negative.
-                        iovs[iovused].iov_len = ch->used - skip > todo ? todo : ch->used - skip;
-                        iovused++;
-                        todo -= ch->used - skip;
-                        ch = ch->next;
-                    }
-                } else {
-                    iovs[iovused].iov_base = resp->iov[x].iov_base;
-                    iovs[iovused].iov_len = resp->iov[x].iov_len;
-                    iovused++;
-                }
-                if (iovused >= IOV_MAX-1)
-                    break;
-            }
-        } else {
-            memcpy(&iovs[iovused], resp->iov, sizeof(struct iovec)*resp->iovcnt);
-            iovused += resp->iovcnt;
-        }
+        iovused = _transmit_resp_iovs(resp, iovs, iovused);
 
         // done looking at first response, walk down the chain.
         resp = resp->next;
@@ -2631,9 +3124,11 @@ static int _transmit_pre(conn *c, struct iovec *iovs, int iovused, bool one_resp
 
 /*
  * Decrements and completes responses based on how much data was transmitted.
- * Takes the connection and current result bytes.
+ * Takes the connection, current result bytes and whether they were sent with
+ * MSG_ZEROCOPY.
  */
-static void _transmit_post(conn *c, ssize_t res) {
+static void _transmit_post(conn *c, ssize_t res, bool zc) {
+    c->sched_deficit -= res;
     // We've written some of the data. Remove the completed
     // responses from the list of pending writes.
     mc_resp *resp = c->resp_head;
@@ -2644,10 +3139,18 @@ static void _transmit_post(conn *c, ssize_t res) {
             continue;
         }
 
+#ifdef ZEROCOPY
+        // some of this response went out in the send we just made.
+        if (zc && res > 0) {
+            resp->zc = true;
+            resp->zc_seq = c->zc_sent - 1;
+        }
+#endif
+
         // fastpath check. all small responses should cut here.
         if (res >= resp->tosend) {
             res -= resp->tosend;
-            resp = resp_finish(c, resp);
+            resp = resp_finish_sent(c, resp);
             continue;
         }
 
@@ -2675,7 +3178,7 @@ static void _transmit_post(conn *c, ssize_t res) {
 
         // are we done with this response object?
         if (resp->tosend == 0) {
-            resp = resp_finish(c, resp);
+            resp = resp_finish_sent(c, resp);
         } else {
             // Jammed up here. This is the new head.
             break;
@@ -2683,6 +3186,88 @@ static void _transmit_post(conn *c, ssize_t res) {
     }
 }
 
+#ifdef ZEROCOPY
+// Large values are worth the page pinning and completion handling of a
+// zerocopy send; small ones are cheaper to copy.
+static bool transmit_zc_wanted(struct iovec *iovs, const int iovused) {
+    for (int x = 0; x < iovused; x++) {
+        if (iovs[x].iov_len >= (size_t)settings.zerocopy_min) {
+            return true;
+        }
+    }
+    return false;
+}
+#endif
+
+#ifdef WORKER_URING
+/*
+ * Queues the next chunk of data as a sendmsg on the thread's io_uring. The
+ * connection stops until the send completes; conn_uring_sent() then picks up
+ * where transmit() would have.
+ */
+static enum transmit_result transmit_uring(conn *c) {
+    struct iovec iovs[IOV_MAX];
+    int iovused = 0;
+
+    if (uring_conn_sending(c))
+        return TRANSMIT_SOFT_ERROR;
+
+    iovused = _transmit_pre(c, iovs, iovused, TRANSMIT_ALL_RESP);
+    if (iovused == 0) {
+        _transmit_post(c, 0, false);
+        return TRANSMIT_COMPLETE;
+    }
+#ifdef ZEROCOPY
+    // sends on the ring are always copied.
+    if (settings.zerocopy_min && transmit_zc_wanted(iovs, iovused)) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.zerocopy_fallbacks++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+#endif
+
+    if (uring_conn_sendmsg(c, iovs, iovused) != 0) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't queue a send\n");
+        conn_set_state(c, conn_closing);
+        return TRANSMIT_HARD_ERROR;
+    }
+    return TRANSMIT_SOFT_ERROR;
+}
+
+/* Called with the result of a send queued by transmit_uring(). The caller
+ * drives the connection on from here. */
+void conn_uring_sent(conn *c, const int res) {
+    if (res >= 0) {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.bytes_written += res;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+
+        _transmit_post(c, res, false);
+    } else if (res != -EAGAIN && res != -EINTR) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Failed to write: %s\n", strerror(-res));
+        conn_set_state(c, conn_closing);
+    }
+}
+#endif
+
+// With -o sched_quantum, don't send more than the connection has budget
+// left for, so one large response can't hold up the worker for long.
+static int transmit_sched_trim(conn *c, struct iovec *iovs, int iovused) {
+    if (!settings.sched_quantum || c->sched_deficit <= 0)
+        return iovused;
+    size_t left = c->sched_deficit;
+    for (int x = 0; x < iovused; x++) {
+        if (iovs[x].iov_len >= left) {
+            iovs[x].iov_len = left;
+            return x + 1;
+        }
+        left -= iovs[x].iov_len;
+    }
+    return iovused;
+}
+
 /*
  * Transmit the next chunk of data from our list of msgbuf structures.
  *
@@ -2698,6 +3283,11 @@ static enum transmit_result transmit(conn *c) {
     struct msghdr msg;
     int iovused = 0;
 
+#ifdef WORKER_URING
+    if (c->uring != NULL)
+        return transmit_uring(c);
+#endif
+
     // init the msg.
     memset(&msg, 0, sizeof(struct msghdr));
     msg.msg_iov = iovs;
@@ -2706,21 +3296,54 @@ static enum transmit_result transmit(conn *c) {
     if (iovused == 0) {
         // Avoid the syscall if we're only handling a noreply.
         // Return the response object.
-        _transmit_post(c, 0);
+        _transmit_post(c, 0, false);
         return TRANSMIT_COMPLETE;
     }
+    iovused = transmit_sched_trim(c, iovs, iovused);
 
     // Alright, send.
     ssize_t res;
+    int flags = 0;
     msg.msg_iovlen = iovused;
-    res = c->sendmsg(c, &msg, 0);
+#ifdef ZEROCOPY
+    bool zc_fallback = false;
+    if (settings.zerocopy_min && transmit_zc_wanted(iovs, iovused)) {
+        if (c->zerocopy) {
+            flags = MSG_ZEROCOPY;
+        } else {
+            zc_fallback = true;
+        }
+    }
+#endif
+    res = c->sendmsg(c, &msg, flags);
+#ifdef ZEROCOPY
+    if (res == -1 && errno == ENOBUFS && flags) {
+        // too many pages pinned by sends in flight; copy this one.
+        flags = 0;
+        zc_fallback = true;
+        res = c->sendmsg(c, &msg, 0);
+    }
+#endif
     if (res >= 0) {
         pthread_mutex_lock(&c->thread->stats.mutex);
         c->thread->stats.bytes_written += res;
+#ifdef ZEROCOPY
+        if (flags) {
+            c->thread->stats.zerocopy_sends++;
+        } else if (zc_fallback) {
+            c->thread->stats.zerocopy_fallbacks++;
+        }
+#endif
         pthread_mutex_unlock(&c->thread->stats.mutex);
 
+#ifdef ZEROCOPY
+        if (flags) {
+            c->zc_sent++;
+            c->zc_pending++;
+        }
+#endif
         // Decrement any partial IOV's and complete any finished resp's.
-        _transmit_post(c, res);
+        _transmit_post(c, res, flags != 0);
 
         if (c->resp_head) {
             return TRANSMIT_INCOMPLETE;
@@ -2730,7 +3353,14 @@ static enum transmit_result transmit(conn *c) {
     }
 
     if (res == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
-        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+        int wait = EV_WRITE;
+#ifdef SHM_TRANSPORT
+        // shm clients ring the socket once there's room in the ring.
+        if (c->shm) {
+            wait = EV_READ;
+        }
+#endif
+        if (!update_event(c, wait | EV_PERSIST)) {
             if (settings.verbose > 0)
                 fprintf(stderr, "Couldn't update event\n");
             conn_set_state(c, conn_closing);
@@ -2777,10 +3407,214 @@ static void build_udp_header(unsigned char *hdr, mc_resp *resp) {
     resp->udp_sequence++;
 }
 
+#ifdef UDP_BATCH
+#ifdef UDP_SEGMENT
+// frames of one response the kernel can split up from a single send: GSO
+// allows 64 segments of at most 64k in total.
+#define UDP_GSO_FRAMES (65507 / UDP_MAX_PAYLOAD_SIZE)
+// set if the kernel or the interface can't segment UDP for us.
+static bool udp_gso_failed = false;
+#endif
+// frame headers built per call.
+#define UDP_BATCH_FRAMES 256
+
+/*
+ * Sends the frames of as many responses as fit with a single sendmmsg().
+ * Responses may be for different clients, so each gets its own messages.
+ * Where the kernel supports UDP_SEGMENT all of a response's frames go in one
+ * message that's split up into full sized datagrams, otherwise it's one
+ * message per frame.
+ *
+ * Frames are only built as far as the responses can be sent in order, since
+ * _transmit_post() counts off the bytes sent from the head of the list.
+ */
+static enum transmit_result transmit_udp_batch(conn *c) {
+    struct iovec data[IOV_MAX];
+    struct iovec iovs[IOV_MAX];
+    struct mmsghdr msgs[UDP_BATCH_MAX];
+    mc_resp *msg_resp[UDP_BATCH_MAX];
+    uint16_t msg_seq[UDP_BATCH_MAX];
+    int msg_frames[UDP_BATCH_MAX];
+    unsigned char hdrs[UDP_BATCH_FRAMES][UDP_HEADER_SIZE];
+#ifdef UDP_SEGMENT
+    union {
+        char buf[CMSG_SPACE(sizeof(uint16_t))];
+        size_t align; /* for the cmsghdr */
+    } ctl[UDP_BATCH_MAX];
+    bool gso = !__atomic_load_n(&udp_gso_failed, __ATOMIC_RELAXED);
+    bool gso_used = false;
+#endif
+    int nmsg = 0, iovused = 0, frames = 0;
+    bool full = false;
+    mc_resp *resp;
+
+    while (c->resp_head && c->resp_head->skip) {
+        resp_finish(c, c->resp_head);
+    }
+    if (!c->resp_head) {
+        return TRANSMIT_COMPLETE;
+    }
+
+    for (resp = c->resp_head; resp != NULL && !full; resp = resp->next) {
+        if (resp->skip) {
+            continue;
+        }
+        int dn = _transmit_resp_iovs(resp, data, 0);
+        int di = 0;
+        size_t doff = 0;
+        int queued = 0;
+        struct mmsghdr *m = NULL;
+
+        while (di < dn) {
+            if (m == NULL
+#ifdef UDP_SEGMENT
+                    || !gso || msg_frames[nmsg-1] == UDP_GSO_FRAMES
+#endif
+                    ) {
+                if (nmsg == settings.udp_batch) {
+                    full = true;
+                    break;
+                }
+                m = &msgs[nmsg];
+                memset(m, 0, sizeof(*m));
+                m->msg_hdr.msg_name = &resp->request_addr;
+                m->msg_hdr.msg_namelen = resp->request_addr_size;
+                m->msg_hdr.msg_iov = &iovs[iovused];
+                msg_resp[nmsg] = resp;
+                msg_seq[nmsg] = resp->udp_sequence;
+                msg_frames[nmsg] = 0;
+                nmsg++;
+            }
+            if (frames == UDP_BATCH_FRAMES || iovused + 2 > IOV_MAX) {
+                full = true;
+                break;
+            }
+
+            // a frame is a header, then up to UDP_DATA_SIZE of the response.
+            build_udp_header(hdrs[frames], resp);
+            iovs[iovused].iov_base = hdrs[frames];
+            iovs[iovused].iov_len = UDP_HEADER_SIZE;
+            iovused++;
+            frames++;
+            size_t room = UDP_DATA_SIZE;
+            while (room && di < dn && iovused < IOV_MAX) {
+                size_t len = data[di].iov_len - doff;
+                if (len > room)
+                    len = room;
+                if (len) {
+                    iovs[iovused].iov_base = (char *)data[di].iov_base + doff;
+                    iovs[iovused].iov_len = len;
+                    iovused++;
+                    room -= len;
+                    doff += len;
+                    queued += len;
+                }
+                if (doff == data[di].iov_len) {
+                    di++;
+                    doff = 0;
+                }
+            }
+            m->msg_hdr.msg_iovlen = &iovs[iovused] - m->msg_hdr.msg_iov;
+            msg_frames[nmsg-1]++;
+            // a short frame has to be the last one of its message.
+            if (room && di < dn) {
+                full = true;
+                break;
+            }
+        }
+        // the next response can't go out until all of this one has.
+        if (queued < resp->tosend) {
+            break;
+        }
+    }
+
+    // drop a message we started but couldn't put a frame in.
+    if (nmsg && msg_frames[nmsg-1] == 0) {
+        nmsg--;
+    }
+    if (nmsg == 0) {
+        // nothing but empty responses.
+        _transmit_post(c, 0, false);
+        return c->resp_head ? TRANSMIT_INCOMPLETE : TRANSMIT_COMPLETE;
+    }
+
+#ifdef UDP_SEGMENT
+    for (int x = 0; x < nmsg; x++) {
+        if (msg_frames[x] > 1) {
+            struct msghdr *h = &msgs[x].msg_hdr;
+            uint16_t segment = UDP_MAX_PAYLOAD_SIZE;
+            h->msg_control = ctl[x].buf;
+            h->msg_controllen = sizeof(ctl[x].buf);
+            struct cmsghdr *cm = CMSG_FIRSTHDR(h);
+            cm->cmsg_level = SOL_UDP;
+            cm->cmsg_type = UDP_SEGMENT;
+            cm->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+            memcpy(CMSG_DATA(cm), &segment, sizeof(segment));
+            gso_used = true;
+        }
+    }
+#endif
+
+    int sent = sendmmsg(c->sfd, msgs, nmsg, 0);
+    // headers for frames that didn't go out get built again next time.
+    for (int x = nmsg - 1; x >= (sent > 0 ? sent : 0); x--) {
+        msg_resp[x]->udp_sequence = msg_seq[x];
+    }
+
+    if (sent > 0) {
+        ssize_t res = 0;
+        int sent_frames = 0;
+        for (int x = 0; x < sent; x++) {
+            res += msgs[x].msg_len;
+            sent_frames += msg_frames[x];
+        }
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.bytes_written += res;
+        c->thread->stats.udp_write_calls++;
+        c->thread->stats.udp_write_datagrams += sent_frames;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+
+        // Ignore the header size from forwarding the IOV's
+        _transmit_post(c, res - sent_frames * UDP_HEADER_SIZE, false);
+
+        if (c->resp_head) {
+            return TRANSMIT_INCOMPLETE;
+        } else {
+            return TRANSMIT_COMPLETE;
+        }
+    }
+
+#ifdef UDP_SEGMENT
+    if (gso_used && (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT)) {
+        // send one frame per message from now on.
+        if (settings.verbose > 0)
+            perror("UDP segmentation offload failed");
+        __atomic_store_n(&udp_gso_failed, true, __ATOMIC_RELAXED);
+        return TRANSMIT_INCOMPLETE;
+    }
+#endif
+
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+            if (settings.verbose > 0)
+                fprintf(stderr, "Couldn't update event\n");
+            conn_set_state(c, conn_closing);
+            return TRANSMIT_HARD_ERROR;
+        }
+        return TRANSMIT_SOFT_ERROR;
+    }
+    if (settings.verbose > 0)
+        perror("Failed to write, and not due to blocking");
+
+    conn_set_state(c, conn_read);
+    return TRANSMIT_HARD_ERROR;
+}
+#endif
+
 /*
  * UDP specific transmit function. Uses its own function rather than check
- * IS_UDP() five times. If we ever implement sendmmsg or similar support they
- * will diverge even more.
+ * IS_UDP() five times. With batching the frames go out through
+ * transmit_udp_batch() instead.
  * Does not use TLS.
  *
  * Returns:
@@ -2797,6 +3631,12 @@ static enum transmit_result transmit_udp(conn *c) {
     int iovused = 0;
     unsigned char udp_hdr[UDP_HEADER_SIZE];
 
+#ifdef UDP_BATCH
+    if (c->udp_batch != NULL) {
+        return transmit_udp_batch(c);
+    }
+#endif
+
     // We only send one UDP packet per call (ugh), so we can only operate on a
     // single response at a time.
     resp = c->resp_head;
@@ -2853,13 +3693,15 @@ static enum transmit_result transmit_udp(conn *c) {
     if (res >= 0) {
         pthread_mutex_lock(&c->thread->stats.mutex);
         c->thread->stats.bytes_written += res;
+        c->thread->stats.udp_write_calls++;
+        c->thread->stats.udp_write_datagrams++;
         pthread_mutex_unlock(&c->thread->stats.mutex);
 
         // Ignore the header size from forwarding the IOV's
         res -= UDP_HEADER_SIZE;
 
         // Decrement any partial IOV's and complete any finished resp's.
-        _transmit_post(c, res);
+        _transmit_post(c, res, false);
 
         if (c->resp_head) {
             return TRANSMIT_INCOMPLETE;
@@ -2970,6 +3812,78 @@ static int read_into_chunked_item(conn *c) {
     return total;
 }
 
+/*
+ * Fair scheduling between the connections on a worker (-o sched_quantum).
+ *
+ * This is deficit round robin: every time a connection is driven it gets its
+ * priority class's quantum of bytes, which parsing requests and transmitting
+ * responses use up. Once it's spent the connection yields, as it does after
+ * reqs_per_event requests, and any overspend from a large response is paid
+ * back by skipping turns. Unused budget isn't saved up past one quantum.
+ */
+static const int sched_class_weight[SCHED_CLASSES] = { 1, 4, 16 };
+
+static bool sched_turn_start(conn *c) {
+    int64_t q = (int64_t)settings.sched_quantum * sched_class_weight[c->sched_class] / 4;
+    c->sched_deficit += q;
+    if (c->sched_deficit > q)
+        c->sched_deficit = q;
+    if (c->sched_deficit > 0 || c->state == conn_closing || c->state == conn_watch)
+        return true;
+
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.sched_skips++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    // a write event always comes back around, whatever we were waiting on.
+    if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+        if (settings.verbose > 0)
+            fprintf(stderr, "Couldn't update event\n");
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+    return false;
+}
+
+static uint64_t sched_now_us(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+static void sched_turn_end(LIBEVENT_THREAD *t, uint64_t start) {
+    uint64_t us = sched_now_us() - start;
+    int b = 0;
+    while (us && b < SCHED_TURN_BUCKETS - 1) {
+        us >>= 1;
+        b++;
+    }
+    pthread_mutex_lock(&t->stats.mutex);
+    t->stats.sched_turn_us[b]++;
+    pthread_mutex_unlock(&t->stats.mutex);
+}
+
+static void sched_count_yield(conn *c) {
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.sched_yields++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+}
+
+static void conn_count_yield(conn *c, const int nreqs) {
+    if (nreqs >= 0) {
+        sched_count_yield(c);
+    } else {
+        pthread_mutex_lock(&c->thread->stats.mutex);
+        c->thread->stats.conn_yields++;
+        pthread_mutex_unlock(&c->thread->stats.mutex);
+    }
+}
+
 static void drive_machine(conn *c) {
     bool stop = false;
     int sfd;
@@ -2986,6 +3900,18 @@ static void drive_machine(conn *c) {
 
     assert(c != NULL);
 
+    // UDP shares one conn per thread and listeners don't parse anything.
+    LIBEVENT_THREAD *t = c->thread;
+    bool sched = settings.sched_quantum && t != NULL
+        && !IS_UDP(c->transport) && c->state != conn_listening;
+    uint64_t turn_start = 0;
+    if (sched && !sched_turn_start(c)) {
+        return;
+    }
+    if (settings.sched_stats && t != NULL && c->state != conn_listening) {
+        turn_start = sched_now_us();
+    }
+
     while (!stop) {
 
         switch(c->state) {
@@ -3012,6 +3938,11 @@ static void drive_machine(conn *c) {
                 } else if (errno == EMFILE) {
                     if (settings.verbose > 0)
                         fprintf(stderr, "Too many open connections\n");
+#ifdef LISTEN_REUSEPORT
+                    if (c->thread != NULL) {
+                        worker_accept_new_conns(c->thread, false);
+                    } else
+#endif
                     accept_new_conns(false);
                     stop = true;
                 } else {
@@ -3088,6 +4019,12 @@ static void drive_machine(conn *c) {
                 ssl_v = (void*) ssl;
 #endif
 
+#ifdef LISTEN_REUSEPORT
+                // only listeners owned by a worker have a thread.
+                if (c->thread != NULL) {
+                    dispatch_conn_local(c->thread, sfd, c->transport, ssl_v, c->tag, c->protocol);
+                } else
+#endif
                 dispatch_conn_new(sfd, conn_new_cmd, EV_READ | EV_PERSIST,
                                      READ_BUFFER_CACHED, c->transport, ssl_v, c->tag, c->protocol);
             }
@@ -3097,6 +4034,13 @@ static void drive_machine(conn *c) {
 
         case conn_waiting:
             rbuf_release(c);
+#ifdef SHM_TRANSPORT
+            // requests in the ring don't make the socket readable.
+            if (c->shm && !shm_wait(c)) {
+                conn_set_state(c, conn_read);
+                break;
+            }
+#endif
             if (!update_event(c, EV_READ | EV_PERSIST)) {
                 if (settings.verbose > 0)
                     fprintf(stderr, "Couldn't update event\n");
@@ -3140,15 +4084,22 @@ static void drive_machine(conn *c) {
 
         case conn_parse_cmd:
             c->noreply = false;
+            res = c->rbytes;
             if (c->try_read_command(c) == 0) {
                 /* we need more data! */
-                if (c->resp_head) {
+                if (udp_read_pending(c)) {
+                    // on to the next datagram, as in reset_cmd_handler().
+                    conn_set_state(c, conn_read);
+                } else if (c->resp_head) {
                     // Buffered responses waiting, flush in the meantime.
                     conn_set_state(c, conn_mwrite);
                 } else {
                     conn_set_state(c, conn_waiting);
                 }
             }
+            if (res > c->rbytes) {
+                c->sched_deficit -= res - c->rbytes;
+            }
 
             break;
 
@@ -3157,16 +4108,27 @@ static void drive_machine(conn *c) {
                connections */
 
             --nreqs;
-            if (nreqs >= 0) {
+            if (nreqs >= 0 && !(sched && c->sched_deficit <= 0)) {
                 reset_cmd_handler(c);
             } else if (c->resp_head) {
                 // flush response pipe on yield.
+#ifdef WORKER_URING
+                // the send completes on a later pass, which starts over
+                // with a fresh budget, so the yield is counted here.
+                if (c->uring != NULL) {
+                    conn_count_yield(c, nreqs);
+                }
+#endif
                 conn_set_state(c, conn_mwrite);
             } else {
-                pthread_mutex_lock(&c->thread->stats.mutex);
-                c->thread->stats.conn_yields++;
-                pthread_mutex_unlock(&c->thread->stats.mutex);
-                if (c->rbytes > 0) {
+                conn_count_yield(c, nreqs);
+                bool pending = c->rbytes > 0 || udp_read_pending(c);
+#ifdef SHM_TRANSPORT
+                if (c->shm && !shm_wait(c)) {
+                    pending = true;
+                }
+#endif
+                if (pending) {
                     /* We have already read in data into the input buffer,
                        so libevent will most likely not signal read events
                        on the socket (unless more data is available. As a
@@ -3208,6 +4170,7 @@ static void drive_machine(conn *c) {
                     c->rlbytes -= tocopy;
                     c->rcurr += tocopy;
                     c->rbytes -= tocopy;
+                    c->sched_deficit -= tocopy;
                     if (c->rlbytes == 0) {
                         break;
                     }
@@ -3224,12 +4187,23 @@ static void drive_machine(conn *c) {
                     }
                     c->ritem += res;
                     c->rlbytes -= res;
+                    c->sched_deficit -= res;
+                    if (sched && c->sched_deficit <= 0 && c->rlbytes > 0) {
+                        sched_count_yield(c);
+                        stop = true;
+                    }
                     break;
                 }
             } else {
                 res = read_into_chunked_item(c);
-                if (res > 0)
+                if (res > 0) {
+                    c->sched_deficit -= res;
+                    if (sched && c->sched_deficit <= 0 && c->rlbytes > 0) {
+                        sched_count_yield(c);
+                        stop = true;
+                    }
                     break;
+                }
             }
 
             if (res == 0) { /* end of stream */
@@ -3321,6 +4295,14 @@ static void drive_machine(conn *c) {
 
         case conn_write:
         case conn_mwrite:
+            /* with more datagrams from the last batch still to answer, go
+             * read those first so all the responses go out together. Counts
+             * against the per-event request limit like conn_new_cmd does.
+             */
+            if (udp_read_pending(c) && --nreqs >= 0) {
+                conn_set_state(c, conn_read);
+                break;
+            }
             /* have side IO's that must process before transmit() can run.
              * remove the connection from the worker thread and dispatch the
              * IO queue
@@ -3337,6 +4319,10 @@ static void drive_machine(conn *c) {
             if (c->io_queues_submitted != 0) {
                 conn_set_state(c, conn_io_queue);
                 event_del(&c->event);
+#ifdef WORKER_URING
+                if (c->uring != NULL)
+                    uring_conn_update(c, 0);
+#endif
 
                 stop = true;
                 break;
@@ -3359,6 +4345,18 @@ static void drive_machine(conn *c) {
                 break;
 
             case TRANSMIT_INCOMPLETE:
+                if (sched && c->sched_deficit <= 0) {
+                    // out of budget; the rest goes out on a later turn.
+                    if (!update_event(c, EV_WRITE | EV_PERSIST)) {
+                        if (settings.verbose > 0)
+                            fprintf(stderr, "Couldn't update event\n");
+                        conn_set_state(c, conn_closing);
+                        break;
+                    }
+                    sched_count_yield(c);
+                    stop = true;
+                }
+                break;
             case TRANSMIT_HARD_ERROR:
                 break;                   /* Continue in state machine. */
 
@@ -3369,11 +4367,14 @@ static void drive_machine(conn *c) {
             break;
 
         case conn_closing:
-            if (IS_UDP(c->transport))
+            if (IS_UDP(c->transport)) {
                 conn_cleanup(c);
-            else
+                // carry on with any datagrams already read.
+                stop = !udp_read_pending(c);
+            } else {
                 conn_close(c);
-            stop = true;
+                stop = true;
+            }
             break;
 
         case conn_closed:
@@ -3383,6 +4384,9 @@ static void drive_machine(conn *c) {
 
         case conn_watch:
             /* We handed off our connection to the logger thread. */
+#ifdef WORKER_URING
+            uring_conn_detach(c);
+#endif
             stop = true;
             break;
         case conn_io_queue:
@@ -3395,6 +4399,9 @@ static void drive_machine(conn *c) {
         }
     }
 
+    if (turn_start) {
+        sched_turn_end(t, turn_start);
+    }
     return;
 }
 
@@ -3405,6 +4412,8 @@ void event_handler(const evutil_socket_t fd, const short which, void *arg) {
     assert(c != NULL);
 
     c->which = which;
+    if (c->thread)
+        c->thread->loop_events++;
 
     /* sanity */
     if (fd != c->sfd) {
@@ -3414,6 +4423,12 @@ void event_handler(const evutil_socket_t fd, const short which, void *arg) {
         return;
     }
 
+#ifdef ZEROCOPY
+    // zerocopy completions wake the socket up with an error queue event.
+    if (c->zc_pending)
+        conn_zc_reap(c);
+#endif
+
     drive_machine(c);
 
     /* wait for next event */
@@ -3476,6 +4491,127 @@ static void maximize_sndbuf(const int sfd) {
         fprintf(stderr, "<%d send buffer was %d, now %d\n", sfd, old_size, last_good);
 }
 
+/*
+ * Sets the options for a new listening socket. Returns nonzero if the
+ * socket can't be used.
+ */
+static int server_socket_opts(int sfd, struct addrinfo *ai,
+                              enum network_transport transport) {
+    struct linger ling = {0, 0};
+    int flags = 1;
+    int error;
+
+#ifdef IPV6_V6ONLY
+    if (ai->ai_family == AF_INET6) {
+        error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
+        if (error != 0) {
+            perror("setsockopt");
+            return 1;
+        }
+    }
+#endif
+#ifdef SOCK_COOKIE_ID
+    if (settings.sock_cookie_id != 0) {
+        error = setsockopt(sfd, SOL_SOCKET, SOCK_COOKIE_ID, (void *)&settings.sock_cookie_id, sizeof(uint32_t));
+        if (error != 0)
+            perror("setsockopt");
+    }
+#endif
+
+    setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
+    if (IS_UDP(transport)) {
+        maximize_sndbuf(sfd);
+    } else {
+        error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
+        if (error != 0)
+            perror("setsockopt");
+
+        error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
+        if (error != 0)
+            perror("setsockopt");
+
+        error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
+        if (error != 0)
+            perror("setsockopt");
+    }
+
+#ifdef LISTEN_REUSEPORT
+    if (settings.reuseport) {
+        error = setsockopt(sfd, SOL_SOCKET, LISTEN_REUSEPORT, (void *)&flags, sizeof(flags));
+        if (error != 0) {
+            perror("setsockopt");
+            return 1;
+        }
+    }
+#endif
+    return 0;
+}
+
+#ifdef LISTEN_REUSEPORT
+/*
+ * With -o reuseport each worker thread gets its own listening socket for an
+ * address, and the kernel spreads new connections over them. The first one
+ * is already bound; the rest are bound to the port it got, in case that was
+ * picked by the kernel.
+ */
+static void server_socket_reuseport(int sfd, struct addrinfo *ai,
+                                    enum network_transport transport,
+                                    bool ssl_enabled, uint64_t conntag,
+                                    enum protocol bproto) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(sfd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("getsockname()");
+        exit(EXIT_FAILURE);
+    }
+    dispatch_listen_conn(0, sfd, transport, ssl_enabled, conntag, bproto);
+
+    for (int tid = 1; tid < settings.num_threads; tid++) {
+        int tsfd = new_socket(ai);
+        if (tsfd == -1 || server_socket_opts(tsfd, ai, transport) != 0) {
+            perror("server_socket");
+            exit(EX_OSERR);
+        }
+        if (bind(tsfd, (struct sockaddr *)&addr, len) == -1) {
+            perror("bind()");
+            exit(EXIT_FAILURE);
+        }
+        if (listen(tsfd, settings.backlog) == -1) {
+            perror("listen()");
+            exit(EXIT_FAILURE);
+        }
+        dispatch_listen_conn(tid, tsfd, transport, ssl_enabled, conntag, bproto);
+    }
+}
+
+/*
+ * UDP threads get a socket each, bound to the same address as the first,
+ * rather than a dup() of it. The kernel then spreads datagrams over them by
+ * flow instead of every thread reading from one socket's queue.
+ */
+static int server_socket_udp_reuseport(int sfd, struct addrinfo *ai,
+                                       enum network_transport transport) {
+    struct sockaddr_storage addr;
+    socklen_t len = sizeof(addr);
+
+    if (getsockname(sfd, (struct sockaddr *)&addr, &len) != 0) {
+        perror("getsockname()");
+        exit(EXIT_FAILURE);
+    }
+    int tsfd = new_socket(ai);
+    if (tsfd == -1 || server_socket_opts(tsfd, ai, transport) != 0) {
+        perror("server_socket");
+        exit(EX_OSERR);
+    }
+    if (bind(tsfd, (struct sockaddr *)&addr, len) == -1) {
+        perror("bind()");
+        exit(EXIT_FAILURE);
+    }
+    return tsfd;
+}
+#endif
+
 /**
  * Create a socket and bind it to a specific port number
  * @param interface the interface to bind to
@@ -3492,7 +4628,6 @@ static int server_socket(const char *interface,
                          uint64_t conntag,
                          enum protocol bproto) {
     int sfd;
-    struct linger ling = {0, 0};
     struct addrinfo *ai;
     struct addrinfo *next;
     struct addrinfo hints = { .ai_flags = AI_PASSIVE,
@@ -3500,7 +4635,6 @@ static int server_socket(const char *interface,
     char port_buf[NI_MAXSERV];
     int error;
     int success = 0;
-    int flags =1;
 
     hints.ai_socktype = IS_UDP(transport) ? SOCK_DGRAM : SOCK_STREAM;
 
@@ -3541,39 +4675,9 @@ static int server_socket(const char *interface,
             }
         }
 
-#ifdef IPV6_V6ONLY
-        if (next->ai_family == AF_INET6) {
-            error = setsockopt(sfd, IPPROTO_IPV6, IPV6_V6ONLY, (char *) &flags, sizeof(flags));
-            if (error != 0) {
-                perror("setsockopt");
-                close(sfd);
-                continue;
-            }
-        }
-#endif
-#ifdef SOCK_COOKIE_ID
-        if (settings.sock_cookie_id != 0) {
-            error = setsockopt(sfd, SOL_SOCKET, SOCK_COOKIE_ID, (void *)&settings.sock_cookie_id, sizeof(uint32_t));
-            if (error != 0)
-                perror("setsockopt");
-        }
-#endif
-
-        setsockopt(sfd, SOL_SOCKET, SO_REUSEADDR, (void *)&flags, sizeof(flags));
-        if (IS_UDP(transport)) {
-            maximize_sndbuf(sfd);
-        } else {
-            error = setsockopt(sfd, SOL_SOCKET, SO_KEEPALIVE, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
-
-            error = setsockopt(sfd, SOL_SOCKET, SO_LINGER, (void *)&ling, sizeof(ling));
-            if (error != 0)
-                perror("setsockopt");
-
-            error = setsockopt(sfd, IPPROTO_TCP, TCP_NODELAY, (void *)&flags, sizeof(flags));
-            if (error != 0)
-                perror("setsockopt");
+        if (server_socket_opts(sfd, next, transport) != 0) {
+            close(sfd);
+            continue;
         }
 
         if (bind(sfd, next->ai_addr, next->ai_addrlen) == -1) {
@@ -3630,6 +4734,10 @@ static int server_socket(const char *interface,
                 int per_thread_fd;
                 if (c == 0) {
                     per_thread_fd = sfd;
+#ifdef LISTEN_REUSEPORT
+                } else if (settings.reuseport) {
+                    per_thread_fd = server_socket_udp_reuseport(sfd, next, transport);
+#endif
                 } else {
                     per_thread_fd = dup(sfd);
                     if (per_thread_fd < 0) {
@@ -3642,6 +4750,12 @@ static int server_socket(const char *interface,
                                   UDP_READ_BUFFER_SIZE, transport, NULL, conntag, bproto);
             }
         } else {
+#ifdef LISTEN_REUSEPORT
+            if (settings.reuseport) {
+                server_socket_reuseport(sfd, next, transport, ssl_enabled, conntag, bproto);
+                continue;
+            }
+#endif
             if (!(listen_conn_add = conn_new(sfd, conn_listening,
                                              EV_READ | EV_PERSIST, 1,
                                              transport, main_base, NULL, conntag, bproto))) {
@@ -4063,7 +5177,9 @@ static void usage(void) {
            "                          user:pass\\nuser2:pass2\\n\n");
     printf("-e, --memory-file=<file>  (EXPERIMENTAL) mmap a file for item memory.\n"
            "                          use only in ram disks or persistent memory mounts!\n"
-           "                          enables restartable cache (stop with SIGUSR1)\n");
+           "                          enables restartable cache (stop with SIGUSR1)\n"
+           "                          the hash table is kept alongside in <file>.hash\n"
+           "                          recovery is spread over -o restart_threads\n");
 #ifdef TLS
     printf("-Z, --enable-ssl          enable TLS/SSL\n");
 #endif
@@ -4073,18 +5189,34 @@ static void usage(void) {
            "   - hashpower:           an integer multiplier for how large the hash\n"
            "                          table should be. normally grows at runtime. (default starts at: %d)\n"
            "                          set based on \"STAT hash_power_level\"\n"
+           "   - hash_expand_threads: number of threads moving buckets while the hash\n"
+           "                          table is resized. (default: %d)\n"
+           "   - hash_shrink:         shrink the hash table when it is mostly empty.\n"
+           "                          never shrinks below its starting size.\n"
+           "   - restart_threads:     number of threads recovering items from a\n"
+           "                          memory file after a restart. (default: %d)\n"
+           "   - lockfree_get:        serve gets of small, hot items without taking\n"
+           "                          item locks or references. (default: %s)\n"
            "   - tail_repair_time:    time in seconds for how long to wait before\n"
            "                          forcefully killing LRU tail item.\n"
            "                          disabled by default; very dangerous option.\n"
            "   - hash_algorithm:      the hash table algorithm\n"
            "                          default is murmur3 hash. options: jenkins, murmur3, xxh3\n"
+           "   - hash_index:          layout of the hash table. options: chained, bucketed\n"
+           "                          bucketed uses more memory but fewer cache misses\n"
+           "                          per lookup. (default: chained)\n"
            "   - no_lru_crawler:      disable LRU Crawler background thread.\n"
            "   - lru_crawler_sleep:   microseconds to sleep between items\n"
            "                          default is %d.\n"
            "   - lru_crawler_tocrawl: max items to crawl per slab per run\n"
-           "                          default is %u (unlimited)\n",
+           "                          default is %u (unlimited)\n"
+           "   - lru_crawler_threads: number of threads a crawl is split over, by slab\n"
+           "                          class or hash table slice. (default: %d)\n",
            flag_enabled_disabled(settings.maxconns_fast), settings.hashpower_init,
-           settings.lru_crawler_sleep, settings.lru_crawler_tocrawl);
+           settings.hash_expand_threads, settings.restart_threads,
+           flag_enabled_disabled(settings.lockfree_get),
+           settings.lru_crawler_sleep, settings.lru_crawler_tocrawl,
+           settings.lru_crawler_threads);
     printf("   - read_buf_mem_limit:  limit in megabytes for connection read/response buffers.\n"
            "                          do not adjust unless you have high (20k+) conn. limits.\n"
            "                          0 means unlimited (default: %u)\n",
@@ -4097,6 +5229,18 @@ static void usage(void) {
            "                          (requires lru_maintainer, default pct: %d)\n"
            "   - hot_max_factor:      items idle > cold lru age * drop from hot lru. (default: %.2f)\n"
            "   - warm_max_factor:     items idle > cold lru age * this drop from warm. (default: %.2f)\n"
+           "   - lru_policy:          eviction policy. options: segmented, tinylfu\n"
+           "                          tinylfu only lets items out of hot lru when their\n"
+           "                          keys are fetched more than what they'd displace.\n"
+           "                          (requires lru_maintainer, default: segmented)\n"
+           "   - lru_clock:           fetches only mark items instead of moving them between\n"
+           "                          LRU's. marked items at the tail of cold lru get a\n"
+           "                          second chance. (requires lru_maintainer)\n"
+           "   - expiry_wheel:        index items by expiry time, so the lru maintainer\n"
+           "                          reclaims them when they expire rather than waiting\n"
+           "                          for the lru crawler. (requires lru_maintainer)\n"
+           "   - snapshot_load:       load a snapshot written by \"lru_crawler export\"\n"
+           "                          before accepting connections.\n"
            "   - temporary_ttl:       TTL's below get separate LRU, can't be evicted.\n"
            "                          (requires lru_maintainer, default: %d)\n"
            "   - idle_timeout:        timeout for idle connections. (default: %d, no timeout)\n",
@@ -4107,15 +5251,28 @@ static void usage(void) {
            "   - worker_logbuf_size:  size in kilobytes of per-worker-thread buffer\n"
            "                          read by background thread, then written to watchers. (default: %u)\n"
            "   - track_sizes:         enable dynamic reports for 'stats sizes' command.\n"
+           "   - mrc_sample_rate:     sample 1 in this many keys to estimate miss ratios\n"
+           "                          at other memory limits, for 'stats mrc'.\n"
+           "                          1000 is a good start. (default: 0, disabled)\n"
            "   - no_hashexpand:       disables hash table expansion (dangerous)\n"
+           "   - no_slab_magazines:   disables per-thread caches of free slab chunks,\n"
+           "                          so every allocation takes the global slabs lock.\n"
            "   - modern:              enables options which will be default in future.\n"
            "                          currently: nothing\n"
            "   - no_modern:           uses defaults of previous major version (1.4.x)\n",
            settings.slab_chunk_size_max / (1 << 10), settings.logger_watcher_buf_size / (1 << 10),
            settings.logger_buf_size / (1 << 10));
     verify_default("tail_repair_time", settings.tail_repair_time == TAIL_REPAIR_TIME_DEFAULT);
+    verify_default("hash_expand_threads", settings.hash_expand_threads == 1);
+    verify_default("hash_shrink", !settings.hash_shrink);
+    verify_default("restart_threads", settings.restart_threads == 1);
+    verify_default("lockfree_get", !settings.lockfree_get);
+    verify_default("slab_magazines", settings.slab_magazines);
     verify_default("lru_crawler_tocrawl", settings.lru_crawler_tocrawl == 0);
+    verify_default("lru_crawler_threads", settings.lru_crawler_threads == 1);
     verify_default("idle_timeout", settings.idle_timeout == 0);
+    verify_default("sched_quantum", settings.sched_quantum == 0);
+    verify_default("mrc_sample_rate", settings.mrc_sample_rate == 0);
 #ifdef HAVE_DROP_PRIVILEGES
     printf("   - drop_privileges:     enable dropping extra syscall privileges\n"
            "   - no_drop_privileges:  disable drop_privileges in case it causes issues with\n"
@@ -4130,6 +5287,46 @@ static void usage(void) {
 #ifdef SOCK_COOKIE_ID
     printf("   - sock_cookie_id:      attributes an ID to a socket for ip filtering/firewalls \n");
 #endif
+#ifdef WORKER_URING
+    printf("   - worker_uring:        use io_uring for client connections on the worker\n"
+           "                          threads. (experimental, default: %s)\n",
+           flag_enabled_disabled(settings.worker_uring));
+#endif
+#ifdef ZEROCOPY
+    printf("   - zerocopy_min:        send values of at least this many bytes to TCP\n"
+           "                          clients with MSG_ZEROCOPY. (default: %d, disabled)\n",
+           settings.zerocopy_min);
+#endif
+#ifdef LISTEN_REUSEPORT
+    printf("   - reuseport:           give each worker thread its own TCP listen sockets\n"
+           "                          and accept on them directly, and its own UDP\n"
+           "                          sockets. (default: %s)\n",
+           flag_enabled_disabled(settings.reuseport));
+#endif
+    printf("   - sched_quantum:       bytes a connection may read and write before it\n"
+           "                          yields to the others on its worker. (default: %d, disabled)\n"
+           "   - sched_stats:         track how long connections hold their worker.\n"
+           "                          (default: %s, implied by sched_quantum)\n",
+           settings.sched_quantum, flag_enabled_disabled(settings.sched_stats));
+    printf("   - worker_spin:         microseconds worker threads poll for events before\n"
+           "                          sleeping. adapts down when idle. (default: %d, disabled)\n",
+           settings.worker_spin);
+#ifdef BUSY_POLL
+    printf("   - busy_poll:           SO_BUSY_POLL microseconds for client sockets.\n"
+           "                          see doc/napi_ids.txt (default: %d, disabled)\n",
+           settings.busy_poll);
+#endif
+#ifdef UDP_BATCH
+    printf("   - udp_batch:           datagrams to read or send per syscall on UDP\n"
+           "                          sockets, 1 to disable. (default: %d, max: %d)\n",
+           settings.udp_batch, UDP_BATCH_MAX);
+#endif
+#ifdef SHM_TRANSPORT
+    printf("   - shm_ring_size:       kilobytes per direction of the shared memory rings\n"
+           "                          unix socket clients can ask for with \"shm\".\n"
+           "                          see doc/shm.txt (default: %d, disabled)\n",
+           settings.shm_ring_size / 1024);
+#endif
 #ifdef EXTSTORE
     printf("\n   - External storage (ext_*) related options (see: https://memcached.org/extstore)\n");
     printf("   - ext_path:            file to write to for external storage.\n"
@@ -4447,6 +5644,7 @@ struct _mc_meta_data {
     int64_t time_delta;
     uint64_t process_started;
     uint32_t current_time;
+    uint64_t recovery_us; // time taken by the last restart_fixup().
 };
 
 // We need to remember a combination of configuration settings and global
@@ -4505,6 +5703,10 @@ static int _mc_meta_save_cb(const char *tag, void *ctx, void *data) {
     restart_set_kv(ctx, "oldest_live", "%u", settings.oldest_live);
     // TODO: use uintptr_t etc? is it portable enough?
     restart_set_kv(ctx, "mmap_oldbase", "%p", meta->mmap_base);
+    // How long recovering this memory took when we last started, for
+    // operators sizing restart_threads. Not checked on load.
+    restart_set_kv(ctx, "recovery_us", "%llu", (unsigned long long) meta->recovery_us);
+    restart_set_kv(ctx, "recovery_threads", "%d", settings.restart_threads);
 
     return 0;
 }
@@ -4549,6 +5751,9 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
         R_STOP_TIME,
         R_PROCESS_STARTED,
         R_HASHPOWER,
+        // informational, don't count towards RESTART_REQUIRED_META.
+        R_RECOVERY_US,
+        R_RECOVERY_THREADS,
     };
 
     const char *opts[] = {
@@ -4569,6 +5774,8 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
         [R_STOP_TIME] = "stop_time",
         [R_PROCESS_STARTED] = "process_started",
         [R_HASHPOWER] = "hashpower",
+        [R_RECOVERY_US] = "recovery_us",
+        [R_RECOVERY_THREADS] = "recovery_threads",
         NULL
     };
 
@@ -4586,7 +5793,9 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
             fprintf(stderr, "[restart] unknown/unhandled key: %s\n", key);
             continue;
         }
-        lines_seen++;
+        if (type < R_RECOVERY_US) {
+            lines_seen++;
+        }
 
         // helper for any boolean checkers.
         bool val_bool = false;
@@ -4604,6 +5813,8 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
             if (!safe_strtoull_hex(val, &meta->old_base)) {
                 fprintf(stderr, "[restart] failed to parse %s: %s\n", key, val);
                 reuse_mmap = -1;
+            } else {
+                restart_mmap_hint((void *)(mc_ptr_t)meta->old_base);
             }
             break;
         case R_MAXBYTES:
@@ -4712,6 +5923,12 @@ static int _mc_meta_load_cb(const char *tag, void *ctx, void *data) {
                 settings.hashpower_init = val_uint;
             }
             break;
+        case R_RECOVERY_US:
+        case R_RECOVERY_THREADS:
+            if (settings.verbose > 0) {
+                fprintf(stderr, "[restart] previous recovery: %s %s\n", key, val);
+            }
+            break;
         default:
             fprintf(stderr, "[restart] unhandled key: %s\n", key);
         }
@@ -4751,6 +5968,8 @@ int main (int argc, char **argv) {
     bool start_lru_crawler = true;
     bool start_assoc_maint = true;
     enum hashfunc_type hash_type = MURMUR3_HASH;
+    enum assoc_index_type hash_index = ASSOC_INDEX_CHAINED;
+    enum lru_policy_type lru_policy = LRU_POLICY_SEGMENTED;
     uint32_t tocrawl;
     uint32_t slab_sizes[MAX_NUMBER_OF_SLAB_CLASSES];
     bool use_slab_sizes = false;
@@ -4760,22 +5979,34 @@ int main (int argc, char **argv) {
     // important settings to save or validate.
     struct _mc_meta_data *meta = malloc(sizeof(struct _mc_meta_data));
     meta->slab_config = NULL;
+    meta->recovery_us = 0;
     char *subopts, *subopts_orig;
     char *subopts_value;
     enum {
         MAXCONNS_FAST = 0,
         HASHPOWER_INIT,
+        HASH_EXPAND_THREADS,
+        HASH_SHRINK,
+        RESTART_THREADS,
+        LOCKFREE_GET,
         NO_HASHEXPAND,
+        NO_SLAB_MAGAZINES,
         SLAB_REASSIGN,
         SLAB_AUTOMOVE,
         SLAB_AUTOMOVE_RATIO,
         SLAB_AUTOMOVE_WINDOW,
         TAIL_REPAIR_TIME,
         HASH_ALGORITHM,
+        HASH_INDEX,
+        LRU_POLICY,
         LRU_CRAWLER,
         LRU_CRAWLER_SLEEP,
         LRU_CRAWLER_TOCRAWL,
+        LRU_CRAWLER_THREADS,
         LRU_MAINTAINER,
+        LRU_CLOCK,
+        EXPIRY_WHEEL,
+        SNAPSHOT_LOAD,
         HOT_LRU_PCT,
         WARM_LRU_PCT,
         HOT_MAX_FACTOR,
@@ -4787,6 +6018,7 @@ int main (int argc, char **argv) {
         SLAB_SIZES,
         SLAB_CHUNK_MAX,
         TRACK_SIZES,
+        MRC_SAMPLE_RATE,
         NO_INLINE_ASCII_RESP,
         MODERN,
         NO_MODERN,
@@ -4822,22 +6054,54 @@ int main (int argc, char **argv) {
 #endif
 #ifdef SOCK_COOKIE_ID
         COOKIE_ID,
+#endif
+#ifdef WORKER_URING
+        WORKER_IO_URING,
+#endif
+#ifdef ZEROCOPY
+        ZEROCOPY_MIN,
+#endif
+#ifdef LISTEN_REUSEPORT
+        REUSEPORT,
+#endif
+        SCHED_QUANTUM,
+        SCHED_STATS,
+        WORKER_SPIN,
+#ifdef BUSY_POLL
+        BUSY_POLL_US,
+#endif
+#ifdef UDP_BATCH
+        UDP_BATCH_SIZE,
+#endif
+#ifdef SHM_TRANSPORT
+        SHM_RING_SIZE,
 #endif
     };
     char *const subopts_tokens[] = {
         [MAXCONNS_FAST] = "maxconns_fast",
         [HASHPOWER_INIT] = "hashpower",
+        [HASH_EXPAND_THREADS] = "hash_expand_threads",
+        [HASH_SHRINK] = "hash_shrink",
+        [RESTART_THREADS] = "restart_threads",
+        [LOCKFREE_GET] = "lockfree_get",
         [NO_HASHEXPAND] = "no_hashexpand",
+        [NO_SLAB_MAGAZINES] = "no_slab_magazines",
         [SLAB_REASSIGN] = "slab_reassign",
         [SLAB_AUTOMOVE] = "slab_automove",
         [SLAB_AUTOMOVE_RATIO] = "slab_automove_ratio",
         [SLAB_AUTOMOVE_WINDOW] = "slab_automove_window",
         [TAIL_REPAIR_TIME] = "tail_repair_time",
         [HASH_ALGORITHM] = "hash_algorithm",
+        [HASH_INDEX] = "hash_index",
+        [LRU_POLICY] = "lru_policy",
         [LRU_CRAWLER] = "lru_crawler",
         [LRU_CRAWLER_SLEEP] = "lru_crawler_sleep",
         [LRU_CRAWLER_TOCRAWL] = "lru_crawler_tocrawl",
+        [LRU_CRAWLER_THREADS] = "lru_crawler_threads",
         [LRU_MAINTAINER] = "lru_maintainer",
+        [LRU_CLOCK] = "lru_clock",
+        [EXPIRY_WHEEL] = "expiry_wheel",
+        [SNAPSHOT_LOAD] = "snapshot_load",
         [HOT_LRU_PCT] = "hot_lru_pct",
         [WARM_LRU_PCT] = "warm_lru_pct",
         [HOT_MAX_FACTOR] = "hot_max_factor",
@@ -4849,6 +6113,7 @@ int main (int argc, char **argv) {
         [SLAB_SIZES] = "slab_sizes",
         [SLAB_CHUNK_MAX] = "slab_chunk_max",
         [TRACK_SIZES] = "track_sizes",
+        [MRC_SAMPLE_RATE] = "mrc_sample_rate",
         [NO_INLINE_ASCII_RESP] = "no_inline_ascii_resp",
         [MODERN] = "modern",
         [NO_MODERN] = "no_modern",
@@ -4884,6 +6149,27 @@ int main (int argc, char **argv) {
 #endif
 #ifdef SOCK_COOKIE_ID
         [COOKIE_ID] = "sock_cookie_id",
+#endif
+#ifdef WORKER_URING
+        [WORKER_IO_URING] = "worker_uring",
+#endif
+#ifdef ZEROCOPY
+        [ZEROCOPY_MIN] = "zerocopy_min",
+#endif
+#ifdef LISTEN_REUSEPORT
+        [REUSEPORT] = "reuseport",
+#endif
+        [SCHED_QUANTUM] = "sched_quantum",
+        [SCHED_STATS] = "sched_stats",
+        [WORKER_SPIN] = "worker_spin",
+#ifdef BUSY_POLL
+        [BUSY_POLL_US] = "busy_poll",
+#endif
+#ifdef UDP_BATCH
+        [UDP_BATCH_SIZE] = "udp_batch",
+#endif
+#ifdef SHM_TRANSPORT
+        [SHM_RING_SIZE] = "shm_ring_size",
 #endif
         NULL
     };
@@ -4902,6 +6188,10 @@ int main (int argc, char **argv) {
     /* init settings */
     settings_init();
     verify_default("hash_algorithm", hash_type == MURMUR3_HASH);
+    verify_default("hash_index", hash_index == ASSOC_INDEX_CHAINED);
+    verify_default("lru_policy", lru_policy == LRU_POLICY_SEGMENTED);
+    verify_default("lru_clock", !settings.lru_clock);
+    verify_default("expiry_wheel", !settings.expiry_wheel);
 #ifdef EXTSTORE
     void *storage = NULL;
     void *storage_cf = storage_init_config(&settings);
@@ -5251,9 +6541,40 @@ int main (int argc, char **argv) {
                     return 1;
                 }
                 break;
+            case HASH_EXPAND_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for hash_expand_threads\n");
+                    return 1;
+                }
+                settings.hash_expand_threads = atoi(subopts_value);
+                if (settings.hash_expand_threads < 1 || settings.hash_expand_threads > 64) {
+                    fprintf(stderr, "hash_expand_threads must be between 1 and 64\n");
+                    return 1;
+                }
+                break;
+            case RESTART_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for restart_threads\n");
+                    return 1;
+                }
+                settings.restart_threads = atoi(subopts_value);
+                if (settings.restart_threads < 1 || settings.restart_threads > 64) {
+                    fprintf(stderr, "restart_threads must be between 1 and 64\n");
+                    return 1;
+                }
+                break;
+            case LOCKFREE_GET:
+                settings.lockfree_get = true;
+                break;
+            case HASH_SHRINK:
+                settings.hash_shrink = true;
+                break;
             case NO_HASHEXPAND:
                 start_assoc_maint = false;
                 break;
+            case NO_SLAB_MAGAZINES:
+                settings.slab_magazines = false;
+                break;
             case SLAB_REASSIGN:
                 settings.slab_reassign = true;
                 break;
@@ -5317,6 +6638,34 @@ int main (int argc, char **argv) {
                     return 1;
                 }
                 break;
+            case HASH_INDEX:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing hash_index argument\n");
+                    return 1;
+                };
+                if (strcmp(subopts_value, "chained") == 0) {
+                    hash_index = ASSOC_INDEX_CHAINED;
+                } else if (strcmp(subopts_value, "bucketed") == 0) {
+                    hash_index = ASSOC_INDEX_BUCKETED;
+                } else {
+                    fprintf(stderr, "Unknown hash_index option (chained, bucketed)\n");
+                    return 1;
+                }
+                break;
+            case LRU_POLICY:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing lru_policy argument\n");
+                    return 1;
+                };
+                if (strcmp(subopts_value, "segmented") == 0) {
+                    lru_policy = LRU_POLICY_SEGMENTED;
+                } else if (strcmp(subopts_value, "tinylfu") == 0) {
+                    lru_policy = LRU_POLICY_TINYLFU;
+                } else {
+                    fprintf(stderr, "Unknown lru_policy option (segmented, tinylfu)\n");
+                    return 1;
+                }
+                break;
             case LRU_CRAWLER:
                 start_lru_crawler = true;
                 break;
@@ -5342,10 +6691,34 @@ int main (int argc, char **argv) {
                 }
                 settings.lru_crawler_tocrawl = tocrawl;
                 break;
+            case LRU_CRAWLER_THREADS:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for lru_crawler_threads\n");
+                    return 1;
+                }
+                settings.lru_crawler_threads = atoi(subopts_value);
+                if (settings.lru_crawler_threads < 1 || settings.lru_crawler_threads > 64) {
+                    fprintf(stderr, "lru_crawler_threads must be between 1 and 64\n");
+                    return 1;
+                }
+                break;
             case LRU_MAINTAINER:
                 start_lru_maintainer = true;
                 settings.lru_segmented = true;
                 break;
+            case LRU_CLOCK:
+                settings.lru_clock = true;
+                break;
+            case EXPIRY_WHEEL:
+                settings.expiry_wheel = true;
+                break;
+            case SNAPSHOT_LOAD:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing snapshot_load argument\n");
+                    return 1;
+                }
+                settings.snapshot_load = strdup(subopts_value);
+                break;
             case HOT_LRU_PCT:
                 if (subopts_value == NULL) {
                     fprintf(stderr, "Missing hot_lru_pct argument\n");
@@ -5441,6 +6814,16 @@ int main (int argc, char **argv) {
             case TRACK_SIZES:
                 item_stats_sizes_init();
                 break;
+            case MRC_SAMPLE_RATE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing mrc_sample_rate argument\n");
+                    return 1;
+                }
+                if (!safe_strtoul(subopts_value, &settings.mrc_sample_rate)) {
+                    fprintf(stderr, "could not parse argument to mrc_sample_rate\n");
+                    return 1;
+                }
+                break;
             case NO_INLINE_ASCII_RESP:
                 break;
             case INLINE_ASCII_RESP:
@@ -5650,6 +7033,109 @@ int main (int argc, char **argv) {
             case COOKIE_ID:
                 (void)safe_strtoul(subopts_value, &settings.sock_cookie_id);
                 break;
+#endif
+#ifdef WORKER_URING
+            case WORKER_IO_URING:
+                settings.worker_uring = true;
+                break;
+#endif
+#ifdef ZEROCOPY
+            case ZEROCOPY_MIN:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for zerocopy_min\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.zerocopy_min)
+                        || settings.zerocopy_min < 0) {
+                    fprintf(stderr, "could not parse argument to zerocopy_min\n");
+                    return 1;
+                }
+                break;
+#endif
+#ifdef LISTEN_REUSEPORT
+            case REUSEPORT:
+                settings.reuseport = true;
+                break;
+#endif
+            case SCHED_QUANTUM:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for sched_quantum\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.sched_quantum)
+                        || settings.sched_quantum < 0) {
+                    fprintf(stderr, "could not parse argument to sched_quantum\n");
+                    return 1;
+                }
+                if (settings.sched_quantum > 0 && settings.sched_quantum < 1024) {
+                    fprintf(stderr, "sched_quantum must be at least 1024 bytes\n");
+                    return 1;
+                }
+                if (settings.sched_quantum) {
+                    settings.sched_stats = true;
+                }
+                break;
+            case SCHED_STATS:
+                settings.sched_stats = true;
+                break;
+            case WORKER_SPIN:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for worker_spin\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.worker_spin)
+                        || settings.worker_spin < 0 || settings.worker_spin > 1000000) {
+                    fprintf(stderr, "could not parse argument to worker_spin\n");
+                    return 1;
+                }
+                break;
+#ifdef BUSY_POLL
+            case BUSY_POLL_US:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for busy_poll\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.busy_poll)
+                        || settings.busy_poll < 0) {
+                    fprintf(stderr, "could not parse argument to busy_poll\n");
+                    return 1;
+                }
+                break;
+#endif
+#ifdef UDP_BATCH
+            case UDP_BATCH_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for udp_batch\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.udp_batch)
+                        || settings.udp_batch < 1 || settings.udp_batch > UDP_BATCH_MAX) {
+                    fprintf(stderr, "udp_batch must be between 1 and %d\n", UDP_BATCH_MAX);
+                    return 1;
+                }
+                break;
+#endif
+#ifdef SHM_TRANSPORT
+            case SHM_RING_SIZE:
+                if (subopts_value == NULL) {
+                    fprintf(stderr, "Missing numeric argument for shm_ring_size\n");
+                    return 1;
+                }
+                if (!safe_strtol(subopts_value, &settings.shm_ring_size)
+                        || settings.shm_ring_size < 0
+                        || settings.shm_ring_size > SHM_RING_MAX / 1024) {
+                    fprintf(stderr, "shm_ring_size must be between 0 and %d\n",
+                            SHM_RING_MAX / 1024);
+                    return 1;
+                }
+                if (settings.shm_ring_size) {
+                    // the rings are indexed with a mask.
+                    int size = SHM_RING_MIN;
+                    while (size < settings.shm_ring_size * 1024)
+                        size *= 2;
+                    settings.shm_ring_size = size;
+                }
+                break;
 #endif
             default:
 #ifdef EXTSTORE
@@ -5760,6 +7246,21 @@ int main (int argc, char **argv) {
         exit(EX_USAGE);
     }
 
+    if (lru_policy == LRU_POLICY_TINYLFU && !start_lru_maintainer) {
+        fprintf(stderr, "lru_policy=tinylfu requires lru_maintainer to be enabled\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.lru_clock && !start_lru_maintainer) {
+        fprintf(stderr, "lru_clock requires lru_maintainer to be enabled\n");
+        exit(EX_USAGE);
+    }
+
+    if (settings.expiry_wheel && !start_lru_maintainer) {
+        fprintf(stderr, "expiry_wheel requires lru_maintainer to be enabled\n");
+        exit(EX_USAGE);
+    }
+
     if (hash_init(hash_type) != 0) {
         fprintf(stderr, "Failed to initialize hash_algorithm!\n");
         exit(EX_USAGE);
@@ -5990,6 +7491,9 @@ int main (int argc, char **argv) {
         // Easier to manage memory if we prefill the global pool when reusing.
         prefill = true;
         restart_register("main", _mc_meta_load_cb, _mc_meta_save_cb, meta);
+        restart_register("assoc", assoc_restart_check, assoc_restart_save, NULL);
+        restart_register("items", item_restart_check, item_restart_save, NULL);
+        restart_register("slabs", slabs_restart_check, slabs_restart_save, NULL);
         reuse_mem = restart_mmap_open(settings.maxbytes,
                         settings.memory_file,
                         &mem_base);
@@ -6005,7 +7509,7 @@ int main (int argc, char **argv) {
     // We override the hash table start argument with what was live
     // previously, to avoid filling a huge set of items into a tiny hash
     // table.
-    assoc_init(settings.hashpower_init);
+    assoc_init(settings.hashpower_init, hash_index);
 #ifdef EXTSTORE
     if (storage_enabled && reuse_mem) {
         fprintf(stderr, "[restart] memory restart with extstore not presently supported.\n");
@@ -6014,6 +7518,11 @@ int main (int argc, char **argv) {
 #endif
     slabs_init(settings.maxbytes, settings.factor, preallocate,
             use_slab_sizes ? slab_sizes : NULL, mem_base, reuse_mem);
+    item_policy_init(lru_policy);
+    mrc_init();
+    if (settings.expiry_wheel) {
+        expiry_init();
+    }
 #ifdef EXTSTORE
     if (storage_enabled) {
         storage = storage_init(storage_cf);
@@ -6043,7 +7552,16 @@ int main (int argc, char **argv) {
         // pointers? passing through uint64_t should work, and we're not
         // annotating the pointer with anything, but it's still slightly
         // insane.
+        struct timeval fixup_start, fixup_end;
+        gettimeofday(&fixup_start, NULL);
         restart_fixup((void *)old_base);
+        gettimeofday(&fixup_end, NULL);
+        meta->recovery_us = (fixup_end.tv_sec - fixup_start.tv_sec) * 1000000ULL
+            + fixup_end.tv_usec - fixup_start.tv_usec;
+        if (settings.verbose > 0) {
+            fprintf(stderr, "[restart] recovered in %llu us with %d threads\n",
+                    (unsigned long long) meta->recovery_us, settings.restart_threads);
+        }
     }
     /*
      * ignore SIGPIPE signals; we can use errno == EPIPE if we
@@ -6107,10 +7625,6 @@ int main (int argc, char **argv) {
         exit(EXIT_FAILURE);
     }
 
-    if (settings.idle_timeout && start_conn_timeout_thread() == -1) {
-        exit(EXIT_FAILURE);
-    }
-
     /* initialise clock event */
 #if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
     {
@@ -6133,6 +7647,11 @@ int main (int argc, char **argv) {
 #endif
     clock_handler(0, 0, 0);
 
+    /* warm up from a snapshot before taking any traffic. */
+    if (settings.snapshot_load && snapshot_load(settings.snapshot_load) != 0) {
+        exit(EXIT_FAILURE);
+    }
+
     /* create unix mode sockets after dropping privileges */
     if (settings.socketpath != NULL) {
         errno = 0;
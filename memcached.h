@@ -45,9 +45,38 @@
 # define SOCK_COOKIE_ID SO_RTABLE
 #endif
 
+/* for per-worker listen sockets */
+#if defined(SO_REUSEPORT_LB)
+# define LISTEN_REUSEPORT SO_REUSEPORT_LB
+#elif defined(__linux__) && defined(SO_REUSEPORT)
+# define LISTEN_REUSEPORT SO_REUSEPORT
+#endif
+
+/* for zero-copy transmit of large values */
+#if defined(__linux__) && defined(MSG_ZEROCOPY) && defined(SO_ZEROCOPY)
+# define ZEROCOPY 1
+#endif
+
+/* for busy polling the NIC queue on reads from client sockets */
+#if defined(__linux__) && defined(SO_BUSY_POLL)
+# define BUSY_POLL 1
+#endif
+
+/* for reading and writing many datagrams per syscall on UDP sockets */
+#if defined(__linux__) && defined(MSG_WAITFORONE)
+# define UDP_BATCH 1
+# define UDP_BATCH_MAX 64
+#endif
+
+/* for handing shared memory rings to clients on the unix socket */
+#if defined(__linux__) && defined(HAVE_MEMFD_CREATE)
+# define SHM_TRANSPORT 1
+#endif
+
 #include "itoa_ljust.h"
 #include "protocol_binary.h"
 #include "cache.h"
+#include "epoch.h"
 #include "logger.h"
 
 #ifdef EXTSTORE
@@ -96,6 +125,17 @@
  */
 #define ITEM_UPDATE_INTERVAL 60
 
+/* Seconds covered by each worker's idle timeout wheel. Connections with a
+ * longer idle_timeout go around it more than once. Must be a power of two. */
+#define IDLE_WHEEL_SLOTS 64
+
+/* Priority classes for fair scheduling (-o sched_quantum), set per
+ * connection with "mp". */
+#define SCHED_CLASSES 3
+#define SCHED_CLASS_DEFAULT 1
+/* log2 buckets of microseconds for time spent driving one connection. */
+#define SCHED_TURN_BUCKETS 24
+
 /*
  * Valid range of the maximum size of an item, in bytes.
  */
@@ -299,7 +339,8 @@ enum delta_result_type {
     X(cas_hits) \
     X(cas_badval) \
     X(incr_hits) \
-    X(decr_hits)
+    X(decr_hits) \
+    X(evicted_misses)
 
 /** Stats stored per slab (and per thread). */
 struct slab_stats {
@@ -332,7 +373,21 @@ struct slab_stats {
     X(response_obj_bytes) \
     X(read_buf_oom) \
     X(store_too_large) \
-    X(store_no_memory)
+    X(store_no_memory) \
+    X(zerocopy_sends) /* sends made with MSG_ZEROCOPY */ \
+    X(zerocopy_copied) /* zerocopy sends the kernel copied anyway */ \
+    X(zerocopy_fallbacks) /* large sends which had to be copied */ \
+    X(sched_yields) /* yields for running out of byte budget */ \
+    X(sched_skips) /* turns skipped to pay back overspent budget */ \
+    X(spin_us) /* time spent polling for events before sleeping */ \
+    X(spin_hits) /* events found by polling */ \
+    X(spin_sleeps) /* times polling gave up and the thread slept */ \
+    X(sleep_us) /* time spent asleep waiting for events */ \
+    X(udp_read_calls) /* reads from UDP sockets which got datagrams */ \
+    X(udp_read_datagrams) \
+    X(udp_write_calls) /* sends on UDP sockets */ \
+    X(udp_write_datagrams) \
+    X(shm_wakeups) /* shm clients woken up from their futex */
 
 #ifdef EXTSTORE
 #define EXTSTORE_THREAD_STATS_FIELDS \
@@ -369,6 +424,7 @@ struct thread_stats {
 #undef X
     struct slab_stats slab_stats[MAX_NUMBER_OF_SLAB_CLASSES];
     uint64_t lru_hits[POWER_LARGEST];
+    uint64_t sched_turn_us[SCHED_TURN_BUCKETS];
     uint64_t read_buf_count;
     uint64_t read_buf_bytes;
     uint64_t read_buf_bytes_free;
@@ -420,10 +476,15 @@ struct stats_state {
     uint64_t      curr_bytes;
     uint64_t      curr_conns;
     uint64_t      hash_bytes;       /* size used for hash tables */
+    uint64_t      hash_expansions;  /* times the hash table has grown */
+    uint64_t      hash_shrinks;     /* times the hash table has shrunk */
+    uint64_t      hash_resize_buckets_moved; /* progress of latest resize */
+    uint64_t      hash_resize_time_us; /* duration of latest resize */
     unsigned int  conn_structs;
     unsigned int  reserved_fds;
     unsigned int  hash_power_level; /* Better hope it's not over 9000 */
     unsigned int  log_watchers; /* number of currently active watchers */
+    unsigned int  shm_conns; /* connections using the shm transport */
     bool          hash_is_expanding; /* If the hash table is being expanded */
     bool          accepting_conns;  /* whether we are currently accepting */
     bool          slab_reassign_running; /* slab reassign in progress */
@@ -469,18 +530,30 @@ struct settings {
     bool lru_crawler;        /* Whether or not to enable the autocrawler thread */
     bool lru_maintainer_thread; /* LRU maintainer background thread */
     bool lru_segmented;     /* Use split or flat LRU's */
+    bool lru_clock;         /* fetches only mark items; COLD is swept instead */
+    bool expiry_wheel;      /* index items by exptime so they're reclaimed on time */
+    char *snapshot_load;    /* snapshot to load before accepting connections */
     bool slab_reassign;     /* Whether or not slab reassignment is allowed */
     int slab_automove;     /* Whether or not to automatically move slabs */
     double slab_automove_ratio; /* youngest must be within pct of oldest */
     unsigned int slab_automove_window; /* window mover for algorithm */
     int hashpower_init;     /* Starting hash power level */
+    int hash_expand_threads; /* threads moving buckets during hash resizing */
+    bool hash_shrink;       /* shrink the hash table when mostly empty */
+    int restart_threads;    /* threads recovering memory after a restart */
+    bool lockfree_get;      /* serve hot gets without item locks */
+    bool slab_magazines;    /* per-thread caches of free slab chunks */
     bool shutdown_command; /* allow shutdown command */
     int tail_repair_time;   /* LRU tail refcount leak repair time */
     bool flush_enabled;     /* flush_all enabled */
     bool dump_enabled;      /* whether cachedump/metadump commands work */
     char *hash_algorithm;     /* Hash algorithm in use */
+    char *hash_index;       /* Hash table layout in use */
+    char *lru_policy;       /* Eviction policy in use */
+    unsigned int mrc_sample_rate; /* 1 in this many keys sampled for stats mrc */
     int lru_crawler_sleep;  /* Microsecond sleep between items */
     uint32_t lru_crawler_tocrawl; /* Number of items to crawl per run */
+    int lru_crawler_threads; /* threads a crawl is split over */
     int hot_lru_pct; /* percentage of slab space for HOT_LRU */
     int warm_lru_pct; /* percentage of slab space for WARM_LRU */
     double hot_max_factor; /* HOT tail age relative to COLD tail */
@@ -538,6 +611,27 @@ struct settings {
 #ifdef SOCK_COOKIE_ID
     uint32_t sock_cookie_id;
 #endif
+#ifdef ZEROCOPY
+    int zerocopy_min; /* responses this large are sent with MSG_ZEROCOPY */
+#endif
+#ifdef LISTEN_REUSEPORT
+    bool reuseport; /* each worker thread accepts on its own TCP listeners */
+#endif
+#ifdef WORKER_URING
+    bool worker_uring; /* worker threads use io_uring for client connections */
+#endif
+    int sched_quantum; /* bytes a connection may handle per turn, 0 is off */
+    bool sched_stats; /* time how long each connection holds its worker */
+    int worker_spin; /* usec workers poll for events before sleeping, 0 is off */
+#ifdef BUSY_POLL
+    int busy_poll; /* SO_BUSY_POLL usec for client sockets */
+#endif
+#ifdef UDP_BATCH
+    int udp_batch; /* datagrams read or sent per syscall on UDP sockets */
+#endif
+#ifdef SHM_TRANSPORT
+    int shm_ring_size; /* bytes per direction for shm clients, 0 is off */
+#endif
 };
 
 extern struct stats stats;
@@ -570,6 +664,8 @@ extern struct settings settings;
 #define ITEM_STALE 2048
 /* if item key was sent in binary */
 #define ITEM_KEY_BINARY 4096
+/* expired, but in use when the expiry wheel came for it */
+#define ITEM_EXPIRED 8192
 
 /**
  * Structure for storing items within memcached.
@@ -601,7 +697,8 @@ typedef struct _stritem {
 
 // TODO: If we eventually want user loaded modules, we can't use an enum :(
 enum crawler_run_type {
-    CRAWLER_AUTOEXPIRE=0, CRAWLER_EXPIRED, CRAWLER_METADUMP, CRAWLER_MGDUMP
+    CRAWLER_AUTOEXPIRE=0, CRAWLER_EXPIRED, CRAWLER_METADUMP, CRAWLER_MGDUMP,
+    CRAWLER_INVALIDATE, CRAWLER_EXPORT
 };
 
 typedef struct {
@@ -705,7 +802,7 @@ typedef struct {
     int thread_baseid;          /* which "number" thread this is for data offsets */
     struct thread_stats stats;  /* Stats generated by this thread */
     io_queue_cb_t io_queues[IO_QUEUE_COUNT];
-    struct conn_queue *ev_queue; /* Worker/conn event queue */
+    struct mpsc_ring *ev_queue; /* Worker/conn event queue */
     cache_t *rbuf_cache;        /* static-sized read buffers */
     mc_resp_bundle *open_bundle;
     cache_t *io_cache;          /* IO objects */
@@ -714,10 +811,24 @@ typedef struct {
 #endif
     logger *l;                  /* logger buffer */
     void *lru_bump_buf;         /* async LRU bump buffer */
+    epoch_slot *epoch;          /* for lock-free reads */
 #ifdef TLS
     char   *ssl_wbuf;
 #endif
     int napi_id;                /* napi id associated with this thread */
+    struct conn **idle_wheel;   /* conns by idle timeout, with -o idle_timeout */
+    struct event idle_event;    /* ticks the wheel once a second */
+    rel_time_t idle_clock;      /* last second the wheel was checked for */
+    uint64_t idle_conns;        /* conns in the wheel */
+    uint64_t loop_events;       /* callbacks run, so polling can see work came in */
+    unsigned int spin_budget;   /* usec to poll before sleeping, with -o worker_spin */
+#ifdef WORKER_URING
+    struct uring_thread *uring; /* io_uring state, with -o worker_uring */
+#endif
+#ifdef LISTEN_REUSEPORT
+    struct conn *listen_conn;   /* this thread's listeners, with -o reuseport */
+    struct event maxconns_event; /* polls to turn them back on after EMFILE */
+#endif
 #ifdef PROXY
     void *proxy_ctx; // proxy global context
     void *L; // lua VM
@@ -757,6 +868,10 @@ typedef struct _mc_resp {
      */
     bool skip;
     bool free; // double free detection.
+#ifdef ZEROCOPY
+    bool zc; // sent with MSG_ZEROCOPY; held until the kernel is done with it
+    uint32_t zc_seq; // id of the last zerocopy send which covered this
+#endif
     // UDP bits. Copied in from the client.
     uint16_t    request_id; /* Incoming UDP request ID, if this is a UDP "connection" */
     uint16_t    udp_sequence; /* packet counter when transmitting result */
@@ -809,6 +924,10 @@ struct conn {
     enum conn_states  state;
     enum bin_substates substate;
     rel_time_t last_cmd_time;
+    int64_t sched_deficit; /* bytes left this turn, negative if overspent */
+    uint8_t sched_class;
+    struct conn *idle_next; /* idle timeout wheel slot */
+    struct conn **idle_pprev;
     struct event event;
     short  ev_flags;
     short  which;   /** which events were just triggered */
@@ -817,6 +936,7 @@ struct conn {
     char   *rcurr;  /** but if we parsed some already, this is where we stopped */
     int    rsize;   /** total allocated size of rbuf */
     int    rbytes;  /** how much data, starting from rcur, do we have unparsed */
+    int    rprefetched; /** bytes past rcurr whose meta get keys were prefetched */
 
     mc_resp *resp; // tail response.
     mc_resp *resp_head; // first response in current stack.
@@ -836,6 +956,17 @@ struct conn {
 
     int io_queues_submitted; /* see notes on io_queue_t */
     io_queue_t io_queues[IO_QUEUE_COUNT]; /* set of deferred IO queues. */
+#ifdef WORKER_URING
+    struct uring_conn *uring; /* set while the thread's io_uring handles this conn */
+#endif
+#ifdef ZEROCOPY
+    bool zerocopy; /* SO_ZEROCOPY is set on the socket */
+    uint32_t zc_sent; /* id of the next zerocopy send */
+    uint32_t zc_done; /* sends before this id are all complete */
+    uint32_t zc_pending; /* sends not yet completed */
+    mc_resp *zc_head; /* sent responses waiting for completions */
+    mc_resp *zc_tail;
+#endif
 #ifdef PROXY
     unsigned int proxy_coro_ref; /* lua reference for active coroutine */
 #endif
@@ -850,6 +981,12 @@ struct conn {
     int    request_id; /* Incoming UDP request ID, if this is a UDP "connection" */
     struct sockaddr_in6 request_addr; /* udp: Who sent the most recent request */
     socklen_t request_addr_size;
+#ifdef UDP_BATCH
+    struct udp_batch *udp_batch; /* udp: datagrams read but not handled yet */
+#endif
+#ifdef SHM_TRANSPORT
+    struct shm_conn *shm; /* set once a unix socket client switched to shm */
+#endif
 
     bool   noreply;   /* True if the reply should not be sent. */
     /* current stats command */
@@ -929,6 +1066,10 @@ conn *conn_new(const int sfd, const enum conn_states init_state, const int event
     enum network_transport transport, struct event_base *base, void *ssl, uint64_t conntag, enum protocol bproto);
 
 void conn_worker_readd(conn *c);
+void event_handler(const evutil_socket_t fd, const short which, void *arg);
+#ifdef WORKER_URING
+void conn_uring_sent(conn *c, const int res);
+#endif
 extern int daemonize(int nochdir, int noclose);
 
 #define mutex_lock(x) pthread_mutex_lock(x)
@@ -951,13 +1092,18 @@ extern int daemonize(int nochdir, int noclose);
  */
 void memcached_thread_init(int nthreads, void *arg);
 void redispatch_conn(conn *c);
-void timeout_conn(conn *c);
 #ifdef PROXY
 void proxy_reload_notify(LIBEVENT_THREAD *t);
 #endif
 void return_io_pending(io_pending_t *io);
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags, int read_buffer_size,
     enum network_transport transport, void *ssl, uint64_t conntag, enum protocol bproto);
+#ifdef LISTEN_REUSEPORT
+void dispatch_listen_conn(int tid, int sfd, enum network_transport transport, bool ssl_enabled,
+    uint64_t conntag, enum protocol bproto);
+void dispatch_conn_local(LIBEVENT_THREAD *me, int sfd, enum network_transport transport, void *ssl,
+    uint64_t conntag, enum protocol bproto);
+#endif
 void sidethread_conn_close(conn *c);
 
 /* Lock wrappers for cache functions that are called from main loop. */
@@ -967,13 +1113,26 @@ enum delta_result_type add_delta(LIBEVENT_THREAD *t, const char *key,
                                  uint64_t *cas);
 void accept_new_conns(const bool do_accept);
 void  conn_close_idle(conn *c);
+void  conn_idle_init(LIBEVENT_THREAD *me);
+void  conn_idle_add(conn *c);
 void  conn_close_all(void);
 item *item_alloc(const char *key, size_t nkey, int flags, rel_time_t exptime, int nbytes);
 #define DO_UPDATE true
 #define DONT_UPDATE false
 item *item_get(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update);
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update);
 item *item_get_locked(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update, uint32_t *hv);
 item *item_touch(const char *key, const size_t nkey, uint32_t exptime, LIBEVENT_THREAD *t);
+item *item_touch_hv(const char *key, const size_t nkey, const uint32_t hv, uint32_t exptime, LIBEVENT_THREAD *t);
+
+/* A key in a batched lookup. hv is filled in by item_prefetch_batch(). */
+typedef struct {
+    const char *key;
+    size_t nkey;
+    uint32_t hv;
+} item_batch_key;
+#define ITEM_BATCH_MAX 32
+void item_prefetch_batch(item_batch_key *keys, const int count);
 int   item_link(item *it);
 void  item_remove(item *it);
 int   item_replace(item *it, item *new_it, const uint32_t hv);
@@ -983,9 +1142,9 @@ void item_lock(uint32_t hv);
 void *item_trylock(uint32_t hv);
 void item_trylock_unlock(void *arg);
 void item_unlock(uint32_t hv);
+void item_locks_sync(void);
 void pause_threads(enum pause_thread_types type);
 void stop_threads(void);
-int stop_conn_timeout_thread(void);
 #define refcount_incr(it) ++(it->refcount)
 #define refcount_decr(it) --(it->refcount)
 void STATS_LOCK(void);
@@ -997,6 +1156,7 @@ void threadlocal_stats_aggregate(struct thread_stats *stats);
 void slab_stats_aggregate(struct thread_stats *stats, struct slab_stats *out);
 void thread_setname(pthread_t thread, const char *name);
 LIBEVENT_THREAD *get_worker_thread(int id);
+void worker_wait(LIBEVENT_THREAD *me);
 
 /* Stat processing functions */
 void append_stat(const char *name, ADD_STAT add_stats, conn *c,
@@ -1014,6 +1174,7 @@ void out_string(conn *c, const char *str);
         REALTIME_MAXDELTA + 1 : exptime
 rel_time_t realtime(const time_t exptime);
 item* limited_get(const char *key, size_t nkey, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow);
+item* limited_get_hv(const char *key, size_t nkey, uint32_t hv, LIBEVENT_THREAD *t, uint32_t exptime, bool should_touch, bool do_update, bool *overflow);
 item* limited_get_locked(const char *key, size_t nkey, LIBEVENT_THREAD *t, bool do_update, uint32_t *hv, bool *overflow);
 // Read/Response object handlers.
 void resp_reset(mc_resp *resp);
@@ -1039,6 +1200,7 @@ bool get_stats(const char *stat_type, int nkey, ADD_STAT add_stats, void *c);
 void stats_reset(void);
 void process_stat_settings(ADD_STAT add_stats, void *c);
 void process_stats_conns(ADD_STAT add_stats, void *c);
+void process_stats_workers(ADD_STAT add_stats, void *c);
 
 #if HAVE_DROP_PRIVILEGES
 extern void setup_privilege_violations_handler(void);
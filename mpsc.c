@@ -0,0 +1,164 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Bounded MPSC queue; see mpsc.h.
+ *
+ * Each slot carries a sequence number saying whose turn it is. A slot at
+ * position pos is free for the producer claiming pos when its sequence is
+ * pos, and holds a published entry for the consumer when it's pos + 1. After
+ * popping, the consumer sets it to pos + ring size for the next lap.
+ *
+ * Once anything has gone to the overflow list, producers keep adding to it
+ * until the consumer has emptied it, and the consumer only takes from it
+ * when every slot claimed in the ring has been popped. That keeps each
+ * producer's entries in order.
+ */
+#include "mpsc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+struct _mpsc_node {
+    mpsc_node *next;
+    char data[];
+};
+
+#define SLOT(r, pos) ((r)->slots + ((pos) & (r)->mask) * (r)->stride)
+#define SLOT_SEQ(s) ((uint64_t *)(s))
+#define SLOT_DATA(s) ((s) + sizeof(uint64_t))
+
+bool mpsc_init(mpsc_ring *r, unsigned int entries, size_t size) {
+    uint64_t n = 1;
+    while (n < entries) {
+        n *= 2;
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->size = size;
+    r->stride = (sizeof(uint64_t) + size + 7) & ~(size_t)7;
+    r->mask = n - 1;
+    r->idle = 1;
+    r->slots = calloc(n, r->stride);
+    if (r->slots == NULL) {
+        return false;
+    }
+    for (uint64_t x = 0; x < n; x++) {
+        *SLOT_SEQ(SLOT(r, x)) = x;
+    }
+    pthread_mutex_init(&r->lock, NULL);
+    return true;
+}
+
+// Claims the flag the consumer leaves when it goes idle. Whoever gets it
+// does the wakeup.
+static bool mpsc_signal(mpsc_ring *r) {
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&r->idle, __ATOMIC_RELAXED) == 0) {
+        return false;
+    }
+    return __atomic_exchange_n(&r->idle, 0, __ATOMIC_SEQ_CST) == 1;
+}
+
+static bool mpsc_overflow(mpsc_ring *r, const void *entry) {
+    mpsc_node *node = malloc(sizeof(mpsc_node) + r->size);
+    if (node == NULL) {
+        return false;
+    }
+    memcpy(node->data, entry, r->size);
+    node->next = NULL;
+
+    pthread_mutex_lock(&r->lock);
+    if (r->otail) {
+        r->otail->next = node;
+    } else {
+        r->ohead = node;
+    }
+    r->otail = node;
+    __atomic_store_n(&r->overflowed, r->overflowed + 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&r->lock);
+    return true;
+}
+
+bool mpsc_push(mpsc_ring *r, const void *entry, bool *wake) {
+    uint64_t pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+    char *slot;
+
+    if (__atomic_load_n(&r->overflowed, __ATOMIC_ACQUIRE) != 0) {
+        if (!mpsc_overflow(r, entry)) {
+            return false;
+        }
+        *wake = mpsc_signal(r);
+        return true;
+    }
+
+    for (;;) {
+        slot = SLOT(r, pos);
+        uint64_t seq = __atomic_load_n(SLOT_SEQ(slot), __ATOMIC_ACQUIRE);
+        int64_t diff = (int64_t)(seq - pos);
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&r->tail, &pos, pos + 1, true,
+                        __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+                break;
+            }
+            // pos now holds the current tail.
+        } else if (diff < 0) {
+            // full: the consumer hasn't popped this slot from the last lap.
+            if (!mpsc_overflow(r, entry)) {
+                return false;
+            }
+            *wake = mpsc_signal(r);
+            return true;
+        } else {
+            pos = __atomic_load_n(&r->tail, __ATOMIC_RELAXED);
+        }
+    }
+
+    memcpy(SLOT_DATA(slot), entry, r->size);
+    __atomic_store_n(SLOT_SEQ(slot), pos + 1, __ATOMIC_RELEASE);
+    *wake = mpsc_signal(r);
+    return true;
+}
+
+bool mpsc_pop(mpsc_ring *r, void *entry) {
+    char *slot = SLOT(r, r->head);
+    if (__atomic_load_n(SLOT_SEQ(slot), __ATOMIC_ACQUIRE) == r->head + 1) {
+        memcpy(entry, SLOT_DATA(slot), r->size);
+        __atomic_store_n(SLOT_SEQ(slot), r->head + r->mask + 1, __ATOMIC_RELEASE);
+        r->head++;
+        return true;
+    }
+
+    if (__atomic_load_n(&r->overflowed, __ATOMIC_ACQUIRE) == 0) {
+        return false;
+    }
+    // a producer is still copying into a claimed slot; it'll signal us.
+    if (__atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) != r->head) {
+        return false;
+    }
+
+    pthread_mutex_lock(&r->lock);
+    mpsc_node *node = r->ohead;
+    r->ohead = node->next;
+    if (r->ohead == NULL) {
+        r->otail = NULL;
+    }
+    __atomic_store_n(&r->overflowed, r->overflowed - 1, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&r->lock);
+
+    memcpy(entry, node->data, r->size);
+    free(node);
+    return true;
+}
+
+bool mpsc_sleep(mpsc_ring *r) {
+    __atomic_store_n(&r->idle, 1, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    char *slot = SLOT(r, r->head);
+    if (__atomic_load_n(SLOT_SEQ(slot), __ATOMIC_ACQUIRE) != r->head + 1
+            && __atomic_load_n(&r->overflowed, __ATOMIC_ACQUIRE) == 0) {
+        return true;
+    }
+    // something was pushed after we last looked. If its producer already
+    // took the flag a wakeup is coming anyway.
+    return __atomic_exchange_n(&r->idle, 0, __ATOMIC_SEQ_CST) == 0;
+}
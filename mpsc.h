@@ -0,0 +1,54 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef MPSC_H
+#define MPSC_H
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Bounded multi-producer, single-consumer queue of fixed size entries.
+ *
+ * Producers claim a slot in a ring with a compare-and-swap and copy their
+ * entry in; the consumer copies entries out in order. Nothing is allocated
+ * and no lock is taken unless the ring fills up, when entries go to a locked
+ * overflow list instead of blocking the producer. A push only fails if there
+ * isn't the memory for an overflow entry. Entries from one producer
+ * are always popped in the order they were pushed.
+ *
+ * Wakeups are coalesced: the consumer marks itself idle with mpsc_sleep()
+ * before it waits, and only the first push after that asks for it to be
+ * woken up.
+ */
+typedef struct _mpsc_node mpsc_node;
+
+/* padding keeps the consumer and producer sides off each other's cache lines */
+typedef struct mpsc_ring {
+    char *slots;
+    size_t size; /* bytes per entry */
+    size_t stride; /* bytes per slot */
+    uint64_t mask;
+    char pad0[64];
+    uint64_t head; /* consumer only */
+    char pad1[64];
+    uint64_t tail; /* next slot to claim */
+    char pad2[64];
+    int idle; /* consumer is asleep, or about to be */
+    unsigned int overflowed; /* entries on the overflow list */
+    pthread_mutex_t lock; /* for the overflow list */
+    mpsc_node *ohead;
+    mpsc_node *otail;
+} mpsc_ring;
+
+/* entries is rounded up to a power of two. */
+bool mpsc_init(mpsc_ring *r, unsigned int entries, size_t size);
+/* Returns false if the entry couldn't be queued. Otherwise *wake says whether
+ * the consumer has to be woken up to see it. */
+bool mpsc_push(mpsc_ring *r, const void *entry, bool *wake);
+/* Consumer only. Returns false if there was nothing to pop. */
+bool mpsc_pop(mpsc_ring *r, void *entry);
+/* Consumer only, when mpsc_pop() comes up empty. Returns true if it can wait
+ * for a wakeup, or false if entries came in and it should keep popping. */
+bool mpsc_sleep(mpsc_ring *r);
+
+#endif
@@ -0,0 +1,396 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Miss ratio curve estimation. See mrc.h.
+ *
+ * This follows SHARDS: only keys whose hash falls under a threshold are
+ * tracked, and reuse distances between them are multiplied by the sampling
+ * rate. The sampled keys are kept in recency order, each stamped with the
+ * time of its last reference. A Fenwick tree over those timestamps holds the
+ * size of the key last referenced at each one, so the bytes referenced since
+ * a key was last seen are a prefix sum away. Timestamps only run forward;
+ * once they run out the live keys are renumbered from one.
+ *
+ * Each slab class has its own tree over the same timestamps, holding only
+ * its own keys, which gives the distances for per-class curves.
+ *
+ * At most MRC_KEYS sampled keys are tracked. Past that the sampling rate is
+ * lowered instead, as in fixed-size SHARDS: the tracked key with the highest
+ * spread hash is forgotten and the threshold drops to its hash, so it and
+ * every key above it are no longer sampled. Counts taken so far are scaled
+ * down by the same factor, and distances from then on scaled up by the new
+ * rate. A heap over the spread hashes finds the key to forget. Everything is
+ * under one lock, which only sampled keys take.
+ */
+#include "memcached.h"
+#include "mrc.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define MRC_KEYS (1 << 15)
+#define MRC_SLOTS (MRC_KEYS * 2)
+/* sizes are kept in units of this many bytes. */
+#define MRC_UNIT 64
+/* the curves have points every eighth of the memory limit, up to four times
+ * the limit. */
+#define MRC_STEPS 8
+#define MRC_POINTS (MRC_STEPS * 4)
+
+typedef struct {
+    uint32_t hv;
+    uint32_t ts;     /* zero when free */
+    uint32_t units;
+    uint32_t older;  /* recency list, by index into keys */
+    uint32_t newer;
+    uint32_t hnext;  /* hash chain, or the free list */
+    unsigned int clsid;
+} mrc_key;
+
+/* counts are doubles as they're scaled down when the rate is. */
+typedef struct {
+    uint32_t *tree;  /* units of the key last referenced at each timestamp */
+    double gets;
+    double hits[MRC_POINTS]; /* gets which hit at each point but not before */
+} mrc_curve;
+
+static pthread_mutex_t mrc_lock = PTHREAD_MUTEX_INITIALIZER;
+uint32_t mrc_threshold = 0;
+
+/* index 0 isn't used, so it can mean none. */
+static mrc_key *keys = NULL;
+static uint32_t *buckets = NULL;
+/* tracked keys by index, highest spread hash first. 1-based. */
+static uint32_t *heap = NULL;
+static uint32_t free_keys = 0;
+static uint32_t oldest = 0;
+static uint32_t newest = 0;
+static uint32_t tracked = 0;
+static uint32_t now = 1;
+static uint64_t step = 0;
+/* one in this many keys is sampled. */
+static double rate = 0;
+static mrc_curve total;
+static mrc_curve *classes[MAX_NUMBER_OF_SLAB_CLASSES];
+
+void mrc_init(void) {
+    uint32_t x;
+
+    if (settings.mrc_sample_rate == 0) {
+        return;
+    }
+    keys = calloc(MRC_KEYS + 1, sizeof(mrc_key));
+    buckets = calloc(MRC_KEYS, sizeof(uint32_t));
+    heap = calloc(MRC_KEYS + 1, sizeof(uint32_t));
+    total.tree = calloc(MRC_SLOTS + 1, sizeof(uint32_t));
+    if (keys == NULL || buckets == NULL || heap == NULL || total.tree == NULL) {
+        fprintf(stderr, "Failed to allocate miss ratio curve tables.\n");
+        exit(EXIT_FAILURE);
+    }
+    for (x = 1; x <= MRC_KEYS; x++) {
+        keys[x].hnext = x < MRC_KEYS ? x + 1 : 0;
+    }
+    free_keys = 1;
+    step = settings.maxbytes / MRC_STEPS;
+    if (step == 0) {
+        step = 1;
+    }
+    rate = settings.mrc_sample_rate;
+    mrc_threshold = UINT32_MAX / settings.mrc_sample_rate;
+}
+
+static void tree_add(uint32_t *tree, uint32_t ts, const uint32_t units) {
+    for (; ts <= MRC_SLOTS; ts += ts & -ts) {
+        tree[ts] += units;
+    }
+}
+
+static void tree_sub(uint32_t *tree, uint32_t ts, const uint32_t units) {
+    for (; ts <= MRC_SLOTS; ts += ts & -ts) {
+        tree[ts] -= units;
+    }
+}
+
+static uint64_t tree_sum(const uint32_t *tree, uint32_t ts) {
+    uint64_t sum = 0;
+    for (; ts > 0; ts -= ts & -ts) {
+        sum += tree[ts];
+    }
+    return sum;
+}
+
+static mrc_curve *mrc_class(const unsigned int clsid) {
+    mrc_curve *cv = classes[clsid];
+    if (cv == NULL) {
+        cv = calloc(1, sizeof(mrc_curve));
+        if (cv == NULL) {
+            return NULL;
+        }
+        cv->tree = calloc(MRC_SLOTS + 1, sizeof(uint32_t));
+        if (cv->tree == NULL) {
+            free(cv);
+            return NULL;
+        }
+        classes[clsid] = cv;
+    }
+    return cv;
+}
+
+/* Counts a hit for every memory size which would have held this many units
+ * referenced since, itself included. */
+static void mrc_hit(mrc_curve *cv, const uint64_t units) {
+    double point = (double)units * MRC_UNIT * rate / step;
+    if (point < MRC_POINTS) {
+        cv->hits[(int)point]++;
+    }
+}
+
+static uint64_t mrc_distance(const uint32_t *tree, const uint32_t ts) {
+    return tree_sum(tree, now - 1) - tree_sum(tree, ts - 1);
+}
+
+static mrc_key *mrc_find(const uint32_t hv) {
+    uint32_t x = buckets[hv & (MRC_KEYS - 1)];
+    while (x != 0 && keys[x].hv != hv) {
+        x = keys[x].hnext;
+    }
+    return x != 0 ? &keys[x] : NULL;
+}
+
+/* Takes a key out of the trees and the recency list, but not the hash. */
+static void mrc_unlink(mrc_key *k) {
+    tree_sub(total.tree, k->ts, k->units);
+    if (classes[k->clsid] != NULL) {
+        tree_sub(classes[k->clsid]->tree, k->ts, k->units);
+    }
+    if (k->older != 0) {
+        keys[k->older].newer = k->newer;
+    } else {
+        oldest = k->newer;
+    }
+    if (k->newer != 0) {
+        keys[k->newer].older = k->older;
+    } else {
+        newest = k->older;
+    }
+    k->older = k->newer = 0;
+}
+
+static bool heap_above(const uint32_t a, const uint32_t b) {
+    return mrc_spread(keys[heap[a]].hv) > mrc_spread(keys[heap[b]].hv);
+}
+
+static void heap_swap(const uint32_t a, const uint32_t b) {
+    uint32_t id = heap[a];
+    heap[a] = heap[b];
+    heap[b] = id;
+}
+
+static void heap_push(const uint32_t id) {
+    uint32_t x = tracked;
+    heap[x] = id;
+    for (; x > 1 && heap_above(x, x / 2); x /= 2) {
+        heap_swap(x, x / 2);
+    }
+}
+
+/* takes the top off the heap, which has one more key than tracked. */
+static void heap_pop(void) {
+    uint32_t x = 1;
+    heap_swap(1, tracked + 1);
+    for (;;) {
+        uint32_t top = x;
+        if (x * 2 <= tracked && heap_above(x * 2, top)) {
+            top = x * 2;
+        }
+        if (x * 2 + 1 <= tracked && heap_above(x * 2 + 1, top)) {
+            top = x * 2 + 1;
+        }
+        if (top == x) {
+            break;
+        }
+        heap_swap(x, top);
+        x = top;
+    }
+}
+
+static void mrc_curve_scale(mrc_curve *cv, const double scale) {
+    int i;
+    cv->gets *= scale;
+    for (i = 0; i < MRC_POINTS; i++) {
+        cv->hits[i] *= scale;
+    }
+}
+
+/* Stops sampling keys at or above this spread hash. */
+static void mrc_lower_threshold(const uint32_t threshold) {
+    double scale = (double)threshold / mrc_threshold;
+    int i;
+
+    mrc_curve_scale(&total, scale);
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (classes[i] != NULL) {
+            mrc_curve_scale(classes[i], scale);
+        }
+    }
+    rate /= scale;
+    mrc_threshold = threshold;
+}
+
+/* Forgets the key at the top of the heap. */
+static void mrc_forget_top(void) {
+    uint32_t id = heap[1];
+    mrc_key *k = &keys[id];
+    uint32_t *x = &buckets[k->hv & (MRC_KEYS - 1)];
+
+    mrc_unlink(k);
+    while (*x != id) {
+        x = &keys[*x].hnext;
+    }
+    *x = k->hnext;
+    k->ts = 0;
+    k->hnext = free_keys;
+    free_keys = id;
+    tracked--;
+    heap_pop();
+}
+
+static void mrc_renumber(void) {
+    uint32_t x;
+    int i;
+
+    memset(total.tree, 0, (MRC_SLOTS + 1) * sizeof(uint32_t));
+    for (i = 0; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (classes[i] != NULL) {
+            memset(classes[i]->tree, 0, (MRC_SLOTS + 1) * sizeof(uint32_t));
+        }
+    }
+    now = 1;
+    for (x = oldest; x != 0; x = keys[x].newer) {
+        mrc_key *k = &keys[x];
+        k->ts = now++;
+        tree_add(total.tree, k->ts, k->units);
+        if (classes[k->clsid] != NULL) {
+            tree_add(classes[k->clsid]->tree, k->ts, k->units);
+        }
+    }
+}
+
+void mrc_reference(const uint32_t hv, const unsigned int clsid,
+        const size_t size, const bool get) {
+    mrc_key *k;
+    uint32_t id;
+
+    pthread_mutex_lock(&mrc_lock);
+    // the rate may have been lowered since the caller checked.
+    if (!mrc_sampled(hv)) {
+        pthread_mutex_unlock(&mrc_lock);
+        return;
+    }
+    if (get) {
+        total.gets++;
+    }
+    k = mrc_find(hv);
+    if (k != NULL) {
+        if (get) {
+            mrc_hit(&total, mrc_distance(total.tree, k->ts));
+            if (classes[k->clsid] != NULL) {
+                classes[k->clsid]->gets++;
+                mrc_hit(classes[k->clsid], mrc_distance(classes[k->clsid]->tree, k->ts));
+            }
+        }
+        mrc_unlink(k);
+    } else {
+        if (get && clsid != 0 && mrc_class(clsid) != NULL) {
+            classes[clsid]->gets++;
+        }
+        // a miss on a key we know nothing about has no size to track.
+        if (clsid == 0) {
+            pthread_mutex_unlock(&mrc_lock);
+            return;
+        }
+        if (free_keys == 0) {
+            uint32_t top = mrc_spread(keys[heap[1]].hv);
+            // this key would be the first to go at a lower rate.
+            if (mrc_spread(hv) > top) {
+                mrc_lower_threshold(mrc_spread(hv));
+                pthread_mutex_unlock(&mrc_lock);
+                return;
+            }
+            mrc_lower_threshold(top);
+            mrc_forget_top();
+        }
+        id = free_keys;
+        k = &keys[id];
+        free_keys = k->hnext;
+        k->hv = hv;
+        k->hnext = buckets[hv & (MRC_KEYS - 1)];
+        buckets[hv & (MRC_KEYS - 1)] = id;
+        tracked++;
+        heap_push(id);
+    }
+
+    // a miss keeps the key where its last store left it, size and all.
+    if (clsid != 0) {
+        k->units = (size + MRC_UNIT - 1) / MRC_UNIT;
+        k->clsid = mrc_class(clsid) != NULL ? clsid : 0;
+    }
+    if (now > MRC_SLOTS) {
+        mrc_renumber();
+    }
+    k->ts = now++;
+    tree_add(total.tree, k->ts, k->units);
+    if (classes[k->clsid] != NULL) {
+        tree_add(classes[k->clsid]->tree, k->ts, k->units);
+    }
+    id = k - keys;
+    k->older = newest;
+    if (newest != 0) {
+        keys[newest].newer = id;
+    } else {
+        oldest = id;
+    }
+    newest = id;
+    pthread_mutex_unlock(&mrc_lock);
+}
+
+static void mrc_curve_stats(const mrc_curve *cv, const char *prefix,
+        ADD_STAT add_stats, void *c) {
+    char key[STAT_KEY_LEN];
+    double hits = 0;
+    int i;
+
+    snprintf(key, sizeof(key), "%sgets", prefix);
+    APPEND_STAT(key, "%.0f", cv->gets);
+    if (cv->gets == 0) {
+        return;
+    }
+    for (i = 0; i < MRC_POINTS; i++) {
+        hits += cv->hits[i];
+        snprintf(key, sizeof(key), "%smiss_ratio:%llu", prefix,
+                (unsigned long long)(step * (i + 1)));
+        APPEND_STAT(key, "%.4f", (cv->gets - hits) / cv->gets);
+    }
+}
+
+void mrc_stats(ADD_STAT add_stats, void *c) {
+    char prefix[16];
+    int i;
+
+    if (mrc_threshold == 0) {
+        APPEND_STAT("mrc_status", "disabled", "");
+        add_stats(NULL, 0, NULL, 0, c);
+        return;
+    }
+
+    pthread_mutex_lock(&mrc_lock);
+    APPEND_STAT("sample_rate", "%g", rate);
+    APPEND_STAT("tracked_keys", "%u", tracked);
+    mrc_curve_stats(&total, "", add_stats, c);
+    for (i = 1; i < MAX_NUMBER_OF_SLAB_CLASSES; i++) {
+        if (classes[i] != NULL) {
+            snprintf(prefix, sizeof(prefix), "%d:", i);
+            mrc_curve_stats(classes[i], prefix, add_stats, c);
+        }
+    }
+    add_stats(NULL, 0, NULL, 0, c);
+    pthread_mutex_unlock(&mrc_lock);
+}
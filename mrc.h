@@ -0,0 +1,36 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef MRC_H
+#define MRC_H
+
+/*
+ * Miss ratio curves, for 'stats mrc'.
+ *
+ * A small fraction of keys, picked by their hash, are run through a simulated
+ * LRU which never evicts. The reuse distance of each fetch, in bytes, says
+ * how much memory it would have taken to hit. Scaled up by the sampling rate,
+ * that gives the miss ratio the cache would have at other memory limits,
+ * both overall and for each slab class.
+ */
+
+/* zero when disabled. Only ever lowered once set. */
+extern uint32_t mrc_threshold;
+
+/* spreads the hash out so the sampled keys don't share low bits. */
+static inline uint32_t mrc_spread(const uint32_t hv) {
+    return hv * 0x9e3779b1U;
+}
+
+static inline bool mrc_sampled(const uint32_t hv) {
+    return mrc_spread(hv) < mrc_threshold;
+}
+
+/* Sets up sampling of 1 in settings.mrc_sample_rate keys, or fewer once
+ * that's more keys than can be tracked. */
+void mrc_init(void);
+/* A fetch (get) or store of a sampled key. clsid is 0 for a fetch which
+ * missed. */
+void mrc_reference(const uint32_t hv, const unsigned int clsid,
+        const size_t size, const bool get);
+void mrc_stats(ADD_STAT add_stats, void *c);
+
+#endif
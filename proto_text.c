@@ -12,9 +12,13 @@
 #include "authfile.h"
 #include "storage.h"
 #include "base64.h"
+#include "snapshot.h"
 #ifdef TLS
 #include "tls.h"
 #endif
+#ifdef SHM_TRANSPORT
+#include "shm.h"
+#endif
 #include <string.h>
 #include <stdlib.h>
 
@@ -444,6 +448,47 @@ int try_read_command_asciiauth(conn *c) {
     return 1;
 }
 
+/*
+ * Pipelined meta gets show up as a run of commands in one read. When we reach
+ * the start of such a run, prefetch the keys of every complete mg line in it
+ * so their cache misses overlap, rather than being taken one command at a
+ * time. Keys are taken as they appear on the line; a base64 encoded key only
+ * costs a wasted prefetch.
+ */
+static void process_meta_prefetch(conn *c) {
+    item_batch_key keys[ITEM_BATCH_MAX];
+    char *line = c->rcurr;
+    char *end = c->rcurr + c->rbytes;
+    int nkeys = 0;
+
+    while (nkeys < ITEM_BATCH_MAX && end - line > 3
+            && strncmp(line, "mg ", 3) == 0) {
+        char *el = memchr(line, '\n', end - line);
+        char *key = line + 3;
+        size_t nkey = 0;
+        if (el == NULL) {
+            break;
+        }
+        while (key < el && *key == ' ') {
+            key++;
+        }
+        while (key + nkey < el && key[nkey] != ' ' && key[nkey] != '\r') {
+            nkey++;
+        }
+        if (nkey > 0 && nkey <= KEY_MAX_LENGTH) {
+            keys[nkeys].key = key;
+            keys[nkeys].nkey = nkey;
+            nkeys++;
+        }
+        line = el + 1;
+    }
+
+    c->rprefetched = line - c->rcurr;
+    if (nkeys > 1) {
+        item_prefetch_batch(keys, nkeys);
+    }
+}
+
 int try_read_command_ascii(conn *c) {
     char *el, *cont;
 
@@ -483,6 +528,9 @@ int try_read_command_ascii(conn *c) {
         return 0;
     }
     cont = el + 1;
+    if (c->rprefetched < cont - c->rcurr && cont < c->rcurr + c->rbytes) {
+        process_meta_prefetch(c);
+    }
     if ((el - c->rcurr) > 1 && *(el - 1) == '\r') {
         el--;
     }
@@ -494,6 +542,10 @@ int try_read_command_ascii(conn *c) {
     process_command_ascii(c, c->rcurr);
 
     c->rbytes -= (cont - c->rcurr);
+    c->rprefetched -= (cont - c->rcurr);
+    if (c->rprefetched < 0) {
+        c->rprefetched = 0;
+    }
     c->rcurr = cont;
 
     assert(c->rcurr <= (c->rbuf + c->rsize));
@@ -545,6 +597,56 @@ static inline int make_ascii_get_suffix(char *suffix, item *it, bool return_cas,
     return (p - suffix) + 2;
 }
 
+/* "VALUE " plus the longest suffix make_ascii_get_suffix() writes. */
+#define ASCII_GET_OVERHEAD (6 + 48)
+
+/* Serves a get hit with -o lockfree_get. The item is copied whole into the
+ * response's write buffer, as we hold no reference to keep it around while
+ * it's written out, so this only works for small items. Returns false if
+ * the caller should do a normal fetch. */
+static bool process_get_lockfree(conn *c, mc_resp *resp, char *key, size_t nkey,
+        const uint32_t hv, bool return_cas) {
+    item *it = item_read_begin(key, nkey, hv, c->thread);
+    char *p = resp->wbuf;
+    int nbytes;
+    int clsid;
+
+    if (it == NULL) {
+        return false;
+    }
+    nbytes = it->nbytes;
+    if (nkey + nbytes + ASCII_GET_OVERHEAD > WRITE_BUFFER_SIZE) {
+        item_read_end(c->thread, it);
+        return false;
+    }
+
+    memcpy(p, "VALUE ", 6);
+    p += 6;
+    memcpy(p, key, nkey);
+    p += nkey;
+    p += make_ascii_get_suffix(p, it, return_cas, nbytes);
+    MEMCACHED_COMMAND_GET(c->sfd, key, nkey, nbytes, ITEM_get_cas(it));
+    memcpy(p, ITEM_data(it), nbytes);
+    p += nbytes;
+    clsid = it->slabs_clsid;
+    if (!item_read_end(c->thread, it)) {
+        return false;
+    }
+    resp_add_iov(resp, resp->wbuf, p - resp->wbuf);
+
+    if (settings.detail_enabled) {
+        stats_prefix_record_get(key, nkey, true);
+    }
+    if (settings.verbose > 1) {
+        fprintf(stderr, ">%d sending key %.*s\n", c->sfd, (int)nkey, key);
+    }
+    pthread_mutex_lock(&c->thread->stats.mutex);
+    c->thread->stats.lru_hits[clsid]++;
+    c->thread->stats.get_cmds++;
+    pthread_mutex_unlock(&c->thread->stats.mutex);
+    return true;
+}
+
 /* ntokens is overwritten here... shrug.. */
 static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens, bool return_cas, bool should_touch) {
     char *key;
@@ -568,6 +670,19 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
     }
 
     do {
+        item_batch_key keys[MAX_TOKENS];
+        int nkeys = 0;
+        int kidx = 0;
+        token_t *kt;
+
+        // hash and prefetch this run of keys before fetching any of them.
+        for (kt = key_token; kt->length != 0 && kt->length <= KEY_MAX_LENGTH; kt++) {
+            keys[nkeys].key = kt->value;
+            keys[nkeys].nkey = kt->length;
+            nkeys++;
+        }
+        item_prefetch_batch(keys, nkeys);
+
         while(key_token->length != 0) {
             bool overflow; // not used here.
             key = key_token->value;
@@ -578,7 +693,13 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 goto stop;
             }
 
-            it = limited_get(key, nkey, c->thread, exptime, should_touch, DO_UPDATE, &overflow);
+            if (settings.lockfree_get && !should_touch
+                    && process_get_lockfree(c, resp, key, nkey, keys[kidx].hv, return_cas)) {
+                kidx++;
+                goto next_key;
+            }
+
+            it = limited_get_hv(key, nkey, keys[kidx++].hv, c->thread, exptime, should_touch, DO_UPDATE, &overflow);
             if (settings.detail_enabled) {
                 stats_prefix_record_get(key, nkey, NULL != it);
             }
@@ -667,6 +788,7 @@ static inline void process_get_command(conn *c, token_t *tokens, size_t ntokens,
                 pthread_mutex_unlock(&c->thread->stats.mutex);
             }
 
+next_key:
             key_token++;
             if (key_token->length != 0) {
                 if (!resp_start(c)) {
@@ -797,6 +919,8 @@ static void process_stat(conn *c, token_t *tokens, const size_t ntokens) {
         return;
     } else if (strcmp(subcommand, "conns") == 0) {
         process_stats_conns(&append_stats, c);
+    } else if (strcmp(subcommand, "workers") == 0) {
+        process_stats_workers(&append_stats, c);
 #ifdef EXTSTORE
     } else if (strcmp(subcommand, "extstore") == 0) {
         process_extstore_stats(&append_stats, c);
@@ -1591,6 +1715,19 @@ error:
     conn_set_state(c, conn_swallow);
 }
 
+// Sets the connection's priority class for -o sched_quantum.
+static void process_mpriority_command(conn *c, token_t *tokens, const size_t ntokens) {
+    uint32_t class;
+
+    if (ntokens != 3 || !safe_strtoul(tokens[KEY_TOKEN].value, &class)
+            || class >= SCHED_CLASSES) {
+        out_errstring(c, "CLIENT_ERROR bad priority class");
+        return;
+    }
+    c->sched_class = class;
+    out_string(c, "HD");
+}
+
 static void process_mdelete_command(conn *c, token_t *tokens, const size_t ntokens) {
     char *key;
     size_t nkey;
@@ -2547,6 +2684,38 @@ static void process_quit_command(conn *c) {
     c->close_reason = NORMAL_CLOSE;
 }
 
+#ifdef SHM_TRANSPORT
+static void process_shm_command(conn *c) {
+    if (settings.shm_ring_size == 0) {
+        out_string(c, "CLIENT_ERROR shm transport not enabled");
+        return;
+    }
+    if (c->transport != local_transport) {
+        out_string(c, "CLIENT_ERROR shm only works over a unix socket");
+        return;
+    }
+    if (c->shm != NULL) {
+        out_string(c, "CLIENT_ERROR already using shm");
+        return;
+    }
+    // the reply skips the response queue, so it can't be pipelined.
+    if (c->resp_head != c->resp) {
+        out_string(c, "CLIENT_ERROR shm must be sent on its own");
+        return;
+    }
+
+    if (!shm_conn_start(c)) {
+        out_string(c, "SERVER_ERROR failed to set up shm");
+        return;
+    }
+    if (c->state != conn_closing) {
+        // already answered.
+        c->resp->skip = true;
+        conn_set_state(c, conn_new_cmd);
+    }
+}
+#endif
+
 static void process_shutdown_command(conn *c, token_t *tokens, const size_t ntokens) {
     if (!settings.shutdown_command) {
         out_string(c, "ERROR: shutdown not enabled");
@@ -2608,6 +2777,27 @@ static void process_slabs_command(conn *c, token_t *tokens, const size_t ntokens
     }
 }
 
+static void process_hash_command(conn *c, token_t *tokens, const size_t ntokens) {
+    if (ntokens == 3 && strcmp(tokens[COMMAND_TOKEN + 1].value, "shrink") == 0) {
+        switch (assoc_start_shrink()) {
+        case SHRINK_OK:
+            out_string(c, "OK");
+            break;
+        case SHRINK_RUNNING:
+            out_string(c, "BUSY currently resizing hash table");
+            break;
+        case SHRINK_MINIMUM:
+            out_string(c, "MINIMUM hash table is at its starting size");
+            break;
+        case SHRINK_DISABLED:
+            out_string(c, "CLIENT_ERROR hash table resizing disabled");
+            break;
+        }
+    } else {
+        out_string(c, "ERROR");
+    }
+}
+
 static void process_lru_crawler_command(conn *c, token_t *tokens, const size_t ntokens) {
     if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "crawl") == 0) {
         int rv;
@@ -2712,6 +2902,79 @@ static void process_lru_crawler_command(conn *c, token_t *tokens, const size_t n
                 break;
         }
         return;
+    } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "invalidate") == 0) {
+        if (settings.lru_crawler == false) {
+            out_string(c, "CLIENT_ERROR lru crawler disabled");
+            return;
+        }
+        if (tokens[2].length > KEY_MAX_LENGTH) {
+            out_string(c, "CLIENT_ERROR pattern too long");
+            return;
+        }
+
+        int rv = lru_crawler_invalidate(tokens[2].value);
+        switch(rv) {
+            case CRAWLER_OK:
+                out_string(c, "OK");
+                break;
+            case CRAWLER_RUNNING:
+                out_string(c, "BUSY currently processing crawler request");
+                break;
+            case CRAWLER_NOTSTARTED:
+                out_string(c, "NOTSTARTED no items to crawl");
+                break;
+            default:
+                out_string(c, "ERROR an unknown error happened");
+                break;
+        }
+        return;
+    } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "export") == 0) {
+        if (settings.lru_crawler == false) {
+            out_string(c, "CLIENT_ERROR lru crawler disabled");
+            return;
+        }
+        if (!settings.dump_enabled) {
+            out_string(c, "ERROR export not allowed");
+            return;
+        }
+        if (resp_has_stack(c)) {
+            out_string(c, "ERROR cannot pipeline other commands before export");
+            return;
+        }
+
+        int rv = lru_crawler_export(tokens[2].value, c, c->sfd);
+        switch(rv) {
+            case CRAWLER_OK:
+                // the crawler replies once the file is written.
+                conn_set_state(c, conn_watch);
+                event_del(&c->event);
+                break;
+            case CRAWLER_RUNNING:
+                out_string(c, "BUSY currently processing crawler request");
+                break;
+            case CRAWLER_NOTSTARTED:
+                out_string(c, "NOTSTARTED no items to crawl");
+                break;
+            default:
+                out_string(c, "ERROR could not open export file");
+                break;
+        }
+        return;
+    } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "import") == 0) {
+        if (!settings.dump_enabled) {
+            out_string(c, "ERROR import not allowed");
+            return;
+        }
+
+        int rv = snapshot_load_start(tokens[2].value);
+        if (rv == 0) {
+            out_string(c, "OK");
+        } else if (rv == -1) {
+            out_string(c, "BUSY currently loading a snapshot");
+        } else {
+            out_string(c, "ERROR an unknown error happened");
+        }
+        return;
     } else if (ntokens == 4 && strcmp(tokens[COMMAND_TOKEN + 1].value, "tocrawl") == 0) {
         uint32_t tocrawl;
          if (!safe_strtoul(tokens[2].value, &tocrawl)) {
@@ -2833,6 +3096,9 @@ void process_command_ascii(conn *c, char *command) {
             case 'e':
                 process_meta_command(c, tokens, ntokens);
                 break;
+            case 'p':
+                process_mpriority_command(c, tokens, ntokens);
+                break;
             default:
                 out_string(c, "ERROR");
                 break;
@@ -2869,6 +3135,12 @@ void process_command_ascii(conn *c, char *command) {
         } else if (strcmp(tokens[COMMAND_TOKEN].value, "slabs") == 0) {
 
             process_slabs_command(c, tokens, ntokens);
+#ifdef SHM_TRANSPORT
+        } else if (strcmp(tokens[COMMAND_TOKEN].value, "shm") == 0) {
+
+            WANT_TOKENS(ntokens, 2, 2);
+            process_shm_command(c);
+#endif
         } else {
             out_string(c, "ERROR");
         }
@@ -2957,6 +3229,10 @@ void process_command_ascii(conn *c, char *command) {
 
         process_lru_crawler_command(c, tokens, ntokens);
 
+    } else if (strcmp(tokens[COMMAND_TOKEN].value, "hash") == 0) {
+
+        process_hash_command(c, tokens, ntokens);
+
     } else if (strcmp(tokens[COMMAND_TOKEN].value, "watch") == 0) {
 
         process_watch_command(c, tokens, ntokens);
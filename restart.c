@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <fcntl.h>
 #include <string.h>
+#include <pthread.h>
 
 typedef struct _restart_data_cb restart_data_cb;
 
@@ -26,6 +27,9 @@ static void *mmap_base = NULL;
 static size_t slabmem_limit = 0;
 char *memory_file = NULL;
 
+static void *mmap_hint = NULL;
+static unsigned int index_restored = 0;
+
 static restart_data_cb *cb_stack = NULL;
 
 // Allows submodules and engines to have independent check and save metadata
@@ -316,21 +320,33 @@ bool restart_mmap_open(const size_t limit, const char *file, void **mem_base) {
         fprintf(stderr, "[restart] memory limit not divisible evenly by pagesize (please report bug)\n");
         abort();
     }
-    mmap_base = mmap(NULL, limit, PROT_READ|PROT_WRITE, MAP_SHARED, mmap_fd, 0);
-    if (mmap_base == MAP_FAILED) {
-        perror("failed to mmap, aborting");
-        abort();
-    }
     // Set the limit before calling check_mmap, so we can find the meta page..
     slabmem_limit = limit;
     if (restart_check(file) != 0) {
         reuse_mmap = false;
     }
+    // The metadata is checked before mapping so we can ask for the same
+    // address as last time. If we get it, no pointers need fixing up.
+    mmap_base = mmap(reuse_mmap ? mmap_hint : NULL, limit,
+            PROT_READ|PROT_WRITE, MAP_SHARED, mmap_fd, 0);
+    if (mmap_base == MAP_FAILED) {
+        perror("failed to mmap, aborting");
+        abort();
+    }
     *mem_base = mmap_base;
 
     return reuse_mmap;
 }
 
+// Called while checking metadata with the address the memory was mapped at.
+void restart_mmap_hint(void *addr) {
+    mmap_hint = addr;
+}
+
+void restart_index_restored(enum restart_index_part part) {
+    index_restored |= part;
+}
+
 /* Gracefully stop/close the shared memory segment */
 void restart_mmap_close(void) {
     msync(mmap_base, slabmem_limit, MS_SYNC);
@@ -348,28 +364,51 @@ void restart_mmap_close(void) {
     free(memory_file);
 }
 
-// given memory base, quickly walk memory and do pointer fixup.
-// do this once on startup to avoid having to do pointer fixup on every
-// reference from hash table or LRU.
-unsigned int restart_fixup(void *orig_addr) {
-    struct timeval tv;
-    uint64_t checked = 0;
+// Registers every page with its slab class, without looking at the chunks
+// inside them. Only usable when nothing needs fixing up.
+static void restart_fixup_pages(void) {
+    uint64_t checked;
+    for (checked = 0; checked < slabmem_limit; checked += settings.slab_page_size) {
+        slabs_fixup((char *)mmap_base + checked, 0, NULL);
+    }
+}
+
+/*
+ * Recovery is split across settings.restart_threads threads, which claim runs
+ * of pages from the memory file until none are left. Each thread keeps its
+ * own freelists and item counts and merges them in once it's done. The only
+ * thing they share while walking is the hash table, which is covered by a
+ * set of striped locks.
+ */
+#define RESTART_FIXUP_PAGES 16
+#define RESTART_FIXUP_LOCKS 1024
+
+typedef struct {
+    pthread_t tid;
+    void *orig_addr;
+    bool relink;
+    bool locked; // only needed with more than one thread.
+    slabs_fixup_freelists freelists;
+    item_fixup_counts counts;
+} restart_fixup_thread;
+
+static uint64_t fixup_cursor = 0;
+static pthread_mutex_t fixup_locks[RESTART_FIXUP_LOCKS];
+
+// walks the chunks in a run of whole pages.
+static void restart_fixup_range(restart_fixup_thread *t, uint64_t checked, const uint64_t end) {
     const unsigned int page_size = settings.slab_page_size;
     unsigned int page_remain = page_size;
-
-    gettimeofday(&tv, NULL);
-    if (settings.verbose > 0) {
-        fprintf(stderr, "[restart] original memory base: [%p] new base: [%p]\n", orig_addr, mmap_base);
-        fprintf(stderr, "[restart] recovery start [%d.%d]\n", (int)tv.tv_sec, (int)tv.tv_usec);
-    }
+    void *orig_addr = t->orig_addr;
 
     // since chunks don't align with pages, we have to also track page size.
-    while (checked < slabmem_limit) {
+    while (checked < end) {
         //fprintf(stderr, "checked: %lu\n", checked);
         item *it = (item *)((char *)mmap_base + checked);
 
         int size = slabs_fixup((char *)mmap_base + checked,
-                checked % settings.slab_page_size);
+                checked % settings.slab_page_size,
+                t->relink ? &t->freelists : NULL);
         //fprintf(stderr, "id: %d, size: %d remain: %u\n", it->slabs_clsid, size, page_remain);
         // slabber gobbled an entire page, skip and move on.
         if (size == -1) {
@@ -383,16 +422,37 @@ unsigned int restart_fixup(void *orig_addr) {
         if (it->it_flags & ITEM_LINKED) {
             // fixup next/prev links while on LRU.
             if (it->next) {
-                it->next = (item *)((mc_ptr_t)it->next - (mc_ptr_t)orig_addr);
-                it->next = (item *)((mc_ptr_t)it->next + (mc_ptr_t)mmap_base);
+                it->next = restart_rebase(it->next, orig_addr, mmap_base);
             }
             if (it->prev) {
-                it->prev = (item *)((mc_ptr_t)it->prev - (mc_ptr_t)orig_addr);
-                it->prev = (item *)((mc_ptr_t)it->prev + (mc_ptr_t)mmap_base);
+                it->prev = restart_rebase(it->prev, orig_addr, mmap_base);
             }
 
             //fprintf(stderr, "item was linked\n");
-            do_item_link_fixup(it);
+            if (t->relink) {
+                uint32_t hv = hash(ITEM_key(it), it->nkey);
+                pthread_mutex_t *lock = &fixup_locks[hv % RESTART_FIXUP_LOCKS];
+                if (t->locked) {
+                    pthread_mutex_lock(lock);
+                }
+                do_item_link_fixup(it, hv, &t->counts);
+                if (t->locked) {
+                    pthread_mutex_unlock(lock);
+                }
+            } else {
+                if (it->h_next) {
+                    it->h_next = restart_rebase(it->h_next, orig_addr, mmap_base);
+                }
+                item_stats_sizes_add(it);
+            }
+        } else if (it->it_flags == ITEM_SLABBED && !t->relink) {
+            // freelist was saved, so its links need moving too.
+            if (it->next) {
+                it->next = restart_rebase(it->next, orig_addr, mmap_base);
+            }
+            if (it->prev) {
+                it->prev = restart_rebase(it->prev, orig_addr, mmap_base);
+            }
         }
 
         if (it->it_flags & (ITEM_CHUNKED|ITEM_CHUNK)) {
@@ -410,16 +470,13 @@ unsigned int restart_fixup(void *orig_addr) {
                 ch = (item_chunk *) it;
             }
             if (ch->next) {
-                ch->next = (item_chunk *)((mc_ptr_t)ch->next - (mc_ptr_t)orig_addr);
-                ch->next = (item_chunk *)((mc_ptr_t)ch->next + (mc_ptr_t)mmap_base);
+                ch->next = restart_rebase(ch->next, orig_addr, mmap_base);
             }
             if (ch->prev) {
-                ch->prev = (item_chunk *)((mc_ptr_t)ch->prev - (mc_ptr_t)orig_addr);
-                ch->prev = (item_chunk *)((mc_ptr_t)ch->prev + (mc_ptr_t)mmap_base);
+                ch->prev = restart_rebase(ch->prev, orig_addr, mmap_base);
             }
             if (ch->head) {
-                ch->head = (item *)((mc_ptr_t)ch->head - (mc_ptr_t)orig_addr);
-                ch->head = (item *)((mc_ptr_t)ch->head + (mc_ptr_t)mmap_base);
+                ch->head = restart_rebase(ch->head, orig_addr, mmap_base);
             }
         }
 
@@ -433,6 +490,90 @@ unsigned int restart_fixup(void *orig_addr) {
         }
         //assert(checked != 3145728);
     }
+}
+
+static void *restart_fixup_worker(void *arg) {
+    restart_fixup_thread *t = arg;
+    const uint64_t run = (uint64_t)settings.slab_page_size * RESTART_FIXUP_PAGES;
+
+    while (1) {
+        uint64_t start = __atomic_fetch_add(&fixup_cursor, run, __ATOMIC_RELAXED);
+        uint64_t end = start + run;
+        if (start >= slabmem_limit) {
+            break;
+        }
+        if (end > slabmem_limit) {
+            end = slabmem_limit;
+        }
+        restart_fixup_range(t, start, end);
+    }
+
+    if (t->relink) {
+        slabs_fixup_merge(&t->freelists);
+        item_fixup_merge(&t->counts);
+    }
+    return NULL;
+}
+
+// given memory base, quickly walk memory and do pointer fixup.
+// do this once on startup to avoid having to do pointer fixup on every
+// reference from hash table or LRU.
+// If the hash table, LRU and slab freelists were all saved, items only need
+// their pointers moved to the new base, or nothing at all if the memory came
+// back at the same address. Otherwise every item is relinked from scratch.
+unsigned int restart_fixup(void *orig_addr) {
+    struct timeval tv;
+    bool relink = index_restored != RESTART_INDEX_ALL;
+    int nthreads = settings.restart_threads;
+    restart_fixup_thread *threads;
+    int x;
+
+    gettimeofday(&tv, NULL);
+    if (settings.verbose > 0) {
+        fprintf(stderr, "[restart] original memory base: [%p] new base: [%p]\n", orig_addr, mmap_base);
+        fprintf(stderr, "[restart] recovery start [%d.%d]\n", (int)tv.tv_sec, (int)tv.tv_usec);
+        fprintf(stderr, "[restart] %s\n", relink ? "relinking items"
+                : "reusing saved hash table and LRU");
+    }
+
+    assoc_restart_fixup(orig_addr, mmap_base, relink);
+    item_restart_fixup(orig_addr, mmap_base, relink);
+    slabs_restart_fixup(orig_addr, mmap_base, relink);
+
+    if (!relink && orig_addr == mmap_base && !item_stats_sizes_status()) {
+        restart_fixup_pages();
+        nthreads = 0;
+    }
+
+    threads = calloc(nthreads, sizeof(restart_fixup_thread));
+    if (threads == NULL && nthreads > 0) {
+        fprintf(stderr, "[restart] failed to allocate recovery threads\n");
+        abort();
+    }
+    for (x = 0; x < RESTART_FIXUP_LOCKS; x++) {
+        pthread_mutex_init(&fixup_locks[x], NULL);
+    }
+    fixup_cursor = 0;
+    for (x = 0; x < nthreads; x++) {
+        threads[x].orig_addr = orig_addr;
+        threads[x].relink = relink;
+        threads[x].locked = nthreads > 1;
+    }
+    // this thread takes a share too.
+    for (x = 1; x < nthreads; x++) {
+        if (pthread_create(&threads[x].tid, NULL, restart_fixup_worker, &threads[x]) != 0) {
+            fprintf(stderr, "[restart] failed to start recovery thread\n");
+            abort();
+        }
+        thread_setname(threads[x].tid, "mc-restart");
+    }
+    if (nthreads > 0) {
+        restart_fixup_worker(&threads[0]);
+    }
+    for (x = 1; x < nthreads; x++) {
+        pthread_join(threads[x].tid, NULL);
+    }
+    free(threads);
 
     if (settings.verbose > 0) {
         gettimeofday(&tv, NULL);
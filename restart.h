@@ -22,7 +22,22 @@ void restart_set_kv(void *ctx, const char *key, const char *fmt, ...);
 enum restart_get_kv_ret restart_get_kv(void *ctx, char **key, char **val);
 
 bool restart_mmap_open(const size_t limit, const char *file, void **mem_base);
+void restart_mmap_hint(void *addr);
 void restart_mmap_close(void);
 unsigned int restart_fixup(void *old_base);
 
+// Parts of the item index saved alongside the memory file. If all of them
+// come back, restart_fixup() doesn't need to relink every item.
+enum restart_index_part {
+    RESTART_INDEX_HASH = 1,
+    RESTART_INDEX_LRU = 2,
+    RESTART_INDEX_SLABS = 4,
+    RESTART_INDEX_ALL = 7
+};
+void restart_index_restored(enum restart_index_part part);
+
+// Moves a pointer saved against the old memory base over to the new one.
+#define restart_rebase(ptr, old_base, new_base) \
+    ((void *)((mc_ptr_t)(ptr) - (mc_ptr_t)(old_base) + (mc_ptr_t)(new_base)))
+
 #endif
@@ -0,0 +1,311 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Shared memory transport for clients on the same host ("-o shm_ring_size").
+ *
+ * A client on the unix socket sends "shm" and gets back a memfd holding two
+ * byte rings: it writes requests into one and reads responses out of the
+ * other. The connection is otherwise an ordinary ascii connection; c->read
+ * and c->sendmsg copy to and from the rings instead of the socket, so
+ * requests go through the same parser as everywhere else.
+ *
+ * The socket stays open for wakeups. Workers keep sleeping in epoll, so a
+ * client which finds the worker waiting on a ring writes a byte to the
+ * socket. Clients sleep on a futex in the ring instead, which the worker
+ * wakes. Either side only signals when the other has said it's waiting, so
+ * a connection that's kept busy makes no syscalls at all. The socket
+ * closing still closes the connection.
+ *
+ * The client can write to the shared memory at any time, so nothing read
+ * from it is trusted: the worker keeps its own copy of its cursors, and a
+ * ring that claims to hold more than fits closes the connection. The memfd
+ * is sealed against resizing before it's sent, so the mapping can't be cut
+ * out from under the worker.
+ */
+#include "memcached.h"
+#ifdef SHM_TRANSPORT
+#include "shm.h"
+#ifdef WORKER_URING
+#include "uring.h"
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+
+struct shm_conn {
+    struct shm_region *region;
+    size_t map_size;
+    unsigned char *req; /* request data */
+    unsigned char *resp; /* response data */
+    uint32_t size;
+    uint32_t req_head; /* our own cursors; the shared ones are only written */
+    uint32_t resp_tail;
+};
+
+static void shm_wake(uint32_t *addr) {
+    // not FUTEX_PRIVATE_FLAG; the waiter is in another process.
+    syscall(SYS_futex, addr, FUTEX_WAKE, INT_MAX, NULL, NULL, 0);
+}
+
+// Wakes the other side if it asked to be. The caller has just published a
+// cursor, so this has to be ordered after that store.
+static bool shm_signal(uint32_t *waiting) {
+    return __atomic_load_n(waiting, __ATOMIC_SEQ_CST)
+        && __atomic_exchange_n(waiting, 0, __ATOMIC_SEQ_CST);
+}
+
+// Anything on the socket is a wakeup. Returns what read() did.
+static ssize_t shm_drain(conn *c) {
+    char buf[64];
+    return read(c->sfd, buf, sizeof(buf));
+}
+
+ssize_t shm_read(conn *c, void *buf, size_t count) {
+    struct shm_conn *s = c->shm;
+    struct shm_ring *r = &s->region->req;
+
+    for (;;) {
+        uint32_t used = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE) - s->req_head;
+        if (used > s->size) {
+            errno = EPROTO;
+            return -1;
+        }
+        if (used > 0) {
+            uint32_t off = s->req_head & (s->size - 1);
+            size_t n = used < count ? used : count;
+            size_t first = s->size - off < n ? s->size - off : n;
+            memcpy(buf, s->req + off, first);
+            memcpy((char *)buf + first, s->req, n - first);
+            s->req_head += n;
+            __atomic_store_n(&r->reader_waiting, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->head, s->req_head, __ATOMIC_SEQ_CST);
+            if (shm_signal(&r->writer_waiting)) {
+                shm_wake(&r->head);
+            }
+            return n;
+        }
+
+        // ask for the socket to be rung, then look again in case the client
+        // wrote before it could see that.
+        __atomic_store_n(&r->reader_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) != s->req_head) {
+            continue;
+        }
+        ssize_t res = shm_drain(c);
+        if (res <= 0) {
+            // closed, or EAGAIN and the conn waits on the socket.
+            return res;
+        }
+    }
+}
+
+bool shm_wait(conn *c) {
+    struct shm_conn *s = c->shm;
+    struct shm_ring *r = &s->region->req;
+
+    __atomic_store_n(&r->reader_waiting, 1, __ATOMIC_SEQ_CST);
+    return __atomic_load_n(&r->tail, __ATOMIC_SEQ_CST) == s->req_head;
+}
+
+ssize_t shm_sendmsg(conn *c, struct msghdr *msg, int flags) {
+    struct shm_conn *s = c->shm;
+    struct shm_ring *r = &s->region->resp;
+
+    for (;;) {
+        uint32_t used = s->resp_tail - __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (used > s->size) {
+            errno = EPROTO;
+            return -1;
+        }
+        size_t room = s->size - used;
+        if (room > 0) {
+            size_t sent = 0;
+            for (size_t x = 0; x < msg->msg_iovlen && room > 0; x++) {
+                struct iovec *iov = &msg->msg_iov[x];
+                size_t n = iov->iov_len < room ? iov->iov_len : room;
+                uint32_t off = (s->resp_tail + sent) & (s->size - 1);
+                size_t first = s->size - off < n ? s->size - off : n;
+                memcpy(s->resp + off, iov->iov_base, first);
+                memcpy(s->resp, (char *)iov->iov_base + first, n - first);
+                sent += n;
+                room -= n;
+            }
+            s->resp_tail += sent;
+            __atomic_store_n(&r->writer_waiting, 0, __ATOMIC_RELAXED);
+            __atomic_store_n(&r->tail, s->resp_tail, __ATOMIC_SEQ_CST);
+            if (shm_signal(&r->reader_waiting)) {
+                shm_wake(&r->tail);
+                pthread_mutex_lock(&c->thread->stats.mutex);
+                c->thread->stats.shm_wakeups++;
+                pthread_mutex_unlock(&c->thread->stats.mutex);
+            }
+            return sent;
+        }
+
+        // full: the client rings the socket once it's made room, which
+        // transmit() waits for with EV_READ.
+        __atomic_store_n(&r->writer_waiting, 1, __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&r->head, __ATOMIC_SEQ_CST) + s->size != s->resp_tail) {
+            continue;
+        }
+        ssize_t res = shm_drain(c);
+        if (res == 0) {
+            errno = ECONNRESET;
+            return -1;
+        } else if (res < 0) {
+            return res;
+        }
+    }
+}
+
+ssize_t shm_write(conn *c, void *buf, size_t count) {
+    struct iovec iov = { .iov_base = buf, .iov_len = count };
+    struct msghdr msg;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    return shm_sendmsg(c, &msg, 0);
+}
+
+// The reply goes straight out on the socket since it has to carry the fd;
+// the caller made sure nothing else is waiting to be sent ahead of it.
+static bool shm_send_fd(conn *c, int fd, uint32_t size) {
+    char line[32];
+    union {
+        char buf[CMSG_SPACE(sizeof(int))];
+        struct cmsghdr align;
+    } ctl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+
+    int len = snprintf(line, sizeof(line), "SHM %u\r\n", size);
+    iov.iov_base = line;
+    iov.iov_len = len;
+    memset(&msg, 0, sizeof(msg));
+    memset(&ctl, 0, sizeof(ctl));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+    if (settings.verbose > 1)
+        fprintf(stderr, ">%d SHM %u\n", c->sfd, size);
+    return sendmsg(c->sfd, &msg, 0) == len;
+}
+
+bool shm_conn_start(conn *c) {
+    uint32_t size = settings.shm_ring_size;
+    size_t map_size = sizeof(struct shm_region) + (size_t)size * 2;
+    struct shm_conn *s;
+    void *map;
+
+    int fd = memfd_create("memcached-shm", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+    if (fd == -1) {
+        if (settings.verbose > 0)
+            perror("memfd_create");
+        return false;
+    }
+    if (ftruncate(fd, map_size) == -1) {
+        if (settings.verbose > 0)
+            perror("ftruncate");
+        close(fd);
+        return false;
+    }
+    // a client shrinking the file would have us fault on the next access.
+    if (fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) == -1) {
+        if (settings.verbose > 0)
+            perror("fcntl F_ADD_SEALS");
+        close(fd);
+        return false;
+    }
+    map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (map == MAP_FAILED) {
+        if (settings.verbose > 0)
+            perror("mmap");
+        close(fd);
+        return false;
+    }
+    s = calloc(1, sizeof(*s));
+    if (s == NULL) {
+        munmap(map, map_size);
+        close(fd);
+        return false;
+    }
+
+    // a new memfd is zeroed, so both rings start out empty.
+    s->region = map;
+    s->map_size = map_size;
+    s->req = (unsigned char *)map + sizeof(struct shm_region);
+    s->resp = s->req + size;
+    s->size = size;
+    s->region->magic = SHM_MAGIC;
+    s->region->version = SHM_VERSION;
+    s->region->ring_size = size;
+
+    bool sent = shm_send_fd(c, fd, size);
+    // the client has its own reference now.
+    close(fd);
+    if (!sent) {
+        // the reply may have partly gone out, so the stream can't be
+        // trusted any more.
+        if (settings.verbose > 0)
+            perror("Failed to send shm reply");
+        munmap(map, map_size);
+        free(s);
+        conn_set_state(c, conn_closing);
+        return true;
+    }
+
+#ifdef WORKER_URING
+    if (c->uring != NULL) {
+        // the socket is only for wakeups now, which libevent can watch.
+        uring_conn_detach(c);
+        c->ev_flags = EV_READ | EV_PERSIST;
+        event_set(&c->event, c->sfd, c->ev_flags, event_handler, (void *)c);
+        event_base_set(c->thread->base, &c->event);
+        if (event_add(&c->event, 0) == -1) {
+            perror("event_add");
+            conn_set_state(c, conn_closing);
+        }
+    }
+#endif
+
+    c->shm = s;
+    c->read = shm_read;
+    c->sendmsg = shm_sendmsg;
+    c->write = shm_write;
+
+    STATS_LOCK();
+    stats_state.shm_conns++;
+    STATS_UNLOCK();
+    return true;
+}
+
+void shm_conn_close(conn *c) {
+    struct shm_conn *s = c->shm;
+
+    // a client asleep on either ring finds the socket closed.
+    shm_wake(&s->region->resp.tail);
+    shm_wake(&s->region->req.head);
+    munmap(s->region, s->map_size);
+    free(s);
+    c->shm = NULL;
+
+    STATS_LOCK();
+    stats_state.shm_conns--;
+    STATS_UNLOCK();
+}
+
+#endif
@@ -0,0 +1,52 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SHM_H
+#define SHM_H
+
+/*
+ * Shared memory transport for clients on the same host, enabled with
+ * "-o shm_ring_size". See shm.c, and doc/shm.txt for the layout clients
+ * have to follow.
+ */
+
+#define SHM_MAGIC 0x4d48534d /* "MSHM" */
+#define SHM_VERSION 1
+#define SHM_RING_MIN 4096
+#define SHM_RING_MAX (64 * 1024 * 1024)
+
+/* One direction. head and tail are free running byte counts; only the
+ * reader writes head and only the writer writes tail. Each is on its own
+ * cache line, and doubles as the futex word clients sleep on. */
+struct shm_ring {
+    uint32_t tail;
+    uint32_t pad0[15];
+    uint32_t head;
+    uint32_t pad1[15];
+    uint32_t reader_waiting; /* reader is asleep, or about to be */
+    uint32_t writer_waiting; /* writer is waiting for space */
+    uint32_t pad2[14];
+};
+
+struct shm_region {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t ring_size; /* bytes of data per direction, a power of two */
+    uint32_t pad[13];
+    struct shm_ring req; /* client to server */
+    struct shm_ring resp; /* server to client */
+    /* followed by ring_size bytes of requests, then of responses */
+};
+
+ssize_t shm_read(conn *c, void *buf, size_t count);
+ssize_t shm_sendmsg(conn *c, struct msghdr *msg, int flags);
+ssize_t shm_write(conn *c, void *buf, size_t count);
+/* Called before the connection waits on the socket for requests. Returns
+ * false if there are some in the ring already. */
+bool shm_wait(conn *c);
+
+/* Handles the "shm" command: maps a fresh pair of rings, sends the reply
+ * with the memfd attached and switches the connection over to them. Returns
+ * false if nothing was sent and the connection is unchanged. */
+bool shm_conn_start(conn *c);
+void shm_conn_close(conn *c);
+
+#endif
@@ -0,0 +1,92 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Count-min sketch with 4 bit counters. See sketch.h.
+ *
+ * The item hash picks a counter in each row. The hash is mixed with a
+ * different odd constant per row, so keys colliding in one row rarely
+ * collide in the others.
+ */
+#include "sketch.h"
+#include <stdlib.h>
+#include <stdbool.h>
+
+#define SKETCH_ROWS 4
+/* halve once there have been this many increments per counter in a row. */
+#define SKETCH_SAMPLE_FACTOR 10
+
+static const uint32_t seeds[SKETCH_ROWS] = {
+    0x97cb3127, 0xb492b66f, 0x9ae16a3b, 0xc2b2ae35
+};
+
+sketch_t *sketch_create(const uint32_t width) {
+    sketch_t *s = calloc(1, sizeof(sketch_t));
+    if (s == NULL) {
+        return NULL;
+    }
+    s->width = 16;
+    while (s->width < width && s->width < (1U << 30)) {
+        s->width <<= 1;
+    }
+    s->table = calloc((size_t)s->width * SKETCH_ROWS / 16, sizeof(uint64_t));
+    if (s->table == NULL) {
+        free(s);
+        return NULL;
+    }
+    s->sample = (uint64_t)s->width * SKETCH_SAMPLE_FACTOR;
+    return s;
+}
+
+static uint32_t sketch_index(sketch_t *s, const uint32_t hv, const int row) {
+    uint32_t h = hv * seeds[row];
+    h ^= h >> 17;
+    return row * s->width + (h & (s->width - 1));
+}
+
+static void sketch_halve(sketch_t *s) {
+    uint64_t words = (uint64_t)s->width * SKETCH_ROWS / 16;
+    uint64_t x;
+    for (x = 0; x < words; x++) {
+        uint64_t w = __atomic_load_n(&s->table[x], __ATOMIC_RELAXED);
+        __atomic_store_n(&s->table[x], (w >> 1) & 0x7777777777777777ULL,
+                __ATOMIC_RELAXED);
+    }
+    __atomic_store_n(&s->additions, s->sample / 2, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&s->resets, 1, __ATOMIC_RELAXED);
+}
+
+void sketch_increment(sketch_t *s, const uint32_t hv) {
+    bool added = false;
+    int row;
+
+    for (row = 0; row < SKETCH_ROWS; row++) {
+        uint32_t idx = sketch_index(s, hv, row);
+        uint64_t *word = &s->table[idx / 16];
+        int shift = (idx % 16) * 4;
+        uint64_t old = __atomic_load_n(word, __ATOMIC_RELAXED);
+        if (((old >> shift) & 0xf) < SKETCH_MAX) {
+            // one try only; losing a race just drops this increment.
+            added |= __atomic_compare_exchange_n(word, &old,
+                    old + ((uint64_t)1 << shift), false,
+                    __ATOMIC_RELAXED, __ATOMIC_RELAXED);
+        }
+    }
+
+    if (added && __atomic_add_fetch(&s->additions, 1, __ATOMIC_RELAXED) == s->sample) {
+        sketch_halve(s);
+    }
+}
+
+unsigned int sketch_estimate(sketch_t *s, const uint32_t hv) {
+    unsigned int min = SKETCH_MAX;
+    int row;
+
+    for (row = 0; row < SKETCH_ROWS; row++) {
+        uint32_t idx = sketch_index(s, hv, row);
+        uint64_t w = __atomic_load_n(&s->table[idx / 16], __ATOMIC_RELAXED);
+        unsigned int count = (w >> ((idx % 16) * 4)) & 0xf;
+        if (count < min) {
+            min = count;
+        }
+    }
+    return min;
+}
@@ -0,0 +1,30 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SKETCH_H
+#define SKETCH_H
+#include <stdint.h>
+
+/*
+ * Count-min sketch of how often keys are asked for, with 4 bit counters.
+ *
+ * Each key has one counter in each of four rows, and its estimate is the
+ * smallest of them. Once enough increments have been recorded every counter
+ * is halved, so the estimates follow recent popularity.
+ * Updates from several threads may be lost, which only makes the estimates
+ * slightly lower.
+ */
+typedef struct {
+    uint64_t *table;    /* sixteen counters per word, row after row */
+    uint32_t width;     /* counters per row, a power of two */
+    uint64_t additions; /* increments since the last halving */
+    uint64_t sample;    /* halve after this many */
+    uint64_t resets;
+} sketch_t;
+
+#define SKETCH_MAX 15
+
+/* width is rounded up to a power of two. */
+sketch_t *sketch_create(const uint32_t width);
+void sketch_increment(sketch_t *s, const uint32_t hv);
+unsigned int sketch_estimate(sketch_t *s, const uint32_t hv);
+
+#endif
@@ -9,6 +9,7 @@
  */
 #include "memcached.h"
 #include "storage.h"
+#include "restart.h"
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/socket.h>
@@ -37,6 +38,13 @@ typedef struct {
 
     void **slab_list;       /* array of slab pointers */
     unsigned int list_size; /* size of prev array */
+
+    void *limbo;            /* freed items lock-free readers may still see */
+    unsigned int limbo_count;
+    void *limbo_sealed;     /* older batch, reusable once limbo_epoch is safe */
+    uint64_t limbo_epoch;
+
+    unsigned int mag_max;   /* chunks a thread magazine may hold, 0 for none */
 } slabclass_t;
 
 static slabclass_t slabclass[MAX_NUMBER_OF_SLAB_CLASSES];
@@ -59,6 +67,35 @@ static void *storage  = NULL;
 static pthread_mutex_t slabs_lock = PTHREAD_MUTEX_INITIALIZER;
 static pthread_mutex_t slabs_rebalance_lock = PTHREAD_MUTEX_INITIALIZER;
 
+/*
+ * Worker threads keep a magazine of free chunks for each slab class, so most
+ * allocations and frees don't touch slabs_lock. A magazine is refilled from
+ * and drained to the class freelist in batches of half its size.
+ * Chunks in a magazine look like freshly allocated memory: neither SLABBED nor
+ * LINKED. The slab mover treats them as busy, and flushes the magazines of the
+ * class it's taking a page from.
+ * Only the owning thread uses a magazine, except to flush it, so its lock is
+ * almost never contended. Lock order is magazine lock -> slabs_lock.
+ */
+#define MAGAZINE_BYTES (64 * 1024)
+#define MAGAZINE_MAX 32
+/* classes with larger chunks than this allows don't get magazines. */
+#define MAGAZINE_MIN 4
+
+typedef struct _slabs_magazine {
+    pthread_mutex_t lock;
+    struct _slabs_magazine *next;
+    struct {
+        item *slots;
+        unsigned int count;
+    } cls[MAX_NUMBER_OF_SLAB_CLASSES];
+} slabs_magazine;
+
+/* Magazines are only ever added, so the list can be walked without a lock. */
+static slabs_magazine *magazines = NULL;
+static pthread_mutex_t magazines_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t magazine_key;
+
 /*
  * Forward Declarations
  */
@@ -66,6 +103,8 @@ static int grow_slab_list (const unsigned int id);
 static int do_slabs_newslab(const unsigned int id);
 static void *memory_allocate(size_t size);
 static void do_slabs_free(void *ptr, const size_t size, unsigned int id);
+static void do_slabs_reclaim(const unsigned int id);
+static void slabs_reclaim_wait(const unsigned int id);
 
 /* Preallocate as many slab pages as possible (called from slabs_init)
    on start-up, so users don't get confused out-of-memory errors when
@@ -163,7 +202,75 @@ static void * alloc_large_chunk(const size_t limit)
     return ptr;
 }
 
-unsigned int slabs_fixup(char *chunk, const int border) {
+/* Freelists read back from the restart metadata. */
+static void *restart_slots[MAX_NUMBER_OF_SLAB_CLASSES];
+static unsigned int restart_sl_curr[MAX_NUMBER_OF_SLAB_CLASSES];
+
+/* Free chunks are linked through the memory file, so only the head of each
+ * freelist needs saving. */
+int slabs_restart_save(const char *tag, void *ctx, void *data) {
+    int id;
+    for (id = 1; id < MAX_NUMBER_OF_SLAB_CLASSES; id++) {
+        slabclass_t *p = &slabclass[id];
+        // items in limbo or magazines aren't on any list, so would be lost.
+        slabs_reclaim_wait(id);
+        slabs_magazines_flush(id);
+        if (p->slots != NULL) {
+            restart_set_kv(ctx, "freelist", "%d,%llx,%u", id,
+                    (unsigned long long)(mc_ptr_t)p->slots, p->sl_curr);
+        }
+    }
+    restart_set_kv(ctx, "done", "%s", "true");
+    return 0;
+}
+
+// A bad or missing line means the freelists get rebuilt by walking memory
+// instead, so this never holds up a restart.
+int slabs_restart_check(const char *tag, void *ctx, void *data) {
+    char *key;
+    char *val;
+    bool done = false;
+    bool failed = false;
+
+    while (restart_get_kv(ctx, &key, &val) == RESTART_OK) {
+        int id;
+        unsigned long long slots;
+        unsigned int sl_curr;
+        if (strcmp(key, "done") == 0) {
+            done = true;
+        } else if (strcmp(key, "freelist") == 0
+                && sscanf(val, "%d,%llx,%u", &id, &slots, &sl_curr) == 3
+                && id > 0 && id < MAX_NUMBER_OF_SLAB_CLASSES) {
+            restart_slots[id] = (void *)(mc_ptr_t)slots;
+            restart_sl_curr[id] = sl_curr;
+        } else {
+            fprintf(stderr, "[restart] bad slabs line: %s %s\n", key, val);
+            failed = true;
+        }
+    }
+
+    if (done && !failed) {
+        restart_index_restored(RESTART_INDEX_SLABS);
+    }
+    return 0;
+}
+
+/* If we're relinking, restart_fixup() rebuilds the freelists as it walks the
+ * chunks. Otherwise we put the saved ones back. */
+void slabs_restart_fixup(void *old_base, void *new_base, const bool relink) {
+    int id;
+    if (relink) {
+        return;
+    }
+    for (id = 1; id < MAX_NUMBER_OF_SLAB_CLASSES; id++) {
+        if (restart_slots[id] != NULL) {
+            slabclass[id].slots = restart_rebase(restart_slots[id], old_base, new_base);
+            slabclass[id].sl_curr = restart_sl_curr[id];
+        }
+    }
+}
+
+unsigned int slabs_fixup(char *chunk, const int border, slabs_fixup_freelists *fl) {
     slabclass_t *p;
     item *it = (item *)chunk;
     int id = ITEM_clsid(it);
@@ -172,35 +279,60 @@ unsigned int slabs_fixup(char *chunk, const int border) {
     // (which must be 0)
     if (id == 0) {
         //assert(border == 0);
+        pthread_mutex_lock(&slabs_lock);
         p = &slabclass[0];
         grow_slab_list(0);
         p->slab_list[p->slabs++] = (char*)chunk;
+        pthread_mutex_unlock(&slabs_lock);
         return -1;
     }
     p = &slabclass[id];
 
     // if we're on a page border, add the slab to slab class
     if (border == 0) {
+        pthread_mutex_lock(&slabs_lock);
         grow_slab_list(id);
         p->slab_list[p->slabs++] = chunk;
+        pthread_mutex_unlock(&slabs_lock);
     }
 
-    // increase free count if ITEM_SLABBED
-    if (it->it_flags == ITEM_SLABBED) {
-        // if ITEM_SLABBED re-stack on freelist.
-        // don't have to run pointer fixups.
+    // if ITEM_SLABBED re-stack on the caller's freelist.
+    // don't have to run pointer fixups.
+    if (fl != NULL && it->it_flags == ITEM_SLABBED) {
         it->prev = 0;
-        it->next = p->slots;
-        if (it->next) it->next->prev = it;
-        p->slots = it;
-
-        p->sl_curr++;
-        //fprintf(stderr, "replacing into freelist\n");
+        it->next = fl->head[id];
+        if (it->next) {
+            it->next->prev = it;
+        } else {
+            fl->tail[id] = it;
+        }
+        fl->head[id] = it;
+        fl->count[id]++;
     }
 
     return p->size;
 }
 
+/* Hands the free chunks found by one fixup thread over to the slab classes. */
+void slabs_fixup_merge(slabs_fixup_freelists *fl) {
+    int id;
+    pthread_mutex_lock(&slabs_lock);
+    for (id = 1; id < MAX_NUMBER_OF_SLAB_CLASSES; id++) {
+        slabclass_t *p = &slabclass[id];
+        item *tail = fl->tail[id];
+        if (tail == NULL) {
+            continue;
+        }
+        tail->next = p->slots;
+        if (tail->next) {
+            tail->next->prev = tail;
+        }
+        p->slots = fl->head[id];
+        p->sl_curr += fl->count[id];
+    }
+    pthread_mutex_unlock(&slabs_lock);
+}
+
 /**
  * Determines the chunk sizes and initializes the slab class descriptors
  * accordingly.
@@ -276,6 +408,14 @@ void slabs_init(const size_t limit, const double factor, const bool prealloc, co
                 i, slabclass[i].size, slabclass[i].perslab);
     }
 
+    pthread_key_create(&magazine_key, NULL);
+    for (i = POWER_SMALLEST; i <= power_largest && settings.slab_magazines; i++) {
+        unsigned int max = MAGAZINE_BYTES / slabclass[i].size;
+        if (max > MAGAZINE_MAX)
+            max = MAGAZINE_MAX;
+        slabclass[i].mag_max = max >= MAGAZINE_MIN ? max : 0;
+    }
+
     /* for the test suite:  faking of how much we've already malloc'd */
     {
         char *t_initial_malloc = getenv("T_MEMD_INITIAL_MALLOC");
@@ -419,6 +559,9 @@ static void *do_slabs_alloc(const size_t size, unsigned int id,
     assert(size <= p->size);
     /* fail unless we have space at the end of a recently allocated page,
        we have something on our freelist, or we could allocate a new page */
+    if (p->sl_curr == 0 && p->limbo_sealed != NULL) {
+        do_slabs_reclaim(id);
+    }
     if (p->sl_curr == 0 && flags != SLABS_ALLOC_NO_NEWPAGE) {
         do_slabs_newslab(id);
     }
@@ -522,6 +665,215 @@ static void do_slabs_free(void *ptr, const size_t size, unsigned int id) {
     return;
 }
 
+/*
+ * With -o lockfree_get, other threads may read an item without a reference
+ * right up until it's freed, and for a moment after. Freed items are held in
+ * limbo until those readers are gone, rather than going straight back on the
+ * freelist. They collect on p->limbo, and every LIMBO_BATCH frees the batch
+ * is sealed with an epoch ticket. A sealed batch goes to the freelist once
+ * the ticket is safe, so checking the reader epochs is rare.
+ * Items in limbo aren't SLABBED or LINKED, so the slab mover treats them as
+ * busy until they're reclaimed.
+ */
+#define LIMBO_BATCH 64
+
+static void do_slabs_retire(void *ptr, const size_t size, unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+    item *it = (item *)ptr;
+
+    // readers only follow h_next, so the LRU links are free for the list.
+    it->next = p->limbo;
+    p->limbo = it;
+    if (++p->limbo_count >= LIMBO_BATCH) {
+        do_slabs_reclaim(id);
+    }
+}
+
+static void do_slabs_limbo_free(item *it, const unsigned int id) {
+    while (it != NULL) {
+        item *next = it->next;
+        do_slabs_free(it, 0, id);
+        it = next;
+    }
+}
+
+/* Frees the sealed batch if it's safe and seals the next one. Never waits. */
+static void do_slabs_reclaim(const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+
+    if (p->limbo_sealed != NULL) {
+        if (!epoch_safe(p->limbo_epoch)) {
+            return;
+        }
+        do_slabs_limbo_free(p->limbo_sealed, id);
+        p->limbo_sealed = NULL;
+    }
+
+    if (p->limbo != NULL) {
+        p->limbo_sealed = p->limbo;
+        p->limbo_epoch = epoch_retire();
+        p->limbo = NULL;
+        p->limbo_count = 0;
+    }
+}
+
+/* Seals everything in limbo into one batch, for a caller about to wait on
+ * readers. Returns the ticket to wait for, or 0 if limbo is empty. */
+static uint64_t do_slabs_limbo_seal(const unsigned int id) {
+    slabclass_t *p = &slabclass[id];
+
+    if (p->limbo != NULL) {
+        if (p->limbo_sealed != NULL) {
+            item *it = p->limbo;
+            while (it->next != NULL) {
+                it = it->next;
+            }
+            it->next = p->limbo_sealed;
+        }
+        // the newer ticket covers the older batch too.
+        p->limbo_sealed = p->limbo;
+        p->limbo_epoch = epoch_retire();
+        p->limbo = NULL;
+        p->limbo_count = 0;
+    }
+    return p->limbo_sealed != NULL ? p->limbo_epoch : 0;
+}
+
+/* Waits on readers until a class's limbo can be freed, and frees it. One
+ * reader getting descheduled mid-read could take a while, so slabs_lock is
+ * dropped for the wait rather than holding up every other allocation.
+ * CALLED WITH slabs_lock HELD, and it's held again on return. */
+static void do_slabs_reclaim_wait(const unsigned int id) {
+    uint64_t ticket = do_slabs_limbo_seal(id);
+    if (ticket == 0) {
+        return;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    epoch_wait(ticket);
+    pthread_mutex_lock(&slabs_lock);
+    // someone else may have sealed a newer batch meanwhile, in which case
+    // this leaves it for later.
+    do_slabs_reclaim(id);
+}
+
+static void slabs_reclaim_wait(const unsigned int id) {
+    pthread_mutex_lock(&slabs_lock);
+    do_slabs_reclaim_wait(id);
+    pthread_mutex_unlock(&slabs_lock);
+}
+
+/* As do_slabs_alloc(), but when the class is out of memory apart from items
+ * in limbo, waits for readers to let go of those and tries again.
+ * CALLED WITH slabs_lock HELD, which is dropped while waiting. */
+static void *do_slabs_alloc_wait(const size_t size, unsigned int id,
+        unsigned int flags) {
+    void *ret = do_slabs_alloc(size, id, flags);
+    if (ret == NULL && id >= POWER_SMALLEST && id <= power_largest
+            && (slabclass[id].limbo != NULL || slabclass[id].limbo_sealed != NULL)) {
+        do_slabs_reclaim_wait(id);
+        ret = do_slabs_alloc(size, id, flags);
+    }
+    return ret;
+}
+
+bool slabs_magazine_create(void) {
+    slabs_magazine *m;
+    if (!settings.slab_magazines) {
+        return true;
+    }
+    m = calloc(1, sizeof(slabs_magazine));
+    if (m == NULL) {
+        return false;
+    }
+    pthread_mutex_init(&m->lock, NULL);
+
+    pthread_mutex_lock(&magazines_lock);
+    m->next = magazines;
+    __atomic_store_n(&magazines, m, __ATOMIC_RELEASE);
+    pthread_mutex_unlock(&magazines_lock);
+
+    pthread_setspecific(magazine_key, m);
+    return true;
+}
+
+static bool magazine_usable(const unsigned int id) {
+    // the slab mover wants this class's chunks back on the freelist.
+    return slabclass[id].mag_max != 0
+        && !(slab_rebalance_signal != 0 && slab_rebal.s_clsid == id);
+}
+
+static void magazine_push(slabs_magazine *m, const unsigned int id, item *it) {
+    it->it_flags = 0;
+    it->refcount = 1;
+    it->next = m->cls[id].slots;
+    m->cls[id].slots = it;
+    m->cls[id].count++;
+}
+
+static item *magazine_pop(slabs_magazine *m, const unsigned int id) {
+    item *it = m->cls[id].slots;
+    m->cls[id].slots = it->next;
+    m->cls[id].count--;
+    it->next = 0;
+    return it;
+}
+
+/* CALLED WITH m->lock HELD */
+static void *magazine_refill(slabs_magazine *m, const size_t size,
+        const unsigned int id, const unsigned int flags) {
+    slabclass_t *p = &slabclass[id];
+    void *ret;
+
+    pthread_mutex_lock(&slabs_lock);
+    ret = do_slabs_alloc_wait(size, id, flags);
+    if (ret != NULL && magazine_usable(id)) {
+        // don't pull in new pages or wait on readers just to fill up.
+        while (m->cls[id].count < p->mag_max / 2 && p->sl_curr != 0) {
+            magazine_push(m, id, do_slabs_alloc(size, id, SLABS_ALLOC_NO_NEWPAGE));
+        }
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return ret;
+}
+
+/* CALLED WITH m->lock HELD */
+static unsigned int magazine_drain(slabs_magazine *m, const unsigned int id,
+        const unsigned int keep) {
+    unsigned int drained = 0;
+    pthread_mutex_lock(&slabs_lock);
+    while (m->cls[id].count > keep) {
+        do_slabs_free(magazine_pop(m, id), 0, id);
+        drained++;
+    }
+    pthread_mutex_unlock(&slabs_lock);
+    return drained;
+}
+
+/* Returns every chunk of a class held in magazines to the freelist. */
+unsigned int slabs_magazines_flush(const unsigned int id) {
+    slabs_magazine *m = __atomic_load_n(&magazines, __ATOMIC_ACQUIRE);
+    unsigned int flushed = 0;
+    for (; m != NULL; m = m->next) {
+        pthread_mutex_lock(&m->lock);
+        if (m->cls[id].count != 0) {
+            flushed += magazine_drain(m, id, 0);
+        }
+        pthread_mutex_unlock(&m->lock);
+    }
+    return flushed;
+}
+
+/* Free chunks sitting in magazines. Only a snapshot, since the owners don't
+ * stop to let us count. */
+static unsigned int magazine_chunks(const unsigned int id) {
+    slabs_magazine *m = __atomic_load_n(&magazines, __ATOMIC_ACQUIRE);
+    unsigned int count = 0;
+    for (; m != NULL; m = m->next) {
+        count += __atomic_load_n(&m->cls[id].count, __ATOMIC_RELAXED);
+    }
+    return count;
+}
+
 /* With refactoring of the various stats code the automover won't need a
  * custom function here.
  */
@@ -532,7 +884,7 @@ void fill_slab_stats_automove(slab_stats_automove *am) {
         slabclass_t *p = &slabclass[n];
         slab_stats_automove *cur = &am[n];
         cur->chunks_per_page = p->perslab;
-        cur->free_chunks = p->sl_curr;
+        cur->free_chunks = p->sl_curr + magazine_chunks(n);
         cur->total_pages = p->slabs;
         cur->chunk_size = p->size;
     }
@@ -563,9 +915,10 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
     for(i = POWER_SMALLEST; i <= power_largest; i++) {
         slabclass_t *p = &slabclass[i];
         if (p->slabs != 0) {
-            uint32_t perslab, slabs;
+            uint32_t perslab, slabs, free_chunks;
             slabs = p->slabs;
             perslab = p->perslab;
+            free_chunks = p->sl_curr + magazine_chunks(i);
 
             char key_str[STAT_KEY_LEN];
             char val_str[STAT_VAL_LEN];
@@ -576,8 +929,8 @@ static void do_slabs_stats(ADD_STAT add_stats, void *c) {
             APPEND_NUM_STAT(i, "total_pages", "%u", slabs);
             APPEND_NUM_STAT(i, "total_chunks", "%u", slabs * perslab);
             APPEND_NUM_STAT(i, "used_chunks", "%u",
-                            slabs*perslab - p->sl_curr);
-            APPEND_NUM_STAT(i, "free_chunks", "%u", p->sl_curr);
+                            slabs*perslab - free_chunks);
+            APPEND_NUM_STAT(i, "free_chunks", "%u", free_chunks);
             /* Stat is dead, but displaying zero instead of removing it. */
             APPEND_NUM_STAT(i, "free_chunks_end", "%u", 0);
             APPEND_NUM_STAT(i, "get_hits", "%llu",
@@ -655,20 +1008,61 @@ static void memory_release(void) {
 
 void *slabs_alloc(size_t size, unsigned int id,
         unsigned int flags) {
+    slabs_magazine *m = pthread_getspecific(magazine_key);
     void *ret;
 
+    if (m != NULL && id >= POWER_SMALLEST && id <= power_largest
+            && slabclass[id].mag_max != 0) {
+        pthread_mutex_lock(&m->lock);
+        if (m->cls[id].count != 0) {
+            ret = magazine_pop(m, id);
+            MEMCACHED_SLABS_ALLOCATE(size, id, slabclass[id].size, ret);
+        } else {
+            ret = magazine_refill(m, size, id, flags);
+        }
+        pthread_mutex_unlock(&m->lock);
+        return ret;
+    }
+
     pthread_mutex_lock(&slabs_lock);
-    ret = do_slabs_alloc(size, id, flags);
+    ret = do_slabs_alloc_wait(size, id, flags);
     pthread_mutex_unlock(&slabs_lock);
     return ret;
 }
 
 void slabs_free(void *ptr, size_t size, unsigned int id) {
+    slabs_magazine *m = pthread_getspecific(magazine_key);
+
+    if (m != NULL && id >= POWER_SMALLEST && id <= power_largest
+            && (((item *)ptr)->it_flags & ITEM_CHUNKED) == 0
+            && magazine_usable(id)) {
+        MEMCACHED_SLABS_FREE(size, id, ptr);
+        pthread_mutex_lock(&m->lock);
+        if (m->cls[id].count >= slabclass[id].mag_max) {
+            magazine_drain(m, id, slabclass[id].mag_max / 2);
+        }
+        magazine_push(m, id, ptr);
+        pthread_mutex_unlock(&m->lock);
+        return;
+    }
+
     pthread_mutex_lock(&slabs_lock);
     do_slabs_free(ptr, size, id);
     pthread_mutex_unlock(&slabs_lock);
 }
 
+/* For items which have been in the hash table, and may still be read by a
+ * lock-free reader. */
+void slabs_retire(void *ptr, size_t size, unsigned int id) {
+    if (!settings.lockfree_get) {
+        slabs_free(ptr, size, id);
+        return;
+    }
+    pthread_mutex_lock(&slabs_lock);
+    do_slabs_retire(ptr, size, id);
+    pthread_mutex_unlock(&slabs_lock);
+}
+
 void slabs_stats(ADD_STAT add_stats, void *c) {
     pthread_mutex_lock(&slabs_lock);
     do_slabs_stats(add_stats, c);
@@ -701,7 +1095,7 @@ unsigned int slabs_available_chunks(const unsigned int id, bool *mem_flag,
 
     pthread_mutex_lock(&slabs_lock);
     p = &slabclass[id];
-    ret = p->sl_curr;
+    ret = p->sl_curr + magazine_chunks(id);
     if (mem_flag != NULL)
         *mem_flag = mem_malloced >= mem_limit ? true : false;
     if (chunks_perslab != NULL)
@@ -778,6 +1172,11 @@ static int slab_rebalance_start(void) {
 
     pthread_mutex_unlock(&slabs_lock);
 
+    // chunks of the page may be held by worker threads.
+    if (slab_rebal.s_clsid != SLAB_GLOBAL_PAGE_POOL) {
+        slabs_magazines_flush(slab_rebal.s_clsid);
+    }
+
     STATS_LOCK();
     stats_state.slab_reassign_running = true;
     STATS_UNLOCK();
@@ -1051,7 +1450,7 @@ static int slab_rebalance_move(void) {
                     } else {
                         ntotal = ITEM_ntotal(it);
                         do_item_unlink(it, hv);
-                        slabs_free(it, ntotal, slab_rebal.s_clsid);
+                        slabs_retire(it, ntotal, slab_rebal.s_clsid);
                         /* Swing around again later to remove it from the freelist. */
                         slab_rebal.busy_items++;
                         was_busy++;
@@ -1093,6 +1492,12 @@ static int slab_rebalance_move(void) {
         /* Some items were busy, start again from the top */
         if (slab_rebal.busy_items) {
             slab_rebal.slab_pos = slab_rebal.slab_start;
+            if (settings.lockfree_get) {
+                // some of them may be waiting in limbo.
+                slabs_reclaim_wait(slab_rebal.s_clsid);
+            }
+            // or freed into a worker's magazine after we flushed it.
+            slabs_magazines_flush(slab_rebal.s_clsid);
             STATS_LOCK();
             stats.slab_reassign_busy_items += slab_rebal.busy_items;
             STATS_UNLOCK();
@@ -1116,6 +1521,13 @@ static void slab_rebalance_finish(void) {
     uint32_t chunk_rescues;
     uint32_t busy_deletes;
 
+    /* Lock-free readers may still be looking at items which were on the page
+     * before we wipe it. Nothing new can land on it now, so wait for them
+     * before taking slabs_lock rather than stalling allocations. */
+    if (settings.lockfree_get) {
+        epoch_sync();
+    }
+
     pthread_mutex_lock(&slabs_lock);
 
     s_cls = &slabclass[slab_rebal.s_clsid];
@@ -27,6 +27,13 @@ void *slabs_alloc(const size_t size, unsigned int id, unsigned int flags);
 
 /** Free previously allocated object */
 void slabs_free(void *ptr, size_t size, unsigned int id);
+/** Free previously linked memory, which waits on lock-free readers first */
+void slabs_retire(void *ptr, size_t size, unsigned int id);
+
+/** Give the calling worker thread its own cache of free chunks */
+bool slabs_magazine_create(void);
+/** Return chunks of a class cached by any thread. Returns how many */
+unsigned int slabs_magazines_flush(const unsigned int id);
 
 /** Adjust global memory limit up or down */
 bool slabs_adjust_mem_limit(size_t new_mem_limit);
@@ -66,7 +73,19 @@ void slabs_rebalancer_resume(void);
 void slabs_set_storage(void *arg);
 #endif
 
-/* Fixup for restartable code. */
-unsigned int slabs_fixup(char *chunk, const int border);
+/* Fixup for restartable code. Several threads may fix up memory at once;
+ * each collects the free chunks it finds in its own slabs_fixup_freelists,
+ * which are merged into the slab classes once it's done. */
+typedef struct {
+    void *head[MAX_NUMBER_OF_SLAB_CLASSES];
+    void *tail[MAX_NUMBER_OF_SLAB_CLASSES];
+    unsigned int count[MAX_NUMBER_OF_SLAB_CLASSES];
+} slabs_fixup_freelists;
+
+unsigned int slabs_fixup(char *chunk, const int border, slabs_fixup_freelists *fl);
+void slabs_fixup_merge(slabs_fixup_freelists *fl);
+int slabs_restart_check(const char *tag, void *ctx, void *data);
+int slabs_restart_save(const char *tag, void *ctx, void *data);
+void slabs_restart_fixup(void *old_base, void *new_base, const bool relink);
 
 #endif
@@ -0,0 +1,397 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * Cache snapshots. See snapshot.h.
+ *
+ * Loading reads the file in large blocks and allocates items straight out
+ * of the read buffer. Allocated items are linked in batches, so the CAS
+ * counter is moved once per batch rather than once per item. Items keep the
+ * CAS they had when exported, and the LRU segment they were in. The export
+ * walks each LRU from the tail, and each item loaded goes on the head, so the
+ * order within an LRU survives too.
+ */
+#include "memcached.h"
+#include "storage.h"
+#include "snapshot.h"
+#include <fcntl.h>
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define SNAPSHOT_READ_SIZE (4 * 1024 * 1024)
+
+typedef struct {
+    item *it;
+    uint64_t cas;
+} snapshot_pending;
+
+static pthread_mutex_t load_lock = PTHREAD_MUTEX_INITIALIZER;
+static bool load_started = false;
+static bool load_running = false;
+static bool load_failed = false;
+static rel_time_t load_start_time = 0;
+static rel_time_t load_end_time = 0;
+/* counts for the running or last load. */
+static uint64_t load_items = 0;
+static uint64_t load_bytes = 0;
+static uint64_t load_expired = 0;
+static uint64_t load_exists = 0;
+static uint64_t load_nomem = 0;
+
+size_t snapshot_record_size(const item *it) {
+    return sizeof(snapshot_record) + it->nkey + it->nbytes - 2;
+}
+
+void snapshot_record_write(char *buf, item *it) {
+    snapshot_record r;
+    char *p = buf + sizeof(r);
+
+    memset(&r, 0, sizeof(r));
+    r.exptime = it->exptime == 0 ? 0 : (int64_t)it->exptime + process_started;
+    r.cas = ITEM_get_cas(it);
+    FLAGS_CONV(it, r.flags);
+    r.nbytes = it->nbytes - 2;
+    r.nkey = it->nkey;
+    r.lru = ITEM_lruid(it);
+    r.it_flags = it->it_flags & (ITEM_FETCHED|ITEM_ACTIVE|ITEM_KEY_BINARY);
+    memcpy(buf, &r, sizeof(r));
+
+    memcpy(p, ITEM_key(it), it->nkey);
+    p += it->nkey;
+    if (it->it_flags & ITEM_CHUNKED) {
+        item_chunk *ch = (item_chunk *) ITEM_schunk(it);
+        uint32_t remain = r.nbytes;
+        for (; ch != NULL && remain != 0; ch = ch->next) {
+            uint32_t todo = (uint32_t)ch->used < remain ? (uint32_t)ch->used : remain;
+            memcpy(p, ch->data, todo);
+            p += todo;
+            remain -= todo;
+        }
+    } else {
+        memcpy(p, ITEM_data(it), r.nbytes);
+    }
+}
+
+/* Copies a value and its "\r\n" into a newly allocated item. */
+static int snapshot_copy_value(item *it, const char *val, const uint32_t len) {
+    item_chunk *ch;
+    uint32_t total = len + 2;
+    uint32_t done = 0;
+
+    if ((it->it_flags & ITEM_CHUNKED) == 0) {
+        memcpy(ITEM_data(it), val, len);
+        memcpy(ITEM_data(it) + len, "\r\n", 2);
+        return 0;
+    }
+
+    ch = (item_chunk *) ITEM_schunk(it);
+    while (done < total) {
+        uint32_t todo;
+        if (ch->used == ch->size) {
+            ch = do_item_alloc_chunk(ch, total - done);
+            if (ch == NULL) {
+                return -1;
+            }
+        }
+        todo = ch->size - ch->used;
+        if (todo > total - done) {
+            todo = total - done;
+        }
+        // the value, then whatever's left of the "\r\n".
+        while (todo != 0) {
+            uint32_t n;
+            if (done < len) {
+                n = len - done < todo ? len - done : todo;
+                memcpy(ch->data + ch->used, val + done, n);
+            } else {
+                n = todo;
+                memcpy(ch->data + ch->used, "\r\n" + (done - len), n);
+            }
+            ch->used += n;
+            done += n;
+            todo -= n;
+        }
+    }
+    return 0;
+}
+
+/* Allocates and fills an item for a record, or returns NULL if it's expired
+ * or there's no memory for it. */
+static item *snapshot_item(const snapshot_record *r, const char *data) {
+    rel_time_t exptime = 0;
+    item *it;
+
+    if (r->exptime != 0) {
+        if (r->exptime <= (int64_t)process_started + current_time) {
+            __atomic_fetch_add(&load_expired, 1, __ATOMIC_RELAXED);
+            return NULL;
+        }
+        exptime = r->exptime - process_started;
+    }
+
+    it = item_alloc(data, r->nkey, r->flags, exptime, r->nbytes + 2);
+    if (it == NULL) {
+        __atomic_fetch_add(&load_nomem, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    if (snapshot_copy_value(it, data + r->nkey, r->nbytes) != 0) {
+        item_remove(it);
+        __atomic_fetch_add(&load_nomem, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+    it->it_flags |= r->it_flags & (ITEM_FETCHED|ITEM_ACTIVE|ITEM_KEY_BINARY);
+    // short TTL items stay in the temp LRU if it's in use.
+    if (settings.lru_segmented && ITEM_lruid(it) != TEMP_LRU
+            && (r->lru == HOT_LRU || r->lru == WARM_LRU || r->lru == COLD_LRU)) {
+        it->slabs_clsid = ITEM_clsid(it) | r->lru;
+    }
+    return it;
+}
+
+static void snapshot_link_batch(snapshot_pending *p, const int count) {
+    uint64_t max_cas = 0;
+    int x;
+
+    for (x = 0; x < count; x++) {
+        if (p[x].cas > max_cas) {
+            max_cas = p[x].cas;
+        }
+    }
+    if (settings.use_cas) {
+        set_cas_id_floor(max_cas);
+    }
+
+    for (x = 0; x < count; x++) {
+        item *it = p[x].it;
+        uint32_t hv = hash(ITEM_key(it), it->nkey);
+        item *old;
+
+        item_lock(hv);
+        old = assoc_find(ITEM_key(it), it->nkey, hv);
+        if (old != NULL && (item_is_flushed(old)
+                    || (old->exptime != 0 && old->exptime <= current_time))) {
+            STORAGE_delete(ext_storage, old);
+            do_item_unlink(old, hv);
+            old = NULL;
+        }
+        if (old == NULL) {
+            do_item_link(it, hv);
+            if (settings.use_cas && p[x].cas != 0) {
+                ITEM_set_cas(it, p[x].cas);
+            }
+            __atomic_fetch_add(&load_items, 1, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&load_bytes, ITEM_ntotal(it), __ATOMIC_RELAXED);
+        } else {
+            // whatever was stored since is newer.
+            __atomic_fetch_add(&load_exists, 1, __ATOMIC_RELAXED);
+        }
+        do_item_remove(it);
+        item_unlock(hv);
+    }
+}
+
+int snapshot_load(const char *path) {
+    snapshot_pending pending[ITEM_BATCH_MAX];
+    int npending = 0;
+    size_t buflen = SNAPSHOT_READ_SIZE;
+    size_t start = 0, end = 0, want = 0;
+    bool header = false;
+    char *buf = NULL;
+    int ret = 0;
+    int fd;
+
+    pthread_mutex_lock(&load_lock);
+    load_started = true;
+    load_failed = false;
+    load_start_time = current_time;
+    load_items = load_bytes = load_expired = load_exists = load_nomem = 0;
+    pthread_mutex_unlock(&load_lock);
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "Failed to open snapshot %s: %s\n", path, strerror(errno));
+        ret = -1;
+        goto done;
+    }
+    buf = malloc(buflen);
+    if (buf == NULL) {
+        fprintf(stderr, "Failed to allocate snapshot read buffer\n");
+        ret = -1;
+        goto done;
+    }
+
+    while (1) {
+        ssize_t n;
+        if (start != 0) {
+            memmove(buf, buf + start, end - start);
+            end -= start;
+            start = 0;
+        }
+        // a record bigger than the buffer.
+        if (want > buflen) {
+            char *nb = realloc(buf, want);
+            if (nb == NULL) {
+                fprintf(stderr, "Failed to allocate snapshot read buffer\n");
+                ret = -1;
+                break;
+            }
+            buf = nb;
+            buflen = want;
+        }
+
+        n = read(fd, buf + end, buflen - end);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "Failed to read snapshot %s: %s\n", path, strerror(errno));
+            ret = -1;
+            break;
+        } else if (n == 0) {
+            if (end != 0 || !header) {
+                fprintf(stderr, "Snapshot %s is truncated\n", path);
+                ret = -1;
+            }
+            break;
+        }
+        end += n;
+
+        if (!header) {
+            snapshot_header h;
+            if (end < sizeof(h)) {
+                continue;
+            }
+            memcpy(&h, buf, sizeof(h));
+            if (memcmp(h.magic, SNAPSHOT_MAGIC, SNAPSHOT_MAGIC_LEN) != 0) {
+                fprintf(stderr, "%s is not a snapshot\n", path);
+                ret = -1;
+                break;
+            }
+            if (h.items != 0) {
+                STATS_LOCK();
+                uint64_t curr_items = stats_state.curr_items;
+                STATS_UNLOCK();
+                assoc_start_expand_to(curr_items + h.items);
+            }
+            start = sizeof(h);
+            header = true;
+        }
+
+        want = 0;
+        while (end - start >= sizeof(snapshot_record)) {
+            snapshot_record r;
+            size_t size;
+            item *it;
+
+            memcpy(&r, buf + start, sizeof(r));
+            // values are stored without their "\r\n", which the item needs.
+            if (r.nkey == 0 || r.nkey > KEY_MAX_LENGTH
+                    || (uint64_t)r.nbytes + 2 > (uint64_t)settings.item_size_max) {
+                fprintf(stderr, "Snapshot %s is corrupt\n", path);
+                ret = -1;
+                break;
+            }
+            size = sizeof(r) + r.nkey + r.nbytes;
+            if (end - start < size) {
+                want = size;
+                break;
+            }
+
+            it = snapshot_item(&r, buf + start + sizeof(r));
+            if (it != NULL) {
+                pending[npending].it = it;
+                pending[npending].cas = r.cas;
+                if (++npending == ITEM_BATCH_MAX) {
+                    snapshot_link_batch(pending, npending);
+                    npending = 0;
+                }
+            }
+            start += size;
+        }
+        if (ret != 0) {
+            break;
+        }
+    }
+
+    if (npending != 0) {
+        snapshot_link_batch(pending, npending);
+    }
+
+done:
+    free(buf);
+    if (fd >= 0) {
+        close(fd);
+    }
+    pthread_mutex_lock(&load_lock);
+    load_failed = ret != 0;
+    load_end_time = current_time;
+    pthread_mutex_unlock(&load_lock);
+    return ret;
+}
+
+static void *snapshot_load_thread(void *arg) {
+    char *path = arg;
+    snapshot_load(path);
+    free(path);
+    pthread_mutex_lock(&load_lock);
+    load_running = false;
+    pthread_mutex_unlock(&load_lock);
+    return NULL;
+}
+
+int snapshot_load_start(const char *path) {
+    pthread_attr_t attr;
+    pthread_t tid;
+    char *p;
+    int ret;
+
+    pthread_mutex_lock(&load_lock);
+    if (load_running) {
+        pthread_mutex_unlock(&load_lock);
+        return -1;
+    }
+    p = strdup(path);
+    if (p == NULL) {
+        pthread_mutex_unlock(&load_lock);
+        return -2;
+    }
+    pthread_attr_init(&attr);
+    pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    if ((ret = pthread_create(&tid, &attr, snapshot_load_thread, p)) != 0) {
+        fprintf(stderr, "Can't create snapshot load thread: %s\n", strerror(ret));
+        pthread_attr_destroy(&attr);
+        free(p);
+        pthread_mutex_unlock(&load_lock);
+        return -2;
+    }
+    pthread_attr_destroy(&attr);
+    thread_setname(tid, "mc-snapload");
+    // the stats show up now, not once the thread gets going.
+    load_started = true;
+    load_running = true;
+    pthread_mutex_unlock(&load_lock);
+    return 0;
+}
+
+void snapshot_stats(ADD_STAT add_stats, void *c) {
+    pthread_mutex_lock(&load_lock);
+    if (!load_started) {
+        pthread_mutex_unlock(&load_lock);
+        return;
+    }
+    APPEND_STAT("snapshot_load_running", "%u", load_running);
+    APPEND_STAT("snapshot_load_failed", "%u", load_failed);
+    APPEND_STAT("snapshot_load_seconds", "%u",
+            (load_running ? current_time : load_end_time) - load_start_time);
+    APPEND_STAT("snapshot_loaded_items", "%llu",
+            (unsigned long long)__atomic_load_n(&load_items, __ATOMIC_RELAXED));
+    APPEND_STAT("snapshot_loaded_bytes", "%llu",
+            (unsigned long long)__atomic_load_n(&load_bytes, __ATOMIC_RELAXED));
+    APPEND_STAT("snapshot_load_expired", "%llu",
+            (unsigned long long)__atomic_load_n(&load_expired, __ATOMIC_RELAXED));
+    APPEND_STAT("snapshot_load_exists", "%llu",
+            (unsigned long long)__atomic_load_n(&load_exists, __ATOMIC_RELAXED));
+    APPEND_STAT("snapshot_load_nomem", "%llu",
+            (unsigned long long)__atomic_load_n(&load_nomem, __ATOMIC_RELAXED));
+    pthread_mutex_unlock(&load_lock);
+}
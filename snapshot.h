@@ -0,0 +1,44 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+/*
+ * Cache snapshots: "lru_crawler export" writes the live items to a flat file,
+ * which can be loaded back in on another node to warm it up. Numbers are in
+ * host byte order, so snapshots only move between machines of the same
+ * endianness.
+ */
+
+#define SNAPSHOT_MAGIC "MCSNAP01"
+#define SNAPSHOT_MAGIC_LEN 8
+
+typedef struct {
+    char magic[SNAPSHOT_MAGIC_LEN];
+    uint64_t items;    /* filled in once the export is done, else 0 */
+} snapshot_header;
+
+/* Each record is followed by the key, then the value without its "\r\n". */
+typedef struct {
+    int64_t exptime;   /* unix time, or 0 for never */
+    uint64_t cas;
+    uint32_t flags;
+    uint32_t nbytes;
+    uint8_t nkey;
+    uint8_t lru;       /* HOT_LRU, WARM_LRU, COLD_LRU or TEMP_LRU */
+    uint16_t it_flags; /* only ITEM_FETCHED, ITEM_ACTIVE and ITEM_KEY_BINARY */
+    uint32_t unused;
+} snapshot_record;
+
+size_t snapshot_record_size(const item *it);
+/* Writes out an item the caller holds a reference to, in
+ * snapshot_record_size() bytes. */
+void snapshot_record_write(char *buf, item *it);
+
+/* Loads a snapshot, returning -1 if it couldn't be read. Keys which are
+ * already live are left alone. */
+int snapshot_load(const char *path);
+/* Loads a snapshot in the background. Returns -1 if a load is running. */
+int snapshot_load_start(const char *path);
+void snapshot_stats(ADD_STAT add_stats, void *c);
+
+#endif
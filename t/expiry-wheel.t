@@ -0,0 +1,93 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $stats = mem_stats($server->sock);
+    ok(!exists $stats->{expiry_wheel_entries}, "no wheel stats by default");
+}
+
+eval {
+    my $server = new_memcached('-o expiry_wheel,no_lru_maintainer');
+};
+ok($@, "expiry_wheel needs the lru maintainer");
+
+# the crawler is off, so only the wheel can reclaim anything.
+my $server = new_memcached('-o expiry_wheel,no_lru_crawler');
+my $sock = $server->sock;
+is(mem_stats($sock, ' settings')->{expiry_wheel}, 'yes', "expiry_wheel enabled");
+
+for my $n (1 .. 100) {
+    print $sock "set short$n 0 2 1 noreply\r\nx\r\n";
+}
+for my $n (1 .. 10) {
+    print $sock "set long$n 0 1000 1 noreply\r\nx\r\n";
+    print $sock "set touched$n 0 2 1 noreply\r\nx\r\n";
+}
+print $sock "set forever 0 0 1 noreply\r\nx\r\n";
+for my $n (1 .. 10) {
+    print $sock "touch touched$n 1000\r\n";
+    is(scalar <$sock>, "TOUCHED\r\n", "touched$n pushed out");
+}
+
+my $stats = mem_stats($sock);
+is($stats->{curr_items}, 121, "all items stored");
+is($stats->{expiry_wheel_entries}, 120, "items with a ttl indexed once");
+
+sleep 5;
+
+$stats = mem_stats($sock);
+is($stats->{curr_items}, 21, "expired items reclaimed without being fetched");
+is($stats->{expiry_wheel_reclaimed}, 100, "reclaimed by the wheel");
+is($stats->{expiry_wheel_entries}, 20, "long ttl items still indexed");
+is($stats->{expiry_wheel_dropped}, 0, "nothing dropped");
+mem_get_is($sock, "long1", "x", "long ttl item kept");
+mem_get_is($sock, "touched1", "x", "touched item kept");
+mem_get_is($sock, "forever", "x", "item without a ttl kept");
+mem_get_is($sock, "short1", undef, "short ttl item gone");
+is($stats->{expiry_wheel_expired_bytes}, 0, "nothing left expired");
+
+# an item a slow client is still being sent can't be reclaimed, but the
+# memory it holds is counted until it is. It's kept off the end of the TEMP
+# LRU by an older item, so the lru maintainer doesn't unlink it first.
+{
+    my $server = new_memcached('-o expiry_wheel,no_lru_crawler,temporary_ttl=60');
+    my $sock = $server->sock;
+    my $value = 'x' x (1024 * 100);
+    for my $k ('first', 'big') {
+        my $ttl = $k eq 'big' ? 2 : 50;
+        print $sock "set $k 0 $ttl " . length($value) . "\r\n$value\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored $k");
+    }
+
+    # far more than the socket buffers hold, so it can't all be sent.
+    my $slow = $server->new_sock;
+    print $slow "get" . (" big" x 500) . "\r\n";
+    sleep 4;
+
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{expiry_wheel_expired_bytes}, '>', length($value),
+        "expired item in use counted");
+    is($stats->{curr_items}, 2, "and not reclaimed");
+
+    my $got = 0;
+    while (my $line = <$slow>) {
+        last if $line =~ /^END/;
+        $got++ if $line =~ /^VALUE big/;
+    }
+    is($got, 500, "slow client got its responses");
+    sleep 2;
+
+    $stats = mem_stats($sock);
+    is($stats->{expiry_wheel_expired_bytes}, 0, "count dropped once it was unlinked");
+    is($stats->{expiry_wheel_reclaimed}, 1, "and the wheel reclaimed it");
+    is($stats->{curr_items}, 1, "older item kept");
+}
+
+done_testing();
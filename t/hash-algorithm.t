@@ -0,0 +1,36 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# Multigets hash a run of keys up front; make sure every algorithm finds the
+# same keys that were stored one at a time.
+for my $algo (qw(jenkins murmur3 xxh3)) {
+    my $server = new_memcached("-o hash_algorithm=$algo");
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hash_algorithm}, $algo, "running with $algo");
+
+    my @keys = map { "k$_" . ('x' x ($_ * 3)) } 1 .. 60;
+    for my $k (@keys) {
+        print $sock "set $k 0 0 2 noreply\r\nok\r\n";
+    }
+
+    my @want = grep { /^k\d*[02468]x/ } @keys;
+    print $sock "get " . join(' ', map { $_, "miss$_" } @want) . "\r\n";
+    my $hits = 0;
+    while (my $line = <$sock>) {
+        last if $line =~ /^END/;
+        if ($line =~ /^VALUE (\S+) 0 2/) {
+            $hits++ if <$sock> eq "ok\r\n";
+        }
+    }
+    is($hits, scalar @want, "$algo multiget found every key");
+}
+
+done_testing();
@@ -0,0 +1,77 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+for my $index ('chained', 'bucketed') {
+    # Small table, so a few thousand keys will force it to grow while we keep
+    # writing and reading.
+    my $server = new_memcached("-m 64 -o hashpower=13,hash_expand_threads=4,hash_index=$index");
+    my $sock = $server->sock;
+
+    my $stats = mem_stats($sock);
+    is($stats->{hash_power_level}, 13, "starting hash power");
+    is($stats->{hash_expansions}, 0, "no expansions yet");
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hash_expand_threads}, 4, "hash_expand_threads setting");
+    is($settings->{hash_index}, $index, "hash_index setting");
+
+    my $count = 40000;
+    for my $k (1 .. $count) {
+        my $val = "val$k";
+        print $sock "set key$k 0 0 " . length($val) . " noreply\r\n$val\r\n";
+        if ($k % 1000 == 0) {
+            # keep reads going while buckets are being moved.
+            mem_get_is($sock, "key" . int($k / 2), "val" . int($k / 2));
+        }
+    }
+
+    my $tries = 0;
+    while ($tries++ < 20) {
+        $stats = mem_stats($sock);
+        last if $stats->{hash_power_level} >= 15 && $stats->{hash_is_expanding} == 0;
+        sleep 1;
+    }
+    cmp_ok($stats->{hash_power_level}, '>=', 15, "hash table grew");
+    is($stats->{hash_is_expanding}, 0, "hash table done expanding");
+    cmp_ok($stats->{hash_expansions}, '>=', 2, "expansions counted");
+    # the bucketed index has half as many 64 byte buckets.
+    my $index_power = $stats->{hash_power_level} - ($index eq 'bucketed' ? 1 : 0);
+    my $bucket_bytes = $index eq 'bucketed' ? 64 : 8;
+    is($stats->{hash_resize_buckets_moved}, 2 ** ($index_power - 1),
+        "every old bucket was moved");
+    is($stats->{hash_bytes}, $bucket_bytes * 2 ** $index_power,
+        "old table was released");
+
+    # the crawler walks the hash table directly.
+    print $sock "lru_crawler mgdump hash\r\n";
+    my $dumped = 0;
+    while (my $line = <$sock>) {
+        last if $line eq "EN\r\n";
+        $dumped++;
+    }
+    is($dumped, $count, "hash walk found every key");
+
+    my $missing = 0;
+    for my $k (1 .. $count) {
+        print $sock "get key$k\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE /) {
+            my $val = <$sock>;
+            $missing++ if $val ne "val$k\r\n";
+            $line = <$sock>;
+        } else {
+            $missing++;
+        }
+    }
+    is($missing, 0, "all keys found after expansion");
+
+    $server->stop;
+}
+
+done_testing();
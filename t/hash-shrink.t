@@ -0,0 +1,104 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $count = 40000;
+my $keep = 100;
+
+sub fill_and_empty {
+    my $sock = shift;
+    for my $k (1 .. $count) {
+        print $sock "set key$k 0 0 1 noreply\r\nx\r\n";
+    }
+    wait_for_power($sock, 15);
+    for my $k ($keep + 1 .. $count) {
+        print $sock "delete key$k noreply\r\n";
+    }
+    # make sure the deletes are done.
+    mem_get_is($sock, "key$count", undef);
+}
+
+sub wait_for_power {
+    my ($sock, $power) = @_;
+    my $stats;
+    for (1 .. 20) {
+        $stats = mem_stats($sock);
+        last if $stats->{hash_power_level} == $power
+            && $stats->{hash_is_expanding} == 0;
+        sleep 1;
+    }
+    return $stats;
+}
+
+sub check_keys {
+    my $sock = shift;
+    my $missing = 0;
+    for my $k (1 .. $keep) {
+        print $sock "get key$k\r\n";
+        my $line = <$sock>;
+        if ($line =~ /^VALUE /) {
+            $line = <$sock>;
+            $line = <$sock>;
+        } else {
+            $missing++;
+        }
+    }
+    is($missing, 0, "remaining keys found after shrink");
+}
+
+for my $index ('chained', 'bucketed') {
+    my $server = new_memcached("-o hashpower=13,hash_index=$index");
+    my $sock = $server->sock;
+
+    fill_and_empty($sock);
+    my $stats = mem_stats($sock);
+    is($stats->{hash_power_level}, 15, "$index: table grew");
+    my $grown_bytes = $stats->{hash_bytes};
+
+    print $sock "hash shrink\r\n";
+    is(scalar <$sock>, "OK\r\n", "$index: shrink started");
+    $stats = wait_for_power($sock, 14);
+    is($stats->{hash_power_level}, 14, "$index: shrunk once");
+    is($stats->{hash_shrinks}, 1, "$index: shrink counted");
+    is($stats->{hash_bytes}, $grown_bytes / 2, "$index: memory released");
+    check_keys($sock);
+
+    print $sock "hash shrink\r\n";
+    is(scalar <$sock>, "OK\r\n", "$index: shrink started again");
+    $stats = wait_for_power($sock, 13);
+    is($stats->{hash_power_level}, 13, "$index: back to starting size");
+    check_keys($sock);
+
+    print $sock "hash shrink\r\n";
+    like(scalar <$sock>, qr/^MINIMUM /, "$index: won't shrink past start");
+
+    $server->stop;
+}
+
+{
+    my $server = new_memcached("-o hashpower=13,hash_shrink");
+    my $sock = $server->sock;
+
+    my $settings = mem_stats($sock, ' settings');
+    is($settings->{hash_shrink}, 'yes', "hash_shrink setting");
+
+    fill_and_empty($sock);
+    my $stats = wait_for_power($sock, 13);
+    is($stats->{hash_power_level}, 13, "shrunk on its own");
+    is($stats->{hash_shrinks}, 2, "shrinks counted");
+    check_keys($sock);
+}
+
+{
+    my $server = new_memcached("-o no_hashexpand");
+    my $sock = $server->sock;
+    print $sock "hash shrink\r\n";
+    like(scalar <$sock>, qr/^CLIENT_ERROR /, "shrink needs the maintenance thread");
+}
+
+done_testing();
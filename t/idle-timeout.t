@@ -3,7 +3,7 @@
 use strict;
 use warnings;
 
-use Test::More tests => 11;
+use Test::More tests => 14;
 
 use FindBin qw($Bin);
 use lib "$Bin/lib";
@@ -41,3 +41,21 @@ if (enabled_tls_testing()) {
 $sock = $server->sock;
 $stats = mem_stats($sock);
 isnt($stats->{idle_kicks}, 0, "check stats timeout");
+
+# the per worker counts add up to the total.
+my $workers = mem_stats($sock, "workers");
+my ($kicks, $idle) = (0, 0);
+for my $k (keys %$workers) {
+    $kicks += $workers->{$k} if $k =~ /^\d+:idle_kicks$/;
+    $idle += $workers->{$k} if $k =~ /^\d+:idle_conns$/;
+}
+is($kicks, $stats->{idle_kicks}, "worker idle_kicks add up");
+is($idle, 1, "one connection waiting on a timeout");
+
+# a busy connection isn't kicked while another one idles out.
+my $sock2 = $server->new_sock;
+for (1 .. 6) {
+    mem_stats($sock2);
+    sleep(1);
+}
+is(mem_stats($sock2)->{idle_kicks}, $kicks + 1, "only the idle one was kicked");
@@ -18,7 +18,9 @@ my @unixsockets = ();
              mem_get_is mem_gets mem_gets_is mem_stats mem_move_time
              supports_sasl free_port supports_drop_priv supports_extstore
              wait_ext_flush supports_tls enabled_tls_testing run_help
-             supports_unix_socket get_memcached_exe supports_proxy);
+             supports_unix_socket get_memcached_exe supports_proxy
+             supports_uring supports_zerocopy supports_reuseport
+             supports_busy_poll supports_udp_batch supports_shm);
 
 use constant MAX_READ_WRITE_SIZE => 16384;
 use constant SRV_CRT => "server_crt.pem";
@@ -221,6 +223,42 @@ sub supports_proxy {
     return 0;
 }
 
+sub supports_uring {
+    my $output = print_help();
+    return 1 if $output =~ /worker_uring/i;
+    return 0;
+}
+
+sub supports_zerocopy {
+    my $output = print_help();
+    return 1 if $output =~ /zerocopy_min/i;
+    return 0;
+}
+
+sub supports_reuseport {
+    my $output = print_help();
+    return 1 if $output =~ /reuseport/i;
+    return 0;
+}
+
+sub supports_busy_poll {
+    my $output = print_help();
+    return 1 if $output =~ /busy_poll/i;
+    return 0;
+}
+
+sub supports_udp_batch {
+    my $output = print_help();
+    return 1 if $output =~ /udp_batch/i;
+    return 0;
+}
+
+sub supports_shm {
+    my $output = print_help();
+    return 1 if $output =~ /shm_ring_size/i;
+    return 0;
+}
+
 sub supports_tls {
     my $output = print_help();
     return 1 if $output =~ /enable-ssl/i;
@@ -299,6 +337,9 @@ sub new_memcached {
         $args .= " -u root";
     }
     $args .= " -o relaxed_privileges";
+    if ($ENV{URING_TEST} && supports_uring()) {
+        $args .= " -o worker_uring";
+    }
 
     my $udpport;
     if ($args =~ /-l (\S+)/ || (($ssl_enabled || $unix_socket_disabled) && ($args !~ /-s (\S+)/))) {
@@ -0,0 +1,125 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-m 32 -o lockfree_get');
+my $sock = $server->sock;
+
+is(mem_stats($sock, ' settings')->{lockfree_get}, 'yes', "lockfree_get enabled");
+
+# An item is served lock-free once its hit flags are set, which takes a couple
+# of reads. Asking for a key three times in one get makes sure at least the
+# last one is, and all three have to match.
+sub hot_get_is {
+    my ($key, $val, $msg, $flags) = @_;
+    $flags ||= 0;
+    print $sock "get $key $key $key\r\n";
+    my $got = '';
+    while (my $line = <$sock>) {
+        last if $line =~ /^END/;
+        $got .= $line;
+    }
+    my $expect = defined $val
+        ? "VALUE $key $flags " . length($val) . "\r\n$val\r\n" : '';
+    is($got, $expect x 3, $msg);
+}
+
+print $sock "set hot 5 0 3\r\nfoo\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored hot");
+hot_get_is('hot', 'foo', "hot key read with flags", 5);
+
+{
+    print $sock "gets hot\r\n";
+    like(scalar <$sock>, qr/^VALUE hot 5 3 \d+\r\n/, "gets has a cas");
+    is(scalar <$sock>, "foo\r\n", "gets value");
+    is(scalar <$sock>, "END\r\n", "gets end");
+}
+
+# small and large values, with misses, in one multiget.
+{
+    my $big = 'B' x 2000;
+    print $sock "set a 0 0 1\r\na\r\nset big 0 0 2000\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a");
+    is(scalar <$sock>, "STORED\r\n", "stored big");
+    hot_get_is('a', 'a', "small value");
+    hot_get_is('big', $big, "large value falls back to a normal get");
+    print $sock "get a nope big hot\r\n";
+    is(scalar <$sock>, "VALUE a 0 1\r\n", "mget a");
+    is(scalar <$sock>, "a\r\n", "mget a value");
+    is(scalar <$sock>, "VALUE big 0 2000\r\n", "mget big");
+    is(scalar <$sock>, "$big\r\n", "mget big value");
+    is(scalar <$sock>, "VALUE hot 5 3\r\n", "mget hot");
+    is(scalar <$sock>, "foo\r\n", "mget hot value");
+    is(scalar <$sock>, "END\r\n", "mget end");
+}
+
+# writes to a hot item are seen right away.
+{
+    print $sock "set hot 0 0 3\r\nbar\r\n";
+    is(scalar <$sock>, "STORED\r\n", "replaced hot");
+    hot_get_is('hot', 'bar', "replaced value");
+
+    print $sock "append hot 0 0 1\r\nx\r\n";
+    is(scalar <$sock>, "STORED\r\n", "appended");
+    hot_get_is('hot', 'barx', "appended value");
+
+    print $sock "set num 0 0 2\r\n10\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored num");
+    for my $n (11 .. 15) {
+        print $sock "incr num 1\r\n";
+        is(scalar <$sock>, "$n\r\n", "incr to $n");
+        hot_get_is('num', $n, "read back $n");
+    }
+    print $sock "decr num 6\r\n";
+    is(scalar <$sock>, "9\r\n", "decr to 9");
+    # never changed in place, so no padding is left behind.
+    hot_get_is('num', '9', "read back 9");
+
+    print $sock "delete hot\r\n";
+    is(scalar <$sock>, "DELETED\r\n", "deleted hot");
+    hot_get_is('hot', undef, "deleted hot key misses");
+
+    print $sock "flush_all\r\n";
+    is(scalar <$sock>, "OK\r\n", "flushed");
+    hot_get_is('a', undef, "flushed key misses");
+}
+
+# expired items still get reaped.
+{
+    print $sock "set short 0 2 1\r\ns\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored short");
+    hot_get_is('short', 's', "short lived key read");
+    sleep 3;
+    hot_get_is('short', undef, "expired key misses");
+}
+
+# Churn through memory so freed items go through limbo and get reused, and
+# make sure sets never fail for lack of memory while reads are going on.
+{
+    my $value = 'x' x 500;
+    my $errors = 0;
+    for my $n (1 .. 100000) {
+        print $sock "set churn$n 0 0 500 noreply\r\n$value\r\n";
+        if ($n % 100 == 0) {
+            my $k = $n - 50;
+            print $sock "get churn$k churn$k churn$k\r\n";
+            while (my $line = <$sock>) {
+                last if $line =~ /^END/;
+                $errors++ if $line =~ /^SERVER_ERROR/;
+            }
+        }
+    }
+    is($errors, 0, "no errors while churning");
+    my $stats = mem_stats($sock);
+    cmp_ok($stats->{evictions}, '>', 0, "evicted while churning");
+    mem_get_is($sock, 'churn100000', $value, "newest item is there");
+    print $sock "set after 0 0 2\r\nok\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored after churning");
+}
+
+done_testing();
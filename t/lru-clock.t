@@ -0,0 +1,70 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+eval {
+    my $server = new_memcached('-o lru_clock,no_lru_maintainer');
+};
+ok($@, "lru_clock needs the lru maintainer");
+
+my $server = new_memcached('-m 6 -o lru_clock');
+my $sock = $server->sock;
+is(mem_stats($sock, ' settings')->{lru_clock}, 'yes', "lru_clock enabled");
+
+my $value = 'x' x 200;
+
+sub fetch_work {
+    my $hits = 0;
+    for my $n (1 .. 1000) {
+        print $sock "get work$n\r\n";
+        while (my $line = <$sock>) {
+            last if $line =~ /^END/;
+            $hits++ if $line =~ /^VALUE/;
+        }
+    }
+    return $hits;
+}
+
+# Fills with keys nobody asks for again, fetching the working set every so
+# often if asked to.
+sub fill {
+    my ($from, $to, $fetch) = @_;
+    my $hits = 0;
+    for my $n ($from .. $to) {
+        print $sock "set fill$n 0 0 200 noreply\r\n$value\r\n";
+        # give the lru maintainer a chance to keep up.
+        if ($n % 5000 == 0) {
+            mem_get_is($sock, "fill$n", $value);
+            $hits += fetch_work() if $fetch;
+            sleep 1;
+        }
+    }
+    return $hits;
+}
+
+for my $n (1 .. 1000) {
+    print $sock "set work$n 0 0 200 noreply\r\n$value\r\n";
+}
+# push the working set down into COLD before it's fetched.
+fill(1, 10000);
+is(fetch_work(), 1000, "working set fetched");
+is(fetch_work(), 1000, "working set fetched again");
+
+# well past what fits, so COLD gets evicted from over and over.
+is(fill(10001, 60000, 1), 10000, "working set kept while filling");
+my $stats = mem_stats($sock);
+cmp_ok($stats->{evictions}, '>', 0, "evicted while filling");
+is($stats->{lru_bumps_dropped}, 0, "no bumps dropped");
+is(fetch_work(), 1000, "working set survived");
+
+my $items = mem_stats($sock, 'items');
+my ($cls) = map { /^items:(\d+):number$/ ? $1 : () } keys %$items;
+cmp_ok($items->{"items:$cls:moves_to_warm"} + $items->{"items:$cls:moves_within_lru"},
+    '>', 0, "fetched items were kept by the lru sweeps");
+
+done_testing();
@@ -0,0 +1,138 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached('-o no_lru_crawler');
+    my $sock = $server->sock;
+    print $sock "lru_crawler invalidate foo\r\n";
+    is(scalar <$sock>, "CLIENT_ERROR lru crawler disabled\r\n", "needs the lru crawler");
+}
+
+my $server = new_memcached('-o lru_crawler_threads=2');
+my $sock = $server->sock;
+
+sub wait_for_crawler {
+    while (1) {
+        my $stats = mem_stats($sock);
+        last unless $stats->{lru_crawler_running};
+        sleep 1;
+    }
+}
+
+# the lru maintainer may have a crawl of its own going.
+sub invalidate {
+    my $pattern = shift;
+    my $res;
+    for (1 .. 20) {
+        print $sock "lru_crawler invalidate $pattern\r\n";
+        $res = <$sock>;
+        last unless $res =~ /^BUSY/;
+        sleep 1;
+    }
+    return $res;
+}
+
+sub count_hits {
+    my ($prefix, $count) = @_;
+    my $hits = 0;
+    for my $n (1 .. $count) {
+        print $sock "get $prefix$n\r\n";
+        while (my $line = <$sock>) {
+            last if $line =~ /^END/;
+            $hits++ if $line =~ /^VALUE/;
+        }
+    }
+    return $hits;
+}
+
+my $stats = mem_stats($sock);
+is($stats->{lru_crawler_invalidated}, 0, "nothing invalidated yet");
+
+my $big = 'x' x 2000;
+for my $n (1 .. 300) {
+    print $sock "set tenant1:small$n 0 0 1 noreply\r\nx\r\n";
+    print $sock "set tenant1:big$n 0 0 2000 noreply\r\n$big\r\n";
+    print $sock "set tenant10:small$n 0 0 1 noreply\r\nx\r\n";
+    print $sock "set tenant2:small$n 0 0 1 noreply\r\nx\r\n";
+}
+mem_get_is($sock, "tenant2:small300", "x", "stored items");
+
+print $sock "lru_crawler invalidate " . ('k' x 251) . "\r\n";
+is(scalar <$sock>, "CLIENT_ERROR pattern too long\r\n", "pattern can't be longer than a key");
+
+is(invalidate("tenant1:"), "OK\r\n", "invalidating a prefix");
+wait_for_crawler();
+
+$stats = mem_stats($sock);
+is($stats->{lru_crawler_invalidated}, 600, "every key with the prefix invalidated");
+cmp_ok($stats->{lru_crawler_invalidated_bytes}, '>', 600000, "bytes freed counted");
+cmp_ok($stats->{lru_crawler_invalidate_checked}, '>=', 1200, "every item checked");
+is($stats->{curr_items}, 600, "other items kept");
+is(count_hits("tenant1:small", 300), 0, "small items gone");
+is(count_hits("tenant1:big", 300), 0, "big items gone");
+is(count_hits("tenant10:small", 300), 300, "longer prefix kept");
+is(count_hits("tenant2:small", 300), 300, "other prefix kept");
+
+is(invalidate("tenant*:small?"), "OK\r\n", "invalidating a glob");
+wait_for_crawler();
+
+$stats = mem_stats($sock);
+is($stats->{lru_crawler_invalidated}, 618, "only keys matching the whole glob invalidated");
+is(count_hits("tenant10:small", 9), 0, "matching keys gone");
+is(count_hits("tenant10:small", 300), 291, "others kept");
+
+# fetches bump items between the LRUs while the crawl is running; none of the
+# matching ones may slip past it. A small HOT LRU puts the items in COLD, where
+# a hit moves them up to WARM, and a slow crawl gives them time to move.
+{
+    my $server = new_memcached('-o lru_crawler_threads=2,lru_crawler_sleep=200,hot_lru_pct=1');
+    my $sock = $server->sock;
+    for my $n (1 .. 5000) {
+        print $sock "set tenant3:k$n 0 0 1 noreply\r\nx\r\n";
+        print $sock "set tenant4:k$n 0 0 1 noreply\r\nx\r\n" if $n <= 100;
+    }
+    mem_get_is($sock, "tenant3:k5000", "x", "stored items to bump");
+
+    my $pid = fork();
+    die "fork failed: $!" unless defined $pid;
+    if ($pid == 0) {
+        my $bsock = $server->new_sock;
+        while (1) {
+            for my $n (reverse 1 .. 5000) {
+                print $bsock "mg tenant3:k$n v\r\n";
+                my $line = <$bsock>;
+                exit 0 unless defined $line;
+                # the value line follows a hit.
+                <$bsock> if $line =~ /^VA/;
+            }
+        }
+    }
+
+    sleep 1;
+    print $sock "lru_crawler invalidate tenant3:\r\n";
+    is(scalar <$sock>, "OK\r\n", "invalidating while keys are fetched");
+    while (mem_stats($sock)->{lru_crawler_running}) {
+        sleep 1;
+    }
+    kill 'TERM', $pid;
+    waitpid($pid, 0);
+
+    my $stats = mem_stats($sock);
+    is($stats->{lru_crawler_invalidated}, 5000, "every bumped key invalidated");
+    is($stats->{curr_items}, 100, "no bumped key survived");
+    my $left = 0;
+    for my $n (1 .. 5000) {
+        print $sock "mg tenant3:k$n\r\n";
+        $left++ if scalar <$sock> =~ /^HD/;
+    }
+    is($left, 0, "no bumped key found");
+    mem_get_is($sock, "tenant4:k100", "x", "other prefix kept");
+}
+
+done_testing();
@@ -0,0 +1,96 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+eval {
+    my $server = new_memcached('-o lru_crawler_threads=0');
+};
+ok($@, "lru_crawler_threads must be at least one");
+
+my $server = new_memcached('-m 64 -o lru_crawler_threads=4');
+my $sock = $server->sock;
+is(mem_stats($sock, ' settings')->{lru_crawler_threads}, 4, "four crawler threads");
+
+# spread over enough slab classes that every thread gets some.
+my @sizes = (10, 100, 300, 700, 1500, 3000, 6000, 12000);
+my %keys = ();
+for my $size (@sizes) {
+    my $value = 'x' x $size;
+    for my $n (1 .. 500) {
+        print $sock "set keep${size}_$n 0 0 $size noreply\r\n$value\r\n";
+        print $sock "set short${size}_$n 0 1 $size noreply\r\n$value\r\n";
+        $keys{"keep${size}_$n"} = 1;
+    }
+}
+mem_get_is($sock, "keep10_1", 'x' x 10, "stored items");
+
+sleep 3;
+
+sub wait_for_crawler {
+    while (1) {
+        my $stats = mem_stats($sock);
+        last unless $stats->{lru_crawler_running};
+        sleep 1;
+    }
+}
+
+print $sock "lru_crawler crawl all\r\n";
+is(scalar <$sock>, "OK\r\n", "kicked lru crawler");
+wait_for_crawler();
+
+my $items = mem_stats($sock, "items");
+my $reclaimed = 0;
+my $classes = 0;
+for my $k (keys %$items) {
+    if ($k =~ /^items:\d+:crawler_reclaimed$/) {
+        $reclaimed += $items->{$k};
+        $classes++ if $items->{$k};
+    }
+}
+is($reclaimed, 4000, "every expired item reclaimed");
+is($classes, scalar @sizes, "in every class");
+is(mem_stats($sock)->{curr_items}, 4000, "live items kept");
+
+for my $mode ('all', 'hash') {
+    print $sock "lru_crawler metadump $mode\r\n";
+    my %seen = ();
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        $seen{$1}++ if $line =~ /^key=(\S+) /;
+    }
+    is(scalar keys %seen, 4000, "metadump $mode found every key");
+    is((grep { $seen{$_} != 1 } keys %seen), 0, "each key once");
+    is((grep { !$keys{$_} } keys %seen), 0, "only live keys");
+
+    print $sock "lru_crawler mgdump $mode\r\n";
+    my $dumped = 0;
+    while (my $line = <$sock>) {
+        last if $line eq "EN\r\n";
+        $dumped++ if $line =~ /^mg keep\d+_\d+\r\n$/;
+    }
+    is($dumped, 4000, "mgdump $mode found every key");
+}
+
+# the threads must survive being turned off and on.
+print $sock "lru_crawler disable\r\n";
+is(scalar <$sock>, "OK\r\n", "disabled lru crawler");
+for (1 .. 10) {
+    last if mem_stats($sock, ' settings')->{lru_crawler} eq "no";
+    sleep 1;
+}
+print $sock "lru_crawler enable\r\n";
+is(scalar <$sock>, "OK\r\n", "enabled lru crawler");
+print $sock "lru_crawler metadump all\r\n";
+my $count = 0;
+while (my $line = <$sock>) {
+    last if $line eq "END\r\n";
+    $count++;
+}
+is($count, 4000, "metadump after restarting the crawler");
+
+done_testing();
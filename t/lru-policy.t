@@ -0,0 +1,107 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+eval {
+    my $server = new_memcached('-o lru_policy=fifo');
+};
+ok($@, "unknown lru_policy is refused");
+
+eval {
+    my $server = new_memcached('-o lru_policy=tinylfu,no_lru_maintainer');
+};
+ok($@, "tinylfu needs the lru maintainer");
+
+my $value = 'x' x 200;
+
+# Reads a working set a few times, then scans through far more keys than fit
+# in memory, each set once and never read.
+sub run_scan {
+    my $sock = shift;
+    for my $round (1 .. 3) {
+        for my $n (1 .. 2000) {
+            print $sock "set work$n 0 0 200 noreply\r\n$value\r\n" if $round == 1;
+            print $sock "get work$n\r\n";
+            while (my $line = <$sock>) {
+                last if $line =~ /^END/;
+            }
+        }
+    }
+    for my $n (1 .. 80000) {
+        print $sock "set scan$n 0 0 200 noreply\r\n$value\r\n";
+        # give the lru maintainer a chance to keep up.
+        if ($n % 5000 == 0) {
+            mem_get_is($sock, "scan$n", $value);
+            sleep 1;
+        }
+    }
+}
+
+sub working_set_hits {
+    my $sock = shift;
+    my $hits = 0;
+    for my $n (1 .. 2000) {
+        print $sock "get work$n\r\n";
+        while (my $line = <$sock>) {
+            last if $line =~ /^END/;
+            $hits++ if $line =~ /^VALUE/;
+        }
+    }
+    return $hits;
+}
+
+# The most recently evicted scan key.
+sub last_evicted {
+    my $sock = shift;
+    for (my $n = 80000; $n > 0; $n--) {
+        print $sock "get scan$n\r\n";
+        my $line = <$sock>;
+        return "scan$n" if $line =~ /^END/;
+        <$sock>; <$sock>;
+    }
+}
+
+sub class_stats {
+    my $sock = shift;
+    my $items = mem_stats($sock, 'items');
+    my ($cls) = map { /^items:(\d+):number$/ ? $1 : () } keys %$items;
+    return map { /^items:$cls:(\w+)$/ ? ($1 => $items->{$_}) : () } keys %$items;
+}
+
+my $segmented_hits;
+{
+    my $server = new_memcached('-m 6');
+    my $sock = $server->sock;
+    is(mem_stats($sock, ' settings')->{lru_policy}, 'segmented', "segmented by default");
+    run_scan($sock);
+    $segmented_hits = working_set_hits($sock);
+    my $key = last_evicted($sock);
+    ok($key, "$key was evicted");
+    my %stats = class_stats($sock);
+    cmp_ok($stats{evicted}, '>', 0, "evicted while scanning");
+    ok(!exists $stats{admission_rejects}, "no admission stats without tinylfu");
+    ok(!exists $stats{evicted_misses}, "no evicted_misses without tinylfu");
+    ok(!exists $stats{hit_ratio}, "no hit_ratio without tinylfu");
+}
+
+{
+    my $server = new_memcached('-m 6 -o lru_policy=tinylfu');
+    my $sock = $server->sock;
+    is(mem_stats($sock, ' settings')->{lru_policy}, 'tinylfu', "tinylfu enabled");
+    run_scan($sock);
+    my $hits = working_set_hits($sock);
+    cmp_ok($hits, '>', $segmented_hits, "more of the working set survived the scan");
+    my $key = last_evicted($sock);
+    ok($key, "$key was turned away");
+    my %stats = class_stats($sock);
+    cmp_ok($stats{admission_rejects}, '>', 0, "scanned keys turned away");
+    cmp_ok($stats{evicted_misses}, '>', 0, "misses on turned away keys counted");
+    like($stats{hit_ratio}, qr/^0\.\d{4}$/, "hit ratio reported");
+}
+
+done_testing();
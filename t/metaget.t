@@ -632,6 +632,31 @@ my $sock = $server->sock;
     like(scalar <$sock>, qr/^HD s0/, "quiet doesn't override autovivication");
 }
 
+{
+    diag "long pipelined mget";
+    # A long run of mg's arriving in one write gets its keys prefetched up
+    # front. Mix in misses, base64 keys and extra spaces.
+    for my $n (0 .. 39) {
+        printf $sock "ms plget$n 2 q\r\n%02d\r\n", $n if $n % 4;
+    }
+    my $req = '';
+    for my $n (0 .. 39) {
+        $req .= $n % 5 ? "mg  plget$n v k\r\n" : "mg bm9rZXkw v b\r\n";
+    }
+    print $sock $req . "mn\r\n";
+    for my $n (0 .. 39) {
+        if ($n % 5 == 0) {
+            like(scalar <$sock>, qr/^EN/, "base64 key $n missed");
+        } elsif ($n % 4 == 0) {
+            like(scalar <$sock>, qr/^EN/, "key $n missed");
+        } else {
+            like(scalar <$sock>, qr/^VA 2 kplget$n/, "key $n hit");
+            is(scalar <$sock>, sprintf("%02d\r\n", $n), "key $n value");
+        }
+    }
+    like(scalar <$sock>, qr/^MN/, "end token");
+}
+
 {
     my $k = 'otest';
     diag "testing mget opaque";
@@ -7,9 +7,7 @@ use Socket qw(MSG_PEEK MSG_DONTWAIT);
 use lib "$Bin/lib";
 use MemcachedTest;
 
-if (!enabled_tls_testing() && supports_drop_priv()) {
-    plan tests => 1;
-} else {
+if (enabled_tls_testing() || !supports_drop_priv()) {
     plan skip_all => 'Privilege drop not supported';
     exit 0;
 }
@@ -27,3 +25,30 @@ my $ret = recv($sock, $buff, 1, MSG_PEEK | MSG_DONTWAIT);
 ok($ret == 0, "did not allow misbehaving");
 
 $server->DESTROY();
+
+# the worker filter has to let through whatever the enabled options use after
+# the threads have started.
+sub check_set_get {
+    my ($opts, $name) = @_;
+    my $server = new_memcached("-o drop_privileges,$opts");
+    my $sock = $server->sock;
+    my $val = 'x' x 100000;
+    print $sock "set foo 0 0 " . length($val) . "\r\n$val\r\n";
+    is(scalar <$sock>, "STORED\r\n", "$name: stored");
+    mem_get_is($sock, "foo", $val, "$name: fetched");
+    $server->DESTROY();
+}
+
+if (supports_uring()) {
+    check_set_get('worker_uring', 'worker_uring');
+}
+
+if (supports_zerocopy()) {
+    check_set_get('zerocopy_min=4096', 'zerocopy');
+}
+
+if (supports_reuseport()) {
+    check_set_get('reuseport', 'reuseport');
+}
+
+done_testing();
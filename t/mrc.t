@@ -0,0 +1,130 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached();
+    my $stats = mem_stats($server->sock, 'mrc');
+    is($stats->{mrc_status}, 'disabled', "disabled by default");
+}
+
+eval {
+    my $server = new_memcached('-o mrc_sample_rate=often');
+};
+ok($@, "bad mrc_sample_rate is refused");
+
+# With every key sampled, fetching keys in the order they were stored needs
+# room for all of them to hit.
+{
+    my $server = new_memcached('-m 8 -o mrc_sample_rate=1');
+    my $sock = $server->sock;
+    is(mem_stats($sock, ' settings')->{mrc_sample_rate}, 1, "sampling every key");
+
+    my $value = 'x' x 1000;
+    for my $n (1 .. 4000) {
+        print $sock "set key$n 0 0 1000 noreply\r\n$value\r\n";
+    }
+    mem_get_is($sock, 'key1', $value, "stored keys");
+    for my $n (2 .. 4000) {
+        mem_get_is($sock, "key$n", $value);
+    }
+    mem_get_is($sock, 'nokey', undef, "miss on a key never stored");
+
+    my $items = mem_stats($sock, 'items');
+    my ($cls) = map { /^items:(\d+):number$/ ? $1 : () } keys %$items;
+    my $slabs = mem_stats($sock, 'slabs');
+    my $need = 4000 * $slabs->{"$cls:chunk_size"};
+    my $step = 1024 * 1024;
+
+    my $stats = mem_stats($sock, 'mrc');
+    is($stats->{sample_rate}, 1, "sample rate reported");
+    is($stats->{tracked_keys}, 4000, "all stored keys tracked");
+    is($stats->{gets}, 4001, "all gets counted");
+    is($stats->{"$cls:gets"}, 4000, "class gets counted");
+    my $under = int($need / $step) * $step;
+    my $over = $under + $step;
+    is($stats->{"miss_ratio:$under"}, '1.0000', "everything misses under $need bytes");
+    is($stats->{"miss_ratio:$over"}, sprintf('%.4f', 1 / 4001),
+        "only the unknown key misses with more");
+    is($stats->{"$cls:miss_ratio:$under"}, '1.0000', "class misses under $need bytes");
+    is($stats->{"$cls:miss_ratio:$over"}, '0.0000', "class hits with more");
+    is($stats->{"miss_ratio:" . 32 * $step}, $stats->{"miss_ratio:$over"},
+        "curve goes up to four times the memory limit");
+    ok(!exists $stats->{"miss_ratio:" . 33 * $step}, "and no further");
+
+    # fetched again in the same order, each still needs room for all of them.
+    for my $n (1 .. 4000) {
+        mem_get_is($sock, "key$n", $value);
+    }
+    $stats = mem_stats($sock, 'mrc');
+    is($stats->{"$cls:gets"}, 8000, "class gets counted");
+    is($stats->{"$cls:miss_ratio:$over"}, '0.0000', "class still hits with more");
+}
+
+# More sampled keys than are tracked, and enough references that the
+# timestamps get renumbered.
+{
+    my $server = new_memcached('-m 8 -o mrc_sample_rate=1');
+    my $sock = $server->sock;
+    for my $round (1 .. 2) {
+        for my $n (1 .. 40000) {
+            print $sock "set key$n 0 0 1 noreply\r\nx\r\n";
+        }
+    }
+    mem_get_is($sock, 'key40000', 'x', "stored keys");
+    for my $n (39001 .. 39999) {
+        mem_get_is($sock, "key$n", 'x');
+    }
+    my $stats = mem_stats($sock, 'mrc');
+    is($stats->{tracked_keys}, 32768, "tracked keys are capped");
+    cmp_ok($stats->{sample_rate}, '>', 1, "sample rate lowered past the cap");
+    cmp_ok(abs($stats->{gets} * $stats->{sample_rate} - 1000), '<', 100,
+        "gets counted at the lowered rate");
+    is($stats->{"miss_ratio:1048576"}, '0.0000', "recent keys hit with little memory");
+}
+
+# A working set of many more keys than are tracked, fetched in a loop, needs
+# room for all of them to hit. The sampling rate drops until the tracked keys
+# cover it.
+{
+    my $server = new_memcached('-m 64 -o mrc_sample_rate=1');
+    my $sock = $server->sock;
+    my $keys = 150000;
+    for my $n (1 .. $keys) {
+        print $sock "set key$n 0 0 1 noreply\r\nx\r\n";
+    }
+    mem_get_is($sock, "key$keys", 'x', "stored keys");
+    for my $round (1 .. 2) {
+        for (my $n = 1; $n <= $keys; $n += 100) {
+            my $last = $n + 99 > $keys ? $keys : $n + 99;
+            print $sock "get " . join(' ', map { "key$_" } $n .. $last) . "\r\n";
+            my $found = 0;
+            while (my $line = <$sock>) {
+                last if $line eq "END\r\n";
+                $found++ if $line =~ /^VALUE /;
+            }
+            die "missing keys" unless $found == $last - $n + 1;
+        }
+    }
+
+    my $items = mem_stats($sock, 'items');
+    my ($cls) = map { /^items:(\d+):number$/ ? $1 : () } keys %$items;
+    my $slabs = mem_stats($sock, 'slabs');
+    my $need = $keys * $slabs->{"$cls:chunk_size"};
+    my $step = 8 * 1024 * 1024;
+    my $under = int($need / $step) * $step;
+    my $over = $under + 2 * $step;
+
+    my $stats = mem_stats($sock, 'mrc');
+    is($stats->{tracked_keys}, 32768, "tracked keys are capped");
+    cmp_ok($stats->{sample_rate}, '>', 3, "sample rate lowered to cover the keys");
+    cmp_ok($stats->{"miss_ratio:$under"}, '>', 0.95, "misses under $need bytes");
+    cmp_ok($stats->{"miss_ratio:$over"}, '<', 0.05, "hits with more");
+}
+
+done_testing();
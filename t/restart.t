@@ -160,8 +160,79 @@ diag "low TTL item should be gone";
     }
 }
 
+# The hash table and LRUs are saved next to the memory file. Make sure the
+# reused LRUs are intact, then restart with a different index layout, which
+# can't reuse the saved table and has to relink everything.
+sub count_dump {
+    my $sock = shift;
+    my $count = 0;
+    print $sock "lru_crawler metadump all\r\n";
+    while (my $line = <$sock>) {
+        last if $line =~ /^END/;
+        $count++ if $line =~ /^key=/;
+    }
+    return $count;
+}
+
+{
+    # drop the one item with a TTL so the counts can't shift under us.
+    print $sock "delete low2\r\n";
+    like(scalar <$sock>, qr/^DELETED/, "deleted low2");
+    my $stats = mem_stats($sock);
+    is(count_dump($sock), $stats->{curr_items}, "restored LRUs hold every item");
+
+    $server->graceful_stop();
+    sleep 10;
+    $server = new_memcached("-m 128 -e $mem_path -I 2m -o hash_index=bucketed");
+    $sock = $server->sock;
+
+    is(mem_stats($sock)->{curr_items}, $stats->{curr_items}, "relinked item count");
+    is(count_dump($sock), $stats->{curr_items}, "relinked LRUs hold every item");
+    mem_get_is($sock, 'foo3', 'x' x 16);
+}
+
+# Recovery split across several threads, relinking back to a chained index.
+# The last recovery's timing is kept in the metadata.
+{
+    my $stats = mem_stats($sock);
+    $server->graceful_stop();
+    sleep 1 while $server->is_running() == 1;
+    open(my $f, "< $mem_path.meta") || die("Can't open the metadata file.");
+    my $meta = do { local $/; <$f> };
+    close($f);
+    like($meta, qr/^Krecovery_us \d+$/m, "recovery time saved in metadata");
+    like($meta, qr/^Krecovery_threads 1$/m, "recovery threads saved in metadata");
+
+    sleep 2;
+    $server = new_memcached("-m 128 -e $mem_path -I 2m -o restart_threads=4");
+    $sock = $server->sock;
+
+    is(mem_stats($sock, ' settings')->{restart_threads}, 4, "restart_threads set");
+    is(mem_stats($sock)->{curr_items}, $stats->{curr_items}, "item count with 4 threads");
+    is(count_dump($sock), $stats->{curr_items}, "LRUs hold every item with 4 threads");
+    mem_get_is($sock, 'foo3', 'x' x 16);
+    {
+        my $cur = 768000;
+        my $cnt = 0;
+        while ($cur <= 768000 + 1024) {
+            if ($cnt != $deleted_chunked_item) {
+                mem_get_is($sock, 'chunk' . $cnt, 'x' x $cur);
+            }
+            $cur += 50;
+            $cnt++;
+        }
+    }
+    print $sock "set after 0 0 2\r\nhi\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored after threaded recovery");
+    mem_get_is($sock, 'after', 'hi');
+}
+
 done_testing();
 
 END {
-    unlink $mem_path if $mem_path;
+    if ($mem_path) {
+        unlink $mem_path;
+        unlink "$mem_path.hash";
+        unlink "$mem_path.meta";
+    }
 }
@@ -0,0 +1,75 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_reuseport()) {
+    plan skip_all => 'SO_REUSEPORT not supported';
+    exit 0;
+}
+
+my $server = new_memcached('-o reuseport -t 4 -c 128 -l 127.0.0.1');
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{reuseport}, "yes", "reuseport enabled");
+
+{
+    my @socks = map { $server->new_sock } 1 .. 40;
+    my $ok = 0;
+    my $i = 0;
+    for my $s (@socks) {
+        $i++;
+        print $s "set conn$i 0 0 " . length($i) . "\r\n$i\r\n";
+        $ok++ if scalar <$s> eq "STORED\r\n";
+    }
+    is($ok, 40, "connections accepted by the workers");
+
+    $ok = 0;
+    $i = 0;
+    for my $s (@socks) {
+        $i++;
+        my $n = 41 - $i;
+        print $s "get conn$n\r\n";
+        $ok++ if scalar <$s> eq "VALUE conn$n 0 " . length($n) . "\r\n"
+            && scalar <$s> eq "$n\r\n" && scalar <$s> eq "END\r\n";
+    }
+    is($ok, 40, "values visible across threads");
+    close($_) for @socks;
+}
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{total_connections}, '>=', 41, "connections counted");
+
+{
+    # over -c, connections are turned away by whichever worker accepted them.
+    my @socks;
+    for (1 .. 200) {
+        my $s = $server->new_sock;
+        push(@socks, $s) if defined $s;
+    }
+    my $rejected = 0;
+    for (1 .. 5) {
+        $stats = mem_stats($sock);
+        $rejected = $stats->{rejected_connections};
+        last if $rejected;
+        sleep 1;
+    }
+    cmp_ok($rejected, '>', 0, "rejected connections over maxconns");
+    close($_) for @socks;
+
+    my $s;
+    for (1 .. 5) {
+        $s = $server->new_sock;
+        last if defined $s;
+        sleep 1;
+    }
+    print $s "get conn1\r\n";
+    is(scalar <$s>, "VALUE conn1 0 1\r\n", "accepting again after maxconns");
+}
+
+done_testing();
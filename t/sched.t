@@ -0,0 +1,73 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $server = new_memcached('-o sched_quantum=4096 -t 1');
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{sched_quantum}, 4096, "sched_quantum set");
+is($stats->{sched_stats}, "yes", "sched_stats implied");
+
+print $sock "mp 2\r\n";
+is(scalar <$sock>, "HD\r\n", "priority class set");
+print $sock "mp 3\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad priority class\r\n", "class out of range");
+print $sock "mp low\r\n";
+is(scalar <$sock>, "CLIENT_ERROR bad priority class\r\n", "class not a number");
+print $sock "mp 0\r\n";
+is(scalar <$sock>, "HD\r\n", "low priority class set");
+
+my $big = join('', map { chr(65 + $_ % 26) } 1 .. 200000);
+# large enough to be chunked, and read in over many turns.
+my $huge = join('', map { chr(97 + $_ % 26) } 1 .. 900000);
+
+print $sock "set big 0 0 200000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big value");
+print $sock "set huge 0 0 900000\r\n$huge\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored chunked value");
+print $sock "set small 0 0 2\r\nhi\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored small value");
+
+{
+    # a low priority client asks for a lot, and another gets served while
+    # it's still reading.
+    print $sock "get big\r\n" x 10;
+    my $other = $server->new_sock;
+    mem_get_is($other, "small", "hi", "small get served");
+
+    my $ok = 0;
+    for (1 .. 10) {
+        my $hdr = <$sock>;
+        my $data;
+        read($sock, $data, 200002);
+        my $end = <$sock>;
+        $ok++ if $hdr eq "VALUE big 0 200000\r\n" && $data eq "$big\r\n"
+            && $end eq "END\r\n";
+    }
+    is($ok, 10, "all big responses intact");
+}
+
+mem_get_is($sock, "huge", $huge, "chunked value read back");
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{sched_yields}, '>', 0, "connections yielded");
+ok(defined $stats->{sched_skips}, "skips counted");
+cmp_ok($stats->{sched_turn_max_us}, '>=', $stats->{sched_turn_p50_us}, "turn times tracked");
+
+{
+    my $plain = new_memcached();
+    my $s = $plain->sock;
+    print $s "mp 2\r\n";
+    is(scalar <$s>, "HD\r\n", "priority accepted without scheduling");
+    $stats = mem_stats($s);
+    ok(!exists $stats->{sched_yields}, "no scheduling stats");
+    ok(!exists $stats->{sched_turn_p99_us}, "no turn stats");
+}
+
+done_testing();
@@ -0,0 +1,150 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use Config;
+use POSIX ();
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_shm() || !supports_unix_socket()) {
+    plan skip_all => 'shm transport not supported';
+    exit 0;
+}
+
+# the rings are torn down when the worker sees the socket close.
+sub shm_conns_are {
+    my ($sock, $want, $msg) = @_;
+    my $stats;
+    for (1 .. 50) {
+        $stats = mem_stats($sock);
+        last if $stats->{curr_shm_connections} == $want;
+        sleep(0.1);
+    }
+    is($stats->{curr_shm_connections}, $want, $msg);
+}
+
+my $server = new_memcached("-o shm_ring_size=64");
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{shm_ring_size}, 65536, "shm_ring_size in bytes");
+$stats = mem_stats($sock);
+is($stats->{curr_shm_connections}, 0, "no shm connections yet");
+is($stats->{shm_wakeups}, 0, "no wakeups yet");
+
+{
+    my $s = $server->new_sock;
+    print $s "shm\r\n";
+    is(scalar <$s>, "SHM 65536\r\n", "switched to shm");
+    shm_conns_are($sock, 1, "counted");
+    # anything sent on the socket now is only a wakeup.
+    print $s "get foo\r\n";
+    print $sock "version\r\n";
+    like(scalar <$sock>, qr/^VERSION /, "server still answering");
+    close($s);
+    shm_conns_are($sock, 0, "closed with the socket");
+}
+
+{
+    my $s = $server->new_sock;
+    print $s "version\r\nshm\r\n";
+    like(scalar <$s>, qr/^VERSION /, "pipelined command answered");
+    is(scalar <$s>, "CLIENT_ERROR shm must be sent on its own\r\n",
+        "shm can't be pipelined");
+    print $s "shm foo\r\n";
+    is(scalar <$s>, "ERROR\r\n", "shm takes no arguments");
+    mem_get_is($s, "foo", undef, "connection unchanged");
+}
+
+# Takes the memfd off the "shm" reply. Perl has no recvmsg(), so this packs
+# the structs by hand, for 64 bit linux.
+sub recv_memfd {
+    my $s = shift;
+    my $line = "\0" x 64;
+    my $ctl = "\0" x 24; # CMSG_SPACE(sizeof(int))
+    my $iov = pack("Q Q", unpack("Q", pack("p", $line)), length($line));
+    my $msg = pack("Q L x4 Q Q Q Q L x4", 0, 0, unpack("Q", pack("p", $iov)),
+        1, unpack("Q", pack("p", $ctl)), length($ctl), 0);
+    my $n = syscall(SYS_recvmsg(), fileno($s), $msg, 0);
+    return (undef, undef) if $n <= 0;
+    my ($len, $level, $type, $fd) = unpack("Q l l l", $ctl);
+    return (substr($line, 0, $n), $level == 1 && $type == 1 ? $fd : undef);
+}
+
+SKIP: {
+    skip "needs 64 bit linux", 7
+        unless $^O eq 'linux' && $Config{ptrsize} == 8 && eval { require "syscall.ph"; 1 };
+    my $s = $server->new_sock;
+    print $s "shm\r\n";
+    $s->flush;
+    my ($line, $fd) = recv_memfd($s);
+    is($line, "SHM 65536\r\n", "switched to shm");
+    ok(defined $fd, "got the memfd");
+    shm_conns_are($sock, 1, "counted");
+
+    # shrinking the file under the worker would fault it on the next read.
+    is(syscall(SYS_ftruncate(), $fd, 0), -1, "can't shrink the memfd");
+    # wake the worker up so it looks at its ring again.
+    print $s "x";
+    $s->flush;
+    select(undef, undef, undef, 0.5);
+    print $sock "version\r\n";
+    like(scalar <$sock>, qr/^VERSION /, "server still answering");
+    is(syscall(SYS_ftruncate(), $fd, 1 << 30), -1, "can't grow the memfd");
+    POSIX::close($fd);
+    close($s);
+    shm_conns_are($sock, 0, "closed with the socket");
+}
+
+{
+    my $off = new_memcached();
+    my $s = $off->sock;
+    print $s "shm\r\n";
+    is(scalar <$s>, "CLIENT_ERROR shm transport not enabled\r\n", "off by default");
+    $stats = mem_stats($s);
+    ok(!defined $stats->{curr_shm_connections}, "no shm stats when off");
+}
+
+{
+    my $tcp = new_memcached("-l 127.0.0.1 -o shm_ring_size=64");
+    my $s = $tcp->sock;
+    print $s "shm\r\n";
+    is(scalar <$s>, "CLIENT_ERROR shm only works over a unix socket\r\n",
+        "unix sockets only");
+}
+
+{
+    my $odd = new_memcached("-o shm_ring_size=5");
+    $stats = mem_stats($odd->sock, "settings");
+    is($stats->{shm_ring_size}, 8192, "rounded up to a power of two");
+}
+
+eval {
+    new_memcached("-o shm_ring_size=1000000");
+};
+ok($@, "shm_ring_size too large");
+
+# the client in vendor/mcmc isn't built by default.
+my $bench = "$Bin/../vendor/mcmc/bench_shm";
+SKIP: {
+    skip "vendor/mcmc/bench_shm not built", 5 unless -x $bench;
+    my $path = $server->{domainsocket};
+
+    my $out = `$bench $path 2000 100 4 2>&1`;
+    is($?, 0, "requests over shm") or diag($out);
+    like($out, qr/^shm\s+\d+/m, "shm results reported");
+
+    # values much larger than the rings, so both sides have to wait for room.
+    my $small = new_memcached("-o shm_ring_size=4");
+    $out = `$bench $small->{domainsocket} 200 50000 2 2>&1`;
+    is($?, 0, "values larger than the ring") or diag($out);
+
+    shm_conns_are($sock, 0, "client disconnected");
+    $stats = mem_stats($sock);
+    cmp_ok($stats->{shm_wakeups}, '>', 0, "client was woken up");
+}
+
+done_testing();
@@ -0,0 +1,91 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+{
+    my $server = new_memcached('-o no_slab_magazines');
+    my $stats = mem_stats($server->sock, ' settings');
+    is($stats->{slab_magazines}, 'no', "magazines can be disabled");
+}
+
+# Chunks freed into a worker's magazine still count as free.
+{
+    my $server = new_memcached();
+    my $sock = $server->sock;
+    is(mem_stats($sock, ' settings')->{slab_magazines}, 'yes', "magazines on by default");
+
+    # big enough values that two pages fill quickly.
+    my $value = 'x' x 5000;
+    for my $n (1 .. 400) {
+        print $sock "set key$n 0 0 5000 noreply\r\n$value\r\n";
+    }
+    mem_get_is($sock, 'key400', $value, "stored keys");
+    my $items = mem_stats($sock, 'items');
+    my ($cls) = map { /^items:(\d+):number$/ ? $1 : () } keys %$items;
+    my $slabs = mem_stats($sock, 'slabs');
+    is($slabs->{"$cls:used_chunks"}, 400, "400 chunks used");
+    is($slabs->{"$cls:used_chunks"} + $slabs->{"$cls:free_chunks"},
+        $slabs->{"$cls:total_chunks"}, "used and free add up");
+    my $pages = $slabs->{"$cls:total_pages"};
+    cmp_ok($pages, '>=', 2, "more than one page");
+
+    for my $n (1 .. 400) {
+        print $sock "delete key$n noreply\r\n";
+    }
+    mem_get_is($sock, 'key1', undef, "deleted keys");
+    $slabs = mem_stats($sock, 'slabs');
+    is($slabs->{"$cls:used_chunks"}, 0, "no chunks used after deletes");
+    is($slabs->{"$cls:free_chunks"}, $slabs->{"$cls:total_chunks"}, "all chunks free");
+
+    # a page can still be moved, even though the last frees were cached by
+    # the worker thread.
+    print $sock "slabs reassign $cls 0\r\n";
+    is(scalar <$sock>, "OK\r\n", "started moving a page out of class $cls");
+    my $tries = 50;
+    while ($tries-- > 0) {
+        $slabs = mem_stats($sock, 'slabs');
+        last if $slabs->{"$cls:total_pages"} < $pages;
+        select undef, undef, undef, 0.1;
+    }
+    is($slabs->{"$cls:total_pages"}, $pages - 1, "page moved out of class $cls");
+    is($slabs->{"$cls:free_chunks"}, $slabs->{"$cls:total_chunks"}, "rest still free");
+}
+
+# With evictions off, chunks freed on one connection's worker thread can still
+# be used by connections on the other thread once memory is full.
+{
+    my $server = new_memcached('-M -m 2 -t 2');
+    my $first = $server->sock;
+    # connections are handed to threads in turn, so one of these is on the
+    # other thread.
+    my @others = ($server->new_sock, $server->new_sock);
+    my $value = 'x' x 1000;
+
+    my $stored = 0;
+    while (1) {
+        print $first "set fill$stored 0 0 1000\r\n$value\r\n";
+        my $res = <$first>;
+        last if $res ne "STORED\r\n";
+        $stored++;
+    }
+    cmp_ok($stored, '>', 100, "filled memory");
+
+    for my $n (0 .. 9) {
+        print $first "delete fill$n\r\n";
+        is(scalar <$first>, "DELETED\r\n", "deleted fill$n");
+    }
+    for my $n (0 .. 9) {
+        my $sock = $others[$n % 2];
+        print $sock "set other$n 0 0 1000\r\n$value\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored other$n");
+    }
+    print $first "set one_more 0 0 1000\r\n$value\r\n";
+    like(scalar <$first>, qr/^SERVER_ERROR/, "full again");
+}
+
+done_testing();
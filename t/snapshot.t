@@ -0,0 +1,172 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+my $snap = "/tmp/snapshot.$$";
+
+{
+    my $server = new_memcached('-X');
+    my $sock = $server->sock;
+    print $sock "lru_crawler export $snap\r\n";
+    like(scalar <$sock>, qr/^ERROR export not allowed/, "export needs dumps enabled");
+    print $sock "lru_crawler import $snap\r\n";
+    like(scalar <$sock>, qr/^ERROR import not allowed/, "import needs dumps enabled");
+}
+
+my $server = new_memcached();
+my $sock = $server->sock;
+
+sub export {
+    my $res;
+    for (1 .. 20) {
+        print $sock "lru_crawler export $snap\r\n";
+        $res = <$sock>;
+        last unless $res =~ /^BUSY/;
+        sleep 1;
+    }
+    return $res;
+}
+
+my $big = join('', map { chr(65 + $_ % 26) } 1 .. 700000);
+for my $n (1 .. 999) {
+    my $len = length("val$n");
+    print $sock "set key$n $n 0 $len noreply\r\nval$n\r\n";
+}
+print $sock "set ttl 5 1000 3 noreply\r\nttl\r\n";
+print $sock "set short 0 1 5 noreply\r\nshort\r\n";
+print $sock "set big 7 0 700000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a chunked item");
+my ($cas) = mem_gets($sock, "key1");
+sleep 2;
+
+is(export(), "OK\r\n", "exported");
+ok(-f $snap, "snapshot written");
+ok(!-e "$snap.tmp", "temporary file renamed");
+my $stats = mem_stats($sock);
+is($stats->{lru_crawler_exported}, 1001, "live items exported");
+is($stats->{lru_crawler_exported_bytes}, (-s $snap) - 16, "bytes written counted, less the header");
+
+print $sock "lru_crawler export /nonexistent/dir/snap\r\n";
+like(scalar <$sock>, qr/^ERROR/, "export to a bad path fails");
+
+sub check_loaded {
+    my ($s, $name) = @_;
+    mem_get_is({ sock => $s, flags => 1 }, "key1", "val1", "$name: value and flags kept");
+    mem_get_is({ sock => $s, flags => 999 }, "key999", "val999", "$name: last item");
+    mem_gets_is({ sock => $s, flags => 1 }, $cas, "key1", "val1", "$name: cas kept");
+    mem_get_is({ sock => $s, flags => 5 }, "ttl", "ttl", "$name: item with a ttl");
+    mem_get_is($s, "short", undef, "$name: expired item not exported");
+    mem_get_is({ sock => $s, flags => 7 }, "big", $big, "$name: chunked value");
+
+    print $s "mg ttl t\r\n";
+    like(scalar <$s>, qr/^HD t(99\d|1000)\r\n/, "$name: ttl kept");
+
+    # new items get a cas above anything loaded.
+    print $s "set new 0 0 1\r\nx\r\n";
+    is(scalar <$s>, "STORED\r\n", "$name: stored a new item");
+    my ($newcas) = mem_gets($s, "new");
+    cmp_ok($newcas, '>', $cas, "$name: new cas is higher");
+}
+
+{
+    my $warm = new_memcached("-o snapshot_load=$snap");
+    my $s = $warm->sock;
+    my $stats = mem_stats($s);
+    is($stats->{snapshot_load_running}, 0, "loaded before listening");
+    is($stats->{snapshot_load_failed}, 0, "load worked");
+    is($stats->{snapshot_loaded_items}, 1001, "every item loaded");
+    is($stats->{curr_items}, 1001, "items linked");
+    check_loaded($s, "startup");
+}
+
+{
+    my $warm = new_memcached();
+    my $s = $warm->sock;
+    ok(!exists mem_stats($s)->{snapshot_load_running}, "no stats before a load");
+    print $s "set key2 0 0 5\r\nnewer\r\n";
+    is(scalar <$s>, "STORED\r\n", "stored a key before loading");
+
+    print $s "lru_crawler import $snap\r\n";
+    is(scalar <$s>, "OK\r\n", "import started");
+    my $stats;
+    for (1 .. 20) {
+        $stats = mem_stats($s);
+        last unless $stats->{snapshot_load_running};
+        sleep 1;
+    }
+    is($stats->{snapshot_loaded_items}, 1000, "items loaded in the background");
+    is($stats->{snapshot_load_exists}, 1, "existing key skipped");
+    mem_get_is($s, "key2", "newer", "existing key kept");
+    check_loaded($s, "import");
+
+    print $s "lru_crawler import /nonexistent/snap\r\n";
+    is(scalar <$s>, "OK\r\n", "import of a missing file started");
+    for (1 .. 20) {
+        $stats = mem_stats($s);
+        last unless $stats->{snapshot_load_running};
+        sleep 1;
+    }
+    is($stats->{snapshot_load_failed}, 1, "missing file noticed");
+}
+
+{
+    open(my $fh, '<', $snap) or die "can't open $snap: $!";
+    binmode $fh;
+    local $/;
+    my $data = <$fh>;
+    close($fh);
+    open($fh, '>', "$snap.cut") or die "can't open $snap.cut: $!";
+    binmode $fh;
+    print $fh substr($data, 0, length($data) - 10);
+    close($fh);
+
+    eval {
+        my $warm = new_memcached("-o snapshot_load=$snap.cut");
+    };
+    ok($@, "truncated snapshot stops startup");
+    unlink("$snap.cut");
+}
+
+# a record header, for hand made snapshots.
+sub record {
+    my ($key, $nbytes, $value) = @_;
+    return pack("q Q L L C C S L", 0, 0, 0, $nbytes, length($key), 0, 0, 0)
+        . $key . $value;
+}
+
+{
+    my $good = record("good", 3, "val");
+    for my $bad (["huge", record("huge", 0xFFFFFFF0, "x" x 64)],
+                 ["too big", record("toobig", 2 * 1024 * 1024, "x" x 64)],
+                 ["no key", record("", 3, "val")]) {
+        my ($name, $rec) = @$bad;
+        open(my $fh, '>', "$snap.bad") or die "can't open $snap.bad: $!";
+        binmode $fh;
+        print $fh "MCSNAP01", pack("Q", 0), $good, $rec, $good;
+        close($fh);
+
+        my $warm = new_memcached();
+        my $s = $warm->sock;
+        print $s "lru_crawler import $snap.bad\r\n";
+        is(scalar <$s>, "OK\r\n", "$name: import started");
+        my $stats;
+        for (1 .. 20) {
+            $stats = mem_stats($s);
+            last unless $stats->{snapshot_load_running};
+            sleep 1;
+        }
+        is($stats->{snapshot_load_failed}, 1, "$name: corrupt record noticed");
+        is($stats->{snapshot_loaded_items}, 1, "$name: records before it loaded");
+        mem_get_is($s, "good", "val", "$name: still serving");
+    }
+    unlink("$snap.bad");
+}
+
+unlink($snap);
+
+done_testing();
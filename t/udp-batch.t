@@ -0,0 +1,107 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_udp_batch()) {
+    plan skip_all => 'UDP batching not supported';
+}
+
+my $big = join('', map { chr(65 + $_ % 26) } 1 .. 5000);
+
+# sends all the requests at once, then collects the responses by request id.
+sub udp_burst {
+    my ($usock, $reqs) = @_;
+    for my $id (sort { $a <=> $b } keys %$reqs) {
+        send($usock, pack("nnnn", $id, 0, 1, 0) . $reqs->{$id}, 0);
+    }
+
+    my %frames;
+    my %total;
+    my $left = scalar keys %$reqs;
+    while ($left) {
+        my $rin = '';
+        vec($rin, fileno($usock), 1) = 1;
+        last unless select(my $rout = $rin, undef, undef, 2);
+        my $pkt;
+        $usock->recv($pkt, 1500, 0);
+        my ($id, $seq, $num, $resv) = unpack("nnnn", substr($pkt, 0, 8));
+        $total{$id} = $num;
+        $frames{$id}{$seq} = substr($pkt, 8);
+        $left-- if keys %{$frames{$id}} == $num;
+    }
+
+    my %res;
+    for my $id (keys %frames) {
+        next unless keys %{$frames{$id}} == $total{$id};
+        $res{$id} = join('', map { $frames{$id}{$_} } 0 .. $total{$id} - 1);
+    }
+    return \%res;
+}
+
+sub check_burst {
+    my ($server, $name) = @_;
+    my $sock = $server->sock;
+    print $sock "set small 0 0 2\r\nhi\r\n";
+    is(scalar <$sock>, "STORED\r\n", "$name: stored small value");
+    print $sock "set big 0 0 5000\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "$name: stored multi-frame value");
+
+    my $usock = $server->new_udp_sock or die "Can't bind : $@\n";
+    my %reqs = map { $_ => ($_ % 4 ? "get small\r\n" : "get big\r\n") } 1 .. 40;
+    my $res = udp_burst($usock, \%reqs);
+    is(scalar keys %$res, 40, "$name: all responses came back");
+    my $ok = 0;
+    for my $id (1 .. 40) {
+        my $want = $id % 4 ? "VALUE small 0 2\r\nhi\r\nEND\r\n"
+            : "VALUE big 0 5000\r\n$big\r\nEND\r\n";
+        $ok++ if defined $res->{$id} && $res->{$id} eq $want;
+    }
+    is($ok, 40, "$name: responses intact");
+    return mem_stats($sock);
+}
+
+{
+    my $server = new_memcached('-l 127.0.0.1 -t 1');
+    my $stats = mem_stats($server->sock, "settings");
+    is($stats->{udp_batch}, 16, "batching on by default");
+
+    $stats = check_burst($server, "batched");
+    is($stats->{udp_read_datagrams}, 40, "datagrams read");
+    cmp_ok($stats->{udp_read_calls}, '<=', 40, "reads counted");
+    # ten big values take four frames each.
+    is($stats->{udp_write_datagrams}, 70, "datagrams sent");
+    cmp_ok($stats->{udp_write_calls}, '<', 40, "responses sent together");
+}
+
+{
+    my $server = new_memcached('-l 127.0.0.1 -o udp_batch=1 -t 1');
+    my $stats = check_burst($server, "unbatched");
+    is($stats->{udp_read_calls}, $stats->{udp_read_datagrams}, "one datagram per read");
+    is($stats->{udp_write_calls}, 70, "one datagram per send");
+}
+
+SKIP: {
+    skip "reuseport not supported", 5 unless supports_reuseport();
+    my $server = new_memcached('-l 127.0.0.1 -o reuseport -t 4');
+    check_burst($server, "reuseport");
+    # separate flows may land on different threads' sockets.
+    my $ok = 0;
+    for my $id (1 .. 8) {
+        my $usock = $server->new_udp_sock or die "Can't bind : $@\n";
+        my $res = udp_burst($usock, { $id => "get small\r\n" });
+        $ok++ if ($res->{$id} // '') eq "VALUE small 0 2\r\nhi\r\nEND\r\n";
+    }
+    is($ok, 8, "every thread's socket answers");
+}
+
+eval {
+    new_memcached('-o udp_batch=0');
+};
+ok($@, "udp_batch=0 rejected");
+
+done_testing();
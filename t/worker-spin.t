@@ -0,0 +1,69 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+# long enough that a client on the same box always answers within it.
+my $spin = 100000;
+my $server = new_memcached("-o worker_spin=$spin -t 1");
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{worker_spin}, $spin, "worker_spin set");
+
+print $sock "set foo 0 0 3\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a value");
+# with a short gap each request comes in while the worker is spinning.
+for (1 .. 20) {
+    print $sock "get foo\r\n";
+    <$sock>; <$sock>; <$sock>;
+    sleep(0.002);
+}
+mem_get_is($sock, "foo", "bar", "gets served while spinning");
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{worker_spin_hits}, '>', 0, "requests caught by spinning");
+cmp_ok($stats->{worker_spin_us}, '>', 0, "time spent spinning");
+
+$stats = mem_stats($sock, "workers");
+my $budget = $stats->{"0:spin_budget_us"};
+ok($budget > 0 && $budget <= $spin, "budget within the maximum");
+
+# idle well past the budget: the thread spins, then sleeps for longer than
+# it spun, so the budget comes down.
+sleep(0.3);
+print $sock "version\r\n";
+like(scalar <$sock>, qr/^VERSION /, "woke up after sleeping");
+
+$stats = mem_stats($sock, "workers");
+cmp_ok($stats->{"0:spin_budget_us"}, '<', $budget, "budget shrinks when idle");
+cmp_ok($stats->{"0:spin_sleeps"}, '>', 0, "slept");
+cmp_ok($stats->{"0:sleep_us"}, '>', 0, "time spent asleep");
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{worker_spin_sleeps}, '>', 0, "sleeps in the totals");
+
+{
+    my $off = new_memcached("-t 1");
+    my $osock = $off->sock;
+    $stats = mem_stats($osock);
+    ok(!defined $stats->{worker_spin_us}, "no spin stats when off");
+    $stats = mem_stats($osock, "workers");
+    ok(!defined $stats->{"0:spin_us"}, "no worker spin stats when off");
+}
+
+SKIP: {
+    skip "busy_poll not supported", 2 unless supports_busy_poll();
+    my $bp = new_memcached("-o busy_poll=50 -t 1");
+    my $bsock = $bp->sock;
+    $stats = mem_stats($bsock, "settings");
+    is($stats->{busy_poll}, 50, "busy_poll set");
+    print $bsock "set foo 0 0 3\r\nbar\r\n";
+    is(scalar <$bsock>, "STORED\r\n", "client works with busy_poll");
+}
+
+done_testing();
@@ -0,0 +1,125 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+
+if (!supports_uring()) {
+    plan skip_all => 'io_uring not enabled';
+    exit 0;
+}
+
+# a small read buffer limit gives each thread a ring of 16 buffers, so large
+# values run the recv out of buffers.
+my $server = new_memcached('-o worker_uring,read_buf_mem_limit=1');
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{worker_uring}, "yes", "worker_uring enabled");
+
+print $sock "set foo 0 0 3\r\nbar\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored a key");
+mem_get_is($sock, "foo", "bar");
+
+print $sock "ms meta 2 T0\r\nhi\r\n";
+is(scalar <$sock>, "HD\r\n", "meta set");
+print $sock "mg meta v\r\n";
+is(scalar <$sock>, "VA 2\r\n", "meta get");
+is(scalar <$sock>, "hi\r\n", "meta get value");
+
+{
+    my $req = '';
+    for my $n (1 .. 500) {
+        $req .= "set pipe$n 0 0 " . length($n) . "\r\n$n\r\n";
+    }
+    for my $n (1 .. 500) {
+        $req .= "get pipe$n\r\n";
+    }
+    print $sock $req;
+    my $ok = 0;
+    for my $n (1 .. 500) {
+        $ok++ if scalar <$sock> eq "STORED\r\n";
+    }
+    is($ok, 500, "pipelined sets");
+    $ok = 0;
+    for my $n (1 .. 500) {
+        my $hdr = <$sock>;
+        my $val = <$sock>;
+        my $end = <$sock>;
+        $ok++ if $hdr eq "VALUE pipe$n 0 " . length($n) . "\r\n"
+            && $val eq "$n\r\n" && $end eq "END\r\n";
+    }
+    is($ok, 500, "pipelined gets");
+}
+
+{
+    my $big = join('', map { chr(65 + $_ % 26) } 1 .. 900000);
+    print $sock "set big 0 0 900000\r\n$big\r\n";
+    is(scalar <$sock>, "STORED\r\n", "stored a value larger than the buffer ring");
+    mem_get_is($sock, "big", $big, "large value read back");
+
+    my $keys = join(' ', ('big') x 8);
+    print $sock "get $keys\r\n";
+    my $got = 0;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        my $val = <$sock>;
+        $got++ if $val eq "$big\r\n";
+    }
+    is($got, 8, "large multiget response");
+}
+
+for my $n (1 .. 50) {
+    print $sock "set quiet$n 0 0 1 noreply\r\nq\r\n";
+}
+mem_get_is($sock, "quiet50", "q", "noreply sets");
+
+{
+    my @socks = map { $server->new_sock } 1 .. 20;
+    my $i = 0;
+    for my $s (@socks) {
+        $i++;
+        print $s "set conn$i 0 0 " . length($i) . "\r\n$i\r\n";
+    }
+    my $ok = 0;
+    for my $s (@socks) {
+        $ok++ if scalar <$s> eq "STORED\r\n";
+    }
+    is($ok, 20, "many connections");
+    close($_) for @socks;
+
+    my $s = $server->new_sock;
+    print $s "quit\r\n";
+    is(scalar <$s>, undef, "quit closes the connection");
+}
+
+{
+    my $watcher = $server->new_sock;
+    print $watcher "watch fetchers\r\n";
+    is(scalar <$watcher>, "OK\r\n", "connection handed to the logger");
+    print $sock "get foo\r\n";
+    is(scalar <$sock>, "VALUE foo 0 3\r\n", "fetched while watched");
+    is(scalar <$sock>, "bar\r\n", "value");
+    is(scalar <$sock>, "END\r\n", "end");
+    like(scalar <$watcher>, qr/key=foo/, "watcher saw the fetch");
+}
+
+{
+    print $sock "lru_crawler metadump all\r\n";
+    my $items = 0;
+    while (my $line = <$sock>) {
+        last if $line eq "END\r\n";
+        $items++;
+    }
+    cmp_ok($items, '>', 500, "connection handed to the crawler");
+    mem_get_is($sock, "foo", "bar", "connection back from the crawler");
+}
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{bytes_written}, '>', 900000 * 9, "bytes written counted");
+cmp_ok($stats->{total_connections}, '>=', 23, "connections counted");
+
+done_testing();
@@ -0,0 +1,122 @@
+#!/usr/bin/env perl
+
+use strict;
+use warnings;
+use Test::More;
+use FindBin qw($Bin);
+use lib "$Bin/lib";
+use MemcachedTest;
+use Socket qw(SOL_SOCKET SO_RCVBUF);
+
+if (!supports_zerocopy()) {
+    plan skip_all => 'MSG_ZEROCOPY not supported';
+    exit 0;
+}
+
+# the unix socket never uses zerocopy.
+my $server = new_memcached('-l 127.0.0.1 -o zerocopy_min=16384');
+my $sock = $server->sock;
+
+my $stats = mem_stats($sock, "settings");
+is($stats->{zerocopy_min}, 16384, "zerocopy_min set");
+
+my $small = "x" x 100;
+my $big = join('', map { chr(65 + $_ % 26) } 1 .. 100000);
+# large enough to be chunked.
+my $huge = join('', map { chr(97 + $_ % 26) } 1 .. 900000);
+
+print $sock "set small 0 0 100\r\n$small\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored small value");
+print $sock "set big 0 0 100000\r\n$big\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored big value");
+print $sock "set huge 0 0 900000\r\n$huge\r\n";
+is(scalar <$sock>, "STORED\r\n", "stored chunked value");
+
+mem_get_is($sock, "small", $small);
+$stats = mem_stats($sock);
+is($stats->{zerocopy_sends}, 0, "small value copied");
+
+mem_get_is($sock, "big", $big);
+mem_get_is($sock, "huge", $huge);
+
+{
+    # responses stay pinned until the kernel's done with them, so overwriting
+    # the keys while a multiget is in flight can't change what's sent.
+    print $sock "get small big huge big small\r\n";
+    for my $n (1 .. 10) {
+        print $sock "set big 0 0 6 noreply\r\nchange\r\n";
+        print $sock "set huge 0 0 6 noreply\r\nchange\r\n";
+    }
+    my @want = ([small => $small], [big => $big], [huge => $huge],
+        [big => $big], [small => $small]);
+    my $ok = 0;
+    for my $w (@want) {
+        my ($key, $val) = @$w;
+        my $hdr = <$sock>;
+        my $got = <$sock>;
+        $ok++ if $hdr eq "VALUE $key 0 " . length($val) . "\r\n"
+            && $got eq "$val\r\n";
+    }
+    is($ok, 5, "multiget of large values");
+    is(scalar <$sock>, "END\r\n", "end of multiget");
+    mem_get_is($sock, "big", "change", "overwritten value");
+}
+
+$stats = mem_stats($sock);
+cmp_ok($stats->{zerocopy_sends} + $stats->{zerocopy_fallbacks}, '>', 0,
+    "large values counted");
+cmp_ok($stats->{zerocopy_copied}, '<=', $stats->{zerocopy_sends},
+    "copied sends are a subset of zerocopy sends");
+
+# a connection closed with sends still pinned.
+{
+    my $s = $server->new_sock;
+    print $s "get huge\r\n";
+    close($s);
+    mem_get_is($sock, "small", $small, "server fine after close");
+}
+
+# a client which half-closes after asking for a large value. The server sees
+# EOF and closes while the tail of the response is still queued on the socket
+# from the item's memory; the item's then free to be reused by a new value.
+# Whatever the client gets after that has to be the old response, or nothing.
+{
+    my $server = new_memcached('-l 127.0.0.1 -t 1 -o zerocopy_min=16384');
+    my $sock = $server->sock;
+    my $len = 200000;
+    my $old = "o" x $len;
+    my $new = "n" x $len;
+    my $fails = 0;
+    for my $n (1 .. 5) {
+        print $sock "set half 0 0 $len\r\n$old\r\n";
+        is(scalar <$sock>, "STORED\r\n", "stored value $n");
+
+        my $s = $server->new_sock;
+        setsockopt($s, SOL_SOCKET, SO_RCVBUF, 4096);
+        print $s "get half\r\n";
+        shutdown($s, 1);
+        # let the server send what fits and see the EOF.
+        select(undef, undef, undef, 0.2);
+
+        print $sock "delete half\r\n";
+        is(scalar <$sock>, "DELETED\r\n", "deleted value $n");
+        for my $k (1 .. 20) {
+            print $sock "set half$k 0 0 $len noreply\r\n$new\r\n";
+        }
+        mem_get_is($sock, "half20", $new, "new values stored $n");
+
+        my $got = '';
+        while (1) {
+            my $buf;
+            my $r = sysread($s, $buf, 65536);
+            last unless $r;
+            $got .= $buf;
+        }
+        close($s);
+        my $want = "VALUE half 0 $len\r\n$old\r\nEND\r\n";
+        $fails++ if $got ne substr($want, 0, length($got));
+    }
+    is($fails, 0, "half-closed clients only got their own response");
+}
+
+done_testing();
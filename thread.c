@@ -3,6 +3,7 @@
  * Thread management for memcached.
  */
 #include "memcached.h"
+#include "mpsc.h"
 #ifdef EXTSTORE
 #include "storage.h"
 #endif
@@ -12,12 +13,16 @@
 #ifdef PROXY
 #include "proto_proxy.h"
 #endif
+#ifdef WORKER_URING
+#include "uring.h"
+#endif
 #include <assert.h>
 #include <stdio.h>
 #include <errno.h>
 #include <stdlib.h>
 #include <string.h>
 #include <pthread.h>
+#include <time.h>
 
 #include "queue.h"
 
@@ -34,8 +39,8 @@
 /* An item in the connection queue. */
 enum conn_queue_item_modes {
     queue_new_conn,   /* brand new connection. */
+    queue_listen,     /* listening socket for this thread to accept on */
     queue_pause,      /* pause thread */
-    queue_timeout,    /* socket sfd timed out */
     queue_redispatch, /* return conn from side thread */
     queue_stop,       /* exit thread */
     queue_return_io,  /* returning a pending IO object immediately */
@@ -53,19 +58,15 @@ struct conn_queue_item {
     enum conn_queue_item_modes mode;
     conn *c;
     void    *ssl;
+    bool    ssl_enabled; // for listeners: accepted connections use TLS.
     uint64_t conntag;
     enum protocol bproto;
     io_pending_t *io; // IO when used for deferred IO handling.
-    STAILQ_ENTRY(conn_queue_item) i_next;
 };
 
-/* A connection queue. */
-typedef struct conn_queue CQ;
-struct conn_queue {
-    STAILQ_HEAD(conn_ev_head, conn_queue_item) head;
-    pthread_mutex_t lock;
-    cache_t *cache; /* freelisted objects */
-};
+/* Slots in each worker's queue. Pushes past this take a lock and a malloc
+ * until the worker catches up. */
+#define CQ_RING_ENTRIES 1024
 
 /* Locks for cache LRU operations */
 pthread_mutex_t lru_locks[POWER_LARGEST];
@@ -103,10 +104,8 @@ static int init_count = 0;
 static pthread_mutex_t init_lock;
 static pthread_cond_t init_cond;
 
-static void notify_worker(LIBEVENT_THREAD *t, CQ_ITEM *item);
+static bool notify_worker(LIBEVENT_THREAD *t, CQ_ITEM *item);
 static void notify_worker_fd(LIBEVENT_THREAD *t, int sfd, enum conn_queue_item_modes mode);
-static CQ_ITEM *cqi_new(CQ *cq);
-static void cq_push(CQ *cq, CQ_ITEM *item);
 
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg);
 
@@ -138,6 +137,16 @@ void item_unlock(uint32_t hv) {
     mutex_unlock(&item_locks[hv & hashmask(item_lock_hashpower)]);
 }
 
+/* Cycles through every item lock once. Anything which was holding an item
+ * lock when this was called has released it by the time we return. */
+void item_locks_sync(void) {
+    uint32_t i;
+    for (i = 0; i < item_lock_count; i++) {
+        mutex_lock(&item_locks[i]);
+        mutex_unlock(&item_locks[i]);
+    }
+}
+
 static void wait_for_thread_registration(int nthreads) {
     while (init_count < nthreads) {
         pthread_cond_wait(&init_cond, &init_lock);
@@ -250,9 +259,6 @@ void stop_threads(void) {
     logger_stop();
     if (settings.verbose > 0)
         fprintf(stderr, "stopped logger thread\n");
-    stop_conn_timeout_thread();
-    if (settings.verbose > 0)
-        fprintf(stderr, "stopped idle timeout thread\n");
 
     // Close all connections then let the workers finally exit.
     if (settings.verbose > 0)
@@ -272,73 +278,22 @@ void stop_threads(void) {
 }
 
 /*
- * Initializes a connection queue.
+ * Queues an item for a worker and wakes it up if it's waiting. While the
+ * worker is busy working through its queue producers skip the write to the
+ * eventfd/pipe, so a burst costs one wakeup rather than one per item.
+ * Returns false if the queue was full and the item couldn't be allocated.
  */
-static void cq_init(CQ *cq) {
-    pthread_mutex_init(&cq->lock, NULL);
-    STAILQ_INIT(&cq->head);
-    cq->cache = cache_create("cq", sizeof(CQ_ITEM), sizeof(char *));
-    if (cq->cache == NULL) {
-        fprintf(stderr, "Failed to create connection queue cache\n");
-        exit(EXIT_FAILURE);
-    }
-}
-
-/*
- * Looks for an item on a connection queue, but doesn't block if there isn't
- * one.
- * Returns the item, or NULL if no item is available
- */
-static CQ_ITEM *cq_pop(CQ *cq) {
-    CQ_ITEM *item;
-
-    pthread_mutex_lock(&cq->lock);
-    item = STAILQ_FIRST(&cq->head);
-    if (item != NULL) {
-        STAILQ_REMOVE_HEAD(&cq->head, i_next);
-    }
-    pthread_mutex_unlock(&cq->lock);
-
-    return item;
-}
-
-/*
- * Adds an item to a connection queue.
- */
-static void cq_push(CQ *cq, CQ_ITEM *item) {
-    pthread_mutex_lock(&cq->lock);
-    STAILQ_INSERT_TAIL(&cq->head, item, i_next);
-    pthread_mutex_unlock(&cq->lock);
-}
-
-/*
- * Returns a fresh connection queue item.
- */
-static CQ_ITEM *cqi_new(CQ *cq) {
-    CQ_ITEM *item = cache_alloc(cq->cache);
-    if (item == NULL) {
+static bool notify_worker(LIBEVENT_THREAD *t, CQ_ITEM *item) {
+    bool wake;
+    if (!mpsc_push(t->ev_queue, item, &wake)) {
         STATS_LOCK();
         stats.malloc_fails++;
         STATS_UNLOCK();
+        return false;
+    }
+    if (!wake) {
+        return true;
     }
-    return item;
-}
-
-/*
- * Frees a connection queue item (adds it to the freelist.)
- */
-static void cqi_free(CQ *cq, CQ_ITEM *item) {
-    cache_free(cq->cache, item);
-}
-
-// TODO: Skip notify if queue wasn't empty?
-// - Requires cq_push() returning a "was empty" flag
-// - Requires event handling loop to pop the entire queue and work from that
-// instead of the ev_count work there now.
-// In testing this does result in a large performance uptick, but unclear how
-// much that will transfer from a synthetic benchmark.
-static void notify_worker(LIBEVENT_THREAD *t, CQ_ITEM *item) {
-    cq_push(t->ev_queue, item);
 #ifdef HAVE_EVENTFD
     uint64_t u = 1;
     if (write(t->notify_event_fd, &u, sizeof(uint64_t)) != sizeof(uint64_t)) {
@@ -352,25 +307,20 @@ static void notify_worker(LIBEVENT_THREAD *t, CQ_ITEM *item) {
         /* TODO: This is a fatal problem. Can it ever happen temporarily? */
     }
 #endif
+    return true;
 }
 
 // NOTE: An external func that takes a conn *c might be cleaner overall.
 static void notify_worker_fd(LIBEVENT_THREAD *t, int sfd, enum conn_queue_item_modes mode) {
-    CQ_ITEM *item;
-    while ( (item = cqi_new(t->ev_queue)) == NULL ) {
+    CQ_ITEM item = { .sfd = sfd, .mode = mode };
+    while (!notify_worker(t, &item)) {
         // NOTE: most callers of this function cannot fail, but mallocs in
         // theory can fail. Small mallocs essentially never do without also
-        // killing the process. Syscalls can also fail but the original code
-        // never handled this either.
-        // As a compromise, I'm leaving this note and this loop: This alloc
+        // killing the process, and the queue only mallocs once it's full.
+        // As a compromise, I'm leaving this note and this loop: This push
         // cannot fail, but pre-allocating the data is too much code in an
-        // area I want to keep more lean. If this CQ business becomes a more
-        // generic queue I'll reconsider.
+        // area I want to keep more lean.
     }
-
-    item->mode = mode;
-    item->sfd = sfd;
-    notify_worker(t, item);
 }
 
 /*
@@ -435,18 +385,20 @@ static void setup_thread(LIBEVENT_THREAD *me) {
         exit(1);
     }
 
-    me->ev_queue = malloc(sizeof(struct conn_queue));
-    if (me->ev_queue == NULL) {
+    me->ev_queue = malloc(sizeof(mpsc_ring));
+    if (me->ev_queue == NULL
+            || !mpsc_init(me->ev_queue, CQ_RING_ENTRIES, sizeof(CQ_ITEM))) {
         perror("Failed to allocate memory for connection queue");
         exit(EXIT_FAILURE);
     }
-    cq_init(me->ev_queue);
 
     if (pthread_mutex_init(&me->stats.mutex, NULL) != 0) {
         perror("Failed to initialize mutex");
         exit(EXIT_FAILURE);
     }
 
+    conn_idle_init(me);
+
     me->rbuf_cache = cache_create("rbuf", READ_BUFFER_SIZE, sizeof(char *));
     if (me->rbuf_cache == NULL) {
         fprintf(stderr, "Failed to create read buffer cache\n");
@@ -497,6 +449,77 @@ static void setup_thread(LIBEVENT_THREAD *me) {
     thread_io_queue_add(me, IO_QUEUE_NONE, NULL, NULL);
 }
 
+static uint64_t spin_now_us(void) {
+#if defined(HAVE_CLOCK_GETTIME) && defined(CLOCK_MONOTONIC)
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return (uint64_t)tv.tv_sec * 1000000 + tv.tv_usec;
+#endif
+}
+
+/*
+ * Runs one pass of the thread's event loop, waiting for something to do.
+ *
+ * With -o worker_spin the thread polls without blocking for up to its spin
+ * budget before it goes to sleep in the kernel, so a request arriving soon
+ * after the last one is picked up without a wakeup. The budget adapts: if
+ * the thread slept for less than the configured maximum, a longer spin would
+ * have caught the next event and the budget doubles; if it slept longer it
+ * halves, so a quiet thread stops burning its core.
+ */
+void worker_wait(LIBEVENT_THREAD *me) {
+    if (settings.worker_spin == 0) {
+        event_base_loop(me->base, EVLOOP_ONCE);
+        return;
+    }
+
+    uint64_t events = me->loop_events;
+    uint64_t start = spin_now_us();
+    uint64_t now = start;
+    uint64_t last = start;
+    do {
+        last = now;
+        // NONBLOCK alone keeps going for as long as callbacks are active.
+        event_base_loop(me->base, EVLOOP_NONBLOCK | EVLOOP_ONCE);
+        if (me->loop_events != events) {
+            // work was already waiting on the first pass; nothing to count.
+            if (last != start) {
+                pthread_mutex_lock(&me->stats.mutex);
+                me->stats.spin_us += last - start;
+                me->stats.spin_hits++;
+                pthread_mutex_unlock(&me->stats.mutex);
+            }
+            return;
+        }
+        now = spin_now_us();
+    } while (now - start < me->spin_budget);
+
+    event_base_loop(me->base, EVLOOP_ONCE);
+    uint64_t slept = spin_now_us() - now;
+
+    unsigned int budget = me->spin_budget;
+    if (slept < (uint64_t)settings.worker_spin) {
+        budget *= 2;
+        if (budget > (unsigned int)settings.worker_spin)
+            budget = settings.worker_spin;
+    } else {
+        budget /= 2;
+        if (budget < 1)
+            budget = 1;
+    }
+    __atomic_store_n(&me->spin_budget, budget, __ATOMIC_RELAXED);
+
+    pthread_mutex_lock(&me->stats.mutex);
+    me->stats.spin_us += now - start;
+    me->stats.spin_sleeps++;
+    me->stats.sleep_us += slept;
+    pthread_mutex_unlock(&me->stats.mutex);
+}
+
 /*
  * Worker thread: main event loop
  */
@@ -508,17 +531,35 @@ static void *worker_libevent(void *arg) {
      */
     me->l = logger_create();
     me->lru_bump_buf = item_lru_bump_buf_create();
-    if (me->l == NULL || me->lru_bump_buf == NULL) {
+    if (me->l == NULL || me->lru_bump_buf == NULL || !slabs_magazine_create()) {
         abort();
     }
 
+#ifdef WORKER_URING
+    if (settings.worker_uring && !uring_thread_init(me)) {
+        exit(EXIT_FAILURE);
+    }
+#endif
+
     if (settings.drop_privileges) {
         drop_worker_privileges();
     }
 
     register_thread_initialized();
 
-    event_base_loop(me->base, 0);
+    me->spin_budget = settings.worker_spin;
+#ifdef WORKER_URING
+    if (me->uring != NULL) {
+        uring_thread_loop(me);
+    } else
+#endif
+    if (settings.worker_spin) {
+        do {
+            worker_wait(me);
+        } while (!event_base_got_exit(me->base));
+    } else {
+        event_base_loop(me->base, 0);
+    }
 
     // same mechanism used to watch for all threads exiting.
     register_thread_initialized();
@@ -532,18 +573,74 @@ static void *worker_libevent(void *arg) {
  * Processes an incoming "connection event" item. This is called when
  * input arrives on the libevent wakeup pipe.
  */
-// Syscalls can be expensive enough that handling a few of them once here can
-// save both throughput and overall latency.
+static void thread_conn_new(LIBEVENT_THREAD *me, int sfd, enum conn_states init_state,
+        int event_flags, int read_buffer_size, enum network_transport transport,
+        void *ssl, uint64_t conntag, enum protocol bproto) {
+    conn *c = conn_new(sfd, init_state, event_flags, read_buffer_size, transport,
+            me->base, ssl, conntag, bproto);
+    if (c == NULL) {
+        if (IS_UDP(transport)) {
+            fprintf(stderr, "Can't listen for events on UDP socket\n");
+            exit(1);
+        } else {
+            if (settings.verbose > 0) {
+                fprintf(stderr, "Can't listen for events on fd %d\n", sfd);
+            }
+#ifdef TLS
+            if (ssl) {
+                SSL_shutdown(ssl);
+                SSL_free(ssl);
+            }
+#endif
+            close(sfd);
+        }
+    } else {
+        c->thread = me;
+        conn_io_queue_setup(c);
+        if (IS_TCP(transport)) {
+            conn_idle_add(c);
+        }
+#ifdef WORKER_URING
+        uring_conn_attach(c);
+#endif
+#ifdef TLS
+        if (settings.ssl_enabled && c->ssl != NULL) {
+            assert(c->thread && c->thread->ssl_wbuf);
+            c->ssl_wbuf = c->thread->ssl_wbuf;
+        }
+#endif
+    }
+}
+
+// Wakes ourselves back up, to finish the queue after a trip through the
+// event loop.
+static void notify_self(LIBEVENT_THREAD *me) {
+#ifdef HAVE_EVENTFD
+    uint64_t u = 1;
+    if (write(me->notify_event_fd, &u, sizeof(uint64_t)) != sizeof(uint64_t)) {
+        perror("failed writing to worker eventfd");
+    }
+#else
+    char buf[1] = "c";
+    if (write(me->notify_send_fd, buf, 1) != 1) {
+        perror("Failed writing to notify pipe");
+    }
+#endif
+}
+
+// Producers only write to the notify fd when we're idle, so there's usually
+// one wakeup per burst of items. Cap how many we handle per wakeup so a flood
+// of new connections can't starve the ones we already have.
 #define MAX_PIPE_EVENTS 32
+#define MAX_QUEUE_ITEMS 256
 static void thread_libevent_process(evutil_socket_t fd, short which, void *arg) {
     LIBEVENT_THREAD *me = arg;
-    CQ_ITEM *item;
+    CQ_ITEM qitem;
+    CQ_ITEM *item = &qitem;
     conn *c;
-    uint64_t ev_count = 0; // max number of events to loop through this run.
+    me->loop_events++;
 #ifdef HAVE_EVENTFD
-    // NOTE: unlike pipe we aren't limiting the number of events per read.
-    // However we do limit the number of queue pulls to what the count was at
-    // the time of this function firing.
+    uint64_t ev_count;
     if (read(fd, &ev_count, sizeof(uint64_t)) != sizeof(uint64_t)) {
         if (settings.verbose > 0)
             fprintf(stderr, "Can't read from libevent pipe\n");
@@ -552,61 +649,52 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
 #else
     char buf[MAX_PIPE_EVENTS];
 
-    ev_count = read(fd, buf, MAX_PIPE_EVENTS);
-    if (ev_count == 0) {
+    if (read(fd, buf, MAX_PIPE_EVENTS) <= 0) {
         if (settings.verbose > 0)
             fprintf(stderr, "Can't read from libevent pipe\n");
         return;
     }
 #endif
 
-    for (int x = 0; x < ev_count; x++) {
-        item = cq_pop(me->ev_queue);
-        if (item == NULL) {
+    for (int x = 0; ; x++) {
+        if (x == MAX_QUEUE_ITEMS) {
+            // we're still flagged as busy, so nobody else will wake us.
+            notify_self(me);
             return;
         }
+        if (!mpsc_pop(me->ev_queue, item)) {
+            if (mpsc_sleep(me->ev_queue)) {
+                return;
+            }
+            continue;
+        }
 
         switch (item->mode) {
             case queue_new_conn:
-                c = conn_new(item->sfd, item->init_state, item->event_flags,
-                                   item->read_buffer_size, item->transport,
-                                   me->base, item->ssl, item->conntag, item->bproto);
+                thread_conn_new(me, item->sfd, item->init_state, item->event_flags,
+                        item->read_buffer_size, item->transport, item->ssl,
+                        item->conntag, item->bproto);
+                break;
+#ifdef LISTEN_REUSEPORT
+            case queue_listen:
+                c = conn_new(item->sfd, conn_listening, EV_READ | EV_PERSIST, 1,
+                        item->transport, me->base, NULL, item->conntag, item->bproto);
                 if (c == NULL) {
-                    if (IS_UDP(item->transport)) {
-                        fprintf(stderr, "Can't listen for events on UDP socket\n");
-                        exit(1);
-                    } else {
-                        if (settings.verbose > 0) {
-                            fprintf(stderr, "Can't listen for events on fd %d\n",
-                                item->sfd);
-                        }
-#ifdef TLS
-                        if (item->ssl) {
-                            SSL_shutdown(item->ssl);
-                            SSL_free(item->ssl);
-                        }
-#endif
-                        close(item->sfd);
-                    }
-                } else {
-                    c->thread = me;
-                    conn_io_queue_setup(c);
+                    fprintf(stderr, "failed to create listening connection\n");
+                    exit(EXIT_FAILURE);
+                }
+                c->thread = me;
 #ifdef TLS
-                    if (settings.ssl_enabled && c->ssl != NULL) {
-                        assert(c->thread && c->thread->ssl_wbuf);
-                        c->ssl_wbuf = c->thread->ssl_wbuf;
-                    }
+                c->ssl_enabled = item->ssl_enabled;
 #endif
-                }
+                c->next = me->listen_conn;
+                me->listen_conn = c;
                 break;
+#endif
             case queue_pause:
                 /* we were told to pause and report in */
                 register_thread_initialized();
                 break;
-            case queue_timeout:
-                /* a client socket timed out */
-                conn_close_idle(conns[item->sfd]);
-                break;
             case queue_redispatch:
                 /* a side thread redispatched a client connection */
                 conn_worker_readd(conns[item->sfd]);
@@ -625,8 +713,6 @@ static void thread_libevent_process(evutil_socket_t fd, short which, void *arg)
                 break;
 #endif
         }
-
-        cqi_free(me->ev_queue, item);
     }
 }
 
@@ -652,6 +738,8 @@ static int last_thread = -1;
 
 /* Last thread we assigned to a connection based on napi_id */
 static int last_thread_by_napi_id = -1;
+/* Workers accepting on their own listeners select threads too. */
+static pthread_mutex_t napi_lock = PTHREAD_MUTEX_INITIALIZER;
 
 static LIBEVENT_THREAD *select_thread_round_robin(void)
 {
@@ -724,40 +812,97 @@ select:
 /*
  * Dispatches a new connection to another thread. This is only ever called
  * from the main thread, either during initialization (for UDP) or because
- * of an incoming connection.
+ * of an incoming connection, or from a worker which accepted a connection
+ * belonging to another thread.
  */
+static void dispatch_conn_to(LIBEVENT_THREAD *thread, int sfd, enum conn_states init_state,
+                             int event_flags, int read_buffer_size,
+                             enum network_transport transport, void *ssl,
+                             uint64_t conntag, enum protocol bproto) {
+    CQ_ITEM item = {
+        .sfd = sfd,
+        .init_state = init_state,
+        .event_flags = event_flags,
+        .read_buffer_size = read_buffer_size,
+        .transport = transport,
+        .mode = queue_new_conn,
+        .ssl = ssl,
+        .conntag = conntag,
+        .bproto = bproto,
+    };
+
+    MEMCACHED_CONN_DISPATCH(sfd, (int64_t)thread->thread_id);
+    if (!notify_worker(thread, &item)) {
+        close(sfd);
+        /* given that malloc failed this may also fail, but let's try */
+        fprintf(stderr, "Failed to allocate memory for connection object\n");
+    }
+}
+
 void dispatch_conn_new(int sfd, enum conn_states init_state, int event_flags,
                        int read_buffer_size, enum network_transport transport, void *ssl,
                        uint64_t conntag, enum protocol bproto) {
-    CQ_ITEM *item = NULL;
     LIBEVENT_THREAD *thread;
 
-    if (!settings.num_napi_ids)
+    if (!settings.num_napi_ids) {
         thread = select_thread_round_robin();
-    else
+    } else {
+        pthread_mutex_lock(&napi_lock);
         thread = select_thread_by_napi_id(sfd);
+        pthread_mutex_unlock(&napi_lock);
+    }
 
-    item = cqi_new(thread->ev_queue);
-    if (item == NULL) {
-        close(sfd);
-        /* given that malloc failed this may also fail, but let's try */
-        fprintf(stderr, "Failed to allocate memory for connection object\n");
-        return;
+    dispatch_conn_to(thread, sfd, init_state, event_flags, read_buffer_size,
+            transport, ssl, conntag, bproto);
+}
+
+#ifdef LISTEN_REUSEPORT
+/*
+ * Hands a TCP listening socket to worker thread tid, which then accepts on
+ * it directly (-o reuseport). Only called from the main thread during
+ * initialization.
+ */
+void dispatch_listen_conn(int tid, int sfd, enum network_transport transport, bool ssl_enabled,
+                          uint64_t conntag, enum protocol bproto) {
+    LIBEVENT_THREAD *thread = threads + tid;
+    CQ_ITEM item = {
+        .sfd = sfd,
+        .transport = transport,
+        .mode = queue_listen,
+        .ssl_enabled = ssl_enabled,
+        .conntag = conntag,
+        .bproto = bproto,
+    };
+
+    if (!notify_worker(thread, &item)) {
+        fprintf(stderr, "Failed to hand a listener to worker thread %d\n", tid);
+        exit(EXIT_FAILURE);
     }
+}
 
-    item->sfd = sfd;
-    item->init_state = init_state;
-    item->event_flags = event_flags;
-    item->read_buffer_size = read_buffer_size;
-    item->transport = transport;
-    item->mode = queue_new_conn;
-    item->ssl = ssl;
-    item->conntag = conntag;
-    item->bproto = bproto;
+/*
+ * Sets up a connection a worker accepted on one of its own listeners. It
+ * stays on the accepting thread, skipping the queue and the wakeup, unless
+ * NAPI ID selection wants it on another thread.
+ */
+void dispatch_conn_local(LIBEVENT_THREAD *me, int sfd, enum network_transport transport, void *ssl,
+                         uint64_t conntag, enum protocol bproto) {
+    if (settings.num_napi_ids) {
+        pthread_mutex_lock(&napi_lock);
+        LIBEVENT_THREAD *thread = select_thread_by_napi_id(sfd);
+        pthread_mutex_unlock(&napi_lock);
+        if (thread != me) {
+            dispatch_conn_to(thread, sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+                    READ_BUFFER_CACHED, transport, ssl, conntag, bproto);
+            return;
+        }
+    }
 
-    MEMCACHED_CONN_DISPATCH(sfd, (int64_t)thread->thread_id);
-    notify_worker(thread, item);
+    MEMCACHED_CONN_DISPATCH(sfd, (int64_t)me->thread_id);
+    thread_conn_new(me, sfd, conn_new_cmd, EV_READ | EV_PERSIST,
+            READ_BUFFER_CACHED, transport, ssl, conntag, bproto);
 }
+#endif
 
 /*
  * Re-dispatches a connection back to the original thread. Can be called from
@@ -767,9 +912,6 @@ void redispatch_conn(conn *c) {
     notify_worker_fd(c->thread, c->sfd, queue_redispatch);
 }
 
-void timeout_conn(conn *c) {
-    notify_worker_fd(c->thread, c->sfd, queue_timeout);
-}
 #ifdef PROXY
 void proxy_reload_notify(LIBEVENT_THREAD *t) {
     notify_worker_fd(t, 0, queue_proxy_reload);
@@ -777,19 +919,11 @@ void proxy_reload_notify(LIBEVENT_THREAD *t) {
 #endif
 
 void return_io_pending(io_pending_t *io) {
-    CQ_ITEM *item = cqi_new(io->thread->ev_queue);
-    if (item == NULL) {
-        // TODO: how can we avoid this?
-        // In the main case I just loop, since a malloc failure here for a
-        // tiny object that's generally in a fixed size queue is going to
-        // implode shortly.
-        return;
-    }
-
-    item->mode = queue_return_io;
-    item->io = io;
-
-    notify_worker(io->thread, item);
+    CQ_ITEM item = { .mode = queue_return_io, .io = io };
+    // TODO: how can we avoid losing the IO if this fails? A malloc failure
+    // for a tiny object, once the queue's already full, is going to implode
+    // shortly anyway.
+    notify_worker(io->thread, &item);
 }
 
 /* This misses the allow_new_conns flag :( */
@@ -820,15 +954,43 @@ item *item_alloc(const char *key, size_t nkey, int flags, rel_time_t exptime, in
  * lazy-expiring as needed.
  */
 item *item_get(const char *key, const size_t nkey, LIBEVENT_THREAD *t, const bool do_update) {
+    return item_get_hv(key, nkey, hash(key, nkey), t, do_update);
+}
+
+// as item_get, for callers which already hashed the key.
+item *item_get_hv(const char *key, const size_t nkey, const uint32_t hv, LIBEVENT_THREAD *t, const bool do_update) {
     item *it;
-    uint32_t hv;
-    hv = hash(key, nkey);
     item_lock(hv);
     it = do_item_get(key, nkey, hv, t, do_update);
     item_unlock(hv);
     return it;
 }
 
+/*
+ * Hashes a batch of keys and prefetches the hash table buckets and items
+ * they're likely to touch. Fetching the keys afterwards with the hash values
+ * filled in here overlaps their cache misses, rather than stalling on each
+ * key in turn.
+ */
+void item_prefetch_batch(item_batch_key *keys, const int count) {
+    uint32_t hv[ITEM_BATCH_MAX];
+    int x, y;
+
+    for (x = 0; x < count; x += ITEM_BATCH_MAX) {
+        int n = count - x > ITEM_BATCH_MAX ? ITEM_BATCH_MAX : count - x;
+        // one key at a time: hashing several short keys in lockstep measured
+        // no faster, as the CPU already overlaps the independent hashes.
+        for (y = 0; y < n; y++) {
+            keys[x+y].hv = hash(keys[x+y].key, keys[x+y].nkey);
+            hv[y] = keys[x+y].hv;
+        }
+        // a lone key has nothing to overlap with.
+        if (n > 1) {
+            assoc_prefetch(hv, n);
+        }
+    }
+}
+
 // returns an item with the item lock held.
 // lock will still be held even if return is NULL, allowing caller to replace
 // an item atomically if desired.
@@ -841,9 +1003,11 @@ item *item_get_locked(const char *key, const size_t nkey, LIBEVENT_THREAD *t, co
 }
 
 item *item_touch(const char *key, size_t nkey, uint32_t exptime, LIBEVENT_THREAD *t) {
+    return item_touch_hv(key, nkey, hash(key, nkey), exptime, t);
+}
+
+item *item_touch_hv(const char *key, size_t nkey, const uint32_t hv, uint32_t exptime, LIBEVENT_THREAD *t) {
     item *it;
-    uint32_t hv;
-    hv = hash(key, nkey);
     item_lock(hv);
     it = do_item_touch(key, nkey, exptime, hv, t);
     item_unlock(hv);
@@ -956,11 +1120,45 @@ void threadlocal_stats_reset(void) {
                 sizeof(threads[ii].stats.slab_stats));
         memset(&threads[ii].stats.lru_hits, 0,
                 sizeof(uint64_t) * POWER_LARGEST);
+        memset(&threads[ii].stats.sched_turn_us, 0,
+                sizeof(uint64_t) * SCHED_TURN_BUCKETS);
 
         pthread_mutex_unlock(&threads[ii].stats.mutex);
     }
 }
 
+/* Per worker stats, for "stats workers". */
+void process_stats_workers(ADD_STAT add_stats, void *c) {
+    char key_str[STAT_KEY_LEN];
+    char val_str[STAT_VAL_LEN];
+    int klen = 0, vlen = 0;
+
+    for (int ii = 0; ii < settings.num_threads; ++ii) {
+        LIBEVENT_THREAD *t = &threads[ii];
+        pthread_mutex_lock(&t->stats.mutex);
+        uint64_t idle_kicks = t->stats.idle_kicks;
+        uint64_t spin_us = t->stats.spin_us;
+        uint64_t spin_hits = t->stats.spin_hits;
+        uint64_t spin_sleeps = t->stats.spin_sleeps;
+        uint64_t sleep_us = t->stats.sleep_us;
+        pthread_mutex_unlock(&t->stats.mutex);
+
+        if (settings.idle_timeout) {
+            APPEND_NUM_STAT(ii, "idle_conns", "%llu",
+                    (unsigned long long)__atomic_load_n(&t->idle_conns, __ATOMIC_RELAXED));
+        }
+        APPEND_NUM_STAT(ii, "idle_kicks", "%llu", (unsigned long long)idle_kicks);
+        if (settings.worker_spin) {
+            APPEND_NUM_STAT(ii, "spin_budget_us", "%u",
+                    __atomic_load_n(&t->spin_budget, __ATOMIC_RELAXED));
+            APPEND_NUM_STAT(ii, "spin_us", "%llu", (unsigned long long)spin_us);
+            APPEND_NUM_STAT(ii, "spin_hits", "%llu", (unsigned long long)spin_hits);
+            APPEND_NUM_STAT(ii, "spin_sleeps", "%llu", (unsigned long long)spin_sleeps);
+            APPEND_NUM_STAT(ii, "sleep_us", "%llu", (unsigned long long)sleep_us);
+        }
+    }
+}
+
 void threadlocal_stats_aggregate(struct thread_stats *stats) {
     int ii, sid;
 
@@ -994,6 +1192,10 @@ void threadlocal_stats_aggregate(struct thread_stats *stats) {
                 threads[ii].stats.lru_hits[sid];
         }
 
+        for (sid = 0; sid < SCHED_TURN_BUCKETS; sid++) {
+            stats->sched_turn_us[sid] += threads[ii].stats.sched_turn_us[sid];
+        }
+
         stats->read_buf_count += threads[ii].rbuf_cache->total;
         stats->read_buf_bytes += threads[ii].rbuf_cache->total * READ_BUFFER_SIZE;
         stats->read_buf_bytes_free += threads[ii].rbuf_cache->freecurr * READ_BUFFER_SIZE;
@@ -1070,6 +1272,7 @@ void memcached_thread_init(int nthreads, void *arg) {
         perror("Can't allocate thread descriptors");
         exit(1);
     }
+    epoch_init(nthreads);
 
     for (i = 0; i < nthreads; i++) {
 #ifdef HAVE_EVENTFD
@@ -1092,6 +1295,7 @@ void memcached_thread_init(int nthreads, void *arg) {
         threads[i].storage = arg;
 #endif
         threads[i].thread_baseid = i;
+        threads[i].epoch = epoch_slot_get(i);
         setup_thread(&threads[i]);
         /* Reserve three fds for the libevent base, and two for the pipe */
         stats_state.reserved_fds += 5;
@@ -0,0 +1,519 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+ * io_uring handling for client connections ("-o worker_uring").
+ *
+ * Each worker thread gets a ring. A client connection arms one multishot
+ * recv, which the kernel fills from a ring of buffers the thread provides; the
+ * buffers queue up on the connection and c->read copies out of them, so the
+ * state machine reads the same way it does from a socket. transmit() queues a
+ * sendmsg rather than making the call, and everything queued while handling
+ * one pass of the event loop goes to the kernel with a single submit.
+ *
+ * libevent still runs the thread: the ring's fd is one more event on the
+ * thread's base, next to the notify pipe and any UDP, TLS or proxy
+ * connections, which stay on libevent.
+ *
+ * Connections only get woken for readiness they asked for with
+ * update_event(). Since there's no socket to poll, a connection which wants
+ * to read and has data queued, or wants to write, is put on the thread's
+ * ready list and driven again at the end of the pass. That keeps the level
+ * triggered behaviour drive_machine() expects.
+ */
+#include "memcached.h"
+#include "uring.h"
+
+#include <liburing.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define URING_ENTRIES 1024
+#define URING_BGID 0
+#define URING_DEFAULT_BUFS 256
+#define URING_MIN_BUFS 16
+#define URING_MAX_BUFS 32768
+
+enum uring_op_type {
+    URING_OP_RECV = 1,
+    URING_OP_SEND,
+};
+
+// points into a uring_conn; used as the user_data of its requests.
+struct uring_op {
+    enum uring_op_type type;
+};
+
+struct uring_conn {
+    struct uring_op recv_op;
+    struct uring_op send_op;
+    conn *c; // NULL once detached
+    struct uring_thread *t;
+    struct uring_conn *next; // ready or starved list
+    int refs; // attached, recv armed, send in flight, on a list
+    int head; // buffer ids received and not yet read
+    int tail;
+    int off; // read offset into the head buffer
+    int err; // recv error, returned once the buffers are read out
+    bool eof;
+    bool recv_armed;
+    bool starved; // recv ran out of buffers
+    bool ready;
+    bool sending;
+    struct msghdr msg;
+    struct iovec *iov;
+    int iovcap;
+};
+
+struct uring_buf {
+    int next;
+    int len;
+};
+
+struct uring_thread {
+    struct io_uring ring;
+    struct event ring_event;
+    struct io_uring_buf_ring *br;
+    char *bufs;
+    struct uring_buf *buf;
+    int nbufs;
+    int mask;
+    int held; // buffers the kernel handed us, not yet given back
+    struct uring_conn *ready;
+    struct uring_conn *starved;
+    pthread_t tid;
+};
+
+#define URING_CONN(op, field) \
+    ((struct uring_conn *)((char *)(op) - offsetof(struct uring_conn, field)))
+
+static struct io_uring_sqe *uring_get_sqe(struct uring_thread *t) {
+    struct io_uring_sqe *sqe = io_uring_get_sqe(&t->ring);
+    if (sqe == NULL) {
+        // submission queue is full; flush it early.
+        io_uring_submit(&t->ring);
+        sqe = io_uring_get_sqe(&t->ring);
+    }
+    return sqe;
+}
+
+static void uring_buf_return(struct uring_thread *t, int bid) {
+    io_uring_buf_ring_add(t->br, t->bufs + (size_t)bid * READ_BUFFER_SIZE,
+            READ_BUFFER_SIZE, bid, t->mask, 0);
+    io_uring_buf_ring_advance(t->br, 1);
+    t->held--;
+}
+
+static void uring_conn_put(struct uring_conn *uc) {
+    if (--uc->refs == 0) {
+        free(uc->iov);
+        free(uc);
+    }
+}
+
+static bool uring_conn_readable(struct uring_conn *uc) {
+    return uc->head != -1 || uc->eof || uc->err != 0;
+}
+
+static void uring_conn_ready(struct uring_conn *uc) {
+    if (!uc->ready) {
+        uc->ready = true;
+        uc->refs++;
+        uc->next = uc->t->ready;
+        uc->t->ready = uc;
+    }
+}
+
+static void uring_conn_starve(struct uring_conn *uc) {
+    if (!uc->starved) {
+        uc->starved = true;
+        uc->refs++;
+        uc->next = uc->t->starved;
+        uc->t->starved = uc;
+    }
+}
+
+static void uring_conn_arm(struct uring_conn *uc) {
+    struct io_uring_sqe *sqe = uring_get_sqe(uc->t);
+    if (sqe == NULL) {
+        // try again at the end of the pass.
+        uring_conn_starve(uc);
+        return;
+    }
+    io_uring_prep_recv_multishot(sqe, uc->c->sfd, NULL, 0, 0);
+    sqe->flags |= IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BGID;
+    io_uring_sqe_set_data(sqe, &uc->recv_op);
+    uc->recv_armed = true;
+    uc->refs++;
+}
+
+// Drives the state machine, then queues the conn to run again if it still
+// wants something we can already give it.
+static void uring_conn_drive(struct uring_conn *uc, short which) {
+    conn *c = uc->c;
+    uc->refs++;
+    event_handler(c->sfd, which, c);
+    if (uc->c != NULL && !uc->sending) {
+        if ((c->ev_flags & EV_WRITE) ||
+            ((c->ev_flags & EV_READ) && uring_conn_readable(uc))) {
+            uring_conn_ready(uc);
+        }
+    }
+    uring_conn_put(uc);
+}
+
+static void uring_recv_done(struct uring_thread *t, struct uring_conn *uc,
+        const struct io_uring_cqe *cqe) {
+    uc->refs++;
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+        int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+        t->held++;
+        if (uc->c != NULL && cqe->res > 0) {
+            t->buf[bid].len = cqe->res;
+            t->buf[bid].next = -1;
+            if (uc->tail == -1) {
+                uc->head = bid;
+                uc->off = 0;
+            } else {
+                t->buf[uc->tail].next = bid;
+            }
+            uc->tail = bid;
+        } else {
+            uring_buf_return(t, bid);
+        }
+    }
+
+    if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uc->recv_armed = false;
+        if (cqe->res == 0) {
+            uc->eof = true;
+        } else if (cqe->res == -ENOBUFS) {
+            if (uc->c != NULL) {
+                uring_conn_starve(uc);
+            }
+        } else if (cqe->res < 0 && cqe->res != -ECANCELED) {
+            uc->err = -cqe->res;
+        } else if (uc->c != NULL) {
+            // the kernel can end a multishot recv for its own reasons.
+            uring_conn_arm(uc);
+        }
+        uring_conn_put(uc);
+    }
+
+    if (uc->c != NULL && (uc->c->ev_flags & EV_READ) && !uc->sending
+            && uring_conn_readable(uc)) {
+        uring_conn_drive(uc, EV_READ);
+    }
+    uring_conn_put(uc);
+}
+
+static void uring_send_done(struct uring_conn *uc, const struct io_uring_cqe *cqe) {
+    uc->sending = false;
+    if (uc->c != NULL) {
+        conn_uring_sent(uc->c, cqe->res);
+        uring_conn_drive(uc, EV_WRITE);
+    }
+    uring_conn_put(uc);
+}
+
+static void uring_thread_handler(evutil_socket_t fd, short which, void *arg) {
+    LIBEVENT_THREAD *me = arg;
+    struct uring_thread *t = me->uring;
+    struct io_uring_cqe *cqe;
+
+    while (io_uring_peek_cqe(&t->ring, &cqe) == 0) {
+        // copy it out and let the slot go: handling it can queue more work.
+        struct io_uring_cqe done = *cqe;
+        struct uring_op *op = io_uring_cqe_get_data(cqe);
+        io_uring_cqe_seen(&t->ring, cqe);
+
+        if (op == NULL) {
+            // a cancel.
+            continue;
+        }
+        switch (op->type) {
+            case URING_OP_RECV:
+                uring_recv_done(t, URING_CONN(op, recv_op), &done);
+                break;
+            case URING_OP_SEND:
+                uring_send_done(URING_CONN(op, send_op), &done);
+                break;
+        }
+    }
+}
+
+bool uring_thread_init(LIBEVENT_THREAD *me) {
+    struct uring_thread *t = calloc(1, sizeof(struct uring_thread));
+    int ret;
+    if (t == NULL) {
+        fprintf(stderr, "Failed to allocate io_uring thread\n");
+        return false;
+    }
+
+    // size the buffer ring like the read buffer cache would be.
+    int n = URING_DEFAULT_BUFS;
+    if (settings.read_buf_mem_limit) {
+        n = settings.read_buf_mem_limit / settings.num_threads / READ_BUFFER_SIZE;
+    }
+    if (n < URING_MIN_BUFS) {
+        n = URING_MIN_BUFS;
+    } else if (n > URING_MAX_BUFS) {
+        n = URING_MAX_BUFS;
+    }
+    t->nbufs = 1;
+    while (t->nbufs * 2 <= n) {
+        t->nbufs *= 2;
+    }
+    t->mask = io_uring_buf_ring_mask(t->nbufs);
+
+    ret = io_uring_queue_init(URING_ENTRIES, &t->ring, 0);
+    if (ret < 0) {
+        fprintf(stderr, "Failed to set up io_uring: %s\n", strerror(-ret));
+        free(t);
+        return false;
+    }
+
+    t->bufs = malloc((size_t)t->nbufs * READ_BUFFER_SIZE);
+    t->buf = calloc(t->nbufs, sizeof(struct uring_buf));
+    if (t->bufs == NULL || t->buf == NULL) {
+        fprintf(stderr, "Failed to allocate io_uring buffers\n");
+        return false;
+    }
+
+    t->br = io_uring_setup_buf_ring(&t->ring, t->nbufs, URING_BGID, 0, &ret);
+    if (t->br == NULL) {
+        fprintf(stderr, "Failed to set up io_uring buffer ring (needs linux 6.0+): %s\n",
+                strerror(-ret));
+        return false;
+    }
+    t->held = t->nbufs;
+    for (int x = 0; x < t->nbufs; x++) {
+        uring_buf_return(t, x);
+    }
+
+    event_set(&t->ring_event, t->ring.ring_fd, EV_READ | EV_PERSIST,
+            uring_thread_handler, me);
+    event_base_set(me->base, &t->ring_event);
+    if (event_add(&t->ring_event, 0) == -1) {
+        fprintf(stderr, "Can't monitor io_uring\n");
+        return false;
+    }
+
+    t->tid = pthread_self();
+    me->uring = t;
+    return true;
+}
+
+// Runs connections which are waiting on the end of the pass, then submits
+// everything that was queued. Returns true if there's more to run already.
+static bool uring_thread_flush(struct uring_thread *t) {
+    struct uring_conn *uc, *next;
+
+    if (t->starved != NULL && t->held < t->nbufs) {
+        uc = t->starved;
+        t->starved = NULL;
+        for (; uc != NULL; uc = next) {
+            next = uc->next;
+            uc->starved = false;
+            if (uc->c != NULL && !uc->recv_armed && !uc->eof && uc->err == 0) {
+                uring_conn_arm(uc);
+            }
+            uring_conn_put(uc);
+        }
+    }
+
+    uc = t->ready;
+    t->ready = NULL;
+    for (; uc != NULL; uc = next) {
+        next = uc->next;
+        uc->ready = false;
+        if (uc->c != NULL && !uc->sending) {
+            if (uc->c->ev_flags & EV_WRITE) {
+                uring_conn_drive(uc, EV_WRITE);
+            } else if ((uc->c->ev_flags & EV_READ) && uring_conn_readable(uc)) {
+                uring_conn_drive(uc, EV_READ);
+            }
+        }
+        uring_conn_put(uc);
+    }
+
+    io_uring_submit(&t->ring);
+    return t->ready != NULL;
+}
+
+void uring_thread_loop(LIBEVENT_THREAD *me) {
+    bool pending = false;
+    do {
+        if (pending) {
+            event_base_loop(me->base, EVLOOP_NONBLOCK);
+        } else {
+            worker_wait(me);
+        }
+        pending = uring_thread_flush(me->uring);
+    } while (!event_base_got_exit(me->base));
+}
+
+bool uring_conn_attach(conn *c) {
+    struct uring_thread *t = c->thread->uring;
+    struct uring_conn *uc = c->uring;
+
+    if (uc != NULL) {
+        // back from an IO queue.
+        return uring_conn_update(c, EV_READ | EV_PERSIST);
+    }
+    if (t == NULL || IS_UDP(c->transport) || c->state == conn_listening) {
+        return false;
+    }
+#ifdef TLS
+    if (c->ssl != NULL) {
+        return false;
+    }
+#endif
+#ifdef SHM_TRANSPORT
+    if (c->shm != NULL) {
+        return false;
+    }
+#endif
+#ifdef PROXY
+    if (c->protocol == proxy_prot) {
+        return false;
+    }
+#endif
+
+    uc = calloc(1, sizeof(struct uring_conn));
+    if (uc == NULL) {
+        return false;
+    }
+    uc->recv_op.type = URING_OP_RECV;
+    uc->send_op.type = URING_OP_SEND;
+    uc->c = c;
+    uc->t = t;
+    uc->refs = 1;
+    uc->head = -1;
+    uc->tail = -1;
+
+    event_del(&c->event);
+    c->uring = uc;
+    c->read = uring_read;
+    c->ev_flags = EV_READ | EV_PERSIST;
+    uring_conn_arm(uc);
+    return true;
+}
+
+void uring_conn_detach(conn *c) {
+    struct uring_conn *uc = c->uring;
+    if (uc == NULL) {
+        return;
+    }
+    struct uring_thread *t = uc->t;
+
+    if (uc->recv_armed) {
+        struct io_uring_sqe *sqe = uring_get_sqe(t);
+        if (sqe != NULL) {
+            io_uring_prep_cancel64(sqe, (uintptr_t)&uc->recv_op, 0);
+            io_uring_sqe_set_data(sqe, NULL);
+        }
+        // the socket's about to be closed or read by another thread.
+        io_uring_submit(&t->ring);
+    }
+    while (uc->head != -1) {
+        int bid = uc->head;
+        uc->head = t->buf[bid].next;
+        uring_buf_return(t, bid);
+    }
+    uc->tail = -1;
+    uc->c = NULL;
+    c->uring = NULL;
+    uring_conn_put(uc);
+}
+
+bool uring_conn_update(conn *c, const int new_flags) {
+    struct uring_conn *uc = c->uring;
+    c->ev_flags = new_flags;
+    if (!uc->sending && ((new_flags & EV_WRITE) ||
+            ((new_flags & EV_READ) && uring_conn_readable(uc)))) {
+        uring_conn_ready(uc);
+    }
+    return true;
+}
+
+bool uring_conn_sending(conn *c) {
+    return c->uring->sending;
+}
+
+int uring_conn_sendmsg(conn *c, struct iovec *iovs, const int iovused) {
+    struct uring_conn *uc = c->uring;
+
+    if (iovused > uc->iovcap) {
+        int cap = uc->iovcap ? uc->iovcap : 16;
+        while (cap < iovused) {
+            cap *= 2;
+        }
+        struct iovec *iov = realloc(uc->iov, cap * sizeof(struct iovec));
+        if (iov == NULL) {
+            return -1;
+        }
+        uc->iov = iov;
+        uc->iovcap = cap;
+    }
+
+    struct io_uring_sqe *sqe = uring_get_sqe(uc->t);
+    if (sqe == NULL) {
+        return -1;
+    }
+    memcpy(uc->iov, iovs, iovused * sizeof(struct iovec));
+    memset(&uc->msg, 0, sizeof(struct msghdr));
+    uc->msg.msg_iov = uc->iov;
+    uc->msg.msg_iovlen = iovused;
+    io_uring_prep_sendmsg(sqe, c->sfd, &uc->msg, 0);
+    io_uring_sqe_set_data(sqe, &uc->send_op);
+    uc->sending = true;
+    uc->refs++;
+    return 0;
+}
+
+ssize_t uring_read(conn *c, void *buf, size_t count) {
+    struct uring_thread *t = c->thread->uring;
+    struct uring_conn *uc;
+
+    // the logger and crawler threads read from connections handed to them.
+    if (t == NULL || !pthread_equal(pthread_self(), t->tid)
+            || (uc = c->uring) == NULL) {
+        return read(c->sfd, buf, count);
+    }
+
+    size_t done = 0;
+    while (done < count && uc->head != -1) {
+        int bid = uc->head;
+        size_t n = t->buf[bid].len - uc->off;
+        if (n > count - done) {
+            n = count - done;
+        }
+        memcpy((char *)buf + done, t->bufs + (size_t)bid * READ_BUFFER_SIZE + uc->off, n);
+        uc->off += n;
+        done += n;
+        if (uc->off == t->buf[bid].len) {
+            uc->head = t->buf[bid].next;
+            uc->off = 0;
+            if (uc->head == -1) {
+                uc->tail = -1;
+            }
+            uring_buf_return(t, bid);
+        }
+    }
+
+    if (done > 0) {
+        return done;
+    }
+    if (uc->err != 0) {
+        errno = uc->err;
+        return -1;
+    }
+    if (uc->eof) {
+        return 0;
+    }
+    errno = EAGAIN;
+    return -1;
+}
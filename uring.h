@@ -0,0 +1,29 @@
+/* -*- Mode: C; tab-width: 4; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+#ifndef URING_H
+#define URING_H
+
+/*
+ * io_uring handling for client connections on worker threads, enabled with
+ * "-o worker_uring". See uring.c.
+ */
+
+bool uring_thread_init(LIBEVENT_THREAD *me);
+/* Runs the thread's event loop until it's told to stop. */
+void uring_thread_loop(LIBEVENT_THREAD *me);
+
+/* Hands a connection over to the ring, returning false if it has to stay
+ * with libevent (UDP, TLS, proxy and listening connections). */
+bool uring_conn_attach(conn *c);
+/* Takes a connection back off the ring, ahead of closing it or handing it to
+ * another thread. */
+void uring_conn_detach(conn *c);
+/* Takes the place of update_event() for attached connections. */
+bool uring_conn_update(conn *c, const int new_flags);
+
+bool uring_conn_sending(conn *c);
+/* Queues a send of the iovecs, which are copied. conn_uring_sent() is called
+ * once it's done. */
+int uring_conn_sendmsg(conn *c, struct iovec *iovs, const int iovused);
+ssize_t uring_read(conn *c, void *buf, size_t count);
+
+#endif